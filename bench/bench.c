@@ -0,0 +1,244 @@
+/* (C) Copyright 2013, Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Benchmark driver for MLib. Runs each benchmark in turn and lets them print
+ * their own numbers.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <mlib/mlib.h>
+
+#include <bench.h>
+
+static struct option bench_opts[] = {
+	{ "help",		0, NULL, 'h' },
+	{ "bench",		1, NULL, 'b' },
+	{ "entries",		1, NULL, 'n' },
+
+	/* NULL terminate. */
+	{ NULL,			0, NULL,  0  },
+};
+static const char *bench_short_opts = ":hb:n:";
+
+/*
+ * All benchmarks. They are executed one after another.
+ */
+static struct benchmark benchmarks[] = {
+	BENCHMARK("Bucket sorted insert", CREATE_LIBRARY,
+		  bench_bucket_insert, NULL),
+	BENCHMARK("Bucket multithreaded lookup", CREATE_LIBRARY,
+		  bench_bucket_lookup_mt, NULL),
+	BENCHMARK("Bucket hash lookup", CREATE_LIBRARY,
+		  bench_bucket_hash, NULL),
+	BENCHMARK("Bucket bloom filter", CREATE_LIBRARY,
+		  bench_bucket_bloom, NULL),
+	BENCHMARK("Bucket search tree", CREATE_LIBRARY,
+		  bench_bucket_tree, NULL),
+	BENCHMARK("Bucket compression", CREATE_LIBRARY,
+		  bench_bucket_compress, NULL),
+	BENCHMARK("Bucket growth", CREATE_LIBRARY,
+		  bench_bucket_growth, NULL),
+	BENCHMARK("Bucket remove", CREATE_LIBRARY,
+		  bench_bucket_remove, NULL),
+	BENCHMARK("Bucket prefix", CREATE_LIBRARY,
+		  bench_bucket_prefix, NULL),
+	BENCHMARK("Bucket rebuild", CREATE_LIBRARY,
+		  bench_bucket_rebuild, NULL),
+	BENCHMARK("Library expansion", CREATE_LIBRARY,
+		  bench_library_expand, NULL),
+	BENCHMARK("Library layout", 0, bench_library_layout, NULL),
+	BENCHMARK("Playlist lookup", 0, bench_library_lookup, NULL),
+	BENCHMARK("Journaled adds", 0, bench_library_journal, NULL),
+	BENCHMARK("Library sync", 0, bench_library_sync, NULL),
+	BENCHMARK("Read-only open", 0, bench_library_open, NULL),
+	BENCHMARK("Library vacuum", 0, bench_library_vacuum, NULL),
+	BENCHMARK("Wide library lookups", 0, bench_library_wide, NULL),
+	BENCHMARK("Remote library lookups", 0, bench_library_remote, NULL),
+	BENCHMARK("Library registry", 0, bench_library_registry, NULL),
+
+	/* NULL terminator. */
+	BENCHMARK(NULL, 0, NULL, NULL),
+};
+
+/*
+ * Behavior modifying fields.
+ */
+static char	*only_bench = NULL;
+static int	 nr_entries = 0;
+
+int main(int argc, char *argv[])
+{
+	if (parse_args(argc, argv))
+		die_print_help();
+
+	mlib_library_init();
+	return do_benchmarks();
+}
+
+int do_single_benchmark(struct benchmark *bench)
+{
+	int ret;
+	struct mlib_library *lib = NULL;
+
+	if (bench->flags & CREATE_LIBRARY) {
+		unlink(".bench-mlib.lib");
+		if (mlib_create_library(".bench-mlib.lib", "bl", "./")) {
+			printf("-- Bench: failed to make internal lib\n");
+			exit(1);
+		}
+		lib = mlib_open_library(".bench-mlib.lib", 0);
+		if (!lib) {
+			printf("-- Bench: failed to open internal lib\n");
+			exit(1);
+		}
+	}
+
+	printf("-- %s\n", bench->name);
+	ret = bench->func(lib, bench->priv);
+
+	if (lib)
+		mlib_close_library(lib);
+	unlink(".bench-mlib.lib");
+
+	if (ret)
+		printf("-- %s: FAILED\n", bench->name);
+	return ret;
+}
+
+/*
+ * Returns the number of benchmarks that failed to run.
+ */
+int do_benchmarks()
+{
+	int failed = 0;
+	struct benchmark *bench;
+
+	for (bench = benchmarks; bench->func != NULL; bench++) {
+		if (only_bench && !strstr(bench->name, only_bench))
+			continue;
+		if (do_single_benchmark(bench))
+			failed++;
+	}
+
+	return failed;
+}
+
+/**
+ * Return a monotonic time stamp in seconds.
+ */
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return the number of entries a benchmark should use: either what was passed
+ * with -n or the benchmark's own default, @def.
+ */
+int bench_nr_entries(int def)
+{
+	return nr_entries ? nr_entries : def;
+}
+
+/**
+ * Generate the @n'th benchmark path into @buf. Paths look roughly like a real
+ * music library and the order they are generated in is scrambled so that
+ * inserts land all over the bucket.
+ */
+void bench_make_path(char *buf, size_t len, unsigned int n)
+{
+	unsigned int h = n * 2654435761u;
+
+	snprintf(buf, len, "Artist %04u/Album %03u/%02u - Track %08x.mp3",
+		 h % 2003, (h >> 11) % 157, (h >> 19) % 23, n);
+}
+
+/**
+ * Print a line of benchmark results.
+ */
+void bench_report(const char *fmt, ...)
+{
+	va_list args;
+
+	printf("   ");
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+/*
+ * Returns 0 on success. Automatically fills in the behavior fields.
+ */
+int parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	opterr = 0;
+
+	do {
+		opt = getopt_long(argc, argv,
+				  bench_short_opts, bench_opts, NULL);
+		switch (opt) {
+		case 'h':
+			die_print_help();
+			break;
+		case 'b':
+			only_bench = optarg;
+			break;
+		case 'n':
+			nr_entries = atoi(optarg);
+			break;
+		case '?':
+			mlib_user_error("Option not recognized: %s\n",
+					argv[optind-1]);
+			return -1;
+		case ':':
+			mlib_user_error("Missing argument for option: %s\n",
+					argv[optind-1]);
+			return -1;
+		case -1:
+			break;
+		}
+	} while (opt != -1);
+	return 0;
+}
+
+/*
+ * Exits after printing help.
+ */
+void die_print_help(void)
+{
+	printf("bench - Benchmarks for MLib.\n"
+	       "\n"
+	       "Usage: bench [-h] [-b name] [-n entries]\n"
+	       "  Mandatory arguments to long options are manditory for short "
+	       "options, too.\n"
+	       "\n"
+	       "	-h|--help	Print this help message.\n"
+	       "	-b|--bench	Only run benchmarks whose name "
+	       "contains the passed string.\n"
+	       "	-n|--entries	Override the number of entries "
+	       "each benchmark uses.\n\n");
+	exit(1);
+}
@@ -0,0 +1,86 @@
+/* (C) Copyright 2013, Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stddef.h>
+
+#define CREATE_LIBRARY	(1 << 0)
+
+struct mlib_library;
+
+struct benchmark {
+	char	*name;
+	int	 flags;
+	int	(*func)(struct mlib_library *lib, void *priv);
+	void	*priv;
+};
+
+/**
+ * Benchmarks are defined just like regression tests (see regress/regress.h).
+ * @NAME is printed before the benchmark runs, @FLAGS may contain
+ * CREATE_LIBRARY to have a scratch library created and passed to @FUNC, and
+ * @PRIV is passed verbatim to @FUNC. The benchmark function prints its own
+ * results with bench_report() and returns 0 on success or non-zero if the
+ * benchmark could not be run.
+ */
+#define BENCHMARK(NAME, FLAGS, FUNC, PRIV)	\
+	{					\
+		.name = NAME,			\
+		.flags = FLAGS,			\
+		.func = FUNC,			\
+		.priv = PRIV,			\
+	}
+
+int	 parse_args(int argc, char *argv[]);
+void	 die_print_help(void);
+int	 do_benchmarks(void);
+
+/*
+ * Helpers for the benchmarks themselves.
+ */
+double	 bench_now(void);
+int	 bench_nr_entries(int def);
+void	 bench_make_path(char *buf, size_t len, unsigned int n);
+void	 bench_report(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/*
+ * Function definitions for all benchmarks.
+ */
+int	 bench_bucket_insert(struct mlib_library *lib, void *priv);
+int	 bench_bucket_lookup_mt(struct mlib_library *lib, void *priv);
+int	 bench_bucket_hash(struct mlib_library *lib, void *priv);
+int	 bench_bucket_bloom(struct mlib_library *lib, void *priv);
+int	 bench_bucket_tree(struct mlib_library *lib, void *priv);
+int	 bench_bucket_compress(struct mlib_library *lib, void *priv);
+int	 bench_bucket_growth(struct mlib_library *lib, void *priv);
+int	 bench_bucket_remove(struct mlib_library *lib, void *priv);
+int	 bench_bucket_prefix(struct mlib_library *lib, void *priv);
+int	 bench_bucket_rebuild(struct mlib_library *lib, void *priv);
+int	 bench_library_expand(struct mlib_library *lib, void *priv);
+int	 bench_library_layout(struct mlib_library *lib, void *priv);
+int	 bench_library_lookup(struct mlib_library *lib, void *priv);
+int	 bench_library_journal(struct mlib_library *lib, void *priv);
+int	 bench_library_sync(struct mlib_library *lib, void *priv);
+int	 bench_library_open(struct mlib_library *lib, void *priv);
+int	 bench_library_vacuum(struct mlib_library *lib, void *priv);
+int	 bench_library_wide(struct mlib_library *lib, void *priv);
+int	 bench_library_remote(struct mlib_library *lib, void *priv);
+int	 bench_library_registry(struct mlib_library *lib, void *priv);
+
+#endif
@@ -0,0 +1,688 @@
+/* (C) Copyright 2013, Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Bucket benchmarks.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <mlib/mlib.h>
+
+#include <bench.h>
+
+/*
+ * Make a playlist named @name (or use .global) whose bucket already has room
+ * for @bytes worth of strings and indexes. This keeps library growth out of
+ * the numbers.
+ */
+static struct mlib_bucket *bench_sized_bucket(struct mlib_library *lib,
+					      const char *name, uint32_t bytes)
+{
+	struct mlib_playlist *plist;
+
+	if (strcmp(name, ".global") && mlib_start_playlist(lib, name))
+		return NULL;
+	plist = mlib_find_playlist(lib, name);
+	if (!plist)
+		return NULL;
+	return mlib_bucket_expand(lib, &plist->data, bytes);
+}
+
+/*
+ * Time @nr inserts into @bucket reporting the cost per insert for each tenth
+ * of the run. If @resort is set the whole index is re-sorted after every
+ * insert; that is what mlib_bucket_add() used to do.
+ */
+static int bench_insert_run(struct mlib_library *lib,
+			    struct mlib_bucket *bucket, int nr, int resort)
+{
+	int i, block;
+	double start, last, now;
+	char path[128];
+
+	block = nr / 10 ? nr / 10 : 1;
+	start = last = bench_now();
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_bucket_add(lib, bucket, path))
+			return -1;
+		if (resort)
+			mlib_bucket_sort(lib, bucket);
+
+		if ((i + 1) % block == 0) {
+			now = bench_now();
+			bench_report("%8d entries: %10.0f ns/insert\n", i + 1,
+				     (now - last) * 1e9 / block);
+			last = now;
+		}
+	}
+	bench_report("total: %.3f s for %d inserts\n", bench_now() - start, nr);
+	return 0;
+}
+
+/*
+ * Insert paths into a pre-sized bucket and report the cost per insert as the
+ * bucket grows. With sorted insertion the cost should stay flat. For
+ * comparison a smaller run re-sorting the whole index after each insert is
+ * done as well; that one goes into a playlist referring to the paths that are
+ * already in .global.
+ */
+int bench_bucket_insert(struct mlib_library *lib, void *priv)
+{
+	int nr = bench_nr_entries(500000);
+	int nr_resort = nr / 50;
+	struct mlib_bucket *bucket;
+
+	bench_report("sorted insert:\n");
+	bucket = bench_sized_bucket(lib, ".global", nr * 64);
+	if (!bucket || bench_insert_run(lib, bucket, nr, 0))
+		return -1;
+
+	bench_report("qsort after every insert:\n");
+	bucket = bench_sized_bucket(lib, "resort", nr_resort * 64);
+	if (!bucket || bench_insert_run(lib, bucket, nr_resort, 1))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * State shared by the lookup threads.
+ */
+struct bench_lookup {
+	const struct mlib_library	*lib;
+	const struct mlib_bucket	*bucket;
+	int				 nr_entries;
+	int				 nr_lookups;
+	int				 serialize;
+	int				 seed;
+	int				 misses;
+};
+
+static pthread_mutex_t bench_lookup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *bench_lookup_thread(void *arg)
+{
+	int i;
+	char path[128];
+	unsigned int n;
+	struct bench_lookup *lookup = arg;
+
+	n = lookup->seed;
+	for (i = 0; i < lookup->nr_lookups; i++) {
+		n = n * 1103515245 + 12345;
+		bench_make_path(path, sizeof(path), n % lookup->nr_entries);
+
+		if (lookup->serialize)
+			pthread_mutex_lock(&bench_lookup_mutex);
+		if (!mlib_bucket_contains(lookup->lib, lookup->bucket, path))
+			lookup->misses++;
+		if (lookup->serialize)
+			pthread_mutex_unlock(&bench_lookup_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run @nr_threads threads doing lookups on @bucket and report the aggregate
+ * lookup rate.
+ */
+static int bench_lookup_run(const struct mlib_library *lib,
+			    const struct mlib_bucket *bucket, int nr_entries,
+			    int nr_threads, int serialize)
+{
+	int i, misses = 0;
+	double start, elapsed;
+	pthread_t threads[nr_threads];
+	struct bench_lookup lookups[nr_threads];
+
+	start = bench_now();
+	for (i = 0; i < nr_threads; i++) {
+		lookups[i].lib = lib;
+		lookups[i].bucket = bucket;
+		lookups[i].nr_entries = nr_entries;
+		lookups[i].nr_lookups = 200000;
+		lookups[i].serialize = serialize;
+		lookups[i].seed = i;
+		lookups[i].misses = 0;
+		pthread_create(&threads[i], NULL, bench_lookup_thread,
+			       &lookups[i]);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		misses += lookups[i].misses;
+	}
+	elapsed = bench_now() - start;
+
+	bench_report("%-10s %2d threads: %8.2f M lookups/s\n",
+		     serialize ? "serialized" : "lock-free", nr_threads,
+		     nr_threads * 200000 / elapsed / 1e6);
+	return misses ? -1 : 0;
+}
+
+/*
+ * Look paths up in one bucket from a growing number of threads. The
+ * serialized runs take a single global mutex around each lookup the way
+ * mlib_bucket_contains() used to, for comparison.
+ */
+int bench_bucket_lookup_mt(struct mlib_library *lib, void *priv)
+{
+	int i, nr_threads, nr = bench_nr_entries(200000);
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char path[128];
+	struct mlib_bucket *bucket;
+
+	bucket = bench_sized_bucket(lib, ".global", nr * 64);
+	if (!bucket)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_bucket_add(lib, bucket, path))
+			return -1;
+	}
+
+	bench_report("%ld online cpus\n", nr_cpus);
+	for (nr_threads = 1; nr_threads <= 2 * nr_cpus; nr_threads *= 2) {
+		if (bench_lookup_run(lib, bucket, nr, nr_threads, 0) ||
+		    bench_lookup_run(lib, bucket, nr, nr_threads, 1))
+			return -1;
+	}
+
+	return 0;
+}
+
+#define BENCH_NR_QUERIES	(1 << 16)
+
+/*
+ * Time 1M lookups in @bucket which holds the first @nr benchmark paths. Every
+ * other lookup is for a path that is not in the bucket. The query strings are
+ * made up front so only the lookups themselves are timed.
+ */
+static int bench_hash_lookup_run(const struct mlib_library *lib,
+				 const struct mlib_bucket *bucket, int nr,
+				 const char *what)
+{
+	int i, hits = 0;
+	unsigned int n = 1;
+	char *queries;
+	double start, elapsed;
+
+	queries = malloc(BENCH_NR_QUERIES * 128);
+	if (!queries)
+		return -1;
+	for (i = 0; i < BENCH_NR_QUERIES; i++) {
+		n = n * 1103515245 + 12345;
+		bench_make_path(queries + i * 128, 128,
+				(i & 1) ? n % nr : nr + n % nr);
+	}
+
+	start = bench_now();
+	for (i = 0; i < 1000000; i++) {
+		if (mlib_bucket_contains(lib, bucket, queries +
+					 (i % BENCH_NR_QUERIES) * 128))
+			hits++;
+	}
+	elapsed = bench_now() - start;
+
+	bench_report("%-12s %8.0f ns/lookup (%d hits)\n", what,
+		     elapsed * 1e9 / 1000000, hits);
+	free(queries);
+	return 0;
+}
+
+/*
+ * Compare binary search lookups against the hash table on the same bucket.
+ */
+int bench_bucket_hash(struct mlib_library *lib, void *priv)
+{
+	int i, nr = bench_nr_entries(200000);
+	char path[128];
+	struct mlib_bucket *bucket;
+
+	bucket = bench_sized_bucket(lib, ".global", nr * 80);
+	if (!bucket)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_bucket_add(lib, bucket, path))
+			return -1;
+	}
+
+	bench_report("%d entries\n", nr);
+	if (bench_hash_lookup_run(lib, bucket, nr, "bsearch:"))
+		return -1;
+	if (mlib_bucket_enable_hash(lib, bucket))
+		return -1;
+	bucket = &mlib_global_playlist(lib)->data;
+	return bench_hash_lookup_run(lib, bucket, nr, "hash table:");
+}
+
+/*
+ * Time lookups of paths that are not in @bucket, the common case when
+ * rescanning a tree full of new files.
+ */
+static int bench_miss_run(const struct mlib_library *lib,
+			  const struct mlib_bucket *bucket, int nr,
+			  const char *what)
+{
+	int i, hits = 0, misses = 1000000;
+	char *queries;
+	double start;
+
+	queries = malloc(BENCH_NR_QUERIES * 128);
+	if (!queries)
+		return -1;
+	for (i = 0; i < BENCH_NR_QUERIES; i++)
+		bench_make_path(queries + i * 128, 128, nr + i);
+
+	start = bench_now();
+	for (i = 0; i < misses; i++) {
+		if (mlib_bucket_contains(lib, bucket, queries +
+					 (i % BENCH_NR_QUERIES) * 128))
+			hits++;
+	}
+	bench_report("%-12s %8.0f ns/miss (%d hits)\n", what,
+		     (bench_now() - start) * 1e9 / misses, hits);
+	free(queries);
+	return hits ? -1 : 0;
+}
+
+/*
+ * Compare negative lookups with and without a Bloom filter, both for binary
+ * searched and hashed buckets, and report the filter's false positive rate.
+ */
+int bench_bucket_bloom(struct mlib_library *lib, void *priv)
+{
+	int i, nr = bench_nr_entries(200000);
+	char path[128];
+	struct mlib_bucket *bucket;
+	struct mlib_bloom_stats stats;
+
+	bucket = bench_sized_bucket(lib, ".global", nr * 80);
+	if (!bucket)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_bucket_add(lib, bucket, path))
+			return -1;
+	}
+
+	bench_report("%d entries\n", nr);
+	if (bench_miss_run(lib, bucket, nr, "bsearch:"))
+		return -1;
+
+	if (mlib_bucket_enable_bloom(lib, bucket))
+		return -1;
+	bucket = &mlib_global_playlist(lib)->data;
+	bench_report("filter: %u bytes, %.1f bits/path\n",
+		     MLIB_BUCKET_BLOOM_BLOCKS(bucket) * MLIB_BLOOM_BLOCK,
+		     MLIB_BUCKET_BLOOM_BLOCKS(bucket) * MLIB_BLOOM_BLOCK * 8.0 /
+		     nr);
+	mlib_bucket_bloom_stats_reset();
+	if (bench_miss_run(lib, bucket, nr, "bloom:"))
+		return -1;
+	mlib_bucket_bloom_stats(&stats);
+	bench_report("false positives: %llu of %llu (%.2f%%)\n",
+		     (unsigned long long)stats.false_positives,
+		     (unsigned long long)stats.checks,
+		     100.0 * stats.false_positives / stats.checks);
+
+	if (mlib_bucket_enable_hash(lib, bucket))
+		return -1;
+	bucket = &mlib_global_playlist(lib)->data;
+	if (bench_miss_run(lib, bucket, nr, "hash+bloom:"))
+		return -1;
+	return bench_hash_lookup_run(lib, bucket, nr, "mixed:");
+}
+
+#define BENCH_PATH_LEN		64
+
+static int bench_path_cmp(const void *a, const void *b, void *arg)
+{
+	const char *paths = arg;
+
+	return strcmp(paths + *(const int *)a * BENCH_PATH_LEN,
+		      paths + *(const int *)b * BENCH_PATH_LEN);
+}
+
+/*
+ * Compare the binary search over the index array against the search tree with
+ * inline keys at a few bucket sizes. Each size gets its own playlist holding
+ * the first N paths. Paths are added in reverse sorted order, which makes
+ * every insert land at the front of the index array, so building the 1M entry
+ * playlists stays cheap.
+ */
+int bench_bucket_tree(struct mlib_library *lib, void *priv)
+{
+	int sizes[] = { 10000, 100000, 1000000 }, nr_sizes = 3;
+	int i, s, max, *order;
+	char *paths, name[32];
+	double start;
+	struct mlib_playlist *pls;
+
+	if (bench_nr_entries(0)) {
+		sizes[0] = bench_nr_entries(0);
+		nr_sizes = 1;
+	}
+	max = sizes[nr_sizes - 1];
+
+	paths = malloc((size_t)max * BENCH_PATH_LEN);
+	order = malloc(max * sizeof(int));
+	if (!paths || !order)
+		return -1;
+	for (i = 0; i < max; i++) {
+		bench_make_path(paths + (size_t)i * BENCH_PATH_LEN,
+				BENCH_PATH_LEN, i);
+		order[i] = i;
+	}
+	qsort_r(order, max, sizeof(int), bench_path_cmp, paths);
+
+	if (mlib_playlist_reserve(lib, ".global", max, max * BENCH_PATH_LEN))
+		return -1;
+	for (i = max - 1; i >= 0; i--) {
+		if (mlib_add_path(lib, ".global",
+				  paths + (size_t)order[i] * BENCH_PATH_LEN))
+			return -1;
+	}
+
+	for (s = 0; s < nr_sizes; s++) {
+		snprintf(name, sizeof(name), "size-%d", sizes[s]);
+		if (mlib_start_playlist(lib, name) ||
+		    mlib_playlist_reserve(lib, name, sizes[s], 0))
+			return -1;
+		for (i = max - 1; i >= 0; i--) {
+			if (order[i] >= sizes[s])
+				continue;
+			if (mlib_add_path(lib, name, paths +
+					  (size_t)order[i] * BENCH_PATH_LEN))
+				return -1;
+		}
+
+		bench_report("%d entries\n", sizes[s]);
+		pls = mlib_find_playlist(lib, name);
+		if (bench_hash_lookup_run(lib, &pls->data, sizes[s], "bsearch:"))
+			return -1;
+
+		start = bench_now();
+		if (mlib_tree_playlist(lib, name))
+			return -1;
+		bench_report("tree built in %.3f s\n", bench_now() - start);
+		pls = mlib_find_playlist(lib, name);
+		if (bench_hash_lookup_run(lib, &pls->data, sizes[s], "tree:"))
+			return -1;
+	}
+
+	free(paths);
+	free(order);
+	return 0;
+}
+
+/*
+ * Compress a bucket of realistic looking paths and report how much smaller
+ * the strings and the library got along with what lookups and reading single
+ * paths cost before and after.
+ */
+int bench_bucket_compress(struct mlib_library *lib, void *priv)
+{
+	int i, nr = bench_nr_entries(200000);
+	uint32_t str_bytes, lib_len;
+	unsigned long sum = 0;
+	char path[128];
+	double start;
+	struct mlib_playlist *plist;
+
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, ".global", path))
+			return -1;
+	}
+
+	plist = mlib_global_playlist(lib);
+	str_bytes = MLIB_BUCKET_STR_BYTES(&plist->data);
+	lib_len = MLIB_LIB_LEN(lib);
+	if (bench_hash_lookup_run(lib, &plist->data, nr, "plain:"))
+		return -1;
+
+	start = bench_now();
+	if (mlib_compress_playlist(lib, ".global"))
+		return -1;
+	bench_report("compressing took %.3f s\n", bench_now() - start);
+
+	plist = mlib_global_playlist(lib);
+	bench_report("string bytes: %u -> %u (%.2fx)\n", str_bytes,
+		     MLIB_BUCKET_STR_BYTES(&plist->data),
+		     (double)str_bytes / MLIB_BUCKET_STR_BYTES(&plist->data));
+	bench_report("library size: %u -> %llu (%.2fx)\n", lib_len,
+		     (unsigned long long)MLIB_LIB_LEN(lib),
+		     (double)lib_len / MLIB_LIB_LEN(lib));
+	if (bench_hash_lookup_run(lib, &plist->data, nr, "compressed:"))
+		return -1;
+
+	start = bench_now();
+	for (i = 0; i < nr; i++)
+		sum += strlen(mlib_get_path_at(lib, plist, i));
+	bench_report("%-12s %8.0f ns/path (%lu bytes)\n", "decode:",
+		     (bench_now() - start) * 1e9 / nr, sum);
+
+	return 0;
+}
+
+/*
+ * Import @nr paths into playlist @name and report how long it took and how
+ * many times the library had to grow.
+ */
+static int bench_import_run(struct mlib_library *lib, const char *name,
+			    int nr, const char *what)
+{
+	int i, grows = 0;
+	uint32_t len = MLIB_LIB_LEN(lib);
+	char path[128];
+	double start;
+
+	start = bench_now();
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, name, path))
+			return -1;
+		if (len != MLIB_LIB_LEN(lib)) {
+			len = MLIB_LIB_LEN(lib);
+			grows++;
+		}
+	}
+
+	bench_report("%-20s %8.3f s %8d expansions\n", what,
+		     bench_now() - start, grows);
+	return 0;
+}
+
+/*
+ * Bulk import into a fresh playlist three ways: growing 128 bytes at a time
+ * like buckets used to, with the default geometric growth and with the space
+ * reserved up front.
+ */
+int bench_bucket_growth(struct mlib_library *lib, void *priv)
+{
+	int ret, nr = bench_nr_entries(100000);
+
+	if (mlib_start_playlist(lib, "fixed") ||
+	    mlib_start_playlist(lib, "geometric") ||
+	    mlib_start_playlist(lib, "reserved"))
+		return -1;
+
+	/* The .global copies would hide what the playlists themselves do. */
+	if (mlib_playlist_reserve(lib, ".global", nr, nr * 64))
+		return -1;
+
+	bench_report("%d paths\n", nr);
+	mlib_bucket_set_growth_cap(MLIB_BUCKET_GROWTH_RATE);
+	ret = bench_import_run(lib, "fixed", nr, "fixed 128 bytes:");
+	mlib_bucket_set_growth_cap(0);
+	if (ret || bench_import_run(lib, "geometric", nr, "geometric:"))
+		return -1;
+
+	if (mlib_playlist_reserve(lib, "reserved", nr, nr * 64))
+		return -1;
+	return bench_import_run(lib, "reserved", nr, "reserved:");
+}
+
+/*
+ * Remove half of a large playlist. Removal only touches the bucket itself so
+ * this should neither move the rest of the library nor slow down as the
+ * library gets bigger.
+ */
+int bench_bucket_remove(struct mlib_library *lib, void *priv)
+{
+	int i, nr = bench_nr_entries(100000);
+	uint32_t len;
+	char path[128];
+	double start;
+	struct mlib_playlist *pls;
+
+	if (mlib_start_playlist(lib, "remove") ||
+	    mlib_playlist_reserve(lib, ".global", nr, nr * 64) ||
+	    mlib_playlist_reserve(lib, "remove", nr, nr * 64))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "remove", path))
+			return -1;
+	}
+
+	len = MLIB_LIB_LEN(lib);
+	pls = mlib_find_playlist(lib, "remove");
+	start = bench_now();
+	for (i = 0; i < nr; i += 2) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_remove_path_from_plist(lib, pls, path))
+			return -1;
+	}
+
+	bench_report("%d of %d paths removed in %.3f s\n", nr / 2, nr,
+		     bench_now() - start);
+	bench_report("library length %u -> %llu, %u dead bytes left\n", len,
+		     (unsigned long long)MLIB_LIB_LEN(lib),
+		     MLIB_BUCKET_DEAD_BYTES(&pls->data));
+	return 0;
+}
+
+/*
+ * Count the paths under a directory: with a prefix range query (using both
+ * compare kernels) and with a linear scan of the playlist.
+ */
+int bench_bucket_prefix(struct mlib_library *lib, void *priv)
+{
+	int i, q, first, last, nr = bench_nr_entries(100000);
+	int found = 0, queries = 100000, scans = 20;
+	char path[128], prefix[128], *slash;
+	const char *cur;
+	double start;
+	struct mlib_playlist *pls;
+
+	if (mlib_playlist_reserve(lib, ".global", nr, nr * 64))
+		return -1;
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, ".global", path))
+			return -1;
+	}
+	pls = mlib_find_playlist(lib, ".global");
+
+	/* Use the top level directory of the last path as the query. */
+	strcpy(prefix, path);
+	slash = strchr(prefix, '/');
+	if (slash)
+		slash[1] = 0;
+
+	bench_report("%d paths, prefix '%s'\n", nr, prefix);
+	for (q = 0; q < 2; q++) {
+		mlib_prefix_cmp_force_scalar(q);
+		start = bench_now();
+		for (i = 0; i < queries; i++)
+			found = mlib_find_prefix(lib, pls, prefix, &first,
+						 &last);
+		bench_report("%-20s %8.1f ns/query %d matches\n",
+			     q ? "range (scalar):" : "range (simd):",
+			     (bench_now() - start) * 1e9 / queries, found);
+	}
+	mlib_prefix_cmp_force_scalar(0);
+
+	start = bench_now();
+	for (q = 0; q < scans; q++) {
+		found = 0;
+		for (i = 0; (cur = mlib_get_path_at(lib, pls, i)) != NULL; i++)
+			found += !strncmp(cur, prefix, strlen(prefix));
+	}
+	bench_report("%-20s %8.1f ns/query %d matches\n", "linear scan:",
+		     (bench_now() - start) * 1e9 / scans, found);
+	return 0;
+}
+
+/*
+ * Sort a bulk loaded .global from scratch: with qsort() through
+ * mlib_bucket_sort() and with the parallel radix sort on one thread and on
+ * every CPU. The paths are appended in an order unrelated to sort order and
+ * the unsorted index array is put back before each run.
+ */
+int bench_bucket_rebuild(struct mlib_library *lib, void *priv)
+{
+	int i, r, nr = bench_nr_entries(2000000);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t bytes;
+	char path[128], *saved;
+	double start;
+	struct mlib_bucket *bucket;
+
+	if (mlib_playlist_reserve(lib, ".global", nr, nr * 64))
+		return -1;
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_append_path(lib, ".global", path))
+			return -1;
+	}
+
+	bucket = &mlib_global_playlist(lib)->data;
+	bytes = MLIB_BUCKET_AUX_OFFS(bucket) - MLIB_BUCKET_INDEX_OFFS(bucket);
+	saved = malloc(bytes);
+	if (!saved)
+		return -1;
+	memcpy(saved, (char *)bucket + MLIB_BUCKET_INDEX_OFFS(bucket), bytes);
+
+	bench_report("%d paths, %ld CPUs\n", nr, cpus);
+	start = bench_now();
+	mlib_bucket_sort(lib, bucket);
+	bench_report("%-20s %8.3f s\n", "qsort:", bench_now() - start);
+
+	for (r = 0; r < 2; r++) {
+		memcpy((char *)bucket + MLIB_BUCKET_INDEX_OFFS(bucket), saved,
+		       bytes);
+		start = bench_now();
+		if (mlib_bucket_rebuild(lib, bucket, r ? 0 : 1))
+			return -1;
+		bench_report("%-20s %8.3f s\n",
+			     r ? "radix, all CPUs:" : "radix, 1 thread:",
+			     bench_now() - start);
+	}
+
+	free(saved);
+	return 0;
+}
@@ -0,0 +1,781 @@
+/* (C) Copyright 2013, Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Library benchmarks.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <mlib/mlib.h>
+
+#include <bench.h>
+
+/*
+ * Read a byte from every 16th page of the library, standing in for the
+ * lookups an import does between expansions.
+ */
+static unsigned int bench_touch(struct mlib_library *lib)
+{
+	volatile unsigned char *p = (void *)lib->header;
+	unsigned int sum = 0;
+	size_t offs;
+
+	for (offs = 0; offs < MLIB_LIB_LEN(lib); offs += 16 * 4096)
+		sum += p[offs];
+	return sum;
+}
+
+/*
+ * Grow the library in MLIB_BUCKET_GROWTH_RATE steps, like a bucket filling up
+ * does, at a few different library sizes. Growing should cost the same no
+ * matter how big the library is; that includes faulting the library back in
+ * if growing it threw the mapping away.
+ */
+int bench_library_expand(struct mlib_library *lib, void *priv)
+{
+	int i, s, nr = bench_nr_entries(2000), moves;
+	size_t sizes[] = { 1 << 20, 32 << 20, 256 << 20 };
+	double start, grow, touch;
+	void *header;
+
+	for (s = 0; s < 3; s++) {
+		if (MLIB_LIB_LEN(lib) < sizes[s] &&
+		    __mlib_library_expand(lib, sizes[s]))
+			return -1;
+		bench_touch(lib);
+
+		moves = 0;
+		grow = touch = 0;
+		for (i = 0; i < nr; i++) {
+			header = lib->header;
+			start = bench_now();
+			if (__mlib_library_expand(lib, MLIB_LIB_LEN(lib) +
+						  MLIB_BUCKET_GROWTH_RATE))
+				return -1;
+			grow += bench_now() - start;
+			moves += header != lib->header;
+
+			start = bench_now();
+			bench_touch(lib);
+			touch += bench_now() - start;
+		}
+
+		bench_report("%4zu MB: %.2f us per expansion, %.2f us to touch "
+			     "the library after; mapping moved %d times\n",
+			     sizes[s] >> 20, grow * 1e6 / nr, touch * 1e6 / nr,
+			     moves);
+	}
+
+	return 0;
+}
+
+/*
+ * Fill the first playlist of a library in front of a big one and then delete
+ * it, in each library format. A v1 library moves the big playlist every time
+ * the first one grows or goes away; a v2 library shouldn't.
+ */
+int bench_library_layout(struct mlib_library *lib, void *priv)
+{
+	int i, v, nr = bench_nr_entries(20000);
+	uint32_t versions[] = { MLIB_LIB_VERSION_1, MLIB_LIB_VERSION_EXTENTS };
+	const char *name = ".bench-layout.lib";
+	double start, grow, del;
+	char path[128];
+
+	for (v = 0; v < 2; v++) {
+		unlink(name);
+		if (mlib_create_library_version(name, "layout", "./",
+						versions[v]))
+			return -1;
+		lib = mlib_open_library(name, 0);
+		if (!lib)
+			return -1;
+		if (mlib_start_playlist(lib, "first") ||
+		    mlib_start_playlist(lib, "big") ||
+		    mlib_playlist_reserve(lib, "big", 16 << 20, 0))
+			goto fail;
+
+		start = bench_now();
+		for (i = 0; i < nr; i++) {
+			bench_make_path(path, sizeof(path), i);
+			if (mlib_add_path(lib, "first", path))
+				goto fail;
+		}
+		grow = bench_now() - start;
+
+		start = bench_now();
+		if (mlib_delete_playlist(lib, "first"))
+			goto fail;
+		del = bench_now() - start;
+
+		bench_report("v%u: %.2f us per add, %.2f ms to delete\n",
+			     versions[v], grow * 1e6 / nr, del * 1e3);
+		mlib_close_library(lib);
+	}
+
+	unlink(name);
+	return 0;
+
+fail:
+	mlib_close_library(lib);
+	unlink(name);
+	return -1;
+}
+
+/*
+ * Add paths to random playlists of a library with lots of them, in each
+ * library format. Every add looks the playlist up by name; a v1 library walks
+ * the playlists to do so, a v2 library uses its directory.
+ */
+int bench_library_lookup(struct mlib_library *lib, void *priv)
+{
+	int i, v, nr_plists = 5000, nr = bench_nr_entries(20000);
+	uint32_t versions[] = { MLIB_LIB_VERSION_1, MLIB_LIB_VERSION_EXTENTS };
+	const char *file = ".bench-lookup.lib";
+	double start, add;
+	char name[64], path[128];
+
+	for (v = 0; v < 2; v++) {
+		unlink(file);
+		if (mlib_create_library_version(file, "lookup", "./",
+						versions[v]))
+			return -1;
+		lib = mlib_open_library(file, 0);
+		if (!lib)
+			return -1;
+		for (i = 0; i < nr_plists; i++) {
+			snprintf(name, sizeof(name), "plist-%d", i);
+			if (mlib_start_playlist(lib, name))
+				goto fail;
+		}
+
+		srand(1);
+		start = bench_now();
+		for (i = 0; i < nr; i++) {
+			snprintf(name, sizeof(name), "plist-%d",
+				 rand() % nr_plists);
+			bench_make_path(path, sizeof(path), i);
+			if (mlib_add_path(lib, name, path))
+				goto fail;
+		}
+		add = bench_now() - start;
+
+		bench_report("v%u: %d playlists, %.2f us per add\n",
+			     versions[v], nr_plists, add * 1e6 / nr);
+		mlib_close_library(lib);
+	}
+
+	unlink(file);
+	return 0;
+
+fail:
+	mlib_close_library(lib);
+	unlink(file);
+	return -1;
+}
+
+/*
+ * Time a sustained run of plsadd style adds, each of which has to be durable
+ * (or, with a log, durable once its group commits). Without a log that means
+ * a msync() of the whole library after every add.
+ */
+static int bench_durable_adds(const char *file, uint32_t group, int nr,
+			      const char *what)
+{
+	struct mlib_library *lib;
+	char path[128];
+	double start, took;
+	int i, ret = -1;
+
+	unlink(file);
+	if (mlib_create_library(file, "durable", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		return -1;
+	if (mlib_start_playlist(lib, "adds") ||
+	    (group && mlib_journal_enable(lib, 1)))
+		goto done;
+	if (group)
+		mlib_journal_set_group(lib, group);
+
+	start = bench_now();
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "adds", path))
+			goto done;
+		if (!group && mlib_sync_library(lib))
+			goto done;
+	}
+	if (mlib_sync_library(lib))
+		goto done;
+	took = bench_now() - start;
+
+	bench_report("%-22s %8.0f adds/s, %.1f us per add\n", what,
+		     nr / took, took * 1e6 / nr);
+	ret = 0;
+
+done:
+	mlib_close_library(lib);
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Durable adds with a full msync() per add versus a write-ahead log with
+ * different group commit sizes.
+ */
+int bench_library_journal(struct mlib_library *lib, void *priv)
+{
+	const char *file = ".bench-journal.lib";
+	int nr = bench_nr_entries(20000);
+
+	if (bench_durable_adds(file, 0, nr / 10, "msync per add:") ||
+	    bench_durable_adds(file, 1, nr / 10, "log, fsync per add:") ||
+	    bench_durable_adds(file, 16, nr, "log, group of 16:") ||
+	    bench_durable_adds(file, MLIB_WAL_GROUP, nr, "log, group of 64:") ||
+	    bench_durable_adds(file, 1024, nr, "log, group of 1024:"))
+		return -1;
+	return 0;
+}
+
+/*
+ * Sync after every add to a big library, flushing the whole library like
+ * syncs used to and just the dirty ranges.
+ */
+int bench_library_sync(struct mlib_library *lib, void *priv)
+{
+	const char *file = ".bench-sync.lib";
+	int i, nr = bench_nr_entries(2000), ret = -1;
+	struct mlib_sync_stats stats;
+	double start, full, dirty;
+	char path[128];
+
+	unlink(file);
+	if (mlib_create_library(file, "sync", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		return -1;
+	if (mlib_start_playlist(lib, "adds") ||
+	    mlib_start_playlist(lib, "big") ||
+	    mlib_playlist_reserve(lib, "big", 64 << 20, 0) ||
+	    mlib_sync_library(lib))
+		goto done;
+
+	start = bench_now();
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "adds", path) ||
+		    msync(lib->header, MLIB_LIB_LEN(lib), MS_SYNC))
+			goto done;
+		lib->nr_dirty = 0;
+	}
+	full = bench_now() - start;
+
+	start = bench_now();
+	for (i = nr; i < 2 * nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "adds", path) ||
+		    mlib_sync_library(lib))
+			goto done;
+	}
+	dirty = bench_now() - start;
+	mlib_library_sync_stats(lib, &stats);
+
+	bench_report("%llu MB library: whole library %.1f us per add, dirty "
+		     "ranges %.1f us per add (%.1f KB flushed)\n",
+		     (unsigned long long)MLIB_LIB_LEN(lib) >> 20,
+		     full * 1e6 / nr, dirty * 1e6 / nr,
+		     stats.last_bytes / 1024.0);
+	ret = 0;
+
+done:
+	mlib_close_library(lib);
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Open @file in mode @m of bench_library_open() and time the open, the first
+ * lookup and then @nr more lookups. With @cold set the library is dropped
+ * from the page cache first.
+ */
+static int bench_open_mode(const char *file, int m, int cold, int nr,
+			   int nr_paths)
+{
+	const char *modes[] = { "read-write", "read-only", "ro, populate",
+				"ro, willneed" };
+	int flags[] = { 0, 0, MLIB_RO_POPULATE, MLIB_RO_WILLNEED };
+	struct mlib_library *lib;
+	struct mlib_playlist *plist;
+	double start, took, first, rest;
+	char path[128];
+	int i, fd;
+
+	if (cold) {
+		fd = open(file, O_RDONLY);
+		if (fd < 0)
+			return -1;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	start = bench_now();
+	lib = m ? mlib_open_library_ro(file, flags[m]) :
+		mlib_open_library(file, 0);
+	if (!lib)
+		return -1;
+	took = bench_now() - start;
+
+	srand(1);
+	start = bench_now();
+	plist = mlib_global_playlist(lib);
+	bench_make_path(path, sizeof(path), rand() % nr_paths);
+	if (!mlib_find_path(lib, plist, path))
+		goto fail;
+	first = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), rand() % nr_paths);
+		if (!mlib_find_path(lib, plist, path))
+			goto fail;
+	}
+	rest = bench_now() - start;
+
+	bench_report("%-5s %-13s open %8.1f us, first lookup %7.1f us, "
+		     "then %5.2f us per lookup\n", cold ? "cold:" : "warm:",
+		     modes[m], took * 1e6, first * 1e6, rest * 1e6 / nr);
+	return mlib_close_library(lib);
+
+fail:
+	mlib_close_library(lib);
+	return -1;
+}
+
+/*
+ * Latency of the first lookups in a library right after opening it, read-write
+ * and in each read-only mode, with the library in the page cache (warm) and
+ * not (cold).
+ */
+int bench_library_open(struct mlib_library *lib, void *priv)
+{
+	const char *file = ".bench-open.lib";
+	int i, m, cold, nr = bench_nr_entries(200000), ret = -1;
+	char path[128];
+
+	unlink(file);
+	if (mlib_create_library(file, "open", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_append_path(lib, ".global", path))
+			goto fail;
+	}
+	if (mlib_rebuild_playlist(lib, ".global", 0))
+		goto fail;
+	bench_report("%llu MB library, %d paths\n",
+		     (unsigned long long)MLIB_LIB_LEN(lib) >> 20, nr);
+	if (mlib_close_library(lib))
+		goto done;
+
+	for (cold = 1; cold >= 0; cold--)
+		for (m = 0; m < 4; m++)
+			if (bench_open_mode(file, m, cold, 1000, nr))
+				goto done;
+	ret = 0;
+
+done:
+	unlink(file);
+	return ret;
+
+fail:
+	mlib_close_library(lib);
+	unlink(file);
+	return -1;
+}
+
+/*
+ * Vacuum a fragmented library a step at a time, in each library format. The
+ * worst step is what another user of the library may have to wait for.
+ */
+int bench_library_vacuum(struct mlib_library *lib, void *priv)
+{
+	int i, p, v, nr_plists = 50, nr = bench_nr_entries(100000) / 50;
+	uint32_t versions[] = { MLIB_LIB_VERSION_1, MLIB_LIB_VERSION_EXTENTS };
+	const char *file = ".bench-vacuum.lib";
+	struct mlib_vacuum vac;
+	double start, step, worst;
+	char name[64], path[128];
+	uint32_t before;
+
+	for (v = 0; v < 2; v++) {
+		unlink(file);
+		if (mlib_create_library_version(file, "vacuum", "./",
+						versions[v]))
+			return -1;
+		lib = mlib_open_library(file, 0);
+		if (!lib)
+			return -1;
+		for (p = 0; p < nr_plists; p++) {
+			snprintf(name, sizeof(name), "plist-%d", p);
+			if (mlib_start_playlist(lib, name))
+				goto fail;
+		}
+		for (i = 0; i < nr * nr_plists; i++) {
+			snprintf(name, sizeof(name), "plist-%d", i % nr_plists);
+			bench_make_path(path, sizeof(path), i);
+			if (mlib_add_path(lib, name, path))
+				goto fail;
+		}
+		for (i = 0; i < nr * nr_plists; i += 4) {
+			bench_make_path(path, sizeof(path), i);
+			if (mlib_remove_path(lib, ".global", path))
+				goto fail;
+		}
+		for (p = 0; p < nr_plists; p += 5) {
+			snprintf(name, sizeof(name), "plist-%d", p);
+			if (mlib_delete_playlist(lib, name))
+				goto fail;
+		}
+
+		before = MLIB_LIB_LEN(lib);
+		memset(&vac, 0, sizeof(vac));
+		worst = 0;
+		while (!vac.done) {
+			start = bench_now();
+			if (mlib_vacuum_step(lib, &vac, MLIB_VACUUM_STEP))
+				goto fail;
+			step = bench_now() - start;
+			if (step > worst)
+				worst = step;
+		}
+
+		bench_report("v%u: %u KB -> %llu KB, reclaimed %llu KB in %.1f "
+			     "ms, %u steps, worst step %.2f ms\n", versions[v],
+			     before >> 10,
+			     (unsigned long long)MLIB_LIB_LEN(lib) >> 10,
+			     (unsigned long long)vac.reclaimed >> 10,
+			     vac.usecs / 1000.0, vac.steps, worst * 1e3);
+		mlib_close_library(lib);
+	}
+
+	unlink(file);
+	return 0;
+
+fail:
+	mlib_close_library(lib);
+	unlink(file);
+	return -1;
+}
+
+#define BENCH_WIDE_KEYS		4096
+
+/*
+ * Look paths up by playlist name in a v2 and a v3 library with the same
+ * contents. Every lookup goes through the directory and, for the paged
+ * playlist, the page tree, whose offsets a v3 library stores scaled; the
+ * extra shift shouldn't show.
+ */
+int bench_library_wide(struct mlib_library *lib, void *priv)
+{
+	uint32_t versions[] = { MLIB_LIB_VERSION_EXTENTS,
+				MLIB_LIB_VERSION_WIDE };
+	int i, j, v, nr_plists = 2000, nr = bench_nr_entries(100000);
+	int rounds = 20 * nr, ret = -1;
+	const char *file = ".bench-wide.lib";
+	static char names[BENCH_WIDE_KEYS][16], paths[BENCH_WIDE_KEYS][64];
+	struct mlib_playlist *pls, *paged;
+	double start, dir, tree;
+	char name[64], path[128];
+
+	srand(1);
+	for (j = 0; j < BENCH_WIDE_KEYS; j++) {
+		i = rand() % nr;
+		snprintf(names[j], sizeof(names[j]), "plist-%d",
+			 i % nr_plists);
+		bench_make_path(paths[j], sizeof(paths[j]), i);
+	}
+
+	for (v = 0; v < 2; v++) {
+		unlink(file);
+		if (mlib_create_library_version(file, "wide", "./",
+						versions[v]))
+			return -1;
+		lib = mlib_open_library(file, 0);
+		if (!lib)
+			return -1;
+		for (i = 0; i < nr_plists; i++) {
+			snprintf(name, sizeof(name), "plist-%d", i);
+			if (mlib_start_playlist(lib, name))
+				goto done;
+		}
+		if (mlib_start_paged_playlist(lib, "paged"))
+			goto done;
+		for (i = 0; i < nr; i++) {
+			snprintf(name, sizeof(name), "plist-%d",
+				 i % nr_plists);
+			bench_make_path(path, sizeof(path), i);
+			if (mlib_add_path(lib, name, path) ||
+			    mlib_add_path(lib, "paged", path))
+				goto done;
+		}
+
+		start = bench_now();
+		for (i = 0; i < rounds; i++) {
+			j = i % BENCH_WIDE_KEYS;
+			pls = mlib_find_playlist(lib, names[j]);
+			if (!pls || !mlib_find_path(lib, pls, paths[j]))
+				goto done;
+		}
+		dir = bench_now() - start;
+
+		paged = mlib_find_playlist(lib, "paged");
+		start = bench_now();
+		for (i = 0; i < rounds; i++)
+			if (!mlib_find_path(lib, paged,
+					    paths[i % BENCH_WIDE_KEYS]))
+				goto done;
+		tree = bench_now() - start;
+
+		bench_report("v%u: %.1f ns per playlist and path lookup, "
+			     "%.1f ns per paged lookup\n", versions[v],
+			     dir * 1e9 / rounds, tree * 1e9 / rounds);
+		mlib_close_library(lib);
+		lib = NULL;
+	}
+	ret = 0;
+
+done:
+	if (lib)
+		mlib_close_library(lib);
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Look up @nr random paths of the bench_library_remote() library, each in
+ * its own playlist. Returns the time taken per lookup or < 0 on failure.
+ */
+static double bench_remote_lookups(struct mlib_library *lib, int nr,
+				   int nr_paths, int nr_plists)
+{
+	struct mlib_playlist *plist;
+	char name[32], path[128];
+	double start;
+	int i, n;
+
+	srand(1);
+	start = bench_now();
+	for (i = 0; i < nr; i++) {
+		n = rand() % nr_paths;
+		snprintf(name, sizeof(name), "p-%d", n % nr_plists);
+		bench_make_path(path, sizeof(path), n);
+		plist = mlib_find_playlist(lib, name);
+		if (!plist || !mlib_find_path(lib, plist, path))
+			return -1;
+	}
+	return (bench_now() - start) / nr;
+}
+
+/*
+ * Lookups in a library read through remote.c, next to the same library
+ * opened read-only. The library is served as a file:// URL, so this is the
+ * cost of the faults and range requests themselves, without a network. The
+ * second round of lookups finds every chunk it needs cached.
+ */
+int bench_library_remote(struct mlib_library *lib, void *priv)
+{
+	const char *file = ".bench-remote.lib";
+	int i, r, nr_plists = 200, nr = bench_nr_entries(200000), ret = -1;
+	struct mlib_remote_stats stats;
+	char name[32], path[128], cwd[512], url[640], fetched[64];
+	double start, took, cold, warm;
+
+	unlink(file);
+	if (mlib_create_library(file, "remote", "./"))
+		return -1;
+	lib = mlib_open_library(file, MLIB_LOCAL);
+	if (!lib)
+		return -1;
+	for (i = 0; i < nr_plists; i++) {
+		snprintf(name, sizeof(name), "p-%d", i);
+		if (mlib_start_playlist(lib, name))
+			goto fail;
+	}
+	for (i = 0; i < nr; i++) {
+		snprintf(name, sizeof(name), "p-%d", i % nr_plists);
+		bench_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, name, path))
+			goto fail;
+	}
+	bench_report("%llu MB library, %d paths in %d playlists\n",
+		     (unsigned long long)MLIB_LIB_LEN(lib) >> 20, nr,
+		     nr_plists);
+	if (mlib_close_library(lib))
+		goto done;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		goto done;
+	snprintf(url, sizeof(url), "file://%s/%s", cwd, file);
+
+	for (r = 0; r < 2; r++) {
+		start = bench_now();
+		lib = r ? mlib_open_library(url, MLIB_REMOTE) :
+			mlib_open_library_ro(file, 0);
+		if (!lib)
+			goto done;
+		took = bench_now() - start;
+		cold = bench_remote_lookups(lib, 100, nr, nr_plists);
+		warm = bench_remote_lookups(lib, 100, nr, nr_plists);
+		mlib_library_remote_stats(lib, &stats);
+		if (cold < 0 || warm < 0)
+			goto fail;
+
+		fetched[0] = 0;
+		if (r)
+			snprintf(fetched, sizeof(fetched),
+				 ", fetched %.1f%% in %llu requests",
+				 stats.bytes * 100.0 / MLIB_LIB_LEN(lib),
+				 (unsigned long long)stats.requests);
+		bench_report("%-7s open %7.1f us, first 100 lookups %6.2f us "
+			     "each, again %5.2f us%s\n",
+			     r ? "remote:" : "local:", took * 1e6, cold * 1e6,
+			     warm * 1e6, fetched);
+		if (mlib_close_library(lib))
+			goto done;
+	}
+	ret = 0;
+
+done:
+	unlink(file);
+	return ret;
+
+fail:
+	mlib_close_library(lib);
+	unlink(file);
+	return -1;
+}
+
+/*
+ * Find and use random libraries out of @nr registered ones. With @hold set
+ * each library is taken with mlib_library_get() and given back, so idle ones
+ * get unmapped once too many are mapped. Returns the time taken per library
+ * or < 0 on failure.
+ */
+static double bench_registry_round(int nr, int rounds, int hold)
+{
+	struct mlib_library *lib;
+	char name[32];
+	double start;
+	int i;
+
+	srand(1);
+	start = bench_now();
+	for (i = 0; i < rounds; i++) {
+		snprintf(name, sizeof(name), "reg-%d", rand() % nr);
+		lib = hold ? mlib_library_get(name) : mlib_find_library(name);
+		if (!lib || !mlib_find_playlist(lib, ".global"))
+			return -1;
+		if (hold)
+			mlib_library_put(lib);
+	}
+	return (bench_now() - start) / rounds;
+}
+
+/*
+ * Many open libraries: registering them without mapping them, finding them
+ * by name once all are mapped, and using them at random with only a few
+ * allowed to stay mapped.
+ */
+int bench_library_registry(struct mlib_library *lib, void *priv)
+{
+	int i, n, nr = bench_nr_entries(2000), max = 64, ret = -1;
+	struct mlib_library **libs;
+	struct mlib_registry_stats stats;
+	char file[64], name[32];
+	double start, reg, found, cycled, of;
+
+	libs = calloc(nr, sizeof(*libs));
+	if (!libs)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		snprintf(file, sizeof(file), ".bench-reg-%d.lib", i);
+		snprintf(name, sizeof(name), "reg-%d", i);
+		unlink(file);
+		if (mlib_create_library(file, name, "./"))
+			goto done;
+	}
+
+	start = bench_now();
+	for (i = 0; i < nr; i++) {
+		snprintf(file, sizeof(file), ".bench-reg-%d.lib", i);
+		libs[i] = mlib_open_library_lazy(file);
+		if (!libs[i])
+			goto close;
+	}
+	reg = (bench_now() - start) / nr;
+
+	/* Map them all, then time lookups by name alone. */
+	mlib_library_set_max_mapped(nr);
+	if (bench_registry_round(nr, nr * 4, 0) < 0)
+		goto close;
+	found = bench_registry_round(nr, 200000, 0);
+
+	srand(2);
+	start = bench_now();
+	for (i = 0; i < 200000; i++) {
+		n = rand() % nr;
+		if (mlib_library_of(mlib_global_playlist(libs[n])) != libs[n])
+			goto close;
+	}
+	of = (bench_now() - start) / 200000;
+
+	mlib_library_set_max_mapped(max);
+	cycled = bench_registry_round(nr, 20000, 1);
+	mlib_registry_stats(&stats);
+	if (found < 0 || cycled < 0)
+		goto close;
+
+	bench_report("%d libraries: register %.1f us each; all mapped: find "
+		     "%.0f ns, address lookup %.0f ns\n", nr, reg * 1e6,
+		     found * 1e9, of * 1e9);
+	bench_report("at most %d mapped: %.1f us per get/put, %u mapped "
+		     "now, %llu unmaps\n", max, cycled * 1e6, stats.mapped,
+		     (unsigned long long)stats.unmaps);
+	ret = 0;
+
+close:
+	for (i = 0; i < nr; i++)
+		if (libs[i])
+			mlib_close_library(libs[i]);
+	mlib_library_set_max_mapped(MLIB_LIB_MAX_MAPPED);
+done:
+	for (i = 0; i < nr; i++) {
+		snprintf(file, sizeof(file), ".bench-reg-%d.lib", i);
+		unlink(file);
+	}
+	free(libs);
+	return ret;
+}
@@ -0,0 +1,64 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The playlist directory: a hash table of playlist names. See dir.c for the
+ * details.
+ */
+
+#ifndef _MLIB_DIR_H_
+#define _MLIB_DIR_H_
+
+#include <stdint.h>
+
+struct mlib_library;
+struct mlib_playlist;
+
+#define MLIB_DIR_MAGIC		0x44495230	/* DIR0 */
+#define MLIB_DIR_MIN_SLOTS	64
+
+/*
+ * The directory is a record in the library like a playlist; the magic and
+ * length come first so that walking the playlists can step over it. Each slot
+ * holds the library offset of a playlist and the hash of its name.
+ */
+struct mlib_dir {
+	uint32_t	magic;
+	uint32_t	length;
+	uint32_t	nr;		/* Playlists in the table. */
+	uint32_t	dead;		/* Tombstones in the table. */
+	uint32_t	slots;		/* Size of the table; a power of 2. */
+	struct mlib_bucket_hslot	table[];
+} __attribute__((packed));
+
+#define MLIB_DIR_NR(dir)		__mlib_readl(&(dir)->nr)
+#define MLIB_DIR_DEAD(dir)		__mlib_readl(&(dir)->dead)
+#define MLIB_DIR_SLOTS(dir)		__mlib_readl(&(dir)->slots)
+
+#define MLIB_DIR_SET_NR(dir, val)	__mlib_writel(&(dir)->nr, val)
+#define MLIB_DIR_SET_DEAD(dir, val)	__mlib_writel(&(dir)->dead, val)
+#define MLIB_DIR_SET_SLOTS(dir, val)	__mlib_writel(&(dir)->slots, val)
+
+int	 mlib_dir_build(struct mlib_library *lib);
+struct mlib_playlist	*mlib_dir_find(const struct mlib_library *lib,
+				       const char *name);
+int	 mlib_dir_add(struct mlib_library *lib, struct mlib_playlist *plist);
+void	 mlib_dir_remove(struct mlib_library *lib,
+			 struct mlib_playlist *plist);
+void	 mlib_dir_moved(struct mlib_library *lib, uint64_t from, uint64_t to);
+void	 mlib_dir_stats(const struct mlib_library *lib,
+			struct mlib_bucket_stats *stats);
+
+#endif
@@ -31,6 +31,11 @@
 #define __mlib_writel(addr, val) ((*addr) = htobe32(val))
 
 #include <mlib/plist_bucket.h>
+#include <mlib/ptree.h>
+#include <mlib/dir.h>
+#include <mlib/wal.h>
+#include <mlib/vacuum.h>
+#include <mlib/remote.h>
 
 /*
  * Library magic and types.
@@ -39,7 +44,37 @@
 #define MLIB_HEADER_SIZE		(1<<10)		/* 1 Kb */
 #define MLIB_HEADER_FIELD_COUNT		3	/* # of 32 bit fields */
 #define MLIB_LIBRARY_LIB_NAME_LEN	(128 - (4 * MLIB_HEADER_FIELD_COUNT))
-#define MLIB_LIBRARY_MEDIA_PREFIX_LEN	(MLIB_HEADER_SIZE - 128)
+#define MLIB_HEADER_TAIL_FIELD_COUNT	10	/* 32 bit fields at the end */
+#define MLIB_LIBRARY_MEDIA_PREFIX_LEN					\
+	(MLIB_HEADER_SIZE - 128 - (4 * MLIB_HEADER_TAIL_FIELD_COUNT))
+
+/*
+ * Library format versions. v1 libraries were written before the header had a
+ * version field and read as 0 there. See extent.c for v2. v3 is v2 with 64 bit
+ * lengths; offsets stored in the library are in MLIB_EXTENT_ALIGN units so the
+ * same 32 bit fields reach MLIB_LIB_MAX_LEN.
+ */
+#define MLIB_LIB_VERSION_1		1	/* Records back to back. */
+#define MLIB_LIB_VERSION_EXTENTS	2	/* Records in extents. */
+#define MLIB_LIB_VERSION_WIDE		3	/* Past 4GB. */
+#define MLIB_LIB_VERSION_CURRENT	MLIB_LIB_VERSION_WIDE
+
+/*
+ * Library flags.
+ */
+#define MLIB_LIB_F_JOURNAL		(1 << 0)	/* See wal.c. */
+
+/*
+ * Flags for mlib_open_library_ro().
+ */
+#define MLIB_RO_POPULATE		(1 << 0)	/* Prefault it all. */
+#define MLIB_RO_WILLNEED		(1 << 1)	/* Read ahead. */
+
+/*
+ * Modes for mlib_library_lock().
+ */
+#define MLIB_LOCK_READ			1
+#define MLIB_LOCK_WRITE			2
 
 /*
  * Header for a library. This struct is exactly 1 KByte.
@@ -57,8 +92,8 @@ struct mlib_library_header {
 	uint32_t	media_count;
 
 	/*
-	 * Size of the library. Limited to 4GB. Since this is not the actual
-	 * media itself, this doesn't seem too unreasonable.
+	 * Size of the library; the low 32 bits in v3 libraries, which keep the
+	 * rest in lib_len_hi. Older libraries are limited to 4GB.
 	 */
 	uint32_t	lib_len;
 
@@ -77,29 +112,221 @@ struct mlib_library_header {
 	 * path defined in the library.
 	 */
 	char		media_prefix[MLIB_LIBRARY_MEDIA_PREFIX_LEN];
+
+	/*
+	 * High 32 bits of lib_len and free_bytes. These used to be the end of
+	 * media_prefix too so they read as 0 in older libraries.
+	 */
+	uint32_t	lib_len_hi;
+	uint32_t	free_bytes_hi;
+
+	/*
+	 * Bumped every time a process gives up the write lock so that other
+	 * processes know to look at the file again; see mlib_library_lock().
+	 * This used to be the end of media_prefix, which is always 0 there.
+	 */
+	uint32_t	generation;
+
+	/*
+	 * MLIB_LIB_F_* flags.
+	 */
+	uint32_t	flags;
+
+	/*
+	 * Sequence number of the last write-ahead log record that is in the
+	 * library file itself; see wal.c.
+	 */
+	uint32_t	wal_seq;
+
+	/*
+	 * Offset of the playlist directory of a v2 library; see dir.c. 0 if
+	 * it hasn't been built yet.
+	 */
+	uint32_t	dir_offs;
+
+	/*
+	 * Format version; 0 is the same as MLIB_LIB_VERSION_1.
+	 */
+	uint32_t	version;
+
+	/*
+	 * The rest is only used by v2 libraries: the offset of .global, which
+	 * need not be the first playlist, the first extent on the free list
+	 * and the number of bytes on the free list (the low 32 bits of it).
+	 */
+	uint32_t	global_offs;
+	uint32_t	free_offs;
+	uint32_t	free_bytes;
 } __attribute__((packed));
 
 /*
- * A list node for keeping track of all open libraries.
+ * Header of an extent in a v2 library. Extents are multiples of
+ * MLIB_EXTENT_ALIGN bytes long and are either in use, holding one record right
+ * after this header, or on the free list. In v3 libraries @length is in
+ * MLIB_EXTENT_ALIGN units like @next.
+ */
+struct mlib_extent {
+	uint32_t	magic;
+	uint32_t	length;		/* The whole extent, this included. */
+	uint32_t	next;		/* Free extents: the next free extent. */
+	uint32_t	pad;
+	uint8_t		data[];
+} __attribute__((packed));
+
+#define MLIB_EXTENT_USED	0x45585455	/* EXTU */
+#define MLIB_EXTENT_FREE	0x45585446	/* EXTF */
+#define MLIB_EXTENT_ALIGN	16
+#define MLIB_EXTENT_SHIFT	4		/* log2(MLIB_EXTENT_ALIGN) */
+
+/*
+ * Pages of a library written since it was last synced; see
+ * __mlib_library_dirty(). Once there would be more than MLIB_LIB_DIRTY_RANGES
+ * ranges the two closest ones are merged, so a sync may flush a few clean
+ * pages in between.
+ */
+#define MLIB_LIB_DIRTY_RANGES	16
+
+struct mlib_dirty_range {
+	uint32_t	start;		/* First dirty page. */
+	uint32_t	end;		/* Page after the last dirty one. */
+};
+
+/*
+ * Sync counters; see mlib_library_sync_stats().
+ */
+struct mlib_sync_stats {
+	uint64_t	syncs;
+	uint64_t	bytes;		/* Flushed by all syncs so far. */
+	uint64_t	last_bytes;	/* Flushed by the last sync. */
+};
+
+/*
+ * A list node for keeping track of all open libraries. The file is mapped at
+ * the start of a reservation of @map_len bytes of address space so that it can
+ * grow in place; see __mlib_library_expand(). The file itself is kept up to
+ * MLIB_LIB_CHUNK or so longer than the library.
  */
 struct mlib_library {
 	struct list_head	 	 list;
 	struct mlib_library_header	*header;
 	int				 fd;
+	char				*path;
+	size_t				 file_len;
+	size_t				 map_len;
+	int				 map_flags;	/* MAP_SHARED or
+							 * MAP_PRIVATE. */
+	int				 map_prot;
+	int				 read_only;
+	int				 ro_flags;	/* MLIB_RO_*. */
+	int				 is_remote;
+
+	/*
+	 * Registry state; see library.c. @header is NULL while the library is
+	 * not mapped, and @name is valid either way.
+	 */
+	struct hlist_node		 hash;
+	struct list_head		 lru;
+	char				 name[MLIB_LIBRARY_LIB_NAME_LEN];
+	int				 refs;
+	int				 indexed;	/* In mapped[]. */
+
+	/* How far offsets stored in the library are shifted; see v3. */
+	int				 offs_shift;
+
+	/* MLIB_LOCK_* mode held and the header generation last seen. */
+	int				 lock;
+	uint32_t			 generation;
+
+	/* Log of a journaled library; NULL otherwise. */
+	struct mlib_wal			*wal;
+
+	/* Set for a library served over HTTP; see remote.c. */
+	struct mlib_remote		*remote;
+
+	/*
+	 * The last record to move out of its extent; see
+	 * __mlib_library_moved().
+	 */
+	uint64_t			 moved_from;
+	uint64_t			 moved_to;
+
+	/* Dirty ranges, sorted and disjoint; one spare for merging. */
+	struct mlib_dirty_range		 dirty[MLIB_LIB_DIRTY_RANGES + 1];
+	int				 nr_dirty;
+	struct mlib_sync_stats		 sync_stats;
 };
 
+/*
+ * Libraries nobody holds are unmapped once more than this many libraries are
+ * mapped; see mlib_library_put().
+ */
+#define MLIB_LIB_MAX_MAPPED	256
+
+/*
+ * Registry counters; see mlib_registry_stats().
+ */
+struct mlib_registry_stats {
+	uint32_t	libraries;	/* Open. */
+	uint32_t	mapped;		/* Open and mapped right now. */
+	uint64_t	maps;		/* Times a library was mapped in. */
+	uint64_t	unmaps;		/* Times an idle one was unmapped. */
+};
+
+/*
+ * Address space reserved for a library when it is created. Only v3 libraries
+ * can grow past that, and their mappings move when they do.
+ */
+#define MLIB_LIB_RESERVE	\
+	(sizeof(void *) > 4 ? (size_t)UINT32_MAX + 1 : (size_t)64 << 20)
+
+/* Smallest step the library file grows or shrinks by. */
+#define MLIB_LIB_CHUNK		(1 << 20)
+
 /* TODO: Byte level endianness handlers? */
 #define MLIB_LIB_MAGIC(lib)	__mlib_readl(&(lib)->header->mlib_magic)
-#define MLIB_LIB_LEN(lib)	__mlib_readl(&(lib)->header->lib_len)
+#define MLIB_LIB_LEN(lib)					\
+	((uint64_t)__mlib_readl(&(lib)->header->lib_len_hi) << 32 |	\
+	 __mlib_readl(&(lib)->header->lib_len))
 #define MLIB_LIB_NAME(lib)	((lib)->header->lib_name)
 #define MLIB_LIB_PREFIX(lib)	((lib)->header->media_prefix)
 
 #define MLIB_LIB_SET_MAGIC(lib, val)		\
 	__mlib_writel(&(lib)->header->lib_len, val)
-#define MLIB_LIB_SET_LEN(lib, val)		\
-	__mlib_writel(&(lib)->header->lib_len, val)
+#define MLIB_LIB_SET_LEN(lib, val)					\
+	(__mlib_writel(&(lib)->header->lib_len_hi,			\
+		       (uint64_t)(val) >> 32),				\
+	 __mlib_writel(&(lib)->header->lib_len, (uint32_t)(val)))
+#define MLIB_LIB_FREE_BYTES(lib)					\
+	((uint64_t)__mlib_readl(&(lib)->header->free_bytes_hi) << 32 |	\
+	 __mlib_readl(&(lib)->header->free_bytes))
+#define MLIB_LIB_SET_FREE_BYTES(lib, val)				\
+	(__mlib_writel(&(lib)->header->free_bytes_hi,			\
+		       (uint64_t)(val) >> 32),				\
+	 __mlib_writel(&(lib)->header->free_bytes, (uint32_t)(val)))
+
+/*
+ * Offsets of records (and extent lengths) stored in a library. Every record of
+ * a v2 library is MLIB_EXTENT_ALIGN aligned, so v3 stores them in those units.
+ */
+#define __mlib_read_offs(lib, addr)				\
+	((uint64_t)__mlib_readl(addr) << (lib)->offs_shift)
+#define __mlib_write_offs(lib, addr, val)			\
+	__mlib_writel(addr, (uint32_t)((val) >> (lib)->offs_shift))
+#define MLIB_LIB_MAX_LEN(lib)	((uint64_t)UINT32_MAX << (lib)->offs_shift)
+#define MLIB_LIB_DIRTY_HEADER(lib)		\
+	__mlib_library_dirty(lib, (lib)->header, MLIB_HEADER_SIZE)
+
+#define MLIB_LIB_VERSION(lib)					\
+	(__mlib_readl(&(lib)->header->version) ?		\
+	 __mlib_readl(&(lib)->header->version) : MLIB_LIB_VERSION_1)
+#define MLIB_LIB_EXTENTS(lib)					\
+	(MLIB_LIB_VERSION(lib) >= MLIB_LIB_VERSION_EXTENTS)
+#define MLIB_LIB_FLAGS(lib)	__mlib_readl(&(lib)->header->flags)
+#define MLIB_LIB_SET_FLAGS(lib, val)		\
+	__mlib_writel(&(lib)->header->flags, val)
 
 #define MLIB_PLIST_HDR_MAGIC	0x10202010
+#define MLIB_PLIST_PAGED_MAGIC	0x10202011	/* See ptree.c. */
 #define MLIB_PLIST_FIELDS	3
 #define MLIB_PLIST_NAME_LEN	(128 - (MLIB_PLIST_FIELDS * sizeof(uint32_t)))
 
@@ -119,6 +346,9 @@ struct mlib_playlist {
 #define MLIB_PLIST_LEN(plist)		__mlib_readl(&(plist)->length)
 #define MLIB_PLIST_MCOUNT(plist)	__mlib_readl(&(plist)->mcount)
 #define MLIB_PLIST_NAME(plist)		((plist)->name)
+#define MLIB_PLIST_PAGED(plist)				\
+	(MLIB_PLIST_MAGIC(plist) == MLIB_PLIST_PAGED_MAGIC)
+#define MLIB_PLIST_PTREE(plist)	((struct mlib_ptree *)&(plist)->data)
 
 #define MLIB_PLIST_SET_MAGIC(plist, val)		\
 	__mlib_writel(&(plist)->playlist_magic, val)
@@ -144,10 +374,10 @@ struct mlib_playlist {
  * @lib		A pointer to the library.
  * @plist	A pointer variable to use to hold the playlist pointer.
  */
-#define mlib_for_each_path(plist, ind, path)			\
-	for (ind = 0, path = mlib_get_path_at(plist, ind);	\
+#define mlib_for_each_path(lib, plist, ind, path)		\
+	for (ind = 0, path = mlib_get_path_at(lib, plist, ind);	\
 	     path != NULL;					\
-	     path = mlib_get_path_at(plist, ++ind))
+	     path = mlib_get_path_at(lib, plist, ++ind))
 
 /*
  * MLib library functions for general use.
@@ -155,9 +385,25 @@ struct mlib_playlist {
 int	 mlib_library_init();
 int	 mlib_create_library(const char *path, const char *name,
 			     const char *media_prefix);
+int	 mlib_create_library_version(const char *path, const char *name,
+				     const char *media_prefix,
+				     uint32_t version);
 struct mlib_library	*mlib_open_library(const char *location, int remote);
+struct mlib_library	*mlib_open_library_ro(const char *path, int flags);
+struct mlib_library	*mlib_open_library_lazy(const char *path);
 struct mlib_library	*mlib_find_library(const char *name);
-int	 mlib_sync_library(const struct mlib_library *lib);
+struct mlib_library	*mlib_library_get(const char *name);
+int	 mlib_library_hold(struct mlib_library *lib);
+void	 mlib_library_put(struct mlib_library *lib);
+void	 mlib_library_set_max_mapped(uint32_t nr);
+void	 mlib_registry_stats(struct mlib_registry_stats *stats);
+struct mlib_library	*mlib_library_of(const void *addr);
+uint64_t mlib_library_free_bytes(const struct mlib_library *lib);
+int	 mlib_sync_library(struct mlib_library *lib);
+void	 mlib_library_sync_stats(const struct mlib_library *lib,
+				 struct mlib_sync_stats *stats);
+int	 mlib_library_lock(struct mlib_library *lib, int mode);
+int	 mlib_library_unlock(struct mlib_library *lib);
 int	 mlib_close_library(struct mlib_library *lib);
 
 /*
@@ -165,18 +411,47 @@ int	 mlib_close_library(struct mlib_library *lib);
  */
 int	 mlib_playlist_init();
 int	 mlib_start_playlist(struct mlib_library *lib, const char *name);
+int	 mlib_start_paged_playlist(struct mlib_library *lib, const char *name);
 struct mlib_playlist	 *mlib_next_playlist(const struct mlib_library *lib,
 					     struct mlib_playlist *plist);
 struct mlib_playlist	 *mlib_find_playlist(const struct mlib_library *lib,
 					     const char *name);
+struct mlib_playlist	 *mlib_global_playlist(const struct mlib_library *lib);
+int	 mlib_upgrade_playlists(struct mlib_library *lib);
 int	 mlib_add_path_to_plist(struct mlib_library *lib,
 				struct mlib_playlist *plist, const char *path);
 int	 mlib_add_path(struct mlib_library *lib, const char *plist,
 		       const char *path);
-const char	*mlib_find_path(const struct mlib_playlist *plist,
+int	 mlib_append_path(struct mlib_library *lib, const char *plist,
+			  const char *path);
+int	 mlib_remove_path_from_plist(struct mlib_library *lib,
+				     struct mlib_playlist *plist,
+				     const char *path);
+int	 mlib_remove_path(struct mlib_library *lib, const char *plist,
+			  const char *path);
+int	 mlib_media_id(const struct mlib_library *lib, const char *path,
+		       uint32_t *id);
+const char	*mlib_media_path(const struct mlib_library *lib, uint32_t id);
+int	 mlib_playlist_reserve(struct mlib_library *lib, const char *name,
+			       uint32_t nr, uint32_t str_bytes);
+int	 mlib_hash_playlist(struct mlib_library *lib, const char *name);
+int	 mlib_bloom_playlist(struct mlib_library *lib, const char *name);
+int	 mlib_tree_playlist(struct mlib_library *lib, const char *name);
+int	 mlib_rebuild_playlist(struct mlib_library *lib, const char *name,
+			       int nr_threads);
+int	 mlib_compress_playlist(struct mlib_library *lib, const char *name);
+void	 mlib_playlist_stats(const struct mlib_library *lib,
+			     const struct mlib_playlist *plist,
+			     struct mlib_bucket_stats *stats);
+const char	*mlib_find_path(const struct mlib_library *lib,
+				const struct mlib_playlist *plist,
 				const char *path);
-const char	*mlib_get_path_at(const struct mlib_playlist *plist,
+const char	*mlib_get_path_at(const struct mlib_library *lib,
+				  const struct mlib_playlist *plist,
 				  int index);
+int	 mlib_find_prefix(const struct mlib_library *lib,
+			  const struct mlib_playlist *plist,
+			  const char *prefix, int *first, int *last);
 int	 mlib_delete_playlist(struct mlib_library *lib, const char *name);
 
 /*
@@ -184,9 +459,37 @@ int	 mlib_delete_playlist(struct mlib_library *lib, const char *name);
  */
 int	 __mlib_library_expand(struct mlib_library *lib, size_t len);
 int	 __mlib_library_trunc(struct mlib_library *lib, size_t len);
+int	 __mlib_library_remap(struct mlib_library *lib, int flags);
+int	 __mlib_library_writable(const struct mlib_library *lib);
+void	 __mlib_library_dirty(struct mlib_library *lib, const void *addr,
+			      size_t len);
 int 	 __mlib_library_excise(struct mlib_library *lib, void *start,
 			       void *end);
-int	 __mlib_library_insert_space(struct mlib_library *lib, uint32_t offset,
+int	 __mlib_library_insert_space(struct mlib_library *lib, uint64_t offset,
 				     uint32_t length);
+uint64_t __mlib_library_alloc_record(struct mlib_library *lib, uint32_t len);
+int	 __mlib_library_free_record(struct mlib_library *lib, uint64_t rec);
+int	 __mlib_library_grow_record(struct mlib_library *lib, uint64_t *rec,
+				    uint32_t offset, uint32_t length);
+int	 __mlib_library_cut_record(struct mlib_library *lib, uint64_t rec,
+				   uint32_t offset, uint32_t length);
+uint64_t __mlib_library_moved(const struct mlib_library *lib, uint64_t rec);
+int	 __mlib_library_pack_record(struct mlib_library *lib, uint64_t *rec);
+void	 __mlib_library_record_stats(const struct mlib_library *lib,
+				     uint64_t rec,
+				     struct mlib_bucket_stats *stats);
+
+/*
+ * The v2 extent allocator; see extent.c.
+ */
+uint64_t __mlib_extent_alloc(struct mlib_library *lib, uint32_t len);
+void	 __mlib_extent_free(struct mlib_library *lib, uint64_t rec);
+int	 __mlib_extent_reserve(struct mlib_library *lib, uint64_t *rec,
+			       uint32_t len);
+void	 __mlib_extent_trim(struct mlib_library *lib, uint64_t rec,
+			    uint32_t len);
+int	 __mlib_extent_pack(struct mlib_library *lib, uint64_t *rec);
+uint32_t __mlib_extent_capacity(const struct mlib_library *lib, uint64_t rec);
+uint64_t __mlib_extent_next(const struct mlib_library *lib, uint64_t rec);
 
 #endif
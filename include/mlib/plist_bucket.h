@@ -23,8 +23,66 @@
 #ifndef _MLIB_PLIST_BUCKET_H_
 #define _MLIB_PLIST_BUCKET_H_
 
-#define MLIB_BUCKET_MAGIC_VAL	0x12344321
-#define MLIB_BUCKET_GROWTH_RATE	128
+#define MLIB_BUCKET_MAGIC_VAL	0x12344322
+#define MLIB_BUCKET_GROWTH_RATE	128		/* Minimum growth step. */
+#define MLIB_BUCKET_GROWTH_CAP	(16 << 20)	/* Default growth cap. */
+
+/*
+ * Buckets written before the header went past @str_bytes: just the first four
+ * words of struct mlib_bucket and always 32 bit indexes. They only turn up in
+ * libraries with a version of 0 and are upgraded when those are opened; see
+ * mlib_bucket_upgrade().
+ */
+#define MLIB_BUCKET_MAGIC_V0	0x12344321
+#define MLIB_BUCKET_V0_HDR_LEN	16
+
+/*
+ * Removed strings are left in place until more than 1 / 2^DEAD_SHIFT of the
+ * string bytes (and at least MLIB_BUCKET_GROWTH_RATE bytes) are dead. Then the
+ * strings are compacted.
+ */
+#define MLIB_BUCKET_DEAD_SHIFT	2
+
+/*
+ * Bucket flags.
+ */
+#define MLIB_BUCKET_F_HASH	(1 << 0)	/* Hash table after indexes. */
+#define MLIB_BUCKET_F_COMPRESSED (1 << 1)	/* Symbol table compression. */
+#define MLIB_BUCKET_F_IDS	(1 << 2)	/* Indexes are IDs; see bucket.c. */
+#define MLIB_BUCKET_F_REFS	(1 << 3)	/* Indexes are IDs into .global. */
+#define MLIB_BUCKET_F_BLOOM	(1 << 4)	/* Bloom filter after hash table. */
+#define MLIB_BUCKET_F_TREE	(1 << 5)	/* Search tree is up to date. */
+#define MLIB_BUCKET_F_IDX16	(1 << 6)	/* 16 bit index entries. */
+#define MLIB_BUCKET_F_IDX24	(1 << 7)	/* 24 bit index entries. */
+#define MLIB_BUCKET_F_FIXED	(1 << 8)	/* Never grows; see ptree.c. */
+
+/*
+ * ID table entry for an ID whose string was removed.
+ */
+#define MLIB_BUCKET_ID_DEAD	0xffffffff
+
+/*
+ * The Bloom filter is split into blocks of one cache line; each string sets
+ * MLIB_BLOOM_K bits in a single block. The filter is sized for about
+ * MLIB_BLOOM_BITS bits per string, which gives a false positive rate of a
+ * couple of percent at worst.
+ */
+#define MLIB_BLOOM_BLOCK	64
+#define MLIB_BLOOM_K		6
+#define MLIB_BLOOM_BITS		12
+
+/*
+ * Longest string (including the terminator) that a compressed bucket will
+ * hold. Strings get decoded into buffers of this size.
+ */
+#define MLIB_BUCKET_MAX_STR	4096
+
+/*
+ * Symbol table compression; see compress.c.
+ */
+#define MLIB_SYMTAB_ESCAPE	0xff
+#define MLIB_SYMTAB_MAX_SYMS	254
+#define MLIB_SYMTAB_SYM_LEN	8
 
 struct mlib_library;
 
@@ -37,13 +95,65 @@ struct mlib_bucket {
 	uint32_t	length;		/* In bytes (of the entire bucket). */
 	uint32_t	index_offs;	/* Offset of indexes. This array grows
 					 * backwards and includes this header
-					 * in the offset. */
+					 * in the offset. Entries are 2, 3 or
+					 * 4 bytes; see the IDX flags. */
 	uint32_t	str_bytes;	/* Number of bytes in the strings
 					 * array. */
+	uint32_t	flags;		/* MLIB_BUCKET_F_* flags. */
+	uint32_t	aux_offs;	/* Offset of the optional tables that
+					 * follow the index array. The index
+					 * array ends here. */
+	uint32_t	hash_slots;	/* Number of slots in the hash table;
+					 * always a power of 2. */
+	uint32_t	dead_bytes;	/* Bytes of removed strings still in
+					 * the strings array. */
+	uint32_t	id_slots;	/* Size of the ID table. */
+	uint32_t	next_id;	/* Next ID to hand out. */
+	uint32_t	bloom_blocks;	/* Size of the Bloom filter in
+					 * MLIB_BLOOM_BLOCK byte blocks; always
+					 * a power of 2. */
+	uint32_t	tree_slots;	/* Size of the search tree in nodes. */
 	char		strings[];	/* The string data. This grows
 					 * forwards. */
 } __attribute__((packed));
 
+/*
+ * A slot in the optional hash table. @offset is the index value (the string
+ * offset or ID) plus one so that an all zero slot is empty. @hash lets probes
+ * skip strings that can't match without reading the string data. Removed
+ * strings leave a tombstone (MLIB_BUCKET_HSLOT_DEAD) behind so probes for
+ * other strings keep going.
+ */
+struct mlib_bucket_hslot {
+	uint32_t	offset;
+	uint32_t	hash;
+} __attribute__((packed));
+
+#define MLIB_BUCKET_HSLOT_DEAD	0xffffffff
+
+/*
+ * A node of the optional search tree; see bucket.c. @key holds
+ * MLIB_TREE_KEY_LEN bytes of the string starting at @offs, zero padded, so
+ * comparing keys as big endian numbers orders them like strcmp() would. Every
+ * string in the node's subtree shares its first @offs bytes with it.
+ */
+#define MLIB_TREE_KEY_LEN	16
+
+struct mlib_bucket_tnode {
+	uint8_t		key[MLIB_TREE_KEY_LEN];
+	uint32_t	ref;
+	uint32_t	offs;
+} __attribute__((packed));
+
+/*
+ * Symbol table for compressed buckets. It lives at the very end of the bucket.
+ * @lens and @syms are indexed by code; unused codes have a length of 0.
+ */
+struct mlib_symtab {
+	uint8_t		lens[256];
+	char		syms[256][MLIB_SYMTAB_SYM_LEN];
+} __attribute__((packed));
+
 /*
  * The usual macros for dealing with endianness.
  */
@@ -51,6 +161,14 @@ struct mlib_bucket {
 #define MLIB_BUCKET_LENGTH(bucket)	__mlib_readl(&(bucket)->length)
 #define MLIB_BUCKET_INDEX_OFFS(bucket)	__mlib_readl(&(bucket)->index_offs)
 #define MLIB_BUCKET_STR_BYTES(bucket)	__mlib_readl(&(bucket)->str_bytes)
+#define MLIB_BUCKET_FLAGS(bucket)	__mlib_readl(&(bucket)->flags)
+#define MLIB_BUCKET_AUX_OFFS(bucket)	__mlib_readl(&(bucket)->aux_offs)
+#define MLIB_BUCKET_HASH_SLOTS(bucket)	__mlib_readl(&(bucket)->hash_slots)
+#define MLIB_BUCKET_DEAD_BYTES(bucket)	__mlib_readl(&(bucket)->dead_bytes)
+#define MLIB_BUCKET_ID_SLOTS(bucket)	__mlib_readl(&(bucket)->id_slots)
+#define MLIB_BUCKET_NEXT_ID(bucket)	__mlib_readl(&(bucket)->next_id)
+#define MLIB_BUCKET_BLOOM_BLOCKS(bucket) __mlib_readl(&(bucket)->bloom_blocks)
+#define MLIB_BUCKET_TREE_SLOTS(bucket)	__mlib_readl(&(bucket)->tree_slots)
 #define MLIB_BUCKET_SET_MAGIC(bucket, val)		\
 	__mlib_writel(&(bucket)->magic, val)
 #define MLIB_BUCKET_SET_LENGTH(bucket, val)		\
@@ -59,19 +177,146 @@ struct mlib_bucket {
 	__mlib_writel(&(bucket)->index_offs, val)
 #define MLIB_BUCKET_SET_STR_BYTES(bucket, val)		\
 	__mlib_writel(&(bucket)->str_bytes, val)
+#define MLIB_BUCKET_SET_FLAGS(bucket, val)		\
+	__mlib_writel(&(bucket)->flags, val)
+#define MLIB_BUCKET_SET_AUX_OFFS(bucket, val)		\
+	__mlib_writel(&(bucket)->aux_offs, val)
+#define MLIB_BUCKET_SET_HASH_SLOTS(bucket, val)		\
+	__mlib_writel(&(bucket)->hash_slots, val)
+#define MLIB_BUCKET_SET_DEAD_BYTES(bucket, val)		\
+	__mlib_writel(&(bucket)->dead_bytes, val)
+#define MLIB_BUCKET_SET_ID_SLOTS(bucket, val)		\
+	__mlib_writel(&(bucket)->id_slots, val)
+#define MLIB_BUCKET_SET_NEXT_ID(bucket, val)		\
+	__mlib_writel(&(bucket)->next_id, val)
+#define MLIB_BUCKET_SET_BLOOM_BLOCKS(bucket, val)	\
+	__mlib_writel(&(bucket)->bloom_blocks, val)
+#define MLIB_BUCKET_SET_TREE_SLOTS(bucket, val)		\
+	__mlib_writel(&(bucket)->tree_slots, val)
+
+/*
+ * Bloom filter counters, summed over every bucket in the process. A lookup the
+ * filter lets through that then isn't found is a false positive, so the false
+ * positive rate is @false_positives / (@false_positives + @negatives).
+ */
+struct mlib_bloom_stats {
+	uint64_t	checks;		/* Lookups that consulted a filter. */
+	uint64_t	negatives;	/* Lookups the filter answered. */
+	uint64_t	false_positives;
+};
+
+/*
+ * Storage statistics; see mlib_bucket_stats(). Every byte counted in
+ * @total_bytes is in exactly one of the other byte counts except @path_bytes.
+ */
+struct mlib_bucket_stats {
+	uint64_t	entries;
+	uint64_t	total_bytes;
+	uint64_t	header_bytes;
+	uint64_t	str_bytes;	/* Live strings as stored. */
+	uint64_t	dead_bytes;	/* Removed strings not compacted yet. */
+	uint64_t	index_bytes;
+	uint64_t	aux_bytes;	/* Hash, Bloom, tree and ID tables etc. */
+	uint64_t	free_bytes;	/* Room left to grow into. */
+	uint64_t	path_bytes;	/* Length of the paths, decoded. */
+};
+
+/*
+ * A string to sort and the index value to carry along with it.
+ */
+struct mlib_sort_ent {
+	const char	*str;
+	uint32_t	 ref;
+};
 
 /*
  * Functions for manipulating the bucket.
  */
 int	 mlib_bucket_init();
-int	 mlib_init_bucket(struct mlib_bucket *bucket, uint32_t size);
+int	 mlib_init_bucket(struct mlib_bucket *bucket, uint32_t size,
+			  uint32_t flags);
 int	 mlib_bucket_add(struct mlib_library *lib, struct mlib_bucket *bucket,
 			 const char *str);
+int	 mlib_bucket_append(struct mlib_library *lib,
+			    struct mlib_bucket *bucket, const char *str);
+int	 mlib_bucket_remove(struct mlib_library *lib,
+			    struct mlib_bucket *bucket, const char *str);
+int	 mlib_bucket_split(struct mlib_library *lib, struct mlib_bucket *bucket,
+			   struct mlib_bucket *dst);
+int	 mlib_bucket_compact(struct mlib_library *lib,
+			     struct mlib_bucket *bucket);
+int	 mlib_bucket_enable_hash(struct mlib_library *lib,
+				 struct mlib_bucket *bucket);
+int	 mlib_bucket_enable_bloom(struct mlib_library *lib,
+				  struct mlib_bucket *bucket);
+void	 mlib_bucket_bloom_stats(struct mlib_bloom_stats *stats);
+int	 mlib_bucket_build_tree(struct mlib_library *lib,
+				struct mlib_bucket *bucket);
+void	 mlib_bucket_bloom_stats_reset(void);
+int	 mlib_bucket_compress(struct mlib_library *lib,
+			      struct mlib_bucket *bucket);
+int	 mlib_bucket_reserve(struct mlib_library *lib,
+			     struct mlib_bucket *bucket, uint32_t nr,
+			     uint32_t str_bytes);
+uint32_t mlib_bucket_set_growth_cap(uint32_t cap);
+int	 mlib_bucket_trim(struct mlib_library *lib, struct mlib_bucket *bucket);
+int	 mlib_bucket_pack(struct mlib_library *lib, struct mlib_bucket *bucket);
+struct mlib_bucket	*mlib_bucket_upgrade(struct mlib_library *lib,
+					     struct mlib_bucket *bucket);
+struct mlib_bucket	*mlib_bucket_expand(struct mlib_library *lib,
+					    struct mlib_bucket *bucket,
+					    uint32_t length);
+void	 mlib_bucket_sort(struct mlib_library *lib, struct mlib_bucket *bucket);
+int	 mlib_bucket_rebuild(struct mlib_library *lib,
+			     struct mlib_bucket *bucket, int nr_threads);
 int	 mlib_bucket_nr_indexes(const struct mlib_bucket *bucket);
-const char	*mlib_bucket_string_at(const struct mlib_bucket *bucket,
+void	 mlib_bucket_stats(const struct mlib_library *lib,
+			   const struct mlib_bucket *bucket,
+			   struct mlib_bucket_stats *stats);
+uint32_t mlib_bucket_index(const struct mlib_bucket *bucket, int i);
+const char	*mlib_bucket_string_at(const struct mlib_library *lib,
+				       const struct mlib_bucket *bucket,
 				       uint32_t offset);
-const char	*mlib_bucket_string(const struct mlib_bucket *bucket, int n);
-const char	*mlib_bucket_contains(const struct mlib_bucket *bucket,
+const char	*mlib_bucket_string(const struct mlib_library *lib,
+				    const struct mlib_bucket *bucket, int n);
+const char	*mlib_bucket_contains(const struct mlib_library *lib,
+				      const struct mlib_bucket *bucket,
 				      const char *str);
+int	 mlib_bucket_assign_ids(struct mlib_library *lib,
+				struct mlib_bucket *bucket);
+int	 mlib_bucket_make_refs(struct mlib_library *lib,
+			       struct mlib_bucket *bucket);
+int	 mlib_bucket_find_id(const struct mlib_library *lib,
+			     const struct mlib_bucket *bucket, const char *str,
+			     uint32_t *id);
+const char	*mlib_bucket_id_string(const struct mlib_bucket *bucket,
+				       uint32_t id);
+int	 mlib_bucket_prefix_range(const struct mlib_library *lib,
+				  const struct mlib_bucket *bucket,
+				  const char *prefix, int *first, int *last);
+
+/*
+ * String compare kernels; see simd.c.
+ */
+int	 mlib_prefix_cmp(const char *str, const char *prefix, size_t len);
+void	 mlib_prefix_cmp_force_scalar(int scalar);
+
+/*
+ * Parallel string sort; see sort.c.
+ */
+int	 mlib_sort_strings(struct mlib_sort_ent *ents, uint32_t nr,
+			   int nr_threads);
+
+/*
+ * Symbol table compression.
+ */
+int	 mlib_symtab_train(struct mlib_symtab *symtab, const char **strs,
+			   int nr);
+int	 mlib_symtab_encode(const struct mlib_symtab *symtab, const char *str,
+			    char *out, int out_len);
+int	 mlib_symtab_decode(const struct mlib_symtab *symtab, const char *enc,
+			    char *out, int out_len);
+int	 mlib_symtab_cmp(const struct mlib_symtab *symtab, const char *enc,
+			 const char *str);
 
 #endif
@@ -0,0 +1,104 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Paged playlists: a B+tree of fixed size pages instead of one bucket. See
+ * ptree.c for the details.
+ */
+
+#ifndef _MLIB_PTREE_H_
+#define _MLIB_PTREE_H_
+
+#include <stdint.h>
+
+struct mlib_library;
+struct mlib_playlist;
+struct mlib_bucket_stats;
+
+#define MLIB_PAGE_MAGIC		0x50414745	/* PAGE */
+#define MLIB_PAGE_SIZE		4096
+#define MLIB_PAGE_FREE		0xffffffff	/* Level of a free page. */
+
+/*
+ * A page. Pages are records in the library just like playlists; the magic and
+ * length come first so that walking the playlists can step over them. Leaves
+ * (level 0) hold a fixed size bucket, interior pages an array of children.
+ */
+struct mlib_page {
+	uint32_t	magic;
+	uint32_t	length;		/* Always MLIB_PAGE_SIZE. */
+	uint32_t	level;		/* 0 for leaves. */
+	uint32_t	nr;		/* Children of an interior page. */
+	uint32_t	next;		/* Next page on the free list. */
+	uint8_t		data[];
+} __attribute__((packed));
+
+#define MLIB_PAGE_DATA_LEN	(MLIB_PAGE_SIZE - sizeof(struct mlib_page))
+
+/*
+ * A child of an interior page: the ID of the first path under it, how many
+ * paths are under it and the library offset of its page.
+ */
+struct mlib_page_child {
+	uint32_t	key;
+	uint32_t	count;
+	uint32_t	offs;
+} __attribute__((packed));
+
+#define MLIB_PAGE_FANOUT	\
+	(MLIB_PAGE_DATA_LEN / sizeof(struct mlib_page_child))
+
+/*
+ * What a paged playlist has in place of its bucket. Offsets are from the start
+ * of the library; 0 means none.
+ */
+struct mlib_ptree {
+	uint32_t	root;
+	uint32_t	free;		/* First free page. */
+	uint32_t	nr_pages;	/* Pages owned, free ones included. */
+} __attribute__((packed));
+
+#define MLIB_PAGE_LEVEL(page)		__mlib_readl(&(page)->level)
+#define MLIB_PAGE_NR(page)		__mlib_readl(&(page)->nr)
+#define MLIB_PAGE_NEXT(lib, page)	__mlib_read_offs(lib, &(page)->next)
+
+#define MLIB_PAGE_SET_LEVEL(page, val)	__mlib_writel(&(page)->level, val)
+#define MLIB_PAGE_SET_NR(page, val)	__mlib_writel(&(page)->nr, val)
+#define MLIB_PAGE_SET_NEXT(lib, page, val)			\
+	__mlib_write_offs(lib, &(page)->next, val)
+
+int	 mlib_ptree_init(struct mlib_ptree *ptree);
+int	 mlib_ptree_add(struct mlib_library *lib, struct mlib_playlist *plist,
+			const char *path);
+int	 mlib_ptree_remove(struct mlib_library *lib,
+			   struct mlib_playlist *plist, const char *path);
+const char	*mlib_ptree_find(const struct mlib_library *lib,
+				 const struct mlib_playlist *plist,
+				 const char *path);
+const char	*mlib_ptree_path_at(const struct mlib_library *lib,
+				    const struct mlib_playlist *plist,
+				    int index);
+int	 mlib_ptree_prefix(const struct mlib_library *lib,
+			   const struct mlib_playlist *plist,
+			   const char *prefix, int *first, int *last);
+int	 mlib_ptree_destroy(struct mlib_library *lib,
+			    struct mlib_playlist *plist);
+void	 mlib_ptree_stats(const struct mlib_library *lib,
+			  const struct mlib_playlist *plist,
+			  struct mlib_bucket_stats *stats);
+void	 __mlib_ptree_shift(struct mlib_library *lib, uint64_t len,
+			    uint64_t offset, int32_t delta);
+
+#endif
@@ -0,0 +1,87 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Libraries served over HTTP. See remote.c for the details.
+ */
+
+#ifndef _MLIB_REMOTE_H_
+#define _MLIB_REMOTE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct mlib_library;
+
+/* Remote libraries are fetched in pieces of this many bytes. */
+#define MLIB_REMOTE_CHUNK	(64 << 10)
+
+/*
+ * Seconds a range request may take, and may spend connecting. A request that
+ * fails for a reason that may go away is tried again up to
+ * MLIB_REMOTE_RETRIES more times, waiting MLIB_REMOTE_BACKOFF milliseconds
+ * before the first retry and twice as long before each one after that. A
+ * chunk that still can't be fetched faults for MLIB_REMOTE_POISON
+ * milliseconds; the next read after that fetches it again.
+ */
+#define MLIB_REMOTE_TIMEOUT		30
+#define MLIB_REMOTE_CONNECT_TIMEOUT	10
+#define MLIB_REMOTE_RETRIES		3
+#define MLIB_REMOTE_BACKOFF		100
+#define MLIB_REMOTE_POISON		1000
+
+/*
+ * Remote counters; see mlib_library_remote_stats().
+ */
+struct mlib_remote_stats {
+	uint64_t	requests;	/* Range requests made. */
+	uint64_t	bytes;		/* Bytes fetched by them. */
+	uint64_t	chunks;		/* Chunks cached. */
+	uint64_t	failures;	/* Range requests that failed. */
+	uint64_t	poisoned;	/* Times a chunk was given up on. */
+};
+
+/*
+ * State of an open remote library. The library is mapped at @base like a
+ * local one, but a chunk is only there once it has been fetched. Reads of
+ * missing chunks wait on @uffd until @thread has fetched them.
+ */
+struct mlib_remote {
+	void			*curl;		/* CURL easy handle. */
+	char			*url;
+	void			*base;
+	uint64_t		 len;		/* Of the library. */
+	size_t			 map_len;
+	size_t			 chunk;
+	size_t			 nr_chunks;
+	uint8_t			*cached;	/* Bitmap of fetched chunks. */
+	uint8_t			*poisoned;	/* Chunks that fault for now. */
+	size_t			 nr_poisoned;
+	uint64_t		 unpoison_at;	/* Monotonic, in ms. */
+	char			*buf;		/* A chunk being fetched. */
+	int			 uffd;		/* Catches faults on @base. */
+	int			 stop[2];	/* Closed to stop @thread. */
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;		/* Protects @stats. */
+	struct mlib_remote_stats stats;
+};
+
+void	 mlib_library_remote_stats(const struct mlib_library *lib,
+				   struct mlib_remote_stats *stats);
+int	 __mlib_remote_open(struct mlib_library *lib, const char *url);
+void	 __mlib_remote_close(struct mlib_library *lib);
+
+#endif
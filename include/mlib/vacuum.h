@@ -0,0 +1,51 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Incremental library compaction. See vacuum.c for the details.
+ */
+
+#ifndef _MLIB_VACUUM_H_
+#define _MLIB_VACUUM_H_
+
+#include <stdint.h>
+
+struct mlib_library;
+
+/* Bytes of records a step works through by default. */
+#define MLIB_VACUUM_STEP	(256 << 10)
+
+/*
+ * Where a vacuum is and what it has done so far. Zero it to start a vacuum
+ * and pass it to every step.
+ */
+struct mlib_vacuum {
+	uint64_t	next;		/* Carry on from this library offset. */
+	int		done;
+	uint32_t	steps;
+	uint32_t	records;	/* Records looked at. */
+	uint32_t	moved;		/* Records moved down. */
+	uint64_t	packed;		/* Slack and dead strings squeezed out. */
+	uint64_t	reclaimed;	/* Bytes the library shrank by. */
+	uint64_t	usecs;		/* Time spent in steps. */
+};
+
+int	 mlib_vacuum_step(struct mlib_library *lib, struct mlib_vacuum *vac,
+			  uint32_t budget);
+int	 mlib_vacuum_library(struct mlib_library *lib,
+			     struct mlib_vacuum *vac);
+int	 mlib_vacuum_init();
+
+#endif
@@ -0,0 +1,105 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Write-ahead log for journaled libraries. See wal.c for the details.
+ */
+
+#ifndef _MLIB_WAL_H_
+#define _MLIB_WAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mlib_library;
+
+#define MLIB_WAL_MAGIC		0x57524543	/* WREC */
+#define MLIB_WAL_SUFFIX		"-wal"
+
+/* Commit after this many records by default. */
+#define MLIB_WAL_GROUP		64
+
+/* Checkpoint once the log is this big. */
+#define MLIB_WAL_CKPT_BYTES	(16 << 20)
+
+/*
+ * Operations in the log. Each one is replayed by calling the function it was
+ * logged from again.
+ */
+enum mlib_wal_op {
+	MLIB_WAL_START = 1,	/* mlib_start_playlist() */
+	MLIB_WAL_START_PAGED,	/* mlib_start_paged_playlist() */
+	MLIB_WAL_DELETE,	/* mlib_delete_playlist() */
+	MLIB_WAL_ADD,		/* mlib_add_path_to_plist() */
+	MLIB_WAL_APPEND,	/* mlib_append_path() */
+	MLIB_WAL_REMOVE,	/* mlib_remove_path_from_plist() */
+	MLIB_WAL_RESERVE,	/* mlib_playlist_reserve() */
+	MLIB_WAL_HASH,		/* mlib_hash_playlist() */
+	MLIB_WAL_BLOOM,		/* mlib_bloom_playlist() */
+	MLIB_WAL_TREE,		/* mlib_tree_playlist() */
+	MLIB_WAL_REBUILD,	/* mlib_rebuild_playlist() */
+	MLIB_WAL_COMPRESS,	/* mlib_compress_playlist() */
+};
+
+/*
+ * A log record. @data holds the playlist name and, for operations that take
+ * one, a path; both NUL terminated. Records are padded to 4 bytes and
+ * everything is big endian like the library itself.
+ */
+struct mlib_wal_rec {
+	uint32_t	magic;
+	uint32_t	length;		/* Whole record, padding included. */
+	uint32_t	seq;
+	uint32_t	op;
+	uint32_t	args[2];
+	uint32_t	crc;		/* CRC-32 of the record with this 0. */
+	char		data[];
+} __attribute__((packed));
+
+/*
+ * Log state of an open journaled library.
+ */
+struct mlib_wal {
+	int		 fd;
+	char		*path;		/* The log. */
+	char		*lib_path;	/* The library; for checkpoints. */
+	uint32_t	 seq;		/* Last record logged. */
+	uint32_t	 group;		/* Records per commit. */
+	uint32_t	 pending;	/* Records not committed yet. */
+	int		 replaying;
+	size_t		 size;		/* Committed bytes in the log. */
+	size_t		 ckpt_bytes;
+	char		*buf;		/* Records not committed yet. */
+	size_t		 buf_len;
+	size_t		 buf_size;
+
+	/* Statistics. */
+	uint64_t	 records;
+	uint64_t	 commits;
+	uint64_t	 checkpoints;
+};
+
+int	 mlib_wal_init();
+int	 mlib_journal_enable(struct mlib_library *lib, int on);
+int	 mlib_journal_commit(const struct mlib_library *lib);
+int	 mlib_journal_checkpoint(struct mlib_library *lib);
+void	 mlib_journal_set_group(struct mlib_library *lib, uint32_t group);
+int	 mlib_wal_log(struct mlib_library *lib, uint32_t op, const char *plist,
+		      const char *path, uint32_t arg0, uint32_t arg1);
+int	 __mlib_wal_open(struct mlib_library *lib, int replay);
+int	 __mlib_wal_recover(const char *path, int fd);
+int	 __mlib_wal_close(struct mlib_library *lib);
+
+#endif
@@ -16,9 +16,19 @@
  * Basic regression tests.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <mlib/mlib.h>
 
@@ -80,7 +90,1616 @@ int regress_verify_add_to_plist(struct mlib_library *lib, void *priv)
 		return -1;
 	}
 
-	if (!mlib_find_path(pls, "a/test/path"))
+	if (!mlib_find_path(lib, pls, "a/test/path"))
 		return -1;
 	return 0;
 }
+
+/*
+ * Growing a library should extend the file in place without moving the
+ * mapping, shrinking it should hand whole chunks back and the file should
+ * end up exactly as long as the library once it is closed.
+ */
+int regress_verify_growth(struct mlib_library *lib, void *priv)
+{
+	int i, ret = -1;
+	char path[64];
+	const char *name = ".grow-mlib.lib";
+	void *header;
+	uint32_t len;
+	struct stat sb;
+
+	unlink(name);
+	if (mlib_create_library(name, "grow-lib", "./"))
+		return -1;
+	lib = mlib_open_library(name, 0);
+	if (!lib)
+		goto done;
+
+	header = lib->header;
+	if (mlib_start_playlist(lib, "big"))
+		goto close;
+	for (i = 20000; i > 0; i--) {
+		snprintf(path, sizeof(path), "grow/%06d.mp3", i);
+		if (mlib_add_path(lib, "big", path))
+			goto close;
+	}
+	if (mlib_start_playlist(lib, "pad") ||
+	    mlib_playlist_reserve(lib, "pad", 0, 8 << 20))
+		goto close;
+	if (lib->file_len < MLIB_LIB_LEN(lib) ||
+	    (sizeof(void *) > 4 && lib->header != header))
+		goto close;
+
+	if (mlib_delete_playlist(lib, "pad") ||
+	    lib->file_len > MLIB_LIB_LEN(lib) + 4 * MLIB_LIB_CHUNK)
+		goto close;
+
+	len = MLIB_LIB_LEN(lib);
+	if (mlib_close_library(lib) || stat(name, &sb) || sb.st_size != len)
+		goto done;
+
+	lib = mlib_open_library(name, 0);
+	if (!lib)
+		goto done;
+	if (MLIB_LIB_LEN(lib) == len &&
+	    mlib_find_path(lib, mlib_find_playlist(lib, "big"),
+			   "grow/012345.mp3"))
+		ret = 0;
+
+close:
+	mlib_close_library(lib);
+done:
+	unlink(name);
+	return ret;
+}
+
+/*
+ * Sum up the extents of a v2 library; together with the free space and the
+ * header they have to cover the whole library.
+ */
+static int regress_check_extents(struct mlib_library *lib)
+{
+	uint64_t rec = 0, used = 0;
+
+	while ((rec = __mlib_extent_next(lib, rec)) != 0)
+		used += sizeof(struct mlib_extent) +
+			__mlib_extent_capacity(lib, rec);
+	return MLIB_HEADER_SIZE + used + mlib_library_free_bytes(lib) ==
+		MLIB_LIB_LEN(lib) ? 0 : -1;
+}
+
+static int regress_fill(struct mlib_library *lib, const char *plist, int from,
+			int nr)
+{
+	int i;
+	char path[PATH_MAX];
+
+	for (i = from; i < from + nr; i++) {
+		snprintf(path, sizeof(path), "%s/%06d.mp3", plist, i);
+		if (mlib_add_path(lib, plist, path))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * In a v2 library growing or deleting a playlist must not move any other
+ * playlist, and the space of deleted playlists is reused.
+ */
+int regress_verify_extents(struct mlib_library *lib, void *priv)
+{
+	uint32_t b, c, d, len;
+	char path[64];
+	int i;
+
+	if (MLIB_LIB_VERSION(lib) != MLIB_LIB_VERSION_EXTENTS)
+		return -1;
+	if (mlib_start_playlist(lib, "a") || mlib_start_playlist(lib, "b") ||
+	    mlib_start_playlist(lib, "c") || mlib_start_playlist(lib, "d") ||
+	    regress_fill(lib, "a", 0, 100) || regress_fill(lib, "b", 0, 100) ||
+	    regress_fill(lib, "c", 0, 100) || regress_fill(lib, "d", 0, 100))
+		return -1;
+
+	b = mlib_lib_offset(lib, mlib_find_playlist(lib, "b"));
+	c = mlib_lib_offset(lib, mlib_find_playlist(lib, "c"));
+	d = mlib_lib_offset(lib, mlib_find_playlist(lib, "d"));
+
+	/* Growing "a" (and .global) leaves the rest where they are. */
+	if (regress_fill(lib, "a", 100, 5000) ||
+	    mlib_lib_offset(lib, mlib_find_playlist(lib, "b")) != b ||
+	    mlib_lib_offset(lib, mlib_find_playlist(lib, "c")) != c ||
+	    mlib_lib_offset(lib, mlib_find_playlist(lib, "d")) != d ||
+	    regress_check_extents(lib))
+		return -1;
+	for (i = 0; i < 5100; i += 7) {
+		snprintf(path, sizeof(path), "a/%06d.mp3", i);
+		if (!mlib_find_path(lib, mlib_find_playlist(lib, "a"), path))
+			return -1;
+	}
+
+	/* So does deleting one. */
+	if (mlib_delete_playlist(lib, "b") ||
+	    mlib_lib_offset(lib, mlib_find_playlist(lib, "c")) != c ||
+	    mlib_lib_offset(lib, mlib_find_playlist(lib, "d")) != d ||
+	    !mlib_library_free_bytes(lib) || regress_check_extents(lib))
+		return -1;
+
+	/* A new playlist goes into the hole. */
+	len = MLIB_LIB_LEN(lib);
+	if (mlib_start_playlist(lib, "e") || MLIB_LIB_LEN(lib) != len ||
+	    mlib_lib_offset(lib, mlib_find_playlist(lib, "e")) > b ||
+	    regress_check_extents(lib))
+		return -1;
+
+	/* Deleting everything but .global gives all the space back. */
+	if (mlib_delete_playlist(lib, "a") || mlib_delete_playlist(lib, "c") ||
+	    mlib_delete_playlist(lib, "d") || mlib_delete_playlist(lib, "e") ||
+	    regress_check_extents(lib))
+		return -1;
+	if (mlib_next_playlist(lib, NULL) != mlib_global_playlist(lib) ||
+	    mlib_next_playlist(lib, mlib_global_playlist(lib)) != NULL)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * v1 libraries, with their playlists back to back, must still work: both
+ * opening them and changing them. Start from baseline.mlib, a library written
+ * before there were v2 libraries; see regress_verify_baseline().
+ */
+int regress_verify_v1(struct mlib_library *lib, void *priv)
+{
+	int i, ret = -1;
+	char path[64];
+	const char *name = ".v1-mlib.lib";
+	struct mlib_playlist *pls;
+	struct mlib_bucket_stats stats;
+	uint64_t total = MLIB_HEADER_SIZE;
+
+	if (regress_copy_fixture("baseline.mlib", name))
+		return -1;
+	lib = mlib_open_library(name, 0);
+	if (!lib)
+		goto done;
+
+	if (MLIB_LIB_VERSION(lib) != MLIB_LIB_VERSION_1 ||
+	    mlib_global_playlist(lib) != ((void *)lib->header) +
+	    MLIB_HEADER_SIZE)
+		goto close;
+
+	/* Growing "early" moves the pages of "paged" along with it. */
+	if (mlib_start_playlist(lib, "early") ||
+	    mlib_start_paged_playlist(lib, "paged") ||
+	    regress_fill(lib, "paged", 0, 3000) ||
+	    regress_fill(lib, "early", 0, 3000))
+		goto close;
+	mlib_for_each_pls(lib, pls) {
+		memset(&stats, 0, sizeof(stats));
+		mlib_playlist_stats(lib, pls, &stats);
+		total += stats.total_bytes;
+	}
+	if (total != MLIB_LIB_LEN(lib) || mlib_library_free_bytes(lib))
+		goto close;
+
+	mlib_close_library(lib);
+	lib = mlib_open_library(name, 0);
+	if (!lib)
+		goto done;
+
+	/* Deleting "early" moves them back. */
+	if (MLIB_LIB_VERSION(lib) != MLIB_LIB_VERSION_1 ||
+	    mlib_delete_playlist(lib, "early"))
+		goto close;
+	pls = mlib_find_playlist(lib, "paged");
+	for (i = 0; i < 3000; i++) {
+		snprintf(path, sizeof(path), "paged/%06d.mp3", i);
+		if (!mlib_find_path(lib, pls, path))
+			goto close;
+	}
+
+	/* The playlists the library came with are still there. */
+	if (!mlib_find_path(lib, mlib_find_playlist(lib, "rock"),
+			    "/music/rock/017.mp3") ||
+	    !mlib_find_path(lib, mlib_find_playlist(lib, "jazz"),
+			    "/music/jazz/009.ogg"))
+		goto close;
+	ret = 0;
+
+close:
+	mlib_close_library(lib);
+done:
+	unlink(name);
+	return ret;
+}
+
+/*
+ * Check that every playlist still in the library is found by name, and that
+ * the deleted ones (every third one if @deleted is set) are not.
+ */
+static int regress_check_dir(struct mlib_library *lib, int nr, int deleted)
+{
+	int i, count = 0;
+	char name[64];
+	struct mlib_playlist *pls;
+	struct mlib_dir *dir;
+
+	for (i = 0; i < nr; i++) {
+		snprintf(name, sizeof(name), "pls-%05d", i);
+		pls = mlib_find_playlist(lib, name);
+		if (deleted && i % 3 == 0) {
+			if (pls)
+				return -1;
+			continue;
+		}
+		if (!pls || strcmp(MLIB_PLIST_NAME(pls), name))
+			return -1;
+	}
+	if (mlib_find_playlist(lib, "pls-nope"))
+		return -1;
+
+	/* The directory holds every playlist and nothing else. */
+	mlib_for_each_pls(lib, pls)
+		count++;
+	dir = ((void *)lib->header) +
+		__mlib_read_offs(lib, &lib->header->dir_offs);
+	return __mlib_read_offs(lib, &lib->header->dir_offs) &&
+		MLIB_DIR_NR(dir) == count ? 0 : -1;
+}
+
+/*
+ * Playlists are found through the directory of a v2 library. It has to keep
+ * up with playlists being made, moved and deleted, and survive a reopen.
+ */
+int regress_verify_dir(struct mlib_library *lib, void *priv)
+{
+	int i, ret = -1, nr = 3000;
+	char name[64];
+	const char *file = ".dir-mlib.lib";
+
+	unlink(file);
+	if (mlib_create_library(file, "dir-lib", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+
+	for (i = 0; i < nr; i++) {
+		snprintf(name, sizeof(name), "pls-%05d", i);
+		if (mlib_start_playlist(lib, name))
+			goto close;
+	}
+	if (regress_check_dir(lib, nr, 0))
+		goto close;
+
+	/* Growing playlists moves them to new extents. */
+	for (i = 0; i < nr; i += 10) {
+		snprintf(name, sizeof(name), "pls-%05d", i + 1);
+		if (regress_fill(lib, name, 0, 200))
+			goto close;
+	}
+	for (i = 0; i < nr; i += 3) {
+		snprintf(name, sizeof(name), "pls-%05d", i);
+		if (mlib_delete_playlist(lib, name))
+			goto close;
+	}
+	if (regress_check_dir(lib, nr, 1))
+		goto close;
+
+	mlib_close_library(lib);
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (regress_check_dir(lib, nr, 1))
+		goto close;
+	ret = 0;
+
+close:
+	mlib_close_library(lib);
+done:
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Child side of regress_verify_wal(): change a journaled library and then die
+ * without closing it. Paths up to @committed are committed; the rest may or
+ * may not make it.
+ */
+static void regress_wal_crash(const char *file, int committed, int nr)
+{
+	struct mlib_library *lib = mlib_open_library(file, 0);
+
+	if (!lib || !lib->wal)
+		_exit(1);
+	mlib_journal_set_group(lib, 1000);
+	if (mlib_start_playlist(lib, "crash") ||
+	    mlib_delete_playlist(lib, "gone") ||
+	    regress_fill(lib, "crash", 0, committed) ||
+	    mlib_sync_library(lib) ||
+	    regress_fill(lib, "crash", committed, nr - committed))
+		_exit(1);
+	_exit(0);
+}
+
+/*
+ * Child side of regress_verify_wal(): grow a journaled library well past a
+ * file chunk, checkpoint it, shrink it again and die before the next
+ * checkpoint. The file on disk has to stay as long as the checkpoint says.
+ */
+static void regress_wal_shrink_crash(const char *file)
+{
+	struct mlib_library *lib = mlib_open_library(file, 0);
+
+	if (!lib || !lib->wal)
+		_exit(1);
+	if (mlib_start_playlist(lib, "big") ||
+	    mlib_playlist_reserve(lib, "big", 3000000, 0) ||
+	    mlib_journal_checkpoint(lib) ||
+	    mlib_delete_playlist(lib, "big"))
+		_exit(1);
+	_exit(0);
+}
+
+/*
+ * A journaled library must come back with everything that was committed to
+ * its log after a crash, and the library file itself must not change until a
+ * checkpoint.
+ */
+int regress_verify_wal(struct mlib_library *lib, void *priv)
+{
+	int i, fd, status, ret = -1;
+	const char *file = ".wal-mlib.lib", *log = ".wal-mlib.lib-wal";
+	const char *ckpt = ".wal-mlib.lib.ckpt";
+	uint64_t len;
+	char path[64], junk[4096];
+	struct stat sb, before;
+	pid_t pid;
+
+	unlink(file);
+	unlink(log);
+	if (mlib_create_library(file, "wal-lib", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (mlib_start_playlist(lib, "gone") || mlib_journal_enable(lib, 1) ||
+	    !(MLIB_LIB_FLAGS(lib) & MLIB_LIB_F_JOURNAL) ||
+	    mlib_close_library(lib))
+		goto done;
+
+	if (stat(file, &before))
+		goto done;
+	pid = fork();
+	if (pid < 0)
+		goto done;
+	if (pid == 0)
+		regress_wal_crash(file, 600, 1000);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		goto done;
+
+	/* The library file wasn't touched; the log has it all. */
+	if (stat(file, &sb) || sb.st_ino != before.st_ino ||
+	    sb.st_mtime != before.st_mtime || stat(log, &sb) || !sb.st_size)
+		goto done;
+
+	/* A torn record at the end of the log is dropped. */
+	fd = open(log, O_WRONLY|O_APPEND);
+	if (fd < 0 || write(fd, "WREC torn", 9) != 9)
+		goto done;
+	close(fd);
+
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (!lib->wal || mlib_find_playlist(lib, "gone") ||
+	    !mlib_find_playlist(lib, "crash"))
+		goto close;
+	for (i = 0; i < 600; i++) {
+		snprintf(path, sizeof(path), "crash/%06d.mp3", i);
+		if (!mlib_find_path(lib, mlib_find_playlist(lib, "crash"),
+				    path) ||
+		    !mlib_find_path(lib, mlib_global_playlist(lib), path))
+			goto close;
+	}
+
+	/* Closing checkpoints the library and removes the log. */
+	if (mlib_close_library(lib) || stat(log, &sb) == 0)
+		goto done;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	snprintf(path, sizeof(path), "crash/%06d.mp3", 599);
+	if (!mlib_find_path(lib, mlib_find_playlist(lib, "crash"), path))
+		goto close;
+
+	/* A checkpoint writes the same file and keeps the caller's lock. */
+	if (stat(file, &before) || mlib_library_lock(lib, MLIB_LOCK_WRITE) ||
+	    mlib_start_playlist(lib, "locked") ||
+	    regress_fill(lib, "locked", 0, 100) ||
+	    mlib_journal_checkpoint(lib) || stat(file, &sb) ||
+	    sb.st_ino != before.st_ino || stat(ckpt, &sb) == 0)
+		goto close;
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		goto close;
+	i = flock(fd, LOCK_SH|LOCK_NB) == 0 || mlib_library_unlock(lib) ||
+		flock(fd, LOCK_SH|LOCK_NB);
+	close(fd);
+	if (i || mlib_close_library(lib))
+		goto done;
+
+	/* A checkpoint that didn't get copied over the library yet is. */
+	if (rename(file, ckpt))
+		goto done;
+	fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		goto done;
+	memset(junk, 'x', sizeof(junk));
+	i = write(fd, junk, sizeof(junk)) != sizeof(junk);
+	close(fd);
+	lib = i ? NULL : mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (!mlib_find_path(lib, mlib_find_playlist(lib, "locked"),
+			    "locked/000099.mp3") ||
+	    stat(ckpt, &sb) == 0 || mlib_close_library(lib))
+		goto done;
+
+	pid = fork();
+	if (pid < 0)
+		goto done;
+	if (pid == 0)
+		regress_wal_shrink_crash(file);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		goto done;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (!mlib_find_path(lib, mlib_find_playlist(lib, "crash"), path) ||
+	    mlib_journal_enable(lib, 0) || lib->wal)
+		goto close;
+
+	/* A library file cut short is refused rather than read past its end. */
+	len = MLIB_LIB_LEN(lib);
+	if (mlib_close_library(lib) || truncate(file, len - 1))
+		goto done;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		ret = 0;
+
+close:
+	if (lib)
+		mlib_close_library(lib);
+done:
+	unlink(file);
+	unlink(log);
+	unlink(ckpt);
+	return ret;
+}
+
+static int regress_snapshot(struct mlib_library *lib, char **snap,
+			    size_t *snap_len)
+{
+	free(*snap);
+	*snap_len = MLIB_LIB_LEN(lib);
+	*snap = malloc(*snap_len);
+	if (!*snap)
+		return -1;
+	memcpy(*snap, lib->header, *snap_len);
+	return 0;
+}
+
+/*
+ * Every page of @lib that changed since @snap was taken has to be in one of
+ * the library's dirty ranges, and syncing has to flush exactly those ranges.
+ * Takes a new snapshot afterwards.
+ */
+static int regress_sync_dirty(struct mlib_library *lib, char **snap,
+			      size_t *snap_len)
+{
+	size_t page = getpagesize(), len = MLIB_LIB_LEN(lib), offs, i, end;
+	size_t limit = (lib->file_len + page - 1) / page * page;
+	const char *base = (void *)lib->header;
+	struct mlib_sync_stats stats;
+	uint64_t bytes = 0;
+	int r, changed;
+
+	for (offs = 0; offs < len; offs += page) {
+		end = offs + page < len ? offs + page : len;
+		if (end <= *snap_len && !memcmp(base + offs, *snap + offs,
+						end - offs))
+			continue;
+		for (i = offs, changed = 0; i < end && !changed; i++)
+			changed = base[i] != (i < *snap_len ? (*snap)[i] : 0);
+		if (!changed)
+			continue;
+		for (r = 0; r < lib->nr_dirty; r++)
+			if (offs / page >= lib->dirty[r].start &&
+			    offs / page < lib->dirty[r].end)
+				break;
+		if (r == lib->nr_dirty)
+			return -1;
+	}
+
+	for (r = 0; r < lib->nr_dirty; r++) {
+		end = (size_t)lib->dirty[r].end * page;
+		bytes += (end < limit ? end : limit) -
+			(size_t)lib->dirty[r].start * page;
+	}
+	if (mlib_sync_library(lib) || lib->nr_dirty)
+		return -1;
+	mlib_library_sync_stats(lib, &stats);
+	if (stats.last_bytes != bytes)
+		return -1;
+	return regress_snapshot(lib, snap, snap_len);
+}
+
+/*
+ * Syncing a library must flush every page that changed and, for a small
+ * change to a big library, not much else. Checked for both formats over all
+ * of the ways playlists change.
+ */
+int regress_verify_dirty(struct mlib_library *lib, void *priv)
+{
+	uint32_t versions[] = { MLIB_LIB_VERSION_1, MLIB_LIB_VERSION_EXTENTS };
+	const char *file = ".dirty-mlib.lib";
+	struct mlib_sync_stats stats;
+	char *snap = NULL, path[64];
+	size_t snap_len = 0;
+	int i, v, ret = -1;
+
+	for (v = 0; v < 2; v++) {
+		unlink(file);
+		if (mlib_create_library_version(file, "dirty-lib", "./",
+						versions[v]))
+			return -1;
+		lib = mlib_open_library(file, 0);
+		if (!lib)
+			goto done;
+		if (mlib_start_playlist(lib, "a") ||
+		    mlib_start_playlist(lib, "b") ||
+		    mlib_start_paged_playlist(lib, "paged") ||
+		    mlib_sync_library(lib) ||
+		    regress_snapshot(lib, &snap, &snap_len))
+			goto close;
+
+		if (regress_fill(lib, "a", 0, 5000) ||
+		    regress_sync_dirty(lib, &snap, &snap_len) ||
+		    regress_fill(lib, "paged", 0, 3000) ||
+		    regress_sync_dirty(lib, &snap, &snap_len))
+			goto close;
+
+		for (i = 0; i < 500; i++) {
+			snprintf(path, sizeof(path), "a/%06d.mp3", 4999 - i);
+			if (mlib_append_path(lib, "b", path))
+				goto close;
+		}
+		if (mlib_rebuild_playlist(lib, "b", 2) ||
+		    regress_sync_dirty(lib, &snap, &snap_len) ||
+		    mlib_hash_playlist(lib, "a") ||
+		    mlib_bloom_playlist(lib, "a") ||
+		    mlib_hash_playlist(lib, ".global") ||
+		    regress_fill(lib, "a", 5000, 100) ||
+		    regress_sync_dirty(lib, &snap, &snap_len))
+			goto close;
+
+		/* One more path only touches a few pages. */
+		if (mlib_add_path(lib, "a", "a/one-more.mp3") ||
+		    regress_sync_dirty(lib, &snap, &snap_len))
+			goto close;
+		mlib_library_sync_stats(lib, &stats);
+		if (!stats.last_bytes || stats.last_bytes > 16 * 4096 ||
+		    stats.last_bytes > MLIB_LIB_LEN(lib) / 8)
+			goto close;
+
+		for (i = 0; i < 3000; i += 3) {
+			snprintf(path, sizeof(path), "paged/%06d.mp3", i);
+			if (mlib_remove_path(lib, "paged", path))
+				goto close;
+		}
+		for (i = 0; i < 5000; i += 11) {
+			snprintf(path, sizeof(path), "a/%06d.mp3", i);
+			if (mlib_remove_path(lib, ".global", path))
+				goto close;
+		}
+		if (regress_sync_dirty(lib, &snap, &snap_len) ||
+		    mlib_tree_playlist(lib, "a") ||
+		    mlib_compress_playlist(lib, ".global") ||
+		    regress_sync_dirty(lib, &snap, &snap_len) ||
+		    mlib_delete_playlist(lib, "b") ||
+		    regress_sync_dirty(lib, &snap, &snap_len) ||
+		    mlib_delete_playlist(lib, "paged") ||
+		    regress_sync_dirty(lib, &snap, &snap_len))
+			goto close;
+
+		mlib_close_library(lib);
+	}
+
+	ret = 0;
+	goto done;
+
+close:
+	mlib_close_library(lib);
+done:
+	free(snap);
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Read back every path of @lib opened read-only and check that nothing can
+ * change it.
+ */
+static int regress_ro_check(struct mlib_library *lib, int nr)
+{
+	struct mlib_playlist *plist;
+	char path[64];
+	int i;
+
+	plist = mlib_find_playlist(lib, "a");
+	if (!lib->read_only || !plist || MLIB_PLIST_MCOUNT(plist) != nr)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "a/%06d.mp3", i);
+		if (!mlib_find_path(lib, plist, path) ||
+		    !mlib_find_path(lib, mlib_global_playlist(lib), path))
+			return -1;
+	}
+
+	if (!mlib_start_playlist(lib, "b") ||
+	    !mlib_start_paged_playlist(lib, "b") ||
+	    !mlib_add_path(lib, "a", "new.mp3") ||
+	    !mlib_append_path(lib, "a", "new.mp3") ||
+	    !mlib_remove_path(lib, "a", "a/000000.mp3") ||
+	    !mlib_remove_path_from_plist(lib, plist, "a/000000.mp3") ||
+	    !mlib_hash_playlist(lib, "a") ||
+	    !mlib_playlist_reserve(lib, "a", 10, 100) ||
+	    !mlib_delete_playlist(lib, "a") ||
+	    !mlib_journal_enable(lib, 1) ||
+	    mlib_find_playlist(lib, "b") ||
+	    MLIB_PLIST_MCOUNT(plist) != nr)
+		return -1;
+	return mlib_sync_library(lib);
+}
+
+int regress_verify_ro(struct mlib_library *lib, void *priv)
+{
+	int i, m, fd, status, nr = 2000, ret = -1;
+	int modes[] = { 0, MLIB_RO_POPULATE, MLIB_RO_WILLNEED };
+	const char *file = ".ro-mlib.lib";
+	char path[64], *before = NULL, *after = NULL;
+	struct stat sb, sb_before;
+	pid_t pid;
+
+	unlink(file);
+	if (mlib_create_library(file, "ro-lib", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (mlib_start_playlist(lib, "a"))
+		goto close;
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "a/%06d.mp3", i);
+		if (mlib_add_path(lib, "a", path))
+			goto close;
+	}
+	mlib_close_library(lib);
+
+	if (stat(file, &sb_before))
+		goto done;
+	before = malloc(sb_before.st_size);
+	after = malloc(sb_before.st_size);
+	fd = open(file, O_RDONLY);
+	if (!before || !after || fd < 0 ||
+	    read(fd, before, sb_before.st_size) != sb_before.st_size)
+		goto done;
+	close(fd);
+
+	for (m = 0; m < 3; m++) {
+		lib = mlib_open_library_ro(file, modes[m]);
+		if (!lib)
+			goto done;
+		if (regress_ro_check(lib, nr))
+			goto close;
+
+		/* Other processes can read it at the same time. */
+		pid = fork();
+		if (pid < 0)
+			goto close;
+		if (pid == 0) {
+			mlib_close_library(lib);
+			lib = mlib_open_library_ro(file, modes[m]);
+			_exit(!lib || regress_ro_check(lib, nr));
+		}
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			goto close;
+
+		if (mlib_close_library(lib))
+			goto done;
+	}
+
+	/* Not a byte of the file changed. */
+	fd = open(file, O_RDONLY);
+	if (stat(file, &sb) || sb.st_size != sb_before.st_size ||
+	    sb.st_mtime != sb_before.st_mtime || fd < 0 ||
+	    read(fd, after, sb.st_size) != sb.st_size ||
+	    memcmp(before, after, sb.st_size))
+		goto done;
+	close(fd);
+
+	/* Read-write opens still work afterwards. */
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (lib->read_only || mlib_add_path(lib, "a", "new.mp3") ||
+	    !mlib_find_path(lib, mlib_find_playlist(lib, "a"), "new.mp3"))
+		goto close;
+	ret = 0;
+
+close:
+	mlib_close_library(lib);
+done:
+	free(before);
+	free(after);
+	unlink(file);
+	return ret;
+}
+
+static int regress_share_wait(int fd, char want)
+{
+	char c;
+
+	return read(fd, &c, 1) == 1 && c == want ? 0 : -1;
+}
+
+static int regress_share_tell(int fd, char what)
+{
+	return write(fd, &what, 1) == 1 ? 0 : -1;
+}
+
+/*
+ * Check, under a read lock, that @lib is mapped as long as its file is and
+ * holds paths a/0 to a/@nr - 1.
+ */
+static int regress_share_check(struct mlib_library *lib, int nr)
+{
+	struct mlib_playlist *plist;
+	struct stat sb;
+	char path[64];
+	int i, ret = -1;
+
+	if (mlib_library_lock(lib, MLIB_LOCK_READ))
+		return -1;
+	plist = mlib_find_playlist(lib, "a");
+	if (fstat(lib->fd, &sb) || (size_t)sb.st_size != lib->file_len ||
+	    !plist || MLIB_PLIST_MCOUNT(plist) != nr)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "a/%06d.mp3", i);
+		if (!mlib_find_path(lib, plist, path))
+			goto out;
+	}
+	ret = 0;
+out:
+	mlib_library_unlock(lib);
+	return ret;
+}
+
+/*
+ * The reader side of regress_verify_share(); runs in its own process.
+ */
+static int regress_share_reader(const char *file, int in, int out)
+{
+	struct mlib_library *lib;
+	int ret = -1;
+
+	lib = mlib_open_library_ro(file, 0);
+	if (!lib)
+		return -1;
+
+	/* Hold the read lock while the writer tries to get in. */
+	if (mlib_library_lock(lib, MLIB_LOCK_READ) ||
+	    regress_share_tell(out, 'a') || regress_share_wait(in, 'b') ||
+	    mlib_library_unlock(lib) || regress_share_tell(out, 'c'))
+		goto done;
+
+	/* The writer grew the file and then shrank it again. */
+	if (regress_share_wait(in, 'd') || regress_share_check(lib, 1100) ||
+	    regress_share_tell(out, 'e') || regress_share_wait(in, 'f') ||
+	    regress_share_check(lib, 1100))
+		goto done;
+	ret = 0;
+
+done:
+	mlib_close_library(lib);
+	return ret;
+}
+
+int regress_verify_share(struct mlib_library *lib, void *priv)
+{
+	int i, fd, status, to_reader[2], from_reader[2], ret = -1;
+	const char *file = ".share-mlib.lib";
+	struct stat sb;
+	size_t grown;
+	char path[64];
+	pid_t pid;
+
+	unlink(file);
+	if (mlib_create_library(file, "share-lib", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	i = mlib_start_playlist(lib, "a") || regress_fill(lib, "a", 0, 100);
+	mlib_close_library(lib);
+	if (i)
+		goto done;
+
+	if (pipe(to_reader))
+		goto done;
+	if (pipe(from_reader)) {
+		close(to_reader[0]);
+		close(to_reader[1]);
+		goto done;
+	}
+	pid = fork();
+	if (pid < 0) {
+		close(to_reader[0]);
+		close(to_reader[1]);
+		close(from_reader[0]);
+		close(from_reader[1]);
+		goto done;
+	}
+	if (pid == 0) {
+		close(to_reader[1]);
+		close(from_reader[0]);
+		_exit(!!regress_share_reader(file, to_reader[0],
+					     from_reader[1]));
+	}
+	close(to_reader[0]);
+	close(from_reader[1]);
+
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto reap;
+
+	/* A reader holding the lock keeps writers out, and only until then. */
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		goto close;
+	if (regress_share_wait(from_reader[0], 'a') ||
+	    flock(fd, LOCK_EX|LOCK_NB) == 0 ||
+	    regress_share_tell(to_reader[1], 'b') ||
+	    regress_share_wait(from_reader[0], 'c') ||
+	    flock(fd, LOCK_EX|LOCK_NB) || flock(fd, LOCK_UN)) {
+		close(fd);
+		goto close;
+	}
+	close(fd);
+
+	/*
+	 * Grow the file well past what the reader has mapped; the big playlist
+	 * ends up last so that deleting it shrinks the file again.
+	 */
+	if (mlib_library_lock(lib, MLIB_LOCK_WRITE))
+		goto close;
+	for (i = 100; i < 1100; i++) {
+		snprintf(path, sizeof(path), "a/%06d.mp3", i);
+		if (mlib_add_path(lib, "a", path))
+			goto close;
+	}
+	if (mlib_start_playlist(lib, "big") ||
+	    mlib_playlist_reserve(lib, "big", 1 << 20, 16 << 20))
+		goto close;
+	grown = lib->file_len;
+	if (mlib_library_unlock(lib) || regress_share_tell(to_reader[1], 'd') ||
+	    regress_share_wait(from_reader[0], 'e'))
+		goto close;
+
+	/* And then shrink it out from under the reader. */
+	if (mlib_library_lock(lib, MLIB_LOCK_WRITE) ||
+	    mlib_delete_playlist(lib, "big") ||
+	    mlib_library_unlock(lib) || stat(file, &sb) ||
+	    (size_t)sb.st_size >= grown ||
+	    regress_share_tell(to_reader[1], 'f'))
+		goto close;
+	ret = 0;
+
+close:
+	mlib_close_library(lib);
+reap:
+	close(to_reader[1]);
+	close(from_reader[0]);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		ret = -1;
+done:
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Check that playlists p0 to p9 of the vacuum test library hold what they
+ * should: every path p<n>/<i> for @i < @nr that isn't a multiple of 4, apart
+ * from the deleted playlists p3 and p6, plus @extra paths in p1.
+ */
+static int regress_vacuum_check(struct mlib_library *lib, int nr, int extra)
+{
+	struct mlib_playlist *plist;
+	char name[32], path[64];
+	uint32_t id;
+	int p, i;
+
+	for (p = 0; p < 10; p++) {
+		snprintf(name, sizeof(name), "p%d", p);
+		plist = mlib_find_playlist(lib, name);
+		if ((p == 3 || p == 6) != !plist)
+			return -1;
+		if (!plist)
+			continue;
+		if (MLIB_PLIST_MCOUNT(plist) !=
+		    nr - (nr + 3) / 4 + (p == 1 ? extra : 0))
+			return -1;
+		for (i = 0; i < nr; i++) {
+			snprintf(path, sizeof(path), "p%d/%05d.mp3", p, i);
+			if (!mlib_find_path(lib, plist, path) != (i % 4 == 0))
+				return -1;
+			if (i % 4 && (mlib_media_id(lib, path, &id) ||
+				      strcmp(mlib_media_path(lib, id), path)))
+				return -1;
+		}
+	}
+	for (i = 0; i < extra; i++) {
+		snprintf(path, sizeof(path), "extra/%05d.mp3", i);
+		if (!mlib_find_path(lib, mlib_find_playlist(lib, "p1"), path))
+			return -1;
+	}
+
+	plist = mlib_find_playlist(lib, "paged");
+	if (!plist || MLIB_PLIST_MCOUNT(plist) != 200)
+		return -1;
+	for (i = 1; i < 800; i += 4) {
+		snprintf(path, sizeof(path), "p0/%05d.mp3", i);
+		if (!mlib_find_path(lib, plist, path))
+			return -1;
+	}
+	return 0;
+}
+
+int regress_verify_vacuum(struct mlib_library *lib, void *priv)
+{
+	uint32_t versions[] = { MLIB_LIB_VERSION_1, MLIB_LIB_VERSION_EXTENTS,
+				MLIB_LIB_VERSION_WIDE };
+	const char *file = ".vacuum-mlib.lib";
+	int v, p, i, nr = 800, extra, ret = -1;
+	uint64_t before, free_before;
+	struct mlib_vacuum vac;
+	char name[32], path[64];
+
+	for (v = 0; v < 3; v++) {
+		unlink(file);
+		if (mlib_create_library_version(file, "vacuum", "./",
+						versions[v]))
+			return -1;
+		lib = mlib_open_library(file, 0);
+		if (!lib)
+			goto done;
+
+		/* Interleave the playlists so that they all grow in turns. */
+		for (p = 0; p < 10; p++) {
+			snprintf(name, sizeof(name), "p%d", p);
+			if (mlib_start_playlist(lib, name))
+				goto close;
+		}
+		if (mlib_start_paged_playlist(lib, "paged"))
+			goto close;
+		for (i = 0; i < nr; i++) {
+			for (p = 0; p < 10; p++) {
+				snprintf(name, sizeof(name), "p%d", p);
+				snprintf(path, sizeof(path), "p%d/%05d.mp3",
+					 p, i);
+				if (mlib_add_path(lib, name, path))
+					goto close;
+			}
+			snprintf(path, sizeof(path), "p0/%05d.mp3", i);
+			if (i % 4 == 1 && mlib_add_path(lib, "paged", path))
+				goto close;
+		}
+
+		/* Leave dead strings and holes behind. */
+		for (p = 0; p < 10; p++) {
+			for (i = 0; i < nr; i += 4) {
+				snprintf(path, sizeof(path), "p%d/%05d.mp3",
+					 p, i);
+				if (mlib_remove_path(lib, ".global", path))
+					goto close;
+			}
+		}
+		if (mlib_delete_playlist(lib, "p3") ||
+		    mlib_delete_playlist(lib, "p6") ||
+		    regress_vacuum_check(lib, nr, 0))
+			goto close;
+
+		/*
+		 * Vacuum in small steps and keep using the library in between.
+		 */
+		before = MLIB_LIB_LEN(lib);
+		free_before = mlib_library_free_bytes(lib);
+		memset(&vac, 0, sizeof(vac));
+		for (extra = 0; !vac.done; extra++) {
+			if (mlib_vacuum_step(lib, &vac, 4096))
+				goto close;
+			snprintf(path, sizeof(path), "extra/%05d.mp3", extra);
+			if (mlib_add_path(lib, "p1", path))
+				goto close;
+		}
+		if (regress_vacuum_check(lib, nr, extra) || vac.steps < 4 ||
+		    vac.records < 11 || !vac.packed || !vac.reclaimed ||
+		    MLIB_LIB_LEN(lib) >= before)
+			goto close;
+		if (v > 0 && (!vac.moved ||
+			      mlib_library_free_bytes(lib) >= free_before))
+			goto close;
+
+		/* All in one go; there should be hardly anything left to do. */
+		before = MLIB_LIB_LEN(lib);
+		if (mlib_vacuum_library(lib, &vac) ||
+		    MLIB_LIB_LEN(lib) > before || vac.steps != 1 ||
+		    regress_vacuum_check(lib, nr, extra))
+			goto close;
+
+		mlib_close_library(lib);
+		lib = mlib_open_library(file, 0);
+		if (!lib)
+			goto done;
+		if (regress_vacuum_check(lib, nr, extra))
+			goto close;
+		mlib_close_library(lib);
+	}
+
+	ret = 0;
+	goto done;
+
+close:
+	mlib_close_library(lib);
+done:
+	unlink(file);
+	return ret;
+}
+
+/*
+ * v3 libraries store offsets in MLIB_EXTENT_ALIGN units and lengths in 64
+ * bits. Check the encoding, that they work like v2 libraries otherwise, and
+ * that only they may grow past 4GB.
+ */
+int regress_verify_wide(struct mlib_library *lib, void *priv)
+{
+	const char *file = ".wide-mlib.lib";
+	struct mlib_playlist *pls;
+	uint64_t offs, wide = (5ULL << 30) + 16 * 3;
+	uint32_t field;
+	int i, fd, ret = -1;
+	char path[64], prefix[MLIB_LIBRARY_MEDIA_PREFIX_LEN + 16];
+
+	unlink(file);
+	if (!mlib_create_library_version(file, "wide", "./",
+					 MLIB_LIB_VERSION_CURRENT + 1))
+		return -1;
+	if (mlib_create_library_version(file, "wide", "./",
+					MLIB_LIB_VERSION_WIDE))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (MLIB_LIB_VERSION(lib) != MLIB_LIB_VERSION_WIDE ||
+	    MLIB_LIB_MAX_LEN(lib) <= UINT32_MAX)
+		goto close;
+
+	__mlib_write_offs(lib, &field, wide);
+	if (field != htobe32(wide >> MLIB_EXTENT_SHIFT) ||
+	    __mlib_read_offs(lib, &field) != wide)
+		goto close;
+
+	if (mlib_start_playlist(lib, "a") || mlib_start_playlist(lib, "b") ||
+	    mlib_start_paged_playlist(lib, "paged") ||
+	    regress_fill(lib, "a", 0, 3000) || regress_fill(lib, "b", 0, 100) ||
+	    regress_fill(lib, "paged", 0, 3000) ||
+	    mlib_delete_playlist(lib, "b") || mlib_start_playlist(lib, "c") ||
+	    regress_fill(lib, "c", 0, 100) || regress_check_extents(lib))
+		goto close;
+
+	/* The header points at .global in 16 byte units. */
+	offs = mlib_lib_offset(lib, mlib_global_playlist(lib));
+	if (offs % MLIB_EXTENT_ALIGN ||
+	    __mlib_readl(&lib->header->global_offs) !=
+	    offs >> MLIB_EXTENT_SHIFT ||
+	    strcmp(MLIB_PLIST_NAME(mlib_global_playlist(lib)), ".global"))
+		goto close;
+
+	mlib_close_library(lib);
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (regress_check_extents(lib) || mlib_find_playlist(lib, "b"))
+		goto close;
+	for (i = 0; i < 3000; i++) {
+		snprintf(path, sizeof(path), "a/%06d.mp3", i);
+		if (!mlib_find_path(lib, mlib_find_playlist(lib, "a"), path))
+			goto close;
+		snprintf(path, sizeof(path), "paged/%06d.mp3", i);
+		pls = mlib_find_playlist(lib, "paged");
+		if (!mlib_find_path(lib, pls, path) ||
+		    strcmp(mlib_get_path_at(lib, pls, i), path))
+			goto close;
+	}
+	mlib_close_library(lib);
+	unlink(file);
+
+	/* A v2 library can't be made any bigger than 4GB. */
+	if (mlib_create_library(file, "narrow", "./"))
+		return -1;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (MLIB_LIB_MAX_LEN(lib) != UINT32_MAX ||
+	    !__mlib_library_expand(lib, (size_t)UINT32_MAX + 1))
+		goto close;
+	mlib_close_library(lib);
+
+	/*
+	 * Libraries from before there were versions had zeros where the high
+	 * words of the lengths are now, as long as the media prefix stopped
+	 * short of them.
+	 */
+	if (regress_copy_fixture("baseline.mlib", file))
+		goto done;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		goto done;
+	if (MLIB_LIB_VERSION(lib) != MLIB_LIB_VERSION_1 ||
+	    MLIB_LIB_MAX_LEN(lib) != UINT32_MAX ||
+	    lib->header->lib_len_hi || lib->header->free_bytes_hi ||
+	    MLIB_LIB_LEN(lib) > lib->file_len ||
+	    strcmp(MLIB_LIB_PREFIX(lib), "/media") ||
+	    !__mlib_library_expand(lib, (size_t)UINT32_MAX + 1))
+		goto close;
+	mlib_close_library(lib);
+	lib = NULL;
+
+	/*
+	 * Their prefix could be longer though. This one runs over the high
+	 * words but stops short of the version.
+	 */
+	if (regress_copy_fixture("baseline.mlib", file))
+		goto done;
+	fd = open(file, O_WRONLY);
+	if (fd < 0)
+		goto done;
+	memset(prefix, 'x', sizeof(prefix));
+	i = pwrite(fd, prefix, sizeof(prefix),
+		   offsetof(struct mlib_library_header, media_prefix));
+	close(fd);
+	if (i != sizeof(prefix))
+		goto done;
+	lib = mlib_open_library(file, 0);
+	if (!lib)
+		ret = 0;
+
+close:
+	if (lib)
+		mlib_close_library(lib);
+done:
+	unlink(file);
+	return ret;
+}
+
+struct regress_remote_lookup {
+	struct mlib_library	*lib;
+	struct mlib_playlist	*pls;
+	int			 plist;
+	int			 misses;
+};
+
+/*
+ * Look up every 37th path of one of the fill playlists of the remote test
+ * library.
+ */
+static void *regress_remote_lookup(void *arg)
+{
+	struct regress_remote_lookup *lookup = arg;
+	char path[64];
+	int i;
+
+	for (i = 0; i < 1000; i += 37) {
+		snprintf(path, sizeof(path), "fill-%d/%06d.mp3", lookup->plist,
+			 i);
+		if (!mlib_find_path(lookup->lib, lookup->pls, path))
+			lookup->misses++;
+	}
+	return NULL;
+}
+
+/*
+ * Return the last chunk of remote library @lib that hasn't been fetched yet,
+ * or -1 if there is none.
+ */
+static long regress_remote_missing(struct mlib_library *lib)
+{
+	size_t n;
+
+	for (n = lib->remote->nr_chunks; n-- > 0; )
+		if (!(lib->remote->cached[n / 8] & (1 << (n % 8))))
+			return n;
+	return -1;
+}
+
+static sigjmp_buf regress_remote_jmp;
+
+static void regress_remote_segv(int sig)
+{
+	siglongjmp(regress_remote_jmp, 1);
+}
+
+/*
+ * Read the byte at @addr. Returns non-zero if that faulted.
+ */
+static int regress_remote_faults(const volatile char *addr)
+{
+	struct sigaction sa = { .sa_handler = regress_remote_segv }, old;
+	int faulted = 1;
+
+	sigaction(SIGSEGV, &sa, &old);
+	if (!sigsetjmp(regress_remote_jmp, 1)) {
+		(void)*addr;
+		faulted = 0;
+	}
+	sigaction(SIGSEGV, &old, NULL);
+	return faulted;
+}
+
+/*
+ * Check chunk @n of remote library @lib reads back like @file.
+ */
+static int regress_remote_check(struct mlib_library *lib, long n,
+				const char *file)
+{
+	char buf[256];
+	int fd, ret = -1;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, buf, sizeof(buf), n * lib->remote->chunk) > 0 &&
+	    !memcmp(buf, (char *)lib->header + n * lib->remote->chunk,
+		    sizeof(buf)))
+		ret = 0;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Serve a library from a local HTTP server and read it remotely: lookups
+ * only download the parts of the library they touch, several threads can
+ * wait on chunks at once, the library can't be changed, failed requests are
+ * tried again and a chunk that can't be fetched faults for a while and kills
+ * the process reading it unless it handles that.
+ */
+int regress_verify_remote(struct mlib_library *lib, void *priv)
+{
+	int i, status, nr = 2000, nr_fill = 60, ret = -1;
+	const char *file = ".remote-mlib.lib";
+	struct regress_httpd srv = { 0 };
+	struct regress_remote_lookup lookups[4];
+	struct mlib_remote_stats stats;
+	struct mlib_playlist *pls;
+	char url[64], name[32], path[64];
+	pthread_t threads[4];
+	struct stat sb;
+	char *addr;
+	pid_t pid;
+	long n;
+
+	unlink(file);
+	if (mlib_create_library(file, "remote-lib", "./"))
+		return -1;
+	lib = mlib_open_library(file, MLIB_LOCAL);
+	if (!lib)
+		goto done;
+	if (mlib_start_playlist(lib, "a") || regress_fill(lib, "a", 0, nr) ||
+	    mlib_start_paged_playlist(lib, "paged") ||
+	    regress_fill(lib, "paged", 0, nr))
+		goto close;
+	for (i = 0; i < nr_fill; i++) {
+		snprintf(name, sizeof(name), "fill-%d", i);
+		if (mlib_start_playlist(lib, name) ||
+		    regress_fill(lib, name, 0, 1000))
+			goto close;
+	}
+	mlib_close_library(lib);
+	lib = NULL;
+	if (stat(file, &sb) || regress_httpd_start(&srv, file))
+		goto done;
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/music.lib", srv.port);
+
+	/* Opening fetches the header and the first chunk, nothing else. */
+	lib = mlib_open_library(url, MLIB_REMOTE);
+	if (!lib)
+		goto stop;
+	mlib_library_remote_stats(lib, &stats);
+	if (!lib->remote || stats.requests != 2 || stats.chunks != 1 ||
+	    stats.bytes > MLIB_HEADER_SIZE + MLIB_REMOTE_CHUNK ||
+	    strcmp(MLIB_LIB_NAME(lib), "remote-lib"))
+		goto close;
+
+	/* One lookup reads a handful of chunks. */
+	pls = mlib_find_playlist(lib, "fill-17");
+	if (!pls || !mlib_find_path(lib, pls, "fill-17/000500.mp3") ||
+	    mlib_find_path(lib, pls, "fill-17/001000.mp3"))
+		goto close;
+	mlib_library_remote_stats(lib, &stats);
+	if (stats.chunks > 8)
+		goto close;
+
+	if (regress_ro_check(lib, nr) ||
+	    mlib_library_lock(lib, MLIB_LOCK_READ) ||
+	    mlib_library_unlock(lib) ||
+	    !mlib_library_lock(lib, MLIB_LOCK_WRITE))
+		goto close;
+	pls = mlib_find_playlist(lib, "paged");
+	for (i = 0; i < nr; i += 97) {
+		snprintf(path, sizeof(path), "paged/%06d.mp3", i);
+		if (!mlib_find_path(lib, pls, path) ||
+		    strcmp(mlib_get_path_at(lib, pls, i), path))
+			goto close;
+	}
+
+	/* Threads reading chunks nobody fetched yet all get them. */
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "fill-%d", 40 + i);
+		lookups[i].lib = lib;
+		lookups[i].pls = mlib_find_playlist(lib, name);
+		lookups[i].plist = 40 + i;
+		lookups[i].misses = 0;
+		if (!lookups[i].pls)
+			goto close;
+	}
+	for (i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, regress_remote_lookup,
+			       &lookups[i]);
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		if (lookups[i].misses)
+			goto close;
+	}
+
+	/* The server sent exactly what was fetched, and far from all of it. */
+	mlib_library_remote_stats(lib, &stats);
+	if (stats.bytes != srv.stats->bytes ||
+	    stats.requests != srv.stats->ranges ||
+	    stats.bytes > (uint64_t)sb.st_size / 2)
+		goto close;
+
+	/* A server failing now and then costs a retry, not the chunk. */
+	n = regress_remote_missing(lib);
+	if (n < 0)
+		goto close;
+	srv.stats->fail = 2;
+	if (regress_remote_faults((char *)lib->header +
+				  n * lib->remote->chunk) ||
+	    regress_remote_check(lib, n, file))
+		goto close;
+	mlib_library_remote_stats(lib, &stats);
+	if (stats.failures != 2 || stats.poisoned || srv.stats->fail)
+		goto close;
+
+	/*
+	 * One that keeps failing faults, without asking again right away, and
+	 * is fetched again once it's had time to come back.
+	 */
+	n = regress_remote_missing(lib);
+	if (n < 0)
+		goto close;
+	addr = (char *)lib->header + n * lib->remote->chunk;
+	srv.stats->fail = 100;
+	if (!regress_remote_faults(addr) || !regress_remote_faults(addr))
+		goto close;
+	mlib_library_remote_stats(lib, &stats);
+	if (stats.failures != 3 + MLIB_REMOTE_RETRIES || stats.poisoned != 1 ||
+	    srv.stats->fail != 100 - 1 - MLIB_REMOTE_RETRIES)
+		goto close;
+	srv.stats->fail = 0;
+	usleep((MLIB_REMOTE_POISON + 200) * 1000);
+	if (regress_remote_faults(addr) || regress_remote_check(lib, n, file))
+		goto close;
+
+	/* A child doesn't inherit the mapping; touching it just faults. */
+	pid = fork();
+	if (pid < 0)
+		goto close;
+	if (pid == 0) {
+		(void)*(volatile char *)lib->header;
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status) ||
+	    WTERMSIG(status) != SIGSEGV)
+		goto close;
+
+	if (mlib_close_library(lib))
+		goto stop;
+	lib = NULL;
+
+	/* Reading a chunk the server no longer has takes the reader down. */
+	pid = fork();
+	if (pid < 0)
+		goto stop;
+	if (pid == 0) {
+		lib = mlib_open_library(url, MLIB_REMOTE);
+		if (!lib || truncate(file, MLIB_REMOTE_CHUNK))
+			_exit(1);
+		(void)*((volatile char *)lib->header + lib->file_len - 1);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status) ||
+	    WTERMSIG(status) != SIGSEGV)
+		goto stop;
+	regress_httpd_stop(&srv);
+
+	/* A server that ignores ranges would send the whole library. */
+	srv.flags = REGRESS_HTTPD_NO_RANGES;
+	if (regress_httpd_start(&srv, file))
+		goto done;
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/music.lib", srv.port);
+	lib = mlib_open_library(url, MLIB_REMOTE);
+	if (lib)
+		goto close;
+	ret = 0;
+	goto stop;
+
+close:
+	if (lib)
+		mlib_close_library(lib);
+stop:
+	if (srv.pid)
+		regress_httpd_stop(&srv);
+done:
+	unlink(file);
+	return ret;
+}
+
+/*
+ * Count the file descriptors this process has open.
+ */
+static int regress_nr_fds(void)
+{
+	struct dirent *ent;
+	DIR *dir;
+	int nr = 0;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)))
+		if (ent->d_name[0] != '.')
+			nr++;
+	closedir(dir);
+	return nr;
+}
+
+/*
+ * Register many more libraries than may be mapped at once and use them all:
+ * only a few stay mapped, held ones never go away, changes survive being
+ * unmapped and libraries are found by exact name.
+ */
+int regress_verify_registry(struct mlib_library *lib, void *priv)
+{
+	int i, fds, nr = 300, max = 16, ret = -1;
+	struct mlib_library **libs;
+	struct mlib_registry_stats before, stats;
+	struct mlib_playlist *held, *pls;
+	char file[64], name[32], path[64];
+
+	libs = calloc(nr, sizeof(*libs));
+	if (!libs)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		snprintf(file, sizeof(file), ".reg-%d.lib", i);
+		snprintf(name, sizeof(name), "reg-%d", i);
+		unlink(file);
+		if (mlib_create_library(file, name, "./"))
+			goto done;
+		lib = mlib_open_library(file, MLIB_LOCAL);
+		if (!lib)
+			goto done;
+		if (mlib_start_playlist(lib, "a") ||
+		    regress_fill(lib, "a", 0, 10) ||
+		    (i == 0 && mlib_journal_enable(lib, 1)) ||
+		    mlib_close_library(lib))
+			goto done;
+	}
+
+	mlib_registry_stats(&before);
+	fds = regress_nr_fds();
+	mlib_library_set_max_mapped(max);
+	for (i = 0; i < nr; i++) {
+		snprintf(file, sizeof(file), ".reg-%d.lib", i);
+		libs[i] = mlib_open_library_lazy(file);
+		if (!libs[i] || libs[i]->header)
+			goto close;
+	}
+	mlib_registry_stats(&stats);
+	if (stats.libraries != before.libraries + nr ||
+	    stats.mapped != before.mapped ||
+	    mlib_open_library_lazy(".reg-7.lib"))
+		goto close;
+
+	/* Hold one library the whole time; it must stay where it is. */
+	lib = mlib_library_get("reg-1");
+	held = lib ? mlib_find_playlist(lib, "a") : NULL;
+	if (!held || lib != libs[1])
+		goto close;
+
+	for (i = 0; i < nr; i++) {
+		snprintf(name, sizeof(name), "reg-%d", i);
+		lib = mlib_library_get(name);
+		if (lib != libs[i] || !lib->header)
+			goto close;
+		pls = mlib_find_playlist(lib, "a");
+		if (!mlib_find_path(lib, pls, "a/000003.mp3") ||
+		    mlib_library_of(pls) != lib)
+			goto close;
+		snprintf(path, sizeof(path), "new/%06d.mp3", i);
+		if (mlib_add_path(lib, "a", path))
+			goto close;
+		mlib_library_put(lib);
+
+		/* One more descriptor for the log of reg-0 while it's mapped. */
+		mlib_registry_stats(&stats);
+		if (stats.mapped > before.mapped + max ||
+		    regress_nr_fds() > fds + max + 1)
+			goto close;
+	}
+	if (!libs[1]->header || mlib_library_of(held) != libs[1] ||
+	    !mlib_find_path(libs[1], held, "new/000001.mp3"))
+		goto close;
+	mlib_library_put(libs[1]);
+
+	/* Everything written made it out before the libraries were unmapped. */
+	mlib_registry_stats(&stats);
+	if (stats.unmaps < before.unmaps + nr - max)
+		goto close;
+	for (i = nr - 1; i >= 0; i--) {
+		snprintf(name, sizeof(name), "reg-%d", i);
+		snprintf(path, sizeof(path), "new/%06d.mp3", i);
+		lib = mlib_find_library(name);
+		if (lib != libs[i] ||
+		    !mlib_find_path(lib, mlib_find_playlist(lib, "a"), path))
+			goto close;
+	}
+	if (mlib_find_library("reg-") || mlib_find_library("reg-1x"))
+		goto close;
+	ret = 0;
+
+close:
+	for (i = 0; i < nr; i++)
+		if (libs[i] && mlib_close_library(libs[i]))
+			ret = -1;
+	mlib_registry_stats(&stats);
+	if (stats.libraries != before.libraries)
+		ret = -1;
+	mlib_library_set_max_mapped(MLIB_LIB_MAX_MAPPED);
+done:
+	for (i = 0; i < nr; i++) {
+		snprintf(file, sizeof(file), ".reg-%d.lib", i);
+		unlink(file);
+		strcat(file, MLIB_WAL_SUFFIX);
+		unlink(file);
+	}
+	free(libs);
+	return ret;
+}
@@ -0,0 +1,1513 @@
+/* (C) Copyright 2013, Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Bucket regression tests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <mlib/mlib.h>
+
+#include <regress.h>
+
+/*
+ * Make the @n'th test path. The order is scrambled so that inserts land all
+ * over the index array.
+ */
+static void regress_make_path(char *buf, size_t len, unsigned int n)
+{
+	snprintf(buf, len, "dir-%02u/track-%08x.mp3", (n * 7919) % 37,
+		 n * 2654435761u);
+}
+
+int regress_verify_sorted_insert(struct mlib_library *lib, void *priv)
+{
+	int i, ind, nr = 500;
+	char path[64];
+	const char *cur, *prev = NULL;
+	struct mlib_playlist *pls;
+
+	if (mlib_start_playlist(lib, "sorted"))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "sorted", path))
+			return -1;
+	}
+
+	/* Duplicates must be rejected. */
+	regress_make_path(path, sizeof(path), nr / 2);
+	pls = mlib_find_playlist(lib, "sorted");
+	if (!pls || mlib_add_path_to_plist(lib, pls, path) == 0)
+		return -1;
+
+	pls = mlib_find_playlist(lib, "sorted");
+	mlib_for_each_path(lib, pls, ind, cur) {
+		if (prev && strcmp(prev, cur) >= 0) {
+			mlib_error("Out of order: '%s' >= '%s'\n", prev, cur);
+			return -1;
+		}
+		prev = cur;
+	}
+	if (ind != nr)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, pls, path))
+			return -1;
+	}
+	return 0;
+}
+
+struct regress_lookup {
+	const struct mlib_library	*lib;
+	const struct mlib_playlist	*pls;
+	int				 nr;
+	int				 misses;
+};
+
+static void *regress_lookup_thread(void *arg)
+{
+	int i, j;
+	char path[64];
+	struct regress_lookup *lookup = arg;
+
+	for (j = 0; j < 20; j++) {
+		for (i = 0; i < lookup->nr; i++) {
+			regress_make_path(path, sizeof(path), i);
+			if (!mlib_find_path(lookup->lib, lookup->pls, path))
+				lookup->misses++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Have several threads search the same playlist at once. Lookups share no
+ * state so every one of them must succeed.
+ */
+int regress_verify_concurrent_lookup(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 300, ret = 0;
+	char path[64];
+	pthread_t threads[4];
+	struct regress_lookup lookups[4];
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, ".global", path))
+			return -1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		lookups[i].lib = lib;
+		lookups[i].pls = mlib_find_playlist(lib, ".global");
+		lookups[i].nr = nr;
+		lookups[i].misses = 0;
+		pthread_create(&threads[i], NULL, regress_lookup_thread,
+			       &lookups[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		if (lookups[i].misses)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Check a hashed playlist: one table made up front and grown as paths are
+ * added, the other added to a playlist that already has paths.
+ */
+int regress_verify_hashed_plist(struct mlib_library *lib, void *priv)
+{
+	int i, ind, nr = 500;
+	char path[64];
+	const char *cur, *prev = NULL;
+	struct mlib_playlist *pls;
+
+	if (mlib_start_playlist(lib, "hashed") ||
+	    mlib_hash_playlist(lib, "hashed"))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "hashed", path))
+			return -1;
+	}
+	if (mlib_hash_playlist(lib, ".global"))
+		return -1;
+
+	pls = mlib_find_playlist(lib, "hashed");
+	if (!(MLIB_BUCKET_FLAGS(&pls->data) & MLIB_BUCKET_F_HASH))
+		return -1;
+	if (mlib_add_path(lib, "hashed", "dir-00/not-there.mp3"))
+		return -1;
+
+	pls = mlib_find_playlist(lib, "hashed");
+	mlib_for_each_path(lib, pls, ind, cur) {
+		if (prev && strcmp(prev, cur) >= 0)
+			return -1;
+		prev = cur;
+	}
+	if (ind != nr + 1)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		cur = mlib_find_path(lib, pls, path);
+		if (!cur || strcmp(cur, path))
+			return -1;
+		if (!mlib_find_path(lib, mlib_global_playlist(lib), path))
+			return -1;
+	}
+
+	if (mlib_find_path(lib, pls, "dir-00/missing.mp3"))
+		return -1;
+	/* Named playlists only refer to paths so .global must have it too. */
+	if (!mlib_find_path(lib, mlib_find_playlist(lib, ".global"),
+			    "dir-00/not-there.mp3"))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Check that the rock and jazz playlists of baseline.mlib hold what they were
+ * written with: rock/000.mp3 to rock/039.mp3 and jazz/000.ogg to jazz/009.ogg,
+ * in order.
+ */
+static int regress_check_baseline(struct mlib_library *lib)
+{
+	int i, ind;
+	char path[64];
+	const char *cur;
+	struct mlib_playlist *rock, *jazz;
+
+	rock = mlib_find_playlist(lib, "rock");
+	jazz = mlib_find_playlist(lib, "jazz");
+	if (!rock || !jazz)
+		return -1;
+	for (i = 0; i < 40; i++) {
+		snprintf(path, sizeof(path), "/music/rock/%03d.mp3", i);
+		cur = mlib_get_path_at(lib, rock, i);
+		if (!cur || strcmp(cur, path) ||
+		    !mlib_find_path(lib, rock, path) ||
+		    mlib_find_path(lib, jazz, path))
+			return -1;
+	}
+	mlib_for_each_path(lib, jazz, ind, cur) {
+		snprintf(path, sizeof(path), "/music/jazz/%03d.ogg", ind);
+		if (strcmp(cur, path))
+			return -1;
+	}
+	return ind == 10 ? 0 : -1;
+}
+
+/*
+ * baseline.mlib was written by mlib before buckets had anything past
+ * @str_bytes in their header and before libraries had a version: .global,
+ * "rock" with 40 paths added out of order and "jazz" with 10, each path in
+ * .global as well, and "solo" with a path that is not in .global. Opening it
+ * read-write gives every bucket the current header and interns the paths;
+ * read-only opens are refused until then.
+ */
+int regress_verify_baseline(struct mlib_library *lib, void *priv)
+{
+	int ret = -1;
+	uint32_t id;
+	const char *name = ".baseline-mlib.lib";
+	struct mlib_playlist *pls;
+
+	if (regress_copy_fixture("baseline.mlib", name))
+		return -1;
+	lib = mlib_open_library_ro(name, 0);
+	if (lib)
+		goto close;
+
+	lib = mlib_open_library(name, 0);
+	if (!lib)
+		goto done;
+	if (__mlib_readl(&lib->header->version) != MLIB_LIB_VERSION_1)
+		goto close;
+	mlib_for_each_pls(lib, pls)
+		if (MLIB_BUCKET_MAGIC(&pls->data) != MLIB_BUCKET_MAGIC_VAL)
+			goto close;
+	if (regress_check_baseline(lib) ||
+	    mlib_bucket_nr_indexes(&mlib_global_playlist(lib)->data) != 51)
+		goto close;
+
+	/* The paths are interned in .global like in any other library. */
+	pls = mlib_find_playlist(lib, "rock");
+	if (!(MLIB_BUCKET_FLAGS(&pls->data) & MLIB_BUCKET_F_REFS) ||
+	    MLIB_BUCKET_STR_BYTES(&pls->data) ||
+	    mlib_media_id(lib, "/music/rock/017.mp3", &id) ||
+	    strcmp(mlib_media_path(lib, id), "/music/rock/017.mp3"))
+		goto close;
+	pls = mlib_find_playlist(lib, "solo");
+	if (!pls || !mlib_find_path(lib, pls, "/music/solo/000.flac"))
+		goto close;
+
+	/* The upgraded buckets take new paths and the newer features. */
+	if (mlib_add_path(lib, "jazz", "/music/jazz/010.ogg") ||
+	    mlib_remove_path(lib, "rock", "/music/rock/039.mp3") ||
+	    mlib_hash_playlist(lib, "rock") ||
+	    mlib_add_path(lib, "rock", "/music/rock/039.mp3"))
+		goto close;
+	mlib_close_library(lib);
+
+	/* Once upgraded it opens read-only too. */
+	lib = mlib_open_library_ro(name, 0);
+	if (!lib)
+		goto done;
+	pls = mlib_find_playlist(lib, "jazz");
+	if (!mlib_find_path(lib, pls, "/music/jazz/010.ogg") ||
+	    mlib_remove_path(lib, "jazz", "/music/jazz/010.ogg") == 0)
+		goto close;
+	ret = 0;
+
+close:
+	if (lib)
+		mlib_close_library(lib);
+done:
+	unlink(name);
+	return ret;
+}
+
+/*
+ * Check that a compressed playlist still sorts, finds and iterates paths, both
+ * for paths that were there when it was compressed and ones added afterwards.
+ * The strings live in .global so that is what gets compressed; "packed" reads
+ * its paths from there.
+ */
+int regress_verify_compressed_plist(struct mlib_library *lib, void *priv)
+{
+	int i, ind, nr = 400;
+	char path[64], prev[64] = "";
+	const char *cur;
+	struct mlib_playlist *pls;
+
+	if (mlib_start_playlist(lib, "packed"))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "packed", path))
+			return -1;
+	}
+	if (mlib_hash_playlist(lib, ".global") ||
+	    mlib_hash_playlist(lib, "packed") ||
+	    mlib_compress_playlist(lib, ".global"))
+		return -1;
+
+	pls = mlib_global_playlist(lib);
+	if (!(MLIB_BUCKET_FLAGS(&pls->data) & MLIB_BUCKET_F_COMPRESSED))
+		return -1;
+	if (MLIB_BUCKET_STR_BYTES(&pls->data) * 2 > nr * 30)
+		return -1;
+
+	for (i = nr; i < nr + 100; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "packed", path))
+			return -1;
+	}
+
+	/* A path none of the symbols match. */
+	if (mlib_add_path(lib, "packed", "~~~ {|} ~~~"))
+		return -1;
+
+	pls = mlib_find_playlist(lib, "packed");
+	mlib_for_each_path(lib, pls, ind, cur) {
+		if (strcmp(prev, cur) >= 0)
+			return -1;
+		strcpy(prev, cur);
+	}
+	if (ind != nr + 101)
+		return -1;
+
+	for (i = 0; i < nr + 100; i++) {
+		regress_make_path(path, sizeof(path), i);
+		cur = mlib_find_path(lib, pls, path);
+		if (!cur || strcmp(cur, path))
+			return -1;
+		cur = mlib_find_path(lib, mlib_global_playlist(lib), path);
+		if (!cur || strcmp(cur, path))
+			return -1;
+	}
+	if (!mlib_find_path(lib, pls, "~~~ {|} ~~~") ||
+	    mlib_find_path(lib, pls, "dir-01/track") ||
+	    mlib_find_path(lib, pls, "dir-01/track-00000000.mp3x"))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Reserving space must let that many paths go in without the library growing,
+ * and without a reservation the library should only grow a handful of times.
+ */
+int regress_verify_reserve(struct mlib_library *lib, void *priv)
+{
+	int i, grows = 0, nr = 2000;
+	uint32_t len;
+	char path[64];
+
+	if (mlib_start_playlist(lib, "reserved") ||
+	    mlib_hash_playlist(lib, "reserved"))
+		return -1;
+	if (mlib_playlist_reserve(lib, "reserved", nr, nr * 32) ||
+	    mlib_playlist_reserve(lib, ".global", nr, nr * 32))
+		return -1;
+
+	len = MLIB_LIB_LEN(lib);
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "reserved", path))
+			return -1;
+		if (len != MLIB_LIB_LEN(lib))
+			return -1;
+	}
+
+	/* .global already has these paths so only the new playlist grows. */
+	if (mlib_start_playlist(lib, "unreserved"))
+		return -1;
+	len = MLIB_LIB_LEN(lib);
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "unreserved", path))
+			return -1;
+		if (len != MLIB_LIB_LEN(lib)) {
+			len = MLIB_LIB_LEN(lib);
+			grows++;
+		}
+	}
+
+	return grows > 20 ? -1 : 0;
+}
+
+/*
+ * Remove every other path from a plain and a hashed playlist, check what is
+ * left and that removal never grows the library, then put them all back.
+ */
+static int regress_remove_from(struct mlib_library *lib, const char *name,
+			       int nr)
+{
+	int i, ind;
+	char path[64];
+	const char *cur, *prev = NULL;
+	uint32_t len = MLIB_LIB_LEN(lib);
+	struct mlib_playlist *pls;
+
+	pls = mlib_find_playlist(lib, name);
+	for (i = 0; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_remove_path_from_plist(lib, pls, path))
+			return -1;
+	}
+	if (len != MLIB_LIB_LEN(lib))
+		return -1;
+
+	/* Already gone. */
+	regress_make_path(path, sizeof(path), 0);
+	if (mlib_remove_path_from_plist(lib, pls, path) == 0)
+		return -1;
+
+	if (MLIB_PLIST_MCOUNT(pls) != nr / 2)
+		return -1;
+	if (MLIB_BUCKET_DEAD_BYTES(&pls->data) >
+	    (MLIB_BUCKET_STR_BYTES(&pls->data) >> MLIB_BUCKET_DEAD_SHIFT) &&
+	    MLIB_BUCKET_DEAD_BYTES(&pls->data) > MLIB_BUCKET_GROWTH_RATE)
+		return -1;
+
+	mlib_for_each_path(lib, pls, ind, cur) {
+		if (prev && strcmp(prev, cur) >= 0)
+			return -1;
+		prev = cur;
+	}
+	if (ind != nr / 2)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, pls, path) != !(i & 1))
+			return -1;
+	}
+
+	for (i = 0; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, name, path))
+			return -1;
+	}
+
+	pls = mlib_find_playlist(lib, name);
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		cur = mlib_find_path(lib, pls, path);
+		if (!cur || strcmp(cur, path))
+			return -1;
+	}
+
+	return MLIB_PLIST_MCOUNT(pls) == nr ? 0 : -1;
+}
+
+int regress_verify_remove(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 1000;
+	char path[64];
+
+	if (mlib_start_playlist(lib, "plain") ||
+	    mlib_start_playlist(lib, "hashed") ||
+	    mlib_hash_playlist(lib, "hashed"))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "plain", path) ||
+		    mlib_add_path(lib, "hashed", path))
+			return -1;
+	}
+
+	if (regress_remove_from(lib, "plain", nr) ||
+	    regress_remove_from(lib, "hashed", nr))
+		return -1;
+
+	/* Removing from .global takes the path out of every playlist. */
+	regress_make_path(path, sizeof(path), 1);
+	if (mlib_remove_path(lib, ".global", path))
+		return -1;
+	if (mlib_find_path(lib, mlib_find_playlist(lib, "plain"), path) ||
+	    mlib_find_path(lib, mlib_find_playlist(lib, "hashed"), path))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Check that path @i still has media ID @i and that "named" still refers to
+ * it.
+ */
+static int regress_check_ids(struct mlib_library *lib, int nr, int step)
+{
+	int i;
+	uint32_t id;
+	const char *path;
+	char want[64];
+
+	for (i = 0; i < nr; i += step) {
+		regress_make_path(want, sizeof(want), i);
+		if (mlib_media_id(lib, want, &id) || id != (uint32_t)i)
+			return -1;
+		path = mlib_media_path(lib, id);
+		if (!path || strcmp(path, want))
+			return -1;
+		if (!mlib_find_path(lib, mlib_find_playlist(lib, "named"),
+				    want))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Paths are interned in .global: each gets an ID that stays put through
+ * removals, compaction and compression, and other playlists only store IDs.
+ */
+int regress_verify_interned_ids(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 2000;
+	uint32_t id;
+	char path[64];
+	struct mlib_playlist *pls;
+
+	if (mlib_start_playlist(lib, "named") ||
+	    mlib_hash_playlist(lib, "named"))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, ".global", path))
+			return -1;
+	}
+	for (i = 0; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "named", path))
+			return -1;
+	}
+
+	pls = mlib_find_playlist(lib, "named");
+	if (!(MLIB_BUCKET_FLAGS(&pls->data) & MLIB_BUCKET_F_REFS) ||
+	    MLIB_BUCKET_STR_BYTES(&pls->data) != 0)
+		return -1;
+	if (regress_check_ids(lib, nr, 2))
+		return -1;
+
+	/* Enough removals to force a compaction of .global. */
+	for (i = 1; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_remove_path(lib, ".global", path))
+			return -1;
+	}
+	if (mlib_media_id(lib, path, &id) == 0 ||
+	    mlib_media_path(lib, nr - 1) != NULL)
+		return -1;
+	if (regress_check_ids(lib, nr, 2))
+		return -1;
+
+	if (mlib_compress_playlist(lib, ".global") ||
+	    mlib_compress_playlist(lib, "named"))
+		return -1;
+	if (regress_check_ids(lib, nr, 2))
+		return -1;
+
+	/* New paths get new IDs; old ones are never handed out again. */
+	if (mlib_add_path(lib, "named", "dir-new/new.mp3") ||
+	    mlib_media_id(lib, "dir-new/new.mp3", &id) || id != (uint32_t)nr)
+		return -1;
+
+	/* .global holds everything else so it can't go away. */
+	if (mlib_delete_playlist(lib, ".global") == 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Look up @nr paths starting at @start in @pls; they must all be found if
+ * @present is set and none of them otherwise.
+ */
+static int regress_bloom_lookups(struct mlib_library *lib,
+				 struct mlib_playlist *pls, int start, int nr,
+				 int present)
+{
+	int i;
+	char path[64];
+
+	for (i = start; i < start + nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, pls, path) != !present)
+			return -1;
+	}
+	return 0;
+}
+
+struct regress_bloom_thread {
+	pthread_t		 thread;
+	struct mlib_library	*lib;
+	int			 start;
+	int			 nr;
+	int			 ret;
+};
+
+static void *regress_bloom_thread(void *arg)
+{
+	struct regress_bloom_thread *t = arg;
+
+	t->ret = regress_bloom_lookups(t->lib, mlib_global_playlist(t->lib),
+				       t->start, t->nr, 0);
+	return NULL;
+}
+
+/*
+ * Bloom filters must never hide a path that is present and should turn away
+ * most of the ones that aren't, through growth, removal and compression.
+ */
+int regress_verify_bloom(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 4000;
+	char path[64];
+	struct mlib_bloom_stats stats;
+	struct regress_bloom_thread threads[2];
+
+	if (mlib_start_playlist(lib, "bloomed") ||
+	    mlib_bloom_playlist(lib, "bloomed") ||
+	    mlib_bloom_playlist(lib, ".global"))
+		return -1;
+
+	/* Start small so the filters have to grow a few times. */
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "bloomed", path))
+			return -1;
+	}
+
+	mlib_bucket_bloom_stats_reset();
+	if (regress_bloom_lookups(lib, mlib_global_playlist(lib), 0, nr, 1) ||
+	    regress_bloom_lookups(lib, mlib_find_playlist(lib, "bloomed"), 0,
+				  nr, 1) ||
+	    regress_bloom_lookups(lib, mlib_global_playlist(lib), nr, 10 * nr,
+				  0))
+		return -1;
+
+	mlib_bucket_bloom_stats(&stats);
+	if (stats.checks != 12 * (uint64_t)nr ||
+	    stats.negatives + stats.false_positives != 10 * (uint64_t)nr)
+		return -1;
+	if (stats.false_positives * 20 > stats.negatives)
+		return -1;
+
+	/* Lookups in other threads count too, also once the threads exit. */
+	mlib_bucket_bloom_stats_reset();
+	for (i = 0; i < 2; i++) {
+		threads[i].lib = lib;
+		threads[i].start = (11 + i) * nr;
+		threads[i].nr = nr;
+		if (pthread_create(&threads[i].thread, NULL,
+				   regress_bloom_thread, &threads[i]))
+			return -1;
+	}
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i].thread, NULL);
+	mlib_bucket_bloom_stats(&stats);
+	if (threads[0].ret || threads[1].ret ||
+	    stats.checks != 2 * (uint64_t)nr ||
+	    stats.negatives + stats.false_positives != 2 * (uint64_t)nr)
+		return -1;
+
+	/* Removal compacts .global which rebuilds the filter. */
+	for (i = 0; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_remove_path(lib, ".global", path))
+			return -1;
+	}
+	for (i = 1; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, mlib_global_playlist(lib), path) ||
+		    !mlib_find_path(lib, mlib_find_playlist(lib, "bloomed"),
+				    path))
+			return -1;
+	}
+
+	if (mlib_hash_playlist(lib, ".global") ||
+	    mlib_compress_playlist(lib, ".global"))
+		return -1;
+	for (i = 1; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, mlib_global_playlist(lib), path))
+			return -1;
+	}
+	if (regress_bloom_lookups(lib, mlib_global_playlist(lib), nr, nr, 0))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Paths that end inside, right at and just past the inline tree key.
+ */
+static const char *regress_short_paths[] = {
+	"a", "ab.mp3", "abc.mp3", "abcd.mp3", "abcd.mp", "abcd.mp3x", "dir-0",
+	NULL,
+};
+
+/*
+ * Check every regression path below @nr and the short paths are found in @pls
+ * and a few that were never added are not.
+ */
+static int regress_tree_lookups(struct mlib_library *lib,
+				struct mlib_playlist *pls, int nr)
+{
+	int i;
+	const char *found;
+	char path[64];
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		found = mlib_find_path(lib, pls, path);
+		if (!found || strcmp(found, path))
+			return -1;
+	}
+	for (i = 0; regress_short_paths[i]; i++) {
+		if (!mlib_find_path(lib, pls, regress_short_paths[i]))
+			return -1;
+	}
+
+	if (mlib_find_path(lib, pls, "") || mlib_find_path(lib, pls, "ab") ||
+	    mlib_find_path(lib, pls, "abcd.mp30") ||
+	    mlib_find_path(lib, pls, "dir-00"))
+		return -1;
+	for (i = nr; i < 2 * nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_find_path(lib, pls, path))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The search tree has to agree with the binary search, go stale when the
+ * playlist changes and survive compaction and compression.
+ */
+int regress_verify_search_tree(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 3000;
+	char path[64];
+	const char *name;
+
+	if (mlib_start_playlist(lib, "tree"))
+		return -1;
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "tree", path))
+			return -1;
+	}
+	for (i = 0; (name = regress_short_paths[i]) != NULL; i++) {
+		if (mlib_add_path(lib, "tree", name))
+			return -1;
+	}
+
+	if (mlib_tree_playlist(lib, ".global") ||
+	    mlib_tree_playlist(lib, "tree"))
+		return -1;
+	if (!(MLIB_BUCKET_FLAGS(&mlib_find_playlist(lib, "tree")->data) &
+	      MLIB_BUCKET_F_TREE))
+		return -1;
+	if (regress_tree_lookups(lib, mlib_find_playlist(lib, ".global"), nr) ||
+	    regress_tree_lookups(lib, mlib_find_playlist(lib, "tree"), nr))
+		return -1;
+
+	/* Adding a path makes the tree stale; lookups must still see it. */
+	if (mlib_add_path(lib, "tree", "zzz.mp3"))
+		return -1;
+	if (MLIB_BUCKET_FLAGS(&mlib_find_playlist(lib, "tree")->data) &
+	    MLIB_BUCKET_F_TREE)
+		return -1;
+	if (!mlib_find_path(lib, mlib_find_playlist(lib, "tree"), "zzz.mp3") ||
+	    mlib_tree_playlist(lib, "tree") ||
+	    !mlib_find_path(lib, mlib_find_playlist(lib, "tree"), "zzz.mp3"))
+		return -1;
+
+	/* Compaction and compression move every string of .global. */
+	for (i = nr / 2; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_remove_path(lib, ".global", path))
+			return -1;
+	}
+	if (mlib_tree_playlist(lib, ".global") ||
+	    mlib_tree_playlist(lib, "tree") ||
+	    regress_tree_lookups(lib, mlib_global_playlist(lib), nr / 2) ||
+	    regress_tree_lookups(lib, mlib_find_playlist(lib, "tree"), nr / 2))
+		return -1;
+
+	if (mlib_compress_playlist(lib, ".global") ||
+	    regress_tree_lookups(lib, mlib_global_playlist(lib), nr / 2) ||
+	    regress_tree_lookups(lib, mlib_find_playlist(lib, "tree"), nr / 2))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Return the index width flags of playlist @name.
+ */
+static uint32_t regress_idx_flags(struct mlib_library *lib, const char *name)
+{
+	return MLIB_BUCKET_FLAGS(&mlib_find_playlist(lib, name)->data) &
+		(MLIB_BUCKET_F_IDX16 | MLIB_BUCKET_F_IDX24);
+}
+
+/*
+ * Path that gets media ID @id. The names sort backwards so adding them in ID
+ * order puts each one at the front of the index array, which keeps the test
+ * from going quadratic.
+ */
+static void regress_wide_path(char *buf, size_t len, int id)
+{
+	snprintf(buf, len, "wide/%06d.mp3", 999999 - id);
+}
+
+/*
+ * Check that @name holds exactly the paths with IDs @ids, in sorted order.
+ */
+static int regress_check_width(struct mlib_library *lib, const char *name,
+			       const int *ids, int nr)
+{
+	int i;
+	char path[64], prev[64] = "";
+	const char *str;
+	struct mlib_playlist *pls = mlib_find_playlist(lib, name);
+
+	if (mlib_bucket_nr_indexes(&pls->data) != nr)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		regress_wide_path(path, sizeof(path), ids[i]);
+		if (!mlib_find_path(lib, pls, path))
+			return -1;
+	}
+	for (i = 0; i < nr; i++) {
+		str = mlib_bucket_string(lib, &pls->data, i);
+		if (!str || strcmp(prev, str) >= 0)
+			return -1;
+		snprintf(prev, sizeof(prev), "%s", str);
+	}
+
+	return 0;
+}
+
+/*
+ * String @i of regress_compact_width(): 32 strings of 2043 bytes, then "c",
+ * then a long string that sorts before all of them.
+ */
+static void regress_compact_str(char *buf, int i)
+{
+	if (i == 33) {
+		memset(buf, 'a', 4000);
+		buf[4000] = 0;
+	} else if (i == 32) {
+		strcpy(buf, "c");
+	} else {
+		snprintf(buf, 4, "b%02d", i);
+		memset(buf + 3, 'x', 2040);
+		buf[2043] = 0;
+	}
+}
+
+/*
+ * Compaction lays the strings of a bucket out in index order, which can move
+ * one past what its index entry holds: "c" starts below 64K but the long
+ * string added after it moves in front of it. The entries must be widened
+ * first.
+ */
+static int regress_compact_width(void)
+{
+	uint32_t size = 128 * 1024;
+	struct mlib_bucket *bucket;
+	char str[MLIB_BUCKET_MAX_STR];
+	int i, ret = -1;
+
+	bucket = malloc(size);
+	if (!bucket || mlib_init_bucket(bucket, size, 0))
+		goto out;
+
+	for (i = 0; i < 34; i++) {
+		regress_compact_str(str, i);
+		if (mlib_bucket_add(NULL, bucket, str))
+			goto out;
+	}
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDX16))
+		goto out;
+
+	regress_compact_str(str, 0);
+	if (mlib_bucket_remove(NULL, bucket, str) ||
+	    mlib_bucket_compact(NULL, bucket) ||
+	    !(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDX24))
+		goto out;
+	for (i = 1; i < 34; i++) {
+		regress_compact_str(str, i);
+		if (!mlib_bucket_contains(NULL, bucket, str))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(bucket);
+	return ret;
+}
+
+/*
+ * Index entries start out 16 bits wide and are widened once a value no longer
+ * fits: .global past 65536 IDs and any playlist that refers to those IDs.
+ * Playlists that only refer to small IDs stay narrow.
+ */
+int regress_verify_index_width(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 70000;
+	int small[] = { 0, 17, 500, 4096, 65535 };
+	int large[] = { 3, 65536, 69999 };
+	char path[64];
+
+	if (mlib_start_playlist(lib, "small") ||
+	    mlib_start_playlist(lib, "large"))
+		return -1;
+	if (regress_idx_flags(lib, ".global") != MLIB_BUCKET_F_IDX16 ||
+	    regress_idx_flags(lib, "small") != MLIB_BUCKET_F_IDX16)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_wide_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, ".global", path))
+			return -1;
+	}
+	if (regress_idx_flags(lib, ".global") != MLIB_BUCKET_F_IDX24)
+		return -1;
+
+	for (i = 0; i < 5; i++) {
+		regress_wide_path(path, sizeof(path), small[i]);
+		if (mlib_add_path(lib, "small", path))
+			return -1;
+	}
+	for (i = 0; i < 3; i++) {
+		regress_wide_path(path, sizeof(path), large[i]);
+		if (mlib_add_path(lib, "large", path))
+			return -1;
+	}
+	if (regress_idx_flags(lib, "small") != MLIB_BUCKET_F_IDX16 ||
+	    regress_idx_flags(lib, "large") != MLIB_BUCKET_F_IDX24)
+		return -1;
+	if (regress_check_width(lib, "small", small, 5) ||
+	    regress_check_width(lib, "large", large, 3))
+		return -1;
+
+	/*
+	 * Compaction and compression rewrite every .global offset. None of the
+	 * paths in the playlists have IDs of the form 4k + 2.
+	 */
+	for (i = 2; i < nr; i += 4) {
+		regress_wide_path(path, sizeof(path), i);
+		if (mlib_remove_path(lib, ".global", path))
+			return -1;
+	}
+	if (mlib_compress_playlist(lib, ".global") ||
+	    regress_check_width(lib, "small", small, 5) ||
+	    regress_check_width(lib, "large", large, 3))
+		return -1;
+
+	return regress_compact_width();
+}
+
+/*
+ * Check the paths in @pls are in strictly increasing order.
+ */
+static int regress_check_sorted(struct mlib_library *lib,
+				const struct mlib_playlist *pls)
+{
+	int ind;
+	const char *cur;
+	char prev[MLIB_BUCKET_MAX_STR] = "";
+
+	mlib_for_each_path(lib, pls, ind, cur) {
+		if (ind && strcmp(prev, cur) >= 0) {
+			mlib_error("Out of order: '%s' >= '%s'\n", prev, cur);
+			return -1;
+		}
+		snprintf(prev, sizeof(prev), "%s", cur);
+	}
+
+	return 0;
+}
+
+/*
+ * Sort @nr entries with mlib_sort_strings() and check the result against
+ * strcmp().
+ */
+static int regress_sort_check(struct mlib_sort_ent *ents, int nr,
+			      int nr_threads)
+{
+	int i;
+
+	if (mlib_sort_strings(ents, nr, nr_threads))
+		return -1;
+	for (i = 1; i < nr; i++) {
+		if (strcmp(ents[i - 1].str, ents[i].str) > 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * mlib_sort_strings() has to handle empty strings, duplicates, strings that
+ * are prefixes of others and long shared prefixes, with any number of threads,
+ * and strings as long as a bucket takes without running out of stack. Then
+ * bulk loading a playlist with appends and rebuilding it must leave it the
+ * same as adding the paths one by one.
+ */
+int regress_verify_rebuild(struct mlib_library *lib, void *priv)
+{
+	int i, t, nr = 50000, nr_long = MLIB_BUCKET_MAX_STR - 1;
+	int threads[] = { 1, 2, 3, 4, 0 };
+	char path[64], *strs, *long_str = NULL;
+	uint32_t id;
+	struct mlib_sort_ent *ents;
+	struct mlib_playlist *pls;
+
+	strs = malloc(nr * 64);
+	ents = malloc(nr * sizeof(*ents));
+	if (!strs || !ents)
+		goto fail;
+
+	for (t = 0; t < 5; t++) {
+		for (i = 0; i < nr; i++) {
+			if (i % 7 == 0)
+				snprintf(strs + i * 64, 64, "%s", "");
+			else if (i % 5 == 0)
+				snprintf(strs + i * 64, 64, "%.*s", i % 40,
+					 "/music/long/shared/prefix/abcdefghij");
+			else
+				regress_make_path(strs + i * 64, 64, i % 9000);
+			ents[i].str = strs + i * 64;
+			ents[i].ref = i;
+		}
+		if (regress_sort_check(ents, nr, threads[t]))
+			goto fail;
+	}
+
+	/* "a", "aa", ... shuffled; each is a prefix of all the longer ones. */
+	long_str = malloc(nr_long + 1);
+	if (!long_str)
+		goto fail;
+	memset(long_str, 'a', nr_long);
+	long_str[nr_long] = 0;
+	for (i = 0; i < nr_long; i++) {
+		ents[i].str = long_str + nr_long - 1 - (i * 8 % nr_long);
+		ents[i].ref = i;
+	}
+	if (regress_sort_check(ents, nr_long, 1))
+		goto fail;
+
+	/* Bulk load .global and a named playlist in reverse order. */
+	if (mlib_start_playlist(lib, "bulk"))
+		goto fail;
+	for (i = nr - 1; i >= 0; i--) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_append_path(lib, ".global", path))
+			goto fail;
+	}
+	if (mlib_rebuild_playlist(lib, ".global", 4))
+		goto fail;
+	for (i = 0; i < nr; i += 3) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_append_path(lib, "bulk", path))
+			goto fail;
+	}
+	if (mlib_rebuild_playlist(lib, "bulk", 0))
+		goto fail;
+
+	pls = mlib_find_playlist(lib, "bulk");
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_media_id(lib, path, &id) || id != (uint32_t)(nr - 1 - i))
+			goto fail;
+		if (!mlib_find_path(lib, pls, path) != !!(i % 3))
+			goto fail;
+	}
+	if (regress_check_sorted(lib, mlib_find_playlist(lib, ".global")) ||
+	    regress_check_sorted(lib, pls))
+		goto fail;
+
+	/* So does rebuilding a bucket of them. */
+	for (i = 0; i < nr_long; i++) {
+		if (mlib_append_path(lib, ".global",
+				     long_str + nr_long - 1 - (i * 8 % nr_long)))
+			goto fail;
+	}
+	if (mlib_rebuild_playlist(lib, ".global", 1) ||
+	    regress_check_sorted(lib, mlib_find_playlist(lib, ".global")))
+		goto fail;
+
+	/* Compressed strings sort by their plain text. */
+	if (mlib_compress_playlist(lib, ".global") ||
+	    mlib_rebuild_playlist(lib, ".global", 2) ||
+	    regress_check_sorted(lib, mlib_find_playlist(lib, ".global")))
+		goto fail;
+
+	/* Duplicates are reported. */
+	regress_make_path(path, sizeof(path), 3);
+	if (mlib_append_path(lib, "bulk", path) ||
+	    mlib_rebuild_playlist(lib, "bulk", 0) == 0)
+		goto fail;
+
+	free(long_str);
+	free(strs);
+	free(ents);
+	return 0;
+
+fail:
+	free(long_str);
+	free(strs);
+	free(ents);
+	return -1;
+}
+
+/*
+ * Check that the paged playlist @pls holds exactly the paths regress_make_path()
+ * makes for the @n with @n % @step == 0 below @nr, in order, and that prefix
+ * queries on it agree with '.global'.
+ */
+static int regress_check_paged(struct mlib_library *lib,
+			       struct mlib_playlist *pls, int nr, int step)
+{
+	int i, first, last, gfirst, glast, count = 0;
+	const char *prefixes[] = { "", "dir-0", "dir-17/", "dir-36/track-f",
+				   "zzz", NULL };
+	struct mlib_playlist *global = mlib_global_playlist(lib);
+	char path[64];
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, pls, path) != !!(i % step))
+			return -1;
+		count += !(i % step);
+	}
+	if (MLIB_PLIST_MCOUNT(pls) != count ||
+	    mlib_get_path_at(lib, pls, count - 1) == NULL ||
+	    mlib_get_path_at(lib, pls, count) != NULL ||
+	    regress_check_sorted(lib, pls))
+		return -1;
+
+	if (step != 1)
+		return 0;
+	for (i = 0; prefixes[i]; i++) {
+		if (mlib_find_prefix(lib, pls, prefixes[i], &first, &last) !=
+		    mlib_find_prefix(lib, global, prefixes[i], &gfirst,
+				     &glast) ||
+		    first != gfirst || last != glast)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Paged playlists have to keep working as pages split, as earlier playlists
+ * grow and shift the pages and as they empty out again. Enough paths are added
+ * in order, which leaves the leaves half full, to split the root twice.
+ */
+int regress_verify_paged(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 300000;
+	uint32_t len;
+	char path[64];
+	struct mlib_playlist *pls, *early;
+	struct mlib_page *root;
+
+	if (mlib_start_playlist(lib, "early") ||
+	    mlib_start_paged_playlist(lib, "paged") ||
+	    mlib_start_paged_playlist(lib, ".global") == 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_append_path(lib, ".global", path))
+			return -1;
+	}
+	if (mlib_rebuild_playlist(lib, ".global", 0))
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "%s",
+			 mlib_get_path_at(lib, mlib_global_playlist(lib), i));
+		if (mlib_add_path(lib, "paged", path))
+			return -1;
+	}
+	pls = mlib_find_playlist(lib, "paged");
+	if (mlib_add_path_to_plist(lib, pls, path) == 0 ||
+	    mlib_add_path_to_plist(lib, pls, "not/in/global.mp3") == 0 ||
+	    mlib_hash_playlist(lib, "paged") == 0)
+		return -1;
+	root = ((void *)lib->header) +
+		__mlib_read_offs(lib, &MLIB_PLIST_PTREE(pls)->root);
+	if (MLIB_PAGE_LEVEL(root) != 2)
+		return -1;
+	if (regress_check_paged(lib, pls, nr, 1))
+		return -1;
+
+	/*
+	 * Grow the playlist in front of the pages; in a v1 library they all
+	 * move.
+	 */
+	for (i = 0; i < nr; i += 10) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "early", path))
+			return -1;
+	}
+	pls = mlib_find_playlist(lib, "paged");
+	if (regress_check_paged(lib, pls, nr, 1))
+		return -1;
+
+	/* Empty it out; the pages go on the free list. */
+	len = MLIB_LIB_LEN(lib);
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (i % 3 && mlib_remove_path(lib, "paged", path))
+			return -1;
+	}
+	if (regress_check_paged(lib, pls, nr, 3))
+		return -1;
+	for (i = 0; i < nr; i += 3) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_remove_path(lib, "paged", path))
+			return -1;
+	}
+	if (MLIB_PLIST_MCOUNT(pls) != 0 ||
+	    __mlib_read_offs(lib, &MLIB_PLIST_PTREE(pls)->root) != 0 ||
+	    mlib_get_path_at(lib, pls, 0) != NULL)
+		return -1;
+
+	/* Adding in scrambled order reuses the free pages. */
+	for (i = 0; i < nr; i += 2) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "paged", path))
+			return -1;
+	}
+	if (MLIB_LIB_LEN(lib) != len ||
+	    regress_check_paged(lib, pls, nr, 2))
+		return -1;
+
+	/* Deleting it gives all of the pages back. */
+	len = MLIB_LIB_LEN(lib) - mlib_library_free_bytes(lib) -
+		__mlib_readl(&MLIB_PLIST_PTREE(pls)->nr_pages) * MLIB_PAGE_SIZE;
+	if (mlib_delete_playlist(lib, "paged") ||
+	    MLIB_LIB_LEN(lib) - mlib_library_free_bytes(lib) > len)
+		return -1;
+	early = mlib_find_playlist(lib, "early");
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (!mlib_find_path(lib, early, path) != !!(i % 10))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The parts of @s must add up to the whole.
+ */
+static int regress_stats_sum(const struct mlib_bucket_stats *s)
+{
+	return s->header_bytes + s->str_bytes + s->dead_bytes +
+		s->index_bytes + s->aux_bytes + s->free_bytes ==
+		s->total_bytes ? 0 : -1;
+}
+
+/*
+ * What the extent around @pls adds to the playlist; nothing in a v1 library.
+ */
+static uint32_t regress_extent_bytes(struct mlib_library *lib,
+				     struct mlib_playlist *pls)
+{
+	if (!MLIB_LIB_EXTENTS(lib))
+		return 0;
+	return sizeof(struct mlib_extent) - MLIB_PLIST_LEN(pls) +
+		__mlib_extent_capacity(lib, mlib_lib_offset(lib, pls));
+}
+
+/*
+ * Storage statistics have to account for every byte of every kind of
+ * playlist, and summed over the playlists, for the whole library.
+ */
+int regress_verify_stats(struct mlib_library *lib, void *priv)
+{
+	int i, nr = 3000;
+	char path[64];
+	uint64_t path_bytes = 0;
+	struct mlib_bucket_stats stats, total;
+	struct mlib_playlist *pls;
+
+	if (mlib_start_playlist(lib, "plain") ||
+	    mlib_start_paged_playlist(lib, "paged"))
+		return -1;
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		path_bytes += strlen(path);
+		if (mlib_add_path(lib, "plain", path) ||
+		    (i % 2 == 0 && mlib_add_path(lib, "paged", path)))
+			return -1;
+	}
+	if (mlib_hash_playlist(lib, "plain") ||
+	    mlib_bloom_playlist(lib, "plain"))
+		return -1;
+
+	memset(&stats, 0, sizeof(stats));
+	mlib_bucket_stats(lib, &mlib_global_playlist(lib)->data, &stats);
+	if (stats.entries != (uint64_t)nr || stats.path_bytes != path_bytes ||
+	    stats.str_bytes != path_bytes + nr || stats.dead_bytes ||
+	    regress_stats_sum(&stats))
+		return -1;
+
+	/* Removed strings are dead until compacted. */
+	for (i = 0; i < nr / 10; i++) {
+		regress_make_path(path, sizeof(path), i * 10 + 1);
+		if (mlib_remove_path(lib, ".global", path))
+			return -1;
+	}
+	memset(&stats, 0, sizeof(stats));
+	mlib_bucket_stats(lib, &mlib_global_playlist(lib)->data, &stats);
+	if (stats.entries != (uint64_t)(nr - nr / 10) || !stats.dead_bytes ||
+	    regress_stats_sum(&stats))
+		return -1;
+
+	memset(&stats, 0, sizeof(stats));
+	pls = mlib_find_playlist(lib, "plain");
+	mlib_playlist_stats(lib, pls, &stats);
+	if (stats.entries != (uint64_t)(nr - nr / 10) || stats.str_bytes ||
+	    !stats.aux_bytes ||
+	    stats.total_bytes != MLIB_PLIST_LEN(pls) +
+	    regress_extent_bytes(lib, pls) ||
+	    regress_stats_sum(&stats))
+		return -1;
+
+	/*
+	 * Compressed paths still count at their decoded length; "plain" has
+	 * the same paths as .global.
+	 */
+	if (mlib_compress_playlist(lib, ".global"))
+		return -1;
+	path_bytes = stats.path_bytes;
+	memset(&stats, 0, sizeof(stats));
+	mlib_playlist_stats(lib, mlib_global_playlist(lib), &stats);
+	if (stats.path_bytes != path_bytes || stats.dead_bytes ||
+	    regress_stats_sum(&stats))
+		return -1;
+
+	memset(&total, 0, sizeof(total));
+	mlib_for_each_pls(lib, pls) {
+		memset(&stats, 0, sizeof(stats));
+		mlib_playlist_stats(lib, pls, &stats);
+		if (regress_stats_sum(&stats))
+			return -1;
+		total.entries += stats.entries;
+		total.total_bytes += stats.total_bytes;
+	}
+	mlib_dir_stats(lib, &total);
+	if (total.entries != (uint64_t)(2 * (nr - nr / 10) + nr / 2) ||
+	    total.total_bytes + mlib_library_free_bytes(lib) !=
+	    MLIB_LIB_LEN(lib) - MLIB_HEADER_SIZE)
+		return -1;
+
+	return 0;
+}
+
+static int regress_sign(int x)
+{
+	return (x > 0) - (x < 0);
+}
+
+/*
+ * Check the prefix compare kernel against strncmp(), including strings that
+ * end right before an unmapped page.
+ */
+static int regress_prefix_kernel(void)
+{
+	int i, j, k, ret = 0;
+	char *page, *str, *prefix;
+	char buf[128];
+
+	page = mmap(NULL, 8192, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+		return -1;
+	mprotect(page + 4096, 4096, PROT_NONE);
+
+	for (i = 0; i < 100 && !ret; i++) {
+		for (j = 0; j < 100 && !ret; j++) {
+			/* Strings of length i and j ending at the page end. */
+			str = page + 4096 - (i + 1);
+			prefix = page + 2048 - (j + 1);
+			for (k = 0; k < i; k++)
+				str[k] = 'a' + (k * 7 + i) % 3;
+			str[i] = 0;
+			for (k = 0; k < j; k++)
+				prefix[k] = 'a' + (k * 7 + i) % 3 +
+					(k == j - 1 && (i & 1));
+			prefix[j] = 0;
+
+			if (regress_sign(mlib_prefix_cmp(str, prefix, j)) !=
+			    regress_sign(strncmp(str, prefix, j)))
+				ret = -1;
+
+			/* And from the middle of a buffer. */
+			strcpy(buf, str);
+			if (regress_sign(mlib_prefix_cmp(buf, prefix, j)) !=
+			    regress_sign(strncmp(buf, prefix, j)))
+				ret = -1;
+		}
+	}
+
+	munmap(page, 8192);
+	return ret;
+}
+
+/*
+ * Check one prefix against a linear scan of the playlist.
+ */
+static int regress_prefix_query(struct mlib_library *lib,
+				struct mlib_playlist *pls, const char *prefix)
+{
+	int ind, first, last, nr, matches = 0;
+	const char *cur;
+
+	nr = mlib_find_prefix(lib, pls, prefix, &first, &last);
+	if (nr < 0 || last - first + 1 != nr)
+		return -1;
+
+	mlib_for_each_path(lib, pls, ind, cur) {
+		if (strncmp(cur, prefix, strlen(prefix)) != 0)
+			continue;
+		if (ind < first || ind > last)
+			return -1;
+		matches++;
+	}
+
+	return matches == nr ? 0 : -1;
+}
+
+int regress_verify_prefix_range(struct mlib_library *lib, void *priv)
+{
+	int i, scalar, nr = 1000;
+	char path[64];
+	const char *prefixes[] = {
+		"", "dir-", "dir-0", "dir-07/", "dir-07/track-", "dir-36/",
+		"dir-99/", "a", "zzz", "dir-1", "dir-12/track-0",
+	};
+	const char *plists[] = { "prefix", "cprefix" };
+	struct mlib_playlist *pls;
+	unsigned int p, l;
+
+	for (scalar = 0; scalar < 2; scalar++) {
+		mlib_prefix_cmp_force_scalar(scalar);
+		if (regress_prefix_kernel())
+			return -1;
+	}
+	mlib_prefix_cmp_force_scalar(0);
+
+	if (mlib_start_playlist(lib, "prefix") ||
+	    mlib_start_playlist(lib, "cprefix"))
+		return -1;
+	for (i = 0; i < nr; i++) {
+		regress_make_path(path, sizeof(path), i);
+		if (mlib_add_path(lib, "prefix", path) ||
+		    mlib_add_path(lib, "cprefix", path))
+			return -1;
+	}
+	if (mlib_compress_playlist(lib, "cprefix"))
+		return -1;
+
+	for (l = 0; l < 2; l++) {
+		pls = mlib_find_playlist(lib, plists[l]);
+		for (p = 0; p < sizeof(prefixes) / sizeof(*prefixes); p++) {
+			if (regress_prefix_query(lib, pls, prefixes[p])) {
+				mlib_error("Prefix '%s' failed on %s\n",
+					   prefixes[p], plists[l]);
+				return -1;
+			}
+		}
+		for (i = 0; i < 50; i++) {
+			regress_make_path(path, sizeof(path), i);
+			if (regress_prefix_query(lib, pls, path))
+				return -1;
+		}
+	}
+
+	return 0;
+}
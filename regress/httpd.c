@@ -0,0 +1,241 @@
+/* (C) Copyright 2013, Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A tiny HTTP server standing in for whatever serves remote libraries. It
+ * serves one file for any GET, answers Range requests with 206 unless told
+ * not to (or told to fail the next few), and keeps count of what it sent so
+ * tests can see how much of a library a client actually downloaded.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <regress.h>
+
+/*
+ * Send all of @len bytes at @buf.
+ */
+static int httpd_send(int sock, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(sock, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Take one off the count of range requests still to fail. Returns non-zero if
+ * this one should.
+ */
+static int httpd_should_fail(struct regress_httpd *srv)
+{
+	uint64_t left;
+
+	do {
+		left = srv->stats->fail;
+		if (!left)
+			return 0;
+	} while (!__sync_bool_compare_and_swap(&srv->stats->fail, left,
+					       left - 1));
+	return 1;
+}
+
+/*
+ * Answer one request in @req for the @size byte file @fd.
+ */
+static int httpd_answer(struct regress_httpd *srv, int sock, int fd,
+			size_t size, char *req)
+{
+	unsigned long long start = 0, end = size - 1;
+	char head[256], *range, *buf;
+	int partial = 0, len;
+
+	if (strncmp(req, "GET ", 4)) {
+		len = snprintf(head, sizeof(head), "HTTP/1.1 405 Method Not "
+			       "Allowed\r\nContent-Length: 0\r\n\r\n");
+		return httpd_send(sock, head, len);
+	}
+
+	range = strcasestr(req, "\r\nRange: bytes=");
+	if (range && httpd_should_fail(srv)) {
+		len = snprintf(head, sizeof(head), "HTTP/1.1 503 Service "
+			       "Unavailable\r\nContent-Length: 0\r\n\r\n");
+		return httpd_send(sock, head, len);
+	}
+	if (range && !(srv->flags & REGRESS_HTTPD_NO_RANGES)) {
+		if (sscanf(range + 15, "%llu-%llu", &start, &end) != 2 ||
+		    start > end || start >= size) {
+			len = snprintf(head, sizeof(head), "HTTP/1.1 416 Range "
+				       "Not Satisfiable\r\nContent-Length: 0"
+				       "\r\n\r\n");
+			return httpd_send(sock, head, len);
+		}
+		if (end >= size)
+			end = size - 1;
+		partial = 1;
+		__sync_fetch_and_add(&srv->stats->ranges, 1);
+	}
+
+	if (partial)
+		len = snprintf(head, sizeof(head), "HTTP/1.1 206 Partial "
+			       "Content\r\nContent-Length: %llu\r\n"
+			       "Content-Range: bytes %llu-%llu/%zu\r\n\r\n",
+			       end - start + 1, start, end, size);
+	else
+		len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+			       "Content-Length: %zu\r\n\r\n", size);
+
+	buf = malloc(end - start + 1);
+	if (!buf || pread(fd, buf, end - start + 1, start) !=
+	    (ssize_t)(end - start + 1)) {
+		free(buf);
+		return -1;
+	}
+	__sync_fetch_and_add(&srv->stats->requests, 1);
+	__sync_fetch_and_add(&srv->stats->bytes, end - start + 1);
+	if (httpd_send(sock, head, len) ||
+	    httpd_send(sock, buf, end - start + 1)) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ * Serve requests on one connection until the client hangs up.
+ */
+static void httpd_connection(struct regress_httpd *srv, int sock,
+			     const char *file)
+{
+	char req[4096], *end;
+	size_t have = 0;
+	struct stat sb;
+	ssize_t ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) || !sb.st_size)
+		return;
+
+	for (;;) {
+		ret = read(sock, req + have, sizeof(req) - 1 - have);
+		if (ret <= 0)
+			return;
+		have += ret;
+		req[have] = 0;
+
+		/* There may be more than one request in the buffer. */
+		while ((end = strstr(req, "\r\n\r\n"))) {
+			end[2] = 0;
+			if (httpd_answer(srv, sock, fd, sb.st_size, req))
+				return;
+			have -= end + 4 - req;
+			memmove(req, end + 4, have + 1);
+		}
+		if (have == sizeof(req) - 1)
+			return;
+	}
+}
+
+/*
+ * Start serving @file on a port of 127.0.0.1 in a child process. @srv->flags
+ * may have REGRESS_HTTPD_* set; the rest of @srv is filled in. Returns 0 on
+ * success, < 0 on failure.
+ */
+int regress_httpd_start(struct regress_httpd *srv, const char *file)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int sock, conn;
+
+	srv->stats = mmap(NULL, sizeof(*srv->stats), PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (srv->stats == MAP_FAILED)
+		return -1;
+	memset(srv->stats, 0, sizeof(*srv->stats));
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		goto fail;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 16) ||
+	    getsockname(sock, (struct sockaddr *)&addr, &addr_len))
+		goto fail_2;
+	srv->port = ntohs(addr.sin_port);
+
+	srv->pid = fork();
+	if (srv->pid < 0)
+		goto fail_2;
+	if (srv->pid == 0) {
+		/* A process per connection; nobody waits for them. */
+		signal(SIGCHLD, SIG_IGN);
+		for (;;) {
+			conn = accept(sock, NULL, NULL);
+			if (conn < 0)
+				continue;
+			if (fork() == 0) {
+				close(sock);
+				httpd_connection(srv, conn, file);
+				_exit(0);
+			}
+			close(conn);
+		}
+	}
+
+	close(sock);
+	return 0;
+
+fail_2:
+	close(sock);
+fail:
+	munmap(srv->stats, sizeof(*srv->stats));
+	return -1;
+}
+
+/*
+ * Stop the server started by regress_httpd_start(). Connections still open
+ * are served until their clients hang up.
+ */
+void regress_httpd_stop(struct regress_httpd *srv)
+{
+	kill(srv->pid, SIGTERM);
+	waitpid(srv->pid, NULL, 0);
+	munmap(srv->stats, sizeof(*srv->stats));
+}
@@ -17,6 +17,8 @@
  * features.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -47,6 +49,49 @@ static struct regression_test regressions[]  __attribute__ ((unused)) = {
 		   regress_verify_mk_rm_pls, NULL),
 	REGRESSION("Add element to playlist", CREATE_LIBRARY,
 		   regress_verify_add_to_plist, NULL),
+	REGRESSION("Library growth", 0, regress_verify_growth, NULL),
+	REGRESSION("Library extents", CREATE_LIBRARY,
+		   regress_verify_extents, NULL),
+	REGRESSION("Version 1 libraries", 0, regress_verify_v1, NULL),
+	REGRESSION("Playlist directory", 0, regress_verify_dir, NULL),
+	REGRESSION("Write-ahead log", 0, regress_verify_wal, NULL),
+	REGRESSION("Dirty range sync", 0, regress_verify_dirty, NULL),
+	REGRESSION("Read-only opens", 0, regress_verify_ro, NULL),
+	REGRESSION("Shared libraries", 0, regress_verify_share, NULL),
+	REGRESSION("Vacuum", 0, regress_verify_vacuum, NULL),
+	REGRESSION("Wide libraries", 0, regress_verify_wide, NULL),
+	REGRESSION("Remote libraries", 0, regress_verify_remote, NULL),
+	REGRESSION("Library registry", 0, regress_verify_registry, NULL),
+	REGRESSION("Sorted bucket insertion", CREATE_LIBRARY,
+		   regress_verify_sorted_insert, NULL),
+	REGRESSION("Concurrent bucket lookups", CREATE_LIBRARY,
+		   regress_verify_concurrent_lookup, NULL),
+	REGRESSION("Hashed playlist lookups", CREATE_LIBRARY,
+		   regress_verify_hashed_plist, NULL),
+	REGRESSION("Baseline bucket headers", 0, regress_verify_baseline,
+		   NULL),
+	REGRESSION("Compressed playlist", CREATE_LIBRARY,
+		   regress_verify_compressed_plist, NULL),
+	REGRESSION("Playlist reservation and growth", CREATE_LIBRARY,
+		   regress_verify_reserve, NULL),
+	REGRESSION("Path removal", CREATE_LIBRARY,
+		   regress_verify_remove, NULL),
+	REGRESSION("Prefix range queries", CREATE_LIBRARY,
+		   regress_verify_prefix_range, NULL),
+	REGRESSION("Interned path IDs", CREATE_LIBRARY,
+		   regress_verify_interned_ids, NULL),
+	REGRESSION("Bloom filters", CREATE_LIBRARY,
+		   regress_verify_bloom, NULL),
+	REGRESSION("Search tree lookups", CREATE_LIBRARY,
+		   regress_verify_search_tree, NULL),
+	REGRESSION("Adaptive index width", CREATE_LIBRARY,
+		   regress_verify_index_width, NULL),
+	REGRESSION("Parallel rebuild", CREATE_LIBRARY,
+		   regress_verify_rebuild, NULL),
+	REGRESSION("Paged playlists", CREATE_LIBRARY,
+		   regress_verify_paged, NULL),
+	REGRESSION("Storage statistics", CREATE_LIBRARY,
+		   regress_verify_stats, NULL),
 
 	/* NULL terminator. */
 	REGRESSION(NULL, 0, NULL, NULL),
@@ -126,6 +171,39 @@ int do_regressions()
 	return total - passed;
 }
 
+/*
+ * Copy the library @fixture in the regress directory to @path, replacing
+ * whatever is there. Tests change their copy, never the fixture. Returns 0 on
+ * success.
+ */
+int regress_copy_fixture(const char *fixture, const char *path)
+{
+	char src[1024], buf[4096];
+	int in, out, ret = -1;
+	ssize_t len;
+
+	snprintf(src, sizeof(src), "%s/%s", REGRESS_DATA, fixture);
+	in = open(src, O_RDONLY);
+	if (in < 0) {
+		mlib_perror("open: %s", src);
+		return -1;
+	}
+	out = open(path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	if (out < 0) {
+		mlib_perror("open: %s", path);
+		goto done;
+	}
+	while ((len = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, len) != len)
+			break;
+	if (len == 0)
+		ret = 0;
+	close(out);
+done:
+	close(in);
+	return ret;
+}
+
 /*
  * Returns 0 on success. Automatically fills in the behavior fields.
  */
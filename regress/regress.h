@@ -17,6 +17,9 @@
 #ifndef _REGRESS_H_
 #define _REGRESS_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #define CREATE_LIBRARY	(1 << 0)
 
 struct mlib_library;
@@ -60,6 +63,33 @@ int	 parse_args(int argc, char *argv[]);
 void	 die_print_help(void);
 int	 do_regressions(void);
 
+/*
+ * A local HTTP server for remote library tests; see httpd.c.
+ */
+#define REGRESS_HTTPD_NO_RANGES	(1 << 0)	/* Ignore Range headers. */
+
+struct regress_httpd_stats {
+	uint64_t	requests;
+	uint64_t	ranges;		/* Requests answered with 206. */
+	uint64_t	bytes;		/* Body bytes sent. */
+	uint64_t	fail;		/* Range requests to answer with 503. */
+};
+
+struct regress_httpd {
+	int				 flags;
+	int				 port;
+	pid_t				 pid;
+	struct regress_httpd_stats	*stats;	/* Shared with the server. */
+};
+
+/*
+ * Copy the library @fixture from the regress directory to @path.
+ */
+int	 regress_copy_fixture(const char *fixture, const char *path);
+
+int	 regress_httpd_start(struct regress_httpd *srv, const char *file);
+void	 regress_httpd_stop(struct regress_httpd *srv);
+
 /*
  * Function definitions for all regression tests.
  */
@@ -67,5 +97,34 @@ int	 regress_verify_create(struct mlib_library *lib, void *priv);
 int	 regress_verify_open(struct mlib_library *lib, void *priv);
 int	 regress_verify_mk_rm_pls(struct mlib_library *lib, void *priv);
 int	 regress_verify_add_to_plist(struct mlib_library *lib, void *priv);
+int	 regress_verify_growth(struct mlib_library *lib, void *priv);
+int	 regress_verify_extents(struct mlib_library *lib, void *priv);
+int	 regress_verify_v1(struct mlib_library *lib, void *priv);
+int	 regress_verify_dir(struct mlib_library *lib, void *priv);
+int	 regress_verify_wal(struct mlib_library *lib, void *priv);
+int	 regress_verify_dirty(struct mlib_library *lib, void *priv);
+int	 regress_verify_ro(struct mlib_library *lib, void *priv);
+int	 regress_verify_share(struct mlib_library *lib, void *priv);
+int	 regress_verify_vacuum(struct mlib_library *lib, void *priv);
+int	 regress_verify_wide(struct mlib_library *lib, void *priv);
+int	 regress_verify_remote(struct mlib_library *lib, void *priv);
+int	 regress_verify_registry(struct mlib_library *lib, void *priv);
+int	 regress_verify_sorted_insert(struct mlib_library *lib, void *priv);
+int	 regress_verify_concurrent_lookup(struct mlib_library *lib,
+					  void *priv);
+int	 regress_verify_hashed_plist(struct mlib_library *lib, void *priv);
+int	 regress_verify_baseline(struct mlib_library *lib, void *priv);
+int	 regress_verify_compressed_plist(struct mlib_library *lib,
+					 void *priv);
+int	 regress_verify_reserve(struct mlib_library *lib, void *priv);
+int	 regress_verify_remove(struct mlib_library *lib, void *priv);
+int	 regress_verify_prefix_range(struct mlib_library *lib, void *priv);
+int	 regress_verify_interned_ids(struct mlib_library *lib, void *priv);
+int	 regress_verify_bloom(struct mlib_library *lib, void *priv);
+int	 regress_verify_search_tree(struct mlib_library *lib, void *priv);
+int	 regress_verify_index_width(struct mlib_library *lib, void *priv);
+int	 regress_verify_rebuild(struct mlib_library *lib, void *priv);
+int	 regress_verify_paged(struct mlib_library *lib, void *priv);
+int	 regress_verify_stats(struct mlib_library *lib, void *priv);
 
 #endif
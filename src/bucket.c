@@ -17,18 +17,56 @@
  * Special data structure to allow us to access a packet array of arbitrary
  * size strings quickly. The data structure looks kinda like this:
  *
- *   +----------------------------+------ ~~~ ---+----------------------------+
- *   | Strings, null terminated   | Excess space |   uint32_t indexes to strs |
- *   +----------------------------+------ ~~~ ---+----------------------------+
+ *   +--------------------------+---- ~~~ -----+------------------------+-----+
+ *   | Strings, null terminated | Excess space | 2, 3 or 4 byte indexes | Aux |
+ *   +--------------------------+---- ~~~ -----+------------------------+-----+
  *
  * The indexes are alphabetized for a fast binary search to see if a string is
- * contained in the data structure.
+ * contained in the data structure. Index entries are big endian and only as
+ * wide as the largest value in the array needs: new buckets start out with 16
+ * bit entries (MLIB_BUCKET_F_IDX16) and the whole array is widened to 24
+ * (MLIB_BUCKET_F_IDX24) and then 32 bits the first time a value doesn't fit.
+ * Most playlists are small so this halves their index arrays.
+ *
+ * The aux area holds optional tables, each only there if the bucket uses it:
+ *
+ *   +------------+--------------+-------------+----------+--------+
+ *   | Hash table | Bloom filter | Search tree | ID table | Symtab |
+ *   +------------+--------------+-------------+----------+--------+
+ *
+ * The open addressing hash table (MLIB_BUCKET_F_HASH) mapping strings to their
+ * offsets sits at the start of the aux area; when it needs to grow the index
+ * array is shifted down into the excess space to make room for it. A blocked
+ * Bloom filter (MLIB_BUCKET_F_BLOOM) follows the hash table and lets lookups
+ * for strings that aren't in the bucket skip the search entirely. A search
+ * tree (MLIB_BUCKET_F_TREE) comes next; see mlib_bucket_build_tree().
+ * Compressed buckets (MLIB_BUCKET_F_COMPRESSED) keep their symbol table at the
+ * very end of the bucket and store every string encoded with it. See
+ * compress.c.
+ *
+ * Removing a string only drops its index (and hash slot); the string bytes are
+ * left behind and counted in the bucket's dead bytes. Once enough of the
+ * strings are dead they are compacted in one pass, see mlib_bucket_compact().
+ *
+ * Media paths are interned in .global. Its bucket (MLIB_BUCKET_F_IDS) hands
+ * every string a stable 32 bit ID when it is added; the index array holds the
+ * IDs and an ID table in the aux area, between the search tree and the symbol
+ * table, maps each ID to the string's current offset. Compacting or
+ * compressing the strings only has to rewrite the ID table. All other
+ * playlists (MLIB_BUCKET_F_REFS) store no strings at all: their index array is
+ * a sorted list of .global IDs and their strings are read from .global.
+ *
+ * Everything that reads strings through an index value goes through
+ * __mlib_bucket_strings() to find the bucket holding the strings and
+ * __mlib_bucket_ref_offset() to turn the index value into a string offset.
  *
  * This code makes certain assumptions about the data structures - e.g all
  * mlib_buckets are embedded in a playlist structure. Therefor, *do not* use
  * this code directly unless you know what you are doing.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -39,13 +77,20 @@
 
 /* #define __DEBUG_BUCKETS */
 
+/*
+ * The most a bucket will grow by in one go. See __mlib_bucket_make_room().
+ */
+static uint32_t mlib_bucket_growth_cap = MLIB_BUCKET_GROWTH_CAP;
+
 /*
  * Sets up a new hashtable in the passed hash data structure. @size is the
  * maximum number of bytes that the bucket may live in. This memory must have
  * already been set up correctly via the correct library functions (i.e
- * mlib_lbrary_expand()).
+ * mlib_lbrary_expand()). @flags may be MLIB_BUCKET_F_IDS or MLIB_BUCKET_F_REFS.
+ * The index array starts out 16 bits wide.
  */
-int mlib_init_bucket(struct mlib_bucket *bucket, uint32_t size)
+int mlib_init_bucket(struct mlib_bucket *bucket, uint32_t size,
+		     uint32_t flags)
 {
 	if (size < sizeof(struct mlib_bucket)) {
 		mlib_error("Bucket size too small.\n");
@@ -56,24 +101,97 @@ int mlib_init_bucket(struct mlib_bucket *bucket, uint32_t size)
 	MLIB_BUCKET_SET_LENGTH(bucket, size);
 	MLIB_BUCKET_SET_INDEX_OFFS(bucket, size);
 	MLIB_BUCKET_SET_STR_BYTES(bucket, 0);
+	MLIB_BUCKET_SET_FLAGS(bucket, flags | MLIB_BUCKET_F_IDX16);
+	MLIB_BUCKET_SET_AUX_OFFS(bucket, size);
+	MLIB_BUCKET_SET_HASH_SLOTS(bucket, 0);
+	MLIB_BUCKET_SET_DEAD_BYTES(bucket, 0);
+	MLIB_BUCKET_SET_ID_SLOTS(bucket, 0);
+	MLIB_BUCKET_SET_NEXT_ID(bucket, 0);
+	MLIB_BUCKET_SET_BLOOM_BLOCKS(bucket, 0);
+	MLIB_BUCKET_SET_TREE_SLOTS(bucket, 0);
 	return 0;
 }
 
 /*
- * Return uint32_t pointer to the index array.
+ * Note that the @len bytes @offs bytes into @bucket were written to; see
+ * __mlib_library_dirty(). @lib may be NULL.
+ */
+static void __mlib_bucket_dirty(struct mlib_library *lib,
+				const struct mlib_bucket *bucket,
+				uint32_t offs, uint32_t len)
+{
+	__mlib_library_dirty(lib, ((void *)bucket) + offs, len);
+}
+
+/*
+ * Note that anything in @bucket but the free space between the strings and
+ * the indexes may have been written to. For the changes that rewrite most of
+ * a bucket anyway; adds and removes mark just what they touch.
+ */
+static void __mlib_bucket_dirty_all(struct mlib_library *lib,
+				    const struct mlib_bucket *bucket)
+{
+	__mlib_bucket_dirty(lib, bucket, 0, sizeof(*bucket) +
+			    MLIB_BUCKET_STR_BYTES(bucket));
+	__mlib_bucket_dirty(lib, bucket, MLIB_BUCKET_INDEX_OFFS(bucket),
+			    MLIB_BUCKET_LENGTH(bucket) -
+			    MLIB_BUCKET_INDEX_OFFS(bucket));
+}
+
+/*
+ * Return a pointer to the index array.
  */
-uint32_t *mlib_bucket_indexes(const struct mlib_bucket *bucket)
+uint8_t *mlib_bucket_indexes(const struct mlib_bucket *bucket)
 {
 	return ((void *)bucket) + MLIB_BUCKET_INDEX_OFFS(bucket);
 }
 
+/*
+ * Return the size of an index entry in bytes: 2, 3 or 4.
+ */
+static inline uint32_t
+__mlib_bucket_index_width(const struct mlib_bucket *bucket)
+{
+	uint32_t flags = MLIB_BUCKET_FLAGS(bucket);
+
+	if (flags & MLIB_BUCKET_F_IDX16)
+		return 2;
+	if (flags & MLIB_BUCKET_F_IDX24)
+		return 3;
+	return 4;
+}
+
+/*
+ * Read and write @width byte big endian index entries.
+ */
+static inline uint32_t __mlib_read_index(const uint8_t *p, uint32_t width)
+{
+	switch (width) {
+	case 2:
+		return p[0] << 8 | p[1];
+	case 3:
+		return p[0] << 16 | p[1] << 8 | p[2];
+	default:
+		return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	}
+}
+
+static inline void __mlib_write_index(uint8_t *p, uint32_t width,
+				      uint32_t val)
+{
+	while (width--) {
+		p[width] = val;
+		val >>= 8;
+	}
+}
+
 /*
  * Compute the number of indexes in a bucket.
  */
 int mlib_bucket_nr_indexes(const struct mlib_bucket *bucket)
 {
-	return (MLIB_BUCKET_LENGTH(bucket) - MLIB_BUCKET_INDEX_OFFS(bucket)) /
-		sizeof(uint32_t);
+	return (MLIB_BUCKET_AUX_OFFS(bucket) - MLIB_BUCKET_INDEX_OFFS(bucket)) /
+		__mlib_bucket_index_width(bucket);
 }
 
 /*
@@ -81,8 +199,165 @@ int mlib_bucket_nr_indexes(const struct mlib_bucket *bucket)
  */
 uint32_t mlib_bucket_index(const struct mlib_bucket *bucket, int i)
 {
-	uint32_t *indexes = mlib_bucket_indexes(bucket);
-	return __mlib_readl(&indexes[i]);
+	uint32_t width = __mlib_bucket_index_width(bucket);
+
+	return __mlib_read_index(mlib_bucket_indexes(bucket) + i * width,
+				 width);
+}
+
+/*
+ * Set the index value at a particular offset. The value must fit.
+ */
+static void __mlib_bucket_set_index(struct mlib_bucket *bucket, int i,
+				    uint32_t val)
+{
+	uint32_t width = __mlib_bucket_index_width(bucket);
+
+	__mlib_write_index(mlib_bucket_indexes(bucket) + i * width, width,
+			   val);
+}
+
+/*
+ * Return the symbol table of a compressed bucket.
+ */
+static const struct mlib_symtab *
+__mlib_bucket_symtab(const struct mlib_bucket *bucket)
+{
+	return ((void *)bucket) + MLIB_BUCKET_LENGTH(bucket) -
+		sizeof(struct mlib_symtab);
+}
+
+/*
+ * Return the Bloom filter of the bucket. It follows the hash table, if there
+ * is one.
+ */
+static uint8_t *__mlib_bucket_bloom(const struct mlib_bucket *bucket)
+{
+	return ((void *)bucket) + MLIB_BUCKET_AUX_OFFS(bucket) +
+		MLIB_BUCKET_HASH_SLOTS(bucket) *
+		sizeof(struct mlib_bucket_hslot);
+}
+
+/*
+ * Return the search tree of the bucket. It follows the Bloom filter, if there
+ * is one.
+ */
+static struct mlib_bucket_tnode *
+__mlib_bucket_tree(const struct mlib_bucket *bucket)
+{
+	return (void *)__mlib_bucket_bloom(bucket) +
+		MLIB_BUCKET_BLOOM_BLOCKS(bucket) * MLIB_BLOOM_BLOCK;
+}
+
+/*
+ * Return the ID table of a bucket with MLIB_BUCKET_F_IDS set. It follows the
+ * search tree, if there is one, so it need not be 4 byte aligned; go through
+ * __mlib_bucket_id() and __mlib_bucket_set_id() for the entries.
+ */
+static uint8_t *__mlib_bucket_ids(const struct mlib_bucket *bucket)
+{
+	return (void *)(__mlib_bucket_tree(bucket) +
+			MLIB_BUCKET_TREE_SLOTS(bucket));
+}
+
+/*
+ * Read and write the string offset of ID @ref in the ID table.
+ */
+static inline uint32_t __mlib_bucket_id(const struct mlib_bucket *bucket,
+					uint32_t ref)
+{
+	uint32_t val;
+
+	memcpy(&val, __mlib_bucket_ids(bucket) + ref * sizeof(val),
+	       sizeof(val));
+	return be32toh(val);
+}
+
+static inline void __mlib_bucket_set_id(struct mlib_bucket *bucket,
+					uint32_t ref, uint32_t offset)
+{
+	uint32_t val = htobe32(offset);
+
+	memcpy(__mlib_bucket_ids(bucket) + ref * sizeof(val), &val,
+	       sizeof(val));
+}
+
+/*
+ * Return the bucket holding the strings that @bucket's index values refer to:
+ * .global of @lib for MLIB_BUCKET_F_REFS buckets, otherwise the bucket itself.
+ * Returns NULL if a bucket referring to .global comes without its library.
+ */
+static const struct mlib_bucket *
+__mlib_bucket_strings(const struct mlib_library *lib,
+		      const struct mlib_bucket *bucket)
+{
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS))
+		return bucket;
+
+	if (!lib) {
+		mlib_error("Bucket %p refers to .global but has no library.\n",
+			   bucket);
+		return NULL;
+	}
+	return &mlib_global_playlist(lib)->data;
+}
+
+/*
+ * Turn the index value @ref into the offset of its string in @strs, the
+ * bucket holding the strings.
+ */
+static uint32_t __mlib_bucket_ref_offset(const struct mlib_bucket *strs,
+					 uint32_t ref)
+{
+	if (MLIB_BUCKET_FLAGS(strs) & MLIB_BUCKET_F_IDS)
+		return __mlib_bucket_id(strs, ref);
+	return ref;
+}
+
+/*
+ * Return the string for the index value @ref in @strs. For compressed buckets
+ * the string is decoded into @buf, which must be MLIB_BUCKET_MAX_STR bytes
+ * long; otherwise this just points into the bucket.
+ */
+static const char *__mlib_bucket_str(const struct mlib_bucket *strs,
+				     uint32_t ref, char *buf)
+{
+	uint32_t offset = __mlib_bucket_ref_offset(strs, ref);
+
+	if (!(MLIB_BUCKET_FLAGS(strs) & MLIB_BUCKET_F_COMPRESSED))
+		return strs->strings + offset;
+
+	if (mlib_symtab_decode(__mlib_bucket_symtab(strs),
+			       strs->strings + offset, buf,
+			       MLIB_BUCKET_MAX_STR) < 0)
+		buf[0] = 0;
+	return buf;
+}
+
+/*
+ * strcmp() the string for @ref against @str without decoding the whole string
+ * first.
+ */
+static int __mlib_bucket_strcmp(const struct mlib_bucket *strs,
+				uint32_t ref, const char *str)
+{
+	uint32_t offset = __mlib_bucket_ref_offset(strs, ref);
+
+	if (MLIB_BUCKET_FLAGS(strs) & MLIB_BUCKET_F_COMPRESSED)
+		return mlib_symtab_cmp(__mlib_bucket_symtab(strs),
+				       strs->strings + offset, str);
+	return strcmp(strs->strings + offset, str);
+}
+
+/*
+ * Like __mlib_bucket_str() but decodes into a per thread buffer.
+ */
+static const char *__mlib_bucket_string_at(const struct mlib_bucket *strs,
+					   uint32_t ref)
+{
+	static __thread char buf[MLIB_BUCKET_MAX_STR];
+
+	return __mlib_bucket_str(strs, ref, buf);
 }
 
 /*
@@ -90,19 +365,77 @@ uint32_t mlib_bucket_index(const struct mlib_bucket *bucket, int i)
  * is we first compute index N then use that to find where the string is and
  * return that string.
  */
-const char *mlib_bucket_string(const struct mlib_bucket *bucket, int n)
+const char *mlib_bucket_string(const struct mlib_library *lib,
+			       const struct mlib_bucket *bucket, int n)
+{
+	return mlib_bucket_string_at(lib, bucket, mlib_bucket_index(bucket, n));
+}
+
+/*
+ * Return the string for an index value: a string offset, or an ID for .global
+ * and the playlists referring to it. Strings in compressed buckets are decoded
+ * into a per thread buffer which is overwritten by the next call to this
+ * function (or mlib_bucket_string()) from the same thread.
+ */
+const char *mlib_bucket_string_at(const struct mlib_library *lib,
+				  const struct mlib_bucket *bucket, uint32_t ref)
+{
+	const struct mlib_bucket *strs = __mlib_bucket_strings(lib, bucket);
+
+	if (!strs)
+		return NULL;
+	return __mlib_bucket_string_at(strs, ref);
+}
+
+/*
+ * Return the string with ID @id in a MLIB_BUCKET_F_IDS bucket or NULL if there
+ * is no such ID (or it was removed).
+ */
+const char *mlib_bucket_id_string(const struct mlib_bucket *bucket,
+				  uint32_t id)
 {
-	uint32_t str_offset = mlib_bucket_index(bucket, n);
-	return bucket->strings + str_offset;
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS) ||
+	    id >= MLIB_BUCKET_NEXT_ID(bucket) ||
+	    __mlib_bucket_ref_offset(bucket, id) == MLIB_BUCKET_ID_DEAD)
+		return NULL;
+	return __mlib_bucket_string_at(bucket, id);
 }
 
 /*
- * Return the string at the request string offset.
+ * Give a bucket written with the old four word header (MLIB_BUCKET_MAGIC_V0)
+ * the current one. The rest of the header is inserted in front of the
+ * strings; string offsets are relative to the strings so the 32 bit indexes
+ * stay valid as they are. Returns the bucket, which may have moved, or NULL
+ * on failure. Buckets that don't need it are returned as is.
  */
-const char *mlib_bucket_string_at(const struct mlib_bucket *bucket,
-					 uint32_t offset)
+struct mlib_bucket *mlib_bucket_upgrade(struct mlib_library *lib,
+					struct mlib_bucket *bucket)
 {
-	return bucket->strings + offset;
+	uint32_t length = sizeof(struct mlib_bucket) - MLIB_BUCKET_V0_HDR_LEN;
+	uint64_t plist_offset;
+	struct mlib_playlist *plist;
+
+	if (MLIB_BUCKET_MAGIC(bucket) != MLIB_BUCKET_MAGIC_V0)
+		return bucket;
+
+	plist = container_of(bucket, struct mlib_playlist, data);
+	plist_offset = mlib_lib_offset(lib, plist);
+	if (__mlib_library_grow_record(lib, &plist_offset,
+				       offsetof(struct mlib_playlist, data) +
+				       MLIB_BUCKET_V0_HDR_LEN, length))
+		return NULL;
+
+	plist = ((void *)lib->header) + plist_offset;
+	bucket = &plist->data;
+	MLIB_BUCKET_SET_MAGIC(bucket, MLIB_BUCKET_MAGIC_VAL);
+	MLIB_BUCKET_SET_LENGTH(bucket, MLIB_BUCKET_LENGTH(bucket) + length);
+	MLIB_BUCKET_SET_INDEX_OFFS(bucket,
+				   MLIB_BUCKET_INDEX_OFFS(bucket) + length);
+	MLIB_BUCKET_SET_AUX_OFFS(bucket, MLIB_BUCKET_LENGTH(bucket));
+
+	MLIB_PLIST_SET_LEN(plist, MLIB_PLIST_LEN(plist) + length);
+	__mlib_library_dirty(lib, plist, sizeof(*plist));
+	return bucket;
 }
 
 /*
@@ -113,153 +446,1918 @@ struct mlib_bucket *mlib_bucket_expand(struct mlib_library *lib,
 				       uint32_t length)
 {
 	uint32_t offset;
-	uint32_t bucket_offset;
+	uint64_t plist_offset;
 	struct mlib_playlist *plist;
 
+	plist = container_of(bucket, struct mlib_playlist, data);
 	offset = (((void *)bucket) + MLIB_BUCKET_INDEX_OFFS(bucket)) -
-		((void *)lib->header);
-	bucket_offset = mlib_lib_offset(lib, bucket);
+		((void *)plist);
+	plist_offset = mlib_lib_offset(lib, plist);
 
 	/*
 	 * This can potentially change the address of the mmap()'ed library
-	 * data. Thus we must save the bucket offset across this call so we can
-	 * restore the bucket pointer to what we really want.
+	 * data, or move the playlist itself. Thus we must save the playlist
+	 * offset across this call so we can restore the bucket pointer to what
+	 * we really want.
 	 */
-	if (__mlib_library_insert_space(lib, offset, length))
+	if (__mlib_library_grow_record(lib, &plist_offset, offset, length))
 		return NULL;
 
-	bucket = ((void *)lib->header) + bucket_offset;
+	plist = ((void *)lib->header) + plist_offset;
+	bucket = &plist->data;
 	MLIB_BUCKET_SET_LENGTH(bucket, MLIB_BUCKET_LENGTH(bucket) + length);
 	MLIB_BUCKET_SET_INDEX_OFFS(bucket,
 				   MLIB_BUCKET_INDEX_OFFS(bucket) + length);
+	MLIB_BUCKET_SET_AUX_OFFS(bucket,
+				 MLIB_BUCKET_AUX_OFFS(bucket) + length);
 
 	/* Update the playlist the bucket is embedded in. */
-	plist = container_of(bucket, struct mlib_playlist, data);
 	MLIB_PLIST_SET_LEN(plist, MLIB_PLIST_LEN(plist) + length);
+	__mlib_library_dirty(lib, plist, sizeof(*plist));
 
 	return bucket;
 }
 
-static const struct mlib_bucket *__cmp_bucket;
-static pthread_mutex_t __bucket_cmp_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Return the number of unused bytes between the strings and the indexes.
+ */
+static uint32_t __mlib_bucket_free_space(const struct mlib_bucket *bucket)
+{
+	return MLIB_BUCKET_INDEX_OFFS(bucket) - sizeof(struct mlib_bucket) -
+		MLIB_BUCKET_STR_BYTES(bucket);
+}
+
+static struct mlib_bucket *__mlib_bucket_compact(struct mlib_library *lib,
+						 struct mlib_bucket *bucket);
 
 /*
- * Compare function for the index list. Compares the strings that two indexes
- * point to.
+ * Return whether the index entries can still hold every string offset once
+ * the bucket is compacted. Compaction lays the live strings out in index
+ * order, so a string can end up further into the bucket than it was before;
+ * only the end of the live strings bounds where. Entries of buckets with an
+ * ID table hold IDs rather than offsets and never change.
  */
-static int __mlib_bucket_cmp_indexes(const void *a, const void *b)
+static int __mlib_bucket_compact_fits(const struct mlib_bucket *bucket)
 {
-	uint32_t ind_a, ind_b;
-	const char *str_a, *str_b;
+	uint32_t width = __mlib_bucket_index_width(bucket);
+
+	if (width == 4 || MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS)
+		return 1;
+	return !((MLIB_BUCKET_STR_BYTES(bucket) -
+		  MLIB_BUCKET_DEAD_BYTES(bucket)) >> (8 * width));
+}
+
+/*
+ * Make sure there are at least @bytes of free space in the bucket, expanding
+ * it if necessary. Growing a bucket moves everything after it in the library
+ * so buckets grow geometrically: by half their current length, but at most
+ * mlib_bucket_growth_cap bytes at a time (and never less than what is needed).
+ * A bucket filled one entry at a time thus only expands O(log n) times until
+ * it reaches the cap. If compacting the dead strings frees up enough space that
+ * is done instead, unless the compacted offsets would need wider index entries:
+ * widening them is what needs the room, so that must not recurse.
+ * MLIB_BUCKET_F_FIXED buckets live in pages of their own and never grow; for
+ * them running out of space is not an error worth reporting, the caller splits
+ * the page instead. Returns the (possibly moved) bucket or
+ * NULL on failure.
+ */
+static struct mlib_bucket *__mlib_bucket_make_room(struct mlib_library *lib,
+						   struct mlib_bucket *bucket,
+						   uint32_t bytes)
+{
+	uint32_t free_space = __mlib_bucket_free_space(bucket);
+	uint32_t grow;
+
+	if (free_space >= bytes)
+		return bucket;
+
+	if (free_space + MLIB_BUCKET_DEAD_BYTES(bucket) >= bytes &&
+	    __mlib_bucket_compact_fits(bucket))
+		return __mlib_bucket_compact(lib, bucket);
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_FIXED)
+		return NULL;
+
+	grow = MLIB_BUCKET_LENGTH(bucket) / 2;
+	if (grow > mlib_bucket_growth_cap)
+		grow = mlib_bucket_growth_cap;
+	if (grow < bytes - free_space)
+		grow = bytes - free_space;
+
+	grow += MLIB_BUCKET_GROWTH_RATE - 1;
+	grow -= grow % MLIB_BUCKET_GROWTH_RATE;
+	return mlib_bucket_expand(lib, bucket, grow);
+}
+
+/**
+ * Set the most a bucket will grow by at once when it runs out of space.
+ * Returns the previous cap. A cap of 0 restores the default.
+ *
+ * @cap		The new cap in bytes.
+ */
+uint32_t mlib_bucket_set_growth_cap(uint32_t cap)
+{
+	uint32_t old = mlib_bucket_growth_cap;
+
+	mlib_bucket_growth_cap = cap ? cap : MLIB_BUCKET_GROWTH_CAP;
+	return old;
+}
+
+/*
+ * Make sure the index array can hold @val, widening every entry to 24 or 32
+ * bits if it can't. Entries are rewritten from the front of the array (lowest
+ * address) back so each one is read before its wider copy overwrites it.
+ * Returns the (possibly moved) bucket or NULL on failure.
+ */
+static struct mlib_bucket *__mlib_bucket_index_fit(struct mlib_library *lib,
+						   struct mlib_bucket *bucket,
+						   uint32_t val)
+{
+	uint32_t old_w, new_w, nr, i, aux, flags;
+	uint8_t *base;
+
+	old_w = new_w = __mlib_bucket_index_width(bucket);
+	while (new_w < 4 && val >> (8 * new_w))
+		new_w++;
+	if (new_w == old_w)
+		return bucket;
 
-	ind_a = __mlib_readl((uint32_t *)a);
-	ind_b = __mlib_readl((uint32_t *)b);
+	nr = mlib_bucket_nr_indexes(bucket);
+	bucket = __mlib_bucket_make_room(lib, bucket, nr * (new_w - old_w));
+	if (!bucket)
+		return NULL;
 
-	str_a = mlib_bucket_string_at(__cmp_bucket, ind_a);
-	str_b = mlib_bucket_string_at(__cmp_bucket, ind_b);
+	base = (uint8_t *)bucket;
+	aux = MLIB_BUCKET_AUX_OFFS(bucket);
+	for (i = 0; i < nr; i++)
+		__mlib_write_index(base + aux - (nr - i) * new_w, new_w,
+				   __mlib_read_index(base + aux -
+						     (nr - i) * old_w, old_w));
 
-	return strcmp(str_a, str_b);
+	flags = MLIB_BUCKET_FLAGS(bucket) &
+		~(MLIB_BUCKET_F_IDX16 | MLIB_BUCKET_F_IDX24);
+	if (new_w == 3)
+		flags |= MLIB_BUCKET_F_IDX24;
+	MLIB_BUCKET_SET_FLAGS(bucket, flags);
+	MLIB_BUCKET_SET_INDEX_OFFS(bucket, aux - nr * new_w);
+	__mlib_bucket_dirty_all(lib, bucket);
+	return bucket;
 }
 
 /*
- * Compares a string to the string that an index points to.
+ * Resize the aux area at the end of the bucket from @old_len to @new_len
+ * bytes. The index array is shifted down into the free space (or back up) so
+ * that the aux area always ends at the end of the bucket. The contents of the
+ * resized aux area are left for the caller to fill in. Returns the (possibly
+ * moved) bucket or NULL on failure.
  */
-static int __mlib_bucket_cmp_str_to_ind(const void *str, const void *a)
+static struct mlib_bucket *__mlib_bucket_aux_resize(struct mlib_library *lib,
+						    struct mlib_bucket *bucket,
+						    uint32_t old_len,
+						    uint32_t new_len)
 {
-	uint32_t index;
-	const char *bucket_str;
+	void *indexes;
+	uint32_t index_bytes, delta;
+
+	if (new_len > old_len) {
+		bucket = __mlib_bucket_make_room(lib, bucket,
+						 new_len - old_len);
+		if (!bucket)
+			return NULL;
+	}
+
+	indexes = ((void *)bucket) + MLIB_BUCKET_INDEX_OFFS(bucket);
+	index_bytes = MLIB_BUCKET_AUX_OFFS(bucket) -
+		MLIB_BUCKET_INDEX_OFFS(bucket);
 
-	index = __mlib_readl((uint32_t *)a);
-	bucket_str = mlib_bucket_string_at(__cmp_bucket, index);
+	if (new_len > old_len) {
+		delta = new_len - old_len;
+		memmove(indexes - delta, indexes, index_bytes);
+		MLIB_BUCKET_SET_INDEX_OFFS(bucket,
+					   MLIB_BUCKET_INDEX_OFFS(bucket) - delta);
+		MLIB_BUCKET_SET_AUX_OFFS(bucket,
+					 MLIB_BUCKET_AUX_OFFS(bucket) - delta);
+	} else {
+		delta = old_len - new_len;
+		memmove(indexes + delta, indexes, index_bytes);
+		MLIB_BUCKET_SET_INDEX_OFFS(bucket,
+					   MLIB_BUCKET_INDEX_OFFS(bucket) + delta);
+		MLIB_BUCKET_SET_AUX_OFFS(bucket,
+					 MLIB_BUCKET_AUX_OFFS(bucket) + delta);
+	}
 
-	return strcmp(str, bucket_str);
+	/* The caller fills in the aux area; this covers that too. */
+	__mlib_bucket_dirty_all(lib, bucket);
+	return bucket;
 }
 
 /*
- * Sort the bucket. Typically used after adding an element to the bucket. This
- * must be protected by a lock so that only one thread can sort at a time due
- * to the nature of qsort.
+ * Grow the aux area by @bytes, opening up the new space @tail bytes before the
+ * end of the bucket. Whatever is in the aux area in front of that point moves
+ * down; the last @tail bytes stay put. Returns the (possibly moved) bucket or
+ * NULL on failure.
  */
-void mlib_bucket_sort(struct mlib_bucket *bucket)
+static struct mlib_bucket *__mlib_bucket_aux_grow(struct mlib_library *lib,
+						  struct mlib_bucket *bucket,
+						  uint32_t tail, uint32_t bytes)
 {
-	pthread_mutex_lock(&__bucket_cmp_mutex);
+	uint32_t aux_len = MLIB_BUCKET_LENGTH(bucket) -
+		MLIB_BUCKET_AUX_OFFS(bucket);
+	void *aux;
 
-	__cmp_bucket = bucket;
-	qsort(mlib_bucket_indexes(bucket), mlib_bucket_nr_indexes(bucket),
-	      sizeof(uint32_t), __mlib_bucket_cmp_indexes);
+	bucket = __mlib_bucket_aux_resize(lib, bucket, aux_len,
+					  aux_len + bytes);
+	if (!bucket)
+		return NULL;
 
-	pthread_mutex_unlock(&__bucket_cmp_mutex);
+	aux = ((void *)bucket) + MLIB_BUCKET_AUX_OFFS(bucket);
+	memmove(aux, aux + bytes, aux_len - tail);
+	return bucket;
 }
 
 /*
- * Check if a path is in @bucket.
- *
- * @bucket	The bucket to search.
- * @path	Path to search for.
+ * Make sure the ID table of a MLIB_BUCKET_F_IDS bucket has room for @nr more
+ * IDs. The table doubles in size when it runs out. Returns the (possibly
+ * moved) bucket or NULL on failure.
  */
-const char *mlib_bucket_contains(const struct mlib_bucket *bucket,
-				 const char *str)
+static struct mlib_bucket *__mlib_bucket_ids_reserve(struct mlib_library *lib,
+						     struct mlib_bucket *bucket,
+						     uint32_t nr)
 {
-	const char *elem = NULL;
+	uint32_t slots = MLIB_BUCKET_ID_SLOTS(bucket);
+	uint32_t need = MLIB_BUCKET_NEXT_ID(bucket) + nr, tail = 0;
 
-	if (MLIB_BUCKET_MAGIC(bucket) != MLIB_BUCKET_MAGIC_VAL) {
-		mlib_error("Invalid bucket.\n");
+	if (need <= slots)
+		return bucket;
+
+	if (slots < 16)
+		slots = 16;
+	while (slots < need)
+		slots <<= 1;
+
+	/* The new slots go at the end of the table, before the symbol table. */
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_COMPRESSED)
+		tail = sizeof(struct mlib_symtab);
+	bucket = __mlib_bucket_aux_grow(lib, bucket, tail,
+					(slots - MLIB_BUCKET_ID_SLOTS(bucket)) *
+					sizeof(uint32_t));
+	if (!bucket)
 		return NULL;
+
+	MLIB_BUCKET_SET_ID_SLOTS(bucket, slots);
+	return bucket;
+}
+
+/*
+ * Hash a string. This is 32 bit FNV-1a; it's cheap and good enough for paths.
+ */
+static uint32_t __mlib_bucket_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619;
 	}
+	return hash;
+}
+
+/*
+ * Return a pointer to the bucket's hash table. Only valid if the bucket has
+ * MLIB_BUCKET_F_HASH set.
+ */
+static struct mlib_bucket_hslot *
+__mlib_bucket_hash_table(const struct mlib_bucket *bucket)
+{
+	return ((void *)bucket) + MLIB_BUCKET_AUX_OFFS(bucket);
+}
 
-	pthread_mutex_lock(&__bucket_cmp_mutex);
-	__cmp_bucket = bucket;
-	elem = bsearch(str, mlib_bucket_indexes(bucket),
-		       mlib_bucket_nr_indexes(bucket), sizeof(uint32_t),
-		       __mlib_bucket_cmp_str_to_ind);
-	pthread_mutex_unlock(&__bucket_cmp_mutex);
+/*
+ * Put @str, whose index value is @ref, into the hash table. The table must
+ * have a free slot. Tombstones are reused. Returns the slot used.
+ */
+static struct mlib_bucket_hslot *
+__mlib_bucket_hash_insert(struct mlib_bucket *bucket, const char *str,
+			  uint32_t ref)
+{
+	uint32_t hash = __mlib_bucket_hash(str);
+	uint32_t mask = MLIB_BUCKET_HASH_SLOTS(bucket) - 1;
+	uint32_t slot = hash & mask;
+	struct mlib_bucket_hslot *table = __mlib_bucket_hash_table(bucket);
+
+	uint32_t old;
 
-	return elem;
+	while ((old = __mlib_readl(&table[slot].offset)) != 0 &&
+	       old != MLIB_BUCKET_HSLOT_DEAD)
+		slot = (slot + 1) & mask;
+
+	__mlib_writel(&table[slot].offset, ref + 1);
+	__mlib_writel(&table[slot].hash, hash);
+	return &table[slot];
 }
 
 /*
- * Insert an element into the bucket.
+ * Look @str up in the hash table; @strs is the bucket holding the strings.
+ * Returns non-zero and sets @ref to the string's index value if it is found.
  */
-int mlib_bucket_add(struct mlib_library *lib, struct mlib_bucket *bucket,
-		    const char *str)
+static int __mlib_bucket_hash_find(const struct mlib_bucket *bucket,
+				   const struct mlib_bucket *strs,
+				   const char *str, uint32_t *ref)
 {
-	uint32_t len = strlen(str) + 1;
-	void *end_of_strs, *start_of_indexes;
-	char *str_dest;
-	uint32_t *indexes;
+	uint32_t hash = __mlib_bucket_hash(str);
+	uint32_t mask = MLIB_BUCKET_HASH_SLOTS(bucket) - 1;
+	uint32_t slot = hash & mask;
+	uint32_t offset, probes = 0;
+	struct mlib_bucket_hslot *table = __mlib_bucket_hash_table(bucket);
 
-	/* Don't add duplicates. */
-	if (mlib_bucket_contains(bucket, str))
-		return -1;
+	/* Tombstones can fill every empty slot, so stop after a full lap. */
+	while ((offset = __mlib_readl(&table[slot].offset)) != 0 &&
+	       probes++ <= mask) {
+		if (offset != MLIB_BUCKET_HSLOT_DEAD &&
+		    __mlib_readl(&table[slot].hash) == hash &&
+		    __mlib_bucket_strcmp(strs, offset - 1, str) == 0) {
+			*ref = offset - 1;
+			return 1;
+		}
+		slot = (slot + 1) & mask;
+	}
 
-	/* Ensure that we have enough space. */
-restart:
-	end_of_strs = bucket->strings + MLIB_BUCKET_STR_BYTES(bucket);
-	start_of_indexes = ((void *)bucket) + MLIB_BUCKET_INDEX_OFFS(bucket);
+	return 0;
+}
 
-	if ((end_of_strs + len) >= (start_of_indexes - 4)) {
-		bucket = mlib_bucket_expand(lib, bucket,
-					    MLIB_BUCKET_GROWTH_RATE);
-		if (!bucket)
-			return -1;
-		goto restart;
+/*
+ * Replace the hash table entry for @str (index value @ref) with a tombstone.
+ * Returns the slot or NULL if there was no entry.
+ */
+static struct mlib_bucket_hslot *
+__mlib_bucket_hash_remove(struct mlib_bucket *bucket, const char *str,
+			  uint32_t ref)
+{
+	uint32_t mask = MLIB_BUCKET_HASH_SLOTS(bucket) - 1;
+	uint32_t slot = __mlib_bucket_hash(str) & mask;
+	uint32_t slot_offs, probes = 0;
+	struct mlib_bucket_hslot *table = __mlib_bucket_hash_table(bucket);
+
+	while ((slot_offs = __mlib_readl(&table[slot].offset)) != 0 &&
+	       probes++ <= mask) {
+		if (slot_offs == ref + 1) {
+			__mlib_writel(&table[slot].offset,
+				      MLIB_BUCKET_HSLOT_DEAD);
+			return &table[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/*
+ * Clear the hash table and insert every string in the bucket again. This also
+ * gets rid of any tombstones.
+ */
+static void __mlib_bucket_hash_rebuild(const struct mlib_library *lib,
+				       struct mlib_bucket *bucket)
+{
+	int i, nr_indexes;
+	uint32_t ref;
+	char buf[MLIB_BUCKET_MAX_STR];
+	const struct mlib_bucket *strs = __mlib_bucket_strings(lib, bucket);
+
+	memset(__mlib_bucket_hash_table(bucket), 0,
+	       MLIB_BUCKET_HASH_SLOTS(bucket) *
+	       sizeof(struct mlib_bucket_hslot));
+	if (!strs)
+		return;
+
+	nr_indexes = mlib_bucket_nr_indexes(bucket);
+	for (i = 0; i < nr_indexes; i++) {
+		ref = mlib_bucket_index(bucket, i);
+		__mlib_bucket_hash_insert(bucket,
+					  __mlib_bucket_str(strs, ref, buf),
+					  ref);
 	}
+}
 
-	/* We have enough space. */
-	str_dest = end_of_strs;
-	strcpy(str_dest, str);
+/*
+ * Resize the hash table to @slots slots and rehash every string in the
+ * bucket. The hash table is at the front of the aux area so it grows down into
+ * the free space; the ID table after it stays where it is. Returns the
+ * (possibly moved) bucket or NULL on failure.
+ */
+static struct mlib_bucket *__mlib_bucket_hash_resize(struct mlib_library *lib,
+						     struct mlib_bucket *bucket,
+						     uint32_t slots)
+{
+	uint32_t old_len = 0;
 
-	indexes = (uint32_t *)(start_of_indexes - 4);
-	__mlib_writel(indexes, (uint32_t)(end_of_strs -
-					  (void *)bucket->strings));
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH)
+		old_len = MLIB_BUCKET_HASH_SLOTS(bucket) *
+			sizeof(struct mlib_bucket_hslot);
 
-	MLIB_BUCKET_SET_INDEX_OFFS(bucket,
-				   MLIB_BUCKET_INDEX_OFFS(bucket) - 4);
-	MLIB_BUCKET_SET_STR_BYTES(bucket,
-				  MLIB_BUCKET_STR_BYTES(bucket) + len);
+	bucket = __mlib_bucket_aux_resize(lib, bucket, old_len,
+					  slots *
+					  sizeof(struct mlib_bucket_hslot));
+	if (!bucket)
+		return NULL;
 
-	mlib_bucket_sort(bucket);
-	return 0;
+	MLIB_BUCKET_SET_HASH_SLOTS(bucket, slots);
+	MLIB_BUCKET_SET_FLAGS(bucket,
+			      MLIB_BUCKET_FLAGS(bucket) | MLIB_BUCKET_F_HASH);
+	__mlib_bucket_hash_rebuild(lib, bucket);
+
+	return bucket;
+}
+
+/*
+ * Add a hash table to the passed bucket. From then on lookups are answered by
+ * the hash table instead of a binary search, and mlib_bucket_add() keeps the
+ * table up to date. The table is kept at most half full. Returns 0 on success
+ * (including if the bucket already has a hash table), < 0 on failure.
+ */
+int mlib_bucket_enable_hash(struct mlib_library *lib,
+			    struct mlib_bucket *bucket)
+{
+	uint32_t slots = 16;
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH)
+		return 0;
+
+	while (slots < 2 * (mlib_bucket_nr_indexes(bucket) + 1))
+		slots <<= 1;
+
+	return __mlib_bucket_hash_resize(lib, bucket, slots) ? 0 : -1;
+}
+
+/*
+ * Bloom filter counters. Every thread counts its own lookups so parallel
+ * lookups don't all write the same cache line; mlib_bucket_bloom_stats() adds
+ * the counters of every thread up, plus those of the threads that exited.
+ * Only the thread a set of counters belongs to writes it, so resetting just
+ * moves the baseline the sums are reported against.
+ */
+struct __mlib_bloom_counters {
+	struct mlib_bloom_stats	stats;
+	struct list_head	list;
+};
+
+static __thread struct __mlib_bloom_counters *mlib_bloom_mine;
+static LIST_HEAD(mlib_bloom_threads);
+static struct mlib_bloom_stats mlib_bloom_exited;
+static struct mlib_bloom_stats mlib_bloom_base;
+static pthread_mutex_t mlib_bloom_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mlib_bloom_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mlib_bloom_key;
+
+static void __mlib_bloom_add(struct mlib_bloom_stats *sum,
+			     const struct mlib_bloom_stats *stats)
+{
+	sum->checks += __atomic_load_n(&stats->checks, __ATOMIC_RELAXED);
+	sum->negatives += __atomic_load_n(&stats->negatives,
+					  __ATOMIC_RELAXED);
+	sum->false_positives += __atomic_load_n(&stats->false_positives,
+						__ATOMIC_RELAXED);
+}
+
+/*
+ * Fold the counters of an exiting thread into mlib_bloom_exited.
+ */
+static void __mlib_bloom_thread_exit(void *arg)
+{
+	struct __mlib_bloom_counters *mine = arg;
+
+	pthread_mutex_lock(&mlib_bloom_lock);
+	__mlib_bloom_add(&mlib_bloom_exited, &mine->stats);
+	list_del(&mine->list);
+	pthread_mutex_unlock(&mlib_bloom_lock);
+	free(mine);
+	mlib_bloom_mine = NULL;
+}
+
+static void __mlib_bloom_key_init(void)
+{
+	pthread_key_create(&mlib_bloom_key, __mlib_bloom_thread_exit);
+}
+
+/*
+ * Return the calling thread's counters, setting them up the first time. NULL
+ * if they can't be allocated; the thread's lookups just aren't counted then.
+ */
+static struct mlib_bloom_stats *__mlib_bloom_counters(void)
+{
+	struct __mlib_bloom_counters *mine = mlib_bloom_mine;
+
+	if (mine)
+		return &mine->stats;
+
+	pthread_once(&mlib_bloom_once, __mlib_bloom_key_init);
+	mine = calloc(1, sizeof(*mine));
+	if (!mine)
+		return NULL;
+	pthread_mutex_lock(&mlib_bloom_lock);
+	list_add(&mine->list, &mlib_bloom_threads);
+	pthread_mutex_unlock(&mlib_bloom_lock);
+	pthread_setspecific(mlib_bloom_key, mine);
+	mlib_bloom_mine = mine;
+	return &mine->stats;
+}
+
+/*
+ * Add up the counters of every thread. Call with mlib_bloom_lock held.
+ */
+static void __mlib_bloom_sum(struct mlib_bloom_stats *sum)
+{
+	struct __mlib_bloom_counters *counters;
+
+	*sum = mlib_bloom_exited;
+	list_for_each_entry(counters, &mlib_bloom_threads, list)
+		__mlib_bloom_add(sum, &counters->stats);
+}
+
+/*
+ * Count a Bloom filter event in the calling thread's counters. Other threads
+ * only ever read them, so a plain increment stored atomically is enough.
+ */
+#define __mlib_bloom_count(field)					\
+	do {								\
+		struct mlib_bloom_stats *__stats = __mlib_bloom_counters(); \
+									\
+		if (__stats)						\
+			__atomic_store_n(&__stats->field,		\
+					 __stats->field + 1,		\
+					 __ATOMIC_RELAXED);		\
+	} while (0)
+
+/*
+ * Hash a string for the Bloom filter. This is 64 bit FNV-1a so it is
+ * independent of the hash table's hash: the top half picks the block and the
+ * bottom half the bits within it.
+ */
+static uint64_t __mlib_bloom_hash(const char *str)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+ * Return the block of @bloom, which has @blocks blocks, for @hash.
+ */
+static uint8_t *__mlib_bloom_block(uint8_t *bloom, uint32_t blocks,
+				   uint64_t hash)
+{
+	return bloom + ((hash >> 32) & (blocks - 1)) * MLIB_BLOOM_BLOCK;
+}
+
+/*
+ * The bits are picked by repeatedly multiplying the bottom half of the hash by
+ * an odd constant and taking the top 9 bits, enough to address a 512 bit
+ * block.
+ */
+#define __mlib_bloom_next_bit(x)	(((x) *= 0x9e3779b1u) >> 23)
+
+static uint8_t *__mlib_bloom_set(uint8_t *bloom, uint32_t blocks,
+				 const char *str)
+{
+	uint64_t hash = __mlib_bloom_hash(str);
+	uint8_t *block = __mlib_bloom_block(bloom, blocks, hash);
+	uint32_t x = hash, bit;
+	int i;
+
+	for (i = 0; i < MLIB_BLOOM_K; i++) {
+		bit = __mlib_bloom_next_bit(x);
+		block[bit >> 3] |= 1 << (bit & 7);
+	}
+	return block;
+}
+
+/*
+ * Returns zero if @str is definitely not in the bucket, non-zero if it might
+ * be.
+ */
+static int __mlib_bucket_bloom_test(const struct mlib_bucket *bucket,
+				    const char *str)
+{
+	uint64_t hash = __mlib_bloom_hash(str);
+	uint8_t *block = __mlib_bloom_block(__mlib_bucket_bloom(bucket),
+					    MLIB_BUCKET_BLOOM_BLOCKS(bucket),
+					    hash);
+	uint32_t x = hash, bit;
+	int i;
+
+	__mlib_bloom_count(checks);
+	for (i = 0; i < MLIB_BLOOM_K; i++) {
+		bit = __mlib_bloom_next_bit(x);
+		if (!(block[bit >> 3] & (1 << (bit & 7)))) {
+			__mlib_bloom_count(negatives);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Clear the Bloom filter and add every string in the bucket again. Removed
+ * strings can't be taken out of the filter any other way.
+ */
+static void __mlib_bucket_bloom_rebuild(const struct mlib_library *lib,
+					struct mlib_bucket *bucket)
+{
+	int i, nr_indexes;
+	uint32_t blocks = MLIB_BUCKET_BLOOM_BLOCKS(bucket);
+	uint8_t *bloom = __mlib_bucket_bloom(bucket);
+	char buf[MLIB_BUCKET_MAX_STR];
+	const struct mlib_bucket *strs = __mlib_bucket_strings(lib, bucket);
+
+	memset(bloom, 0, blocks * MLIB_BLOOM_BLOCK);
+	if (!strs)
+		return;
+
+	nr_indexes = mlib_bucket_nr_indexes(bucket);
+	for (i = 0; i < nr_indexes; i++)
+		__mlib_bloom_set(bloom, blocks,
+				 __mlib_bucket_str(strs,
+						   mlib_bucket_index(bucket, i),
+						   buf));
+}
+
+/*
+ * Make sure the Bloom filter is big enough for @nr more strings, adding one if
+ * the bucket doesn't have a filter yet. The filter doubles when it gets too
+ * full; the new space is opened up right after the old filter so the hash
+ * table stays put and the tables after the filter just move down. Returns the
+ * (possibly moved) bucket or NULL on failure.
+ */
+static struct mlib_bucket *
+__mlib_bucket_bloom_reserve(struct mlib_library *lib,
+			    struct mlib_bucket *bucket, uint32_t nr)
+{
+	uint32_t old = MLIB_BUCKET_BLOOM_BLOCKS(bucket), blocks = 1, tail;
+
+	nr += mlib_bucket_nr_indexes(bucket);
+	while ((uint64_t)blocks * MLIB_BLOOM_BLOCK * 8 <
+	       (uint64_t)nr * MLIB_BLOOM_BITS)
+		blocks <<= 1;
+	if (blocks <= old && (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM))
+		return bucket;
+
+	tail = MLIB_BUCKET_LENGTH(bucket) - MLIB_BUCKET_AUX_OFFS(bucket) -
+		MLIB_BUCKET_HASH_SLOTS(bucket) *
+		sizeof(struct mlib_bucket_hslot) - old * MLIB_BLOOM_BLOCK;
+	bucket = __mlib_bucket_aux_grow(lib, bucket, tail,
+					(blocks - old) * MLIB_BLOOM_BLOCK);
+	if (!bucket)
+		return NULL;
+
+	MLIB_BUCKET_SET_BLOOM_BLOCKS(bucket, blocks);
+	MLIB_BUCKET_SET_FLAGS(bucket,
+			      MLIB_BUCKET_FLAGS(bucket) | MLIB_BUCKET_F_BLOOM);
+	__mlib_bucket_bloom_rebuild(lib, bucket);
+	return bucket;
+}
+
+/*
+ * Add a Bloom filter to the passed bucket. Lookups for strings that aren't in
+ * the bucket are then usually answered without searching it at all, which
+ * makes checking a mostly new set of paths against a big bucket much cheaper.
+ * mlib_bucket_add() keeps the filter up to date and grows it as needed.
+ * Returns 0 on success (including if the bucket already has a filter), < 0 on
+ * failure.
+ */
+int mlib_bucket_enable_bloom(struct mlib_library *lib,
+			     struct mlib_bucket *bucket)
+{
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM)
+		return 0;
+
+	return __mlib_bucket_bloom_reserve(lib, bucket, 1) ? 0 : -1;
+}
+
+/*
+ * Copy the Bloom filter counters, summed over every thread, into @stats.
+ * Lookups running at the same time may or may not be counted yet.
+ */
+void mlib_bucket_bloom_stats(struct mlib_bloom_stats *stats)
+{
+	struct mlib_bloom_stats sum;
+
+	pthread_mutex_lock(&mlib_bloom_lock);
+	__mlib_bloom_sum(&sum);
+	stats->checks = sum.checks - mlib_bloom_base.checks;
+	stats->negatives = sum.negatives - mlib_bloom_base.negatives;
+	stats->false_positives = sum.false_positives -
+		mlib_bloom_base.false_positives;
+	pthread_mutex_unlock(&mlib_bloom_lock);
+}
+
+/*
+ * Zero the Bloom filter counters.
+ */
+void mlib_bucket_bloom_stats_reset(void)
+{
+	pthread_mutex_lock(&mlib_bloom_lock);
+	__mlib_bloom_sum(&mlib_bloom_base);
+	pthread_mutex_unlock(&mlib_bloom_lock);
+}
+
+/*
+ * Load 8 bytes of a search tree key as a number that orders like the bytes.
+ */
+static uint64_t __mlib_tree_key(const uint8_t *key)
+{
+	uint64_t val;
+
+	memcpy(&val, key, sizeof(val));
+	return be64toh(val);
+}
+
+/*
+ * Length of the common prefix of @a and @b.
+ */
+static uint32_t __mlib_common_prefix(const char *a, const char *b)
+{
+	uint32_t n = 0;
+
+	while (a[n] && a[n] == b[n])
+		n++;
+	return n;
+}
+
+/*
+ * Fill in @node for the sorted index @pos. The node's subtree holds the
+ * indexes [@first, @end). A string looked up under the node sorts between the
+ * indexes @first - 1 and @end, so it shares the prefix those two have in
+ * common, and the key starts right after that prefix. At the edges of the
+ * tree there is no string on one side; the subtree's own first or last string
+ * is used instead. Only strings with that prefix can be found under the node,
+ * so that is still safe.
+ */
+static void __mlib_bucket_tnode_set(struct mlib_bucket_tnode *node,
+				    const struct mlib_bucket *bucket,
+				    const struct mlib_bucket *strs,
+				    int pos, int first, int end)
+{
+	uint32_t ref = mlib_bucket_index(bucket, pos), offs;
+	char buf[MLIB_BUCKET_MAX_STR], lo[MLIB_BUCKET_MAX_STR];
+	char hi[MLIB_BUCKET_MAX_STR];
+	const char *str;
+
+	if (first > 0)
+		first--;
+	if (end == mlib_bucket_nr_indexes(bucket))
+		end--;
+	offs = __mlib_common_prefix(
+		__mlib_bucket_str(strs, mlib_bucket_index(bucket, first), lo),
+		__mlib_bucket_str(strs, mlib_bucket_index(bucket, end), hi));
+
+	str = __mlib_bucket_str(strs, ref, buf);
+	memset(node->key, 0, MLIB_TREE_KEY_LEN);
+	memcpy(node->key, str + offs,
+	       strnlen(str + offs, MLIB_TREE_KEY_LEN));
+	__mlib_writel(&node->ref, ref);
+	__mlib_writel(&node->offs, offs);
+}
+
+/*
+ * Fill the subtree rooted at node @k with the sorted indexes starting at
+ * @first. Returns the index after the last one placed.
+ */
+static int __mlib_bucket_tree_fill(struct mlib_bucket_tnode *tree,
+				   const struct mlib_bucket *bucket,
+				   const struct mlib_bucket *strs,
+				   uint32_t nr, uint32_t k, int first)
+{
+	int pos, end;
+
+	if (k > nr)
+		return first;
+
+	pos = __mlib_bucket_tree_fill(tree, bucket, strs, nr, 2 * k, first);
+	end = __mlib_bucket_tree_fill(tree, bucket, strs, nr, 2 * k + 1,
+				      pos + 1);
+	__mlib_bucket_tnode_set(&tree[k], bucket, strs, pos, first, end);
+	return end;
+}
+
+/*
+ * Look @str, which is @len bytes long, up in the search tree; @strs is the
+ * bucket holding the strings. @len must be less than MLIB_BUCKET_MAX_STR.
+ * Nodes are compared on their inline keys and only strings that match a key
+ * are read. At the edges of the tree @str may not have the prefix a node's key
+ * skips; it then can't be in the subtree and the compares only lead to a miss
+ * since matches are always checked against the string. The children of node
+ * k are 2k and 2k + 1, so the nodes four levels down sit next to each other
+ * and can be prefetched while the levels in between are searched. Returns
+ * non-zero and sets @ref if the string is found.
+ */
+static int __mlib_bucket_tree_find(const struct mlib_bucket *bucket,
+				   const struct mlib_bucket *strs,
+				   const char *str, size_t len, uint32_t *ref)
+{
+	const struct mlib_bucket_tnode *tree = __mlib_bucket_tree(bucket);
+	uint32_t nr = mlib_bucket_nr_indexes(bucket), k = 1, offs, w;
+	char buf[MLIB_BUCKET_MAX_STR + MLIB_TREE_KEY_LEN];
+	uint64_t want, key;
+	int cmp;
+
+	/* Pad the string so a key can be loaded at any offset into it. */
+	memcpy(buf, str, len);
+	memset(buf + len, 0, MLIB_TREE_KEY_LEN);
+
+	while (k <= nr) {
+		__builtin_prefetch(tree + 16 * (size_t)k);
+		offs = __mlib_readl(&tree[k].offs);
+		if (offs > len)
+			break;
+
+		/* Compare the key 8 bytes at a time. */
+		for (w = 0; w < MLIB_TREE_KEY_LEN; w += sizeof(uint64_t)) {
+			want = __mlib_tree_key((const uint8_t *)buf + offs + w);
+			key = __mlib_tree_key(tree[k].key + w);
+			if (key != want)
+				break;
+		}
+		if (key != want)
+			cmp = key < want ? -1 : 1;
+		else
+			cmp = __mlib_bucket_strcmp(strs,
+						   __mlib_readl(&tree[k].ref),
+						   str);
+		if (!cmp) {
+			*ref = __mlib_readl(&tree[k].ref);
+			return 1;
+		}
+		k = 2 * k + (cmp < 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Rebuild the search tree if the bucket has an up to date one. Used after the
+ * index values change underneath it.
+ */
+static void __mlib_bucket_tree_refresh(const struct mlib_library *lib,
+				       struct mlib_bucket *bucket)
+{
+	const struct mlib_bucket *strs;
+
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_TREE))
+		return;
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (strs)
+		__mlib_bucket_tree_fill(__mlib_bucket_tree(bucket), bucket,
+					strs, mlib_bucket_nr_indexes(bucket),
+					1, 0);
+}
+
+/*
+ * Build a search tree over the sorted indexes. The index array is laid out
+ * for a binary search but each probe has to go to the string itself, which is
+ * somewhere else in the bucket, so a lookup takes a cache miss or two per
+ * level. The tree keeps a few bytes of every string inline with its index
+ * value, starting past the prefix shared by everything under the node, and
+ * stores the nodes in breadth first (Eytzinger) order. The top of the tree
+ * stays cached and most levels only touch the tree itself.
+ *
+ * The tree is a snapshot: adding or removing strings marks it out of date and
+ * lookups go back to the binary search until the tree is built again. That
+ * makes it a good fit for buckets that are filled once and then mostly read.
+ * Returns 0 on success, < 0 on failure.
+ */
+int mlib_bucket_build_tree(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	uint32_t need = mlib_bucket_nr_indexes(bucket) + 1;
+	uint32_t slots = MLIB_BUCKET_TREE_SLOTS(bucket), old = slots, tail;
+
+	if (need > old) {
+		if (slots < 16)
+			slots = 16;
+		while (slots < need)
+			slots <<= 1;
+
+		/* Open up the new nodes right after the old ones. */
+		tail = MLIB_BUCKET_LENGTH(bucket) -
+			((void *)(__mlib_bucket_tree(bucket) + old) -
+			 (void *)bucket);
+		bucket = __mlib_bucket_aux_grow(lib, bucket, tail,
+						(slots - old) *
+						sizeof(struct mlib_bucket_tnode));
+		if (!bucket)
+			return -1;
+		MLIB_BUCKET_SET_TREE_SLOTS(bucket, slots);
+	}
+
+	if (!__mlib_bucket_strings(lib, bucket))
+		return -1;
+
+	MLIB_BUCKET_SET_FLAGS(bucket,
+			      MLIB_BUCKET_FLAGS(bucket) | MLIB_BUCKET_F_TREE);
+	__mlib_bucket_tree_refresh(lib, bucket);
+	__mlib_bucket_dirty_all(lib, bucket);
+	return 0;
+}
+
+/*
+ * Mark the search tree out of date.
+ */
+static void __mlib_bucket_tree_stale(struct mlib_bucket *bucket)
+{
+	MLIB_BUCKET_SET_FLAGS(bucket,
+			      MLIB_BUCKET_FLAGS(bucket) & ~MLIB_BUCKET_F_TREE);
+}
+
+/*
+ * Make sure @nr more strings taking up @str_bytes bytes in total (including
+ * their terminators) can be added to the bucket without it having to grow.
+ * If the bucket is hashed the hash table is sized for them as well. Callers
+ * that know how much they are about to add should use this so the bucket is
+ * expanded once instead of many times. Buckets referring to .global only need
+ * room for the IDs. Returns 0 on success, < 0 on failure.
+ */
+int mlib_bucket_reserve(struct mlib_library *lib, struct mlib_bucket *bucket,
+			uint32_t nr, uint32_t str_bytes)
+{
+	uint32_t slots, need;
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS)
+		str_bytes = 0;
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH) {
+		slots = MLIB_BUCKET_HASH_SLOTS(bucket);
+		need = 2 * (mlib_bucket_nr_indexes(bucket) + nr);
+		while (slots < need)
+			slots <<= 1;
+		if (slots != MLIB_BUCKET_HASH_SLOTS(bucket)) {
+			bucket = __mlib_bucket_hash_resize(lib, bucket, slots);
+			if (!bucket)
+				return -1;
+		}
+	}
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM) {
+		bucket = __mlib_bucket_bloom_reserve(lib, bucket, nr);
+		if (!bucket)
+			return -1;
+	}
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS) {
+		bucket = __mlib_bucket_ids_reserve(lib, bucket, nr);
+		if (!bucket)
+			return -1;
+	}
+
+	bucket = __mlib_bucket_make_room(lib, bucket,
+					 str_bytes + nr *
+					 __mlib_bucket_index_width(bucket));
+	return bucket ? 0 : -1;
+}
+
+struct __mlib_bucket_sort_arg {
+	const struct mlib_bucket	*strs;
+	uint32_t			 width;
+};
+
+/*
+ * Compare function for the index list. Compares the strings that two indexes
+ * point to. The bucket holding the strings and the index width are passed in
+ * through qsort_r()'s argument so there is no shared state between callers.
+ */
+static int __mlib_bucket_cmp_indexes(const void *a, const void *b, void *arg)
+{
+	const struct __mlib_bucket_sort_arg *sort = arg;
+	uint32_t ind_a, ind_b;
+	const char *str_a;
+	char buf[MLIB_BUCKET_MAX_STR];
+
+	ind_a = __mlib_read_index(a, sort->width);
+	ind_b = __mlib_read_index(b, sort->width);
+
+	str_a = __mlib_bucket_str(sort->strs, ind_a, buf);
+	return -__mlib_bucket_strcmp(sort->strs, ind_b, str_a);
+}
+
+/*
+ * Sort the bucket. Only needed when the index array has been filled in out of
+ * order; mlib_bucket_add() keeps the indexes sorted on its own. This is
+ * reentrant so different buckets can be sorted concurrently. For big buckets
+ * mlib_bucket_rebuild() is much faster.
+ */
+void mlib_bucket_sort(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	struct __mlib_bucket_sort_arg sort;
+
+	sort.strs = __mlib_bucket_strings(lib, bucket);
+	sort.width = __mlib_bucket_index_width(bucket);
+	if (!sort.strs)
+		return;
+	qsort_r(mlib_bucket_indexes(bucket), mlib_bucket_nr_indexes(bucket),
+		sort.width, __mlib_bucket_cmp_indexes, &sort);
+	__mlib_bucket_dirty_all(lib, bucket);
+}
+
+/*
+ * Find the slot in the sorted index array where @str belongs: that is the
+ * first index whose string does not compare less than @str. If @found is not
+ * NULL it is set to non-zero when the string at that slot is @str itself.
+ * @strs is the bucket holding the strings.
+ *
+ * This only reads the bucket so any number of threads may search the same
+ * bucket at once.
+ */
+static int __mlib_bucket_search(const struct mlib_bucket *bucket,
+				const struct mlib_bucket *strs,
+				const char *str, int *found)
+{
+	int lo = 0, hi, mid, cmp;
+	int nr_indexes = mlib_bucket_nr_indexes(bucket);
+
+	hi = nr_indexes;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		cmp = __mlib_bucket_strcmp(strs,
+					   mlib_bucket_index(bucket, mid), str);
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (found)
+		*found = lo < nr_indexes &&
+			__mlib_bucket_strcmp(strs,
+					     mlib_bucket_index(bucket, lo),
+					     str) == 0;
+	return lo;
+}
+
+/*
+ * Find @str in @bucket with the hash table if it has one, then the search
+ * tree, otherwise with a binary search. If the bucket has a Bloom filter that
+ * is checked first.
+ * Returns non-zero and sets @ref to its index value if found.
+ */
+static int __mlib_bucket_find(const struct mlib_bucket *bucket,
+			      const struct mlib_bucket *strs, const char *str,
+			      uint32_t *ref)
+{
+	int pos, found;
+	int bloom = MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM;
+	size_t len;
+
+	if (bloom && !__mlib_bucket_bloom_test(bucket, str))
+		return 0;
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH) {
+		found = __mlib_bucket_hash_find(bucket, strs, str, ref);
+	} else if ((MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_TREE) &&
+		   (len = strlen(str)) < MLIB_BUCKET_MAX_STR) {
+		found = __mlib_bucket_tree_find(bucket, strs, str, len, ref);
+	} else {
+		pos = __mlib_bucket_search(bucket, strs, str, &found);
+		if (found)
+			*ref = mlib_bucket_index(bucket, pos);
+	}
+
+	if (bloom && !found)
+		__mlib_bloom_count(false_positives);
+	return found;
+}
+
+/*
+ * Check if a path is in @bucket. Returns a pointer to the bucket's copy of the
+ * string or NULL if it is not present. Lookups take no locks; they may run
+ * concurrently with each other but not with writers to the same bucket.
+ *
+ * @lib		The library the bucket is in.
+ * @bucket	The bucket to search.
+ * @path	Path to search for.
+ */
+const char *mlib_bucket_contains(const struct mlib_library *lib,
+				 const struct mlib_bucket *bucket,
+				 const char *str)
+{
+	uint32_t ref;
+	const struct mlib_bucket *strs;
+
+	if (MLIB_BUCKET_MAGIC(bucket) != MLIB_BUCKET_MAGIC_VAL) {
+		mlib_error("Invalid bucket.\n");
+		return NULL;
+	}
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs || !__mlib_bucket_find(bucket, strs, str, &ref))
+		return NULL;
+
+	return __mlib_bucket_string_at(strs, ref);
+}
+
+/*
+ * Look up the ID of @str: in .global this is the string's media ID, in the
+ * other playlists the .global ID it refers to. Returns 0 and sets @id if @str
+ * is in the bucket, < 0 otherwise.
+ *
+ * @lib		The library the bucket is in.
+ * @bucket	The bucket to search.
+ * @str		String to search for.
+ * @id		Set to the ID.
+ */
+int mlib_bucket_find_id(const struct mlib_library *lib,
+			const struct mlib_bucket *bucket, const char *str,
+			uint32_t *id)
+{
+	const struct mlib_bucket *strs;
+
+	if (!(MLIB_BUCKET_FLAGS(bucket) &
+	      (MLIB_BUCKET_F_IDS | MLIB_BUCKET_F_REFS)))
+		return -1;
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs || !__mlib_bucket_find(bucket, strs, str, id))
+		return -1;
+	return 0;
+}
+
+/*
+ * Make a plain bucket, as written before paths were interned, into .global:
+ * each string gets the ID of its slot in the index array, so the index array
+ * is still sorted. Only buckets with no flags at all can be converted.
+ * Returns 0 on success, < 0 on failure.
+ */
+int mlib_bucket_assign_ids(struct mlib_library *lib,
+			   struct mlib_bucket *bucket)
+{
+	uint32_t i, nr = mlib_bucket_nr_indexes(bucket);
+
+	if (MLIB_BUCKET_FLAGS(bucket)) {
+		mlib_error("Bucket %p already has flags.\n", bucket);
+		return -1;
+	}
+
+	bucket = __mlib_bucket_aux_grow(lib, bucket, 0, nr * sizeof(uint32_t));
+	if (!bucket)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		__mlib_bucket_set_id(bucket, i, mlib_bucket_index(bucket, i));
+		__mlib_bucket_set_index(bucket, i, i);
+	}
+	MLIB_BUCKET_SET_ID_SLOTS(bucket, nr);
+	MLIB_BUCKET_SET_NEXT_ID(bucket, nr);
+	MLIB_BUCKET_SET_FLAGS(bucket, MLIB_BUCKET_F_IDS);
+	__mlib_bucket_dirty_all(lib, bucket);
+	return 0;
+}
+
+/*
+ * Make a plain bucket refer to .global instead of holding its own strings.
+ * .global must hold every one of them already. The strings are left behind
+ * as free space; mlib_bucket_trim() gives it back. Returns 0 on success, < 0
+ * on failure.
+ */
+int mlib_bucket_make_refs(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	const struct mlib_bucket *global = &mlib_global_playlist(lib)->data;
+	uint32_t i, id, nr = mlib_bucket_nr_indexes(bucket);
+	const char *str;
+
+	if (MLIB_BUCKET_FLAGS(bucket)) {
+		mlib_error("Bucket %p already has flags.\n", bucket);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		str = bucket->strings + mlib_bucket_index(bucket, i);
+		if (mlib_bucket_find_id(lib, global, str, &id)) {
+			mlib_error("'%s' is not in .global.\n", str);
+			return -1;
+		}
+		__mlib_bucket_set_index(bucket, i, id);
+	}
+	MLIB_BUCKET_SET_STR_BYTES(bucket, 0);
+	MLIB_BUCKET_SET_DEAD_BYTES(bucket, 0);
+	MLIB_BUCKET_SET_FLAGS(bucket, MLIB_BUCKET_F_REFS);
+	__mlib_bucket_dirty_all(lib, bucket);
+	return 0;
+}
+
+/*
+ * Compare the string for @ref against the first @len bytes of @prefix, like
+ * strncmp().
+ */
+static int __mlib_bucket_prefix_cmp(const struct mlib_bucket *strs,
+				    uint32_t ref, const char *prefix,
+				    size_t len)
+{
+	char buf[MLIB_BUCKET_MAX_STR];
+
+	return mlib_prefix_cmp(__mlib_bucket_str(strs, ref, buf), prefix, len);
+}
+
+/*
+ * Return the first index in [@lo, @hi) whose string compares greater than
+ * @prefix, or greater than or equal to it if @or_equal is set. Since the
+ * indexes are sorted all strings starting with @prefix are next to each other.
+ */
+static int __mlib_bucket_prefix_search(const struct mlib_bucket *bucket,
+				       const struct mlib_bucket *strs,
+				       const char *prefix, size_t len,
+				       int lo, int hi, int or_equal)
+{
+	int mid, cmp;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		cmp = __mlib_bucket_prefix_cmp(strs,
+					       mlib_bucket_index(bucket, mid),
+					       prefix, len);
+		if (cmp < 0 || (cmp == 0 && !or_equal))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Find the strings in @bucket that start with @prefix; e.g a prefix of
+ * "music/rock/" finds everything under that directory. Matches occupy the
+ * contiguous index range [@first, @last] which can be read with
+ * mlib_bucket_string(). Returns the number of matches; when there are none
+ * @first is where a string starting with @prefix would go and @last is
+ * @first - 1, or < 0 on error. Like mlib_bucket_contains() this takes no
+ * locks.
+ *
+ * @lib		The library the bucket is in.
+ * @bucket	The bucket to search.
+ * @prefix	Prefix to look for. An empty prefix matches every string.
+ * @first	Set to the first matching index.
+ * @last	Set to the last matching index.
+ */
+int mlib_bucket_prefix_range(const struct mlib_library *lib,
+			     const struct mlib_bucket *bucket,
+			     const char *prefix, int *first, int *last)
+{
+	int nr = mlib_bucket_nr_indexes(bucket);
+	size_t len = strlen(prefix);
+	int lo, hi;
+	const struct mlib_bucket *strs = __mlib_bucket_strings(lib, bucket);
+
+	if (!strs)
+		return -1;
+
+	lo = __mlib_bucket_prefix_search(bucket, strs, prefix, len, 0, nr, 1);
+	hi = __mlib_bucket_prefix_search(bucket, strs, prefix, len, lo, nr, 0);
+
+	*first = lo;
+	*last = hi - 1;
+	return hi - lo;
+}
+
+/*
+ * Insert @str into the bucket with its index at slot @pos. Only the indexes in
+ * front of that slot are shifted down by one to make room: since the index
+ * array grows backwards the new array starts one entry before the old one, so
+ * indexes past the insertion point never have to move.
+ *
+ * In .global the string gets the next ID. Other playlists only store the ID of
+ * the string in .global, so the string has to be added there first and adding
+ * it here is a fixed size write.
+ */
+static int __mlib_bucket_insert(struct mlib_library *lib,
+				struct mlib_bucket *bucket,
+				const struct mlib_bucket *strs,
+				const char *str, int pos)
+{
+	uint32_t len = strlen(str) + 1;
+	uint32_t slots, offset = 0, ref = 0, width;
+	void *end_of_strs;
+	uint8_t *indexes;
+	struct mlib_bucket_hslot *hslot;
+	const char *data = str;
+	char enc[2 * MLIB_BUCKET_MAX_STR];
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS) {
+		if (!__mlib_bucket_find(strs, strs, str, &ref)) {
+			mlib_error("'%s' is not in .global.\n", str);
+			return -1;
+		}
+		len = 0;
+	} else if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_COMPRESSED) {
+		if (len > MLIB_BUCKET_MAX_STR) {
+			mlib_error("String too long for compressed bucket.\n");
+			return -1;
+		}
+		len = mlib_symtab_encode(__mlib_bucket_symtab(bucket), str,
+					 enc, sizeof(enc)) + 1;
+		data = enc;
+	}
+
+	/* Keep the hash table, if there is one, at most half full. */
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH) {
+		slots = MLIB_BUCKET_HASH_SLOTS(bucket);
+		if (2 * (mlib_bucket_nr_indexes(bucket) + 1) > slots) {
+			bucket = __mlib_bucket_hash_resize(lib, bucket,
+							   slots << 1);
+			if (!bucket)
+				return -1;
+		}
+	}
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM) {
+		bucket = __mlib_bucket_bloom_reserve(lib, bucket, 1);
+		if (!bucket)
+			return -1;
+	}
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS) {
+		bucket = __mlib_bucket_ids_reserve(lib, bucket, 1);
+		if (!bucket)
+			return -1;
+	}
+
+	/*
+	 * Widen the indexes if the new one won't fit: .global IDs grow by one,
+	 * offsets by at most the string itself.
+	 */
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS)
+		bucket = __mlib_bucket_index_fit(lib, bucket,
+						 MLIB_BUCKET_NEXT_ID(bucket));
+	else if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS))
+		bucket = __mlib_bucket_index_fit(lib, bucket,
+						 MLIB_BUCKET_STR_BYTES(bucket));
+	else
+		bucket = __mlib_bucket_index_fit(lib, bucket, ref);
+	if (!bucket)
+		return -1;
+
+	/* Ensure that we have enough space. */
+	width = __mlib_bucket_index_width(bucket);
+	bucket = __mlib_bucket_make_room(lib, bucket, len + width);
+	if (!bucket)
+		return -1;
+
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS)) {
+		end_of_strs = bucket->strings + MLIB_BUCKET_STR_BYTES(bucket);
+		offset = end_of_strs - (void *)bucket->strings;
+		memcpy(end_of_strs, data, len);
+		__mlib_library_dirty(lib, end_of_strs, len);
+		MLIB_BUCKET_SET_STR_BYTES(bucket,
+					  MLIB_BUCKET_STR_BYTES(bucket) + len);
+		ref = offset;
+	}
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS) {
+		ref = MLIB_BUCKET_NEXT_ID(bucket);
+		__mlib_bucket_set_id(bucket, ref, offset);
+		__mlib_library_dirty(lib, __mlib_bucket_ids(bucket) +
+				     ref * sizeof(uint32_t), sizeof(uint32_t));
+		MLIB_BUCKET_SET_NEXT_ID(bucket, ref + 1);
+	}
+
+	indexes = mlib_bucket_indexes(bucket) - width;
+	memmove(indexes, indexes + width, pos * width);
+	__mlib_write_index(indexes + pos * width, width, ref);
+	__mlib_library_dirty(lib, indexes, (pos + 1) * width);
+	MLIB_BUCKET_SET_INDEX_OFFS(bucket,
+				   MLIB_BUCKET_INDEX_OFFS(bucket) - width);
+	__mlib_bucket_tree_stale(bucket);
+	__mlib_bucket_dirty(lib, bucket, 0, sizeof(*bucket));
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH) {
+		hslot = __mlib_bucket_hash_insert(bucket, str, ref);
+		__mlib_library_dirty(lib, hslot, sizeof(*hslot));
+	}
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM)
+		__mlib_library_dirty(lib,
+				     __mlib_bloom_set(__mlib_bucket_bloom(bucket),
+						      MLIB_BUCKET_BLOOM_BLOCKS(bucket),
+						      str),
+				     MLIB_BLOOM_BLOCK);
+
+	return 0;
+}
+
+/*
+ * Insert an element into the bucket. The index array is kept sorted by
+ * finding the new string's slot with a binary search.
+ */
+int mlib_bucket_add(struct mlib_library *lib, struct mlib_bucket *bucket,
+		    const char *str)
+{
+	const struct mlib_bucket *strs;
+	int pos, found;
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs)
+		return -1;
+
+	/* Don't add duplicates. */
+	pos = __mlib_bucket_search(bucket, strs, str, &found);
+	if (found)
+		return -1;
+
+	return __mlib_bucket_insert(lib, bucket, strs, str, pos);
+}
+
+/*
+ * Add @str to the front of the index array without searching for its slot, so
+ * nothing has to move. This is for bulk loads: the caller makes sure @str is
+ * not in the bucket yet and calls mlib_bucket_rebuild() once done. Until then
+ * lookups in the bucket (and, for .global, adds to the playlists referring to
+ * it) give wrong answers.
+ */
+int mlib_bucket_append(struct mlib_library *lib, struct mlib_bucket *bucket,
+		       const char *str)
+{
+	const struct mlib_bucket *strs;
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs)
+		return -1;
+
+	return __mlib_bucket_insert(lib, bucket, strs, str, 0);
+}
+
+/*
+ * Sort the index array from scratch with the parallel radix sort in sort.c,
+ * using up to @nr_threads threads (0 for one per CPU). This is the way to
+ * finish a bulk load done with mlib_bucket_append() and is much faster than
+ * mlib_bucket_sort() on big buckets. Compressed strings are decoded once up
+ * front. Returns 0 on success, < 0 on failure or if a string is in the bucket
+ * twice; the index is sorted either way.
+ */
+int mlib_bucket_rebuild(struct mlib_library *lib, struct mlib_bucket *bucket,
+			int nr_threads)
+{
+	int i, nr, ret = -1;
+	uint32_t bytes = 0;
+	const struct mlib_bucket *strs;
+	struct mlib_sort_ent *ents;
+	char *plain = NULL, buf[MLIB_BUCKET_MAX_STR];
+	const char *str;
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs)
+		return -1;
+
+	nr = mlib_bucket_nr_indexes(bucket);
+	ents = malloc((nr + 1) * sizeof(*ents));
+	if (!ents)
+		return -1;
+
+	if (MLIB_BUCKET_FLAGS(strs) & MLIB_BUCKET_F_COMPRESSED) {
+		for (i = 0; i < nr; i++) {
+			str = __mlib_bucket_str(strs, mlib_bucket_index(bucket, i),
+						buf);
+			bytes += strlen(str) + 1;
+		}
+		plain = malloc(bytes + 1);
+		if (!plain)
+			goto done;
+		bytes = 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ents[i].ref = mlib_bucket_index(bucket, i);
+		str = __mlib_bucket_str(strs, ents[i].ref, buf);
+		if (plain) {
+			strcpy(plain + bytes, str);
+			str = plain + bytes;
+			bytes += strlen(str) + 1;
+		}
+		ents[i].str = str;
+	}
+
+	if (mlib_sort_strings(ents, nr, nr_threads))
+		goto done;
+
+	ret = 0;
+	for (i = 0; i < nr; i++) {
+		__mlib_bucket_set_index(bucket, i, ents[i].ref);
+		if (i && strcmp(ents[i - 1].str, ents[i].str) == 0) {
+			mlib_error("'%s' is in the bucket twice.\n",
+				   ents[i].str);
+			ret = -1;
+		}
+	}
+	__mlib_bucket_tree_refresh(lib, bucket);
+	__mlib_bucket_dirty_all(lib, bucket);
+
+done:
+	free(plain);
+	free(ents);
+	return ret;
+}
+
+/*
+ * Remove @str from the bucket. The string is found with a binary search and
+ * its index is dropped by shifting the indexes in front of it up by one, the
+ * reverse of mlib_bucket_add(). The string bytes themselves stay where they
+ * are and are only counted as dead; nothing outside of the bucket moves. Once
+ * too much of the bucket is dead the strings are compacted. Returns 0 on
+ * success, < 0 if @str is not in the bucket.
+ *
+ * A string removed from .global must not be referred to by any other playlist;
+ * mlib_remove_path() takes care of that.
+ */
+int mlib_bucket_remove(struct mlib_library *lib, struct mlib_bucket *bucket,
+		       const char *str)
+{
+	uint32_t ref, offset, len, dead, str_bytes, width;
+	uint8_t *indexes;
+	const struct mlib_bucket *strs;
+	struct mlib_bucket_hslot *hslot;
+	int pos, found;
+
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs)
+		return -1;
+
+	pos = __mlib_bucket_search(bucket, strs, str, &found);
+	if (!found)
+		return -1;
+
+	ref = mlib_bucket_index(bucket, pos);
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH) {
+		hslot = __mlib_bucket_hash_remove(bucket, str, ref);
+		if (hslot)
+			__mlib_library_dirty(lib, hslot, sizeof(*hslot));
+	}
+
+	width = __mlib_bucket_index_width(bucket);
+	indexes = mlib_bucket_indexes(bucket);
+	memmove(indexes + width, indexes, pos * width);
+	__mlib_library_dirty(lib, indexes, (pos + 1) * width);
+	MLIB_BUCKET_SET_INDEX_OFFS(bucket,
+				   MLIB_BUCKET_INDEX_OFFS(bucket) + width);
+	__mlib_bucket_tree_stale(bucket);
+	__mlib_bucket_dirty(lib, bucket, 0, sizeof(*bucket));
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS)
+		return 0;
+
+	offset = __mlib_bucket_ref_offset(bucket, ref);
+	len = strlen(bucket->strings + offset) + 1;
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS) {
+		__mlib_bucket_set_id(bucket, ref, MLIB_BUCKET_ID_DEAD);
+		__mlib_library_dirty(lib, __mlib_bucket_ids(bucket) +
+				     ref * sizeof(uint32_t), sizeof(uint32_t));
+	}
+
+	/* The last string added can just be handed back to the free space. */
+	str_bytes = MLIB_BUCKET_STR_BYTES(bucket);
+	if (offset + len == str_bytes) {
+		MLIB_BUCKET_SET_STR_BYTES(bucket, str_bytes - len);
+		return 0;
+	}
+
+	dead = MLIB_BUCKET_DEAD_BYTES(bucket) + len;
+	MLIB_BUCKET_SET_DEAD_BYTES(bucket, dead);
+
+	if (dead > MLIB_BUCKET_GROWTH_RATE &&
+	    dead > (str_bytes >> MLIB_BUCKET_DEAD_SHIFT))
+		mlib_bucket_compact(lib, bucket);
+
+	return 0;
+}
+
+/*
+ * Move the upper half of the entries of a bucket that refers to .global into
+ * the empty bucket @dst, which must have the same flags and be at least as
+ * big. Used to split full B+tree leaves. Returns 0 on success, < 0 if the
+ * buckets don't qualify.
+ */
+int mlib_bucket_split(struct mlib_library *lib, struct mlib_bucket *bucket,
+		      struct mlib_bucket *dst)
+{
+	uint32_t width, nr, keep, aux;
+	uint8_t *indexes;
+
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS) ||
+	    mlib_bucket_nr_indexes(dst) ||
+	    MLIB_BUCKET_LENGTH(dst) < MLIB_BUCKET_LENGTH(bucket))
+		return -1;
+
+	width = __mlib_bucket_index_width(bucket);
+	nr = mlib_bucket_nr_indexes(bucket);
+	keep = nr / 2;
+
+	MLIB_BUCKET_SET_FLAGS(dst, MLIB_BUCKET_FLAGS(bucket));
+	aux = MLIB_BUCKET_AUX_OFFS(dst);
+	MLIB_BUCKET_SET_INDEX_OFFS(dst, aux - (nr - keep) * width);
+	indexes = mlib_bucket_indexes(bucket);
+	memcpy(mlib_bucket_indexes(dst), indexes + keep * width,
+	       (nr - keep) * width);
+
+	/* The entries kept have to end up against the aux area. */
+	aux = MLIB_BUCKET_AUX_OFFS(bucket);
+	memmove((uint8_t *)bucket + aux - keep * width, indexes, keep * width);
+	MLIB_BUCKET_SET_INDEX_OFFS(bucket, aux - keep * width);
+
+	__mlib_bucket_tree_stale(bucket);
+	__mlib_bucket_tree_stale(dst);
+	__mlib_bucket_dirty_all(lib, bucket);
+	__mlib_bucket_dirty_all(lib, dst);
+	return 0;
+}
+
+/*
+ * Squeeze the dead strings out of the bucket. The live strings are rewritten
+ * in index order, so afterwards they are also laid out alphabetically. A
+ * string can thus move further into the bucket, so the index entries are
+ * widened first if the new offsets would not fit them. The space freed becomes
+ * free space in the bucket; use mlib_bucket_trim() to give it back to the
+ * library. String offsets change so any pointers into the bucket become stale;
+ * IDs do not. Returns the (possibly moved) bucket or NULL on failure.
+ */
+static struct mlib_bucket *__mlib_bucket_compact(struct mlib_library *lib,
+						 struct mlib_bucket *bucket)
+{
+	int i, nr;
+	uint32_t ref, offset, len, live;
+	char *strs;
+
+	if (!MLIB_BUCKET_DEAD_BYTES(bucket))
+		return bucket;
+
+	live = MLIB_BUCKET_STR_BYTES(bucket) - MLIB_BUCKET_DEAD_BYTES(bucket);
+	if (!__mlib_bucket_compact_fits(bucket)) {
+		bucket = __mlib_bucket_index_fit(lib, bucket, live);
+		if (!bucket)
+			return NULL;
+	}
+
+	strs = malloc(live + 1);
+	if (!strs)
+		return NULL;
+
+	live = 0;
+
+	nr = mlib_bucket_nr_indexes(bucket);
+	for (i = 0; i < nr; i++) {
+		ref = mlib_bucket_index(bucket, i);
+		offset = __mlib_bucket_ref_offset(bucket, ref);
+		len = strlen(bucket->strings + offset) + 1;
+		memcpy(strs + live, bucket->strings + offset, len);
+		if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS)
+			__mlib_bucket_set_id(bucket, ref, live);
+		else
+			__mlib_bucket_set_index(bucket, i, live);
+		live += len;
+	}
+
+	memcpy(bucket->strings, strs, live);
+	MLIB_BUCKET_SET_STR_BYTES(bucket, live);
+	MLIB_BUCKET_SET_DEAD_BYTES(bucket, 0);
+	free(strs);
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH)
+		__mlib_bucket_hash_rebuild(lib, bucket);
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM)
+		__mlib_bucket_bloom_rebuild(lib, bucket);
+	__mlib_bucket_tree_refresh(lib, bucket);
+	__mlib_bucket_dirty_all(lib, bucket);
+
+	return bucket;
+}
+
+/*
+ * Squeeze the dead strings out of the bucket; see __mlib_bucket_compact().
+ * This can move the bucket. Returns 0 on success, < 0 on failure.
+ */
+int mlib_bucket_compact(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	return __mlib_bucket_compact(lib, bucket) ? 0 : -1;
+}
+
+/*
+ * Give the free space in the bucket past the first @keep bytes back to the
+ * library.
+ */
+static int __mlib_bucket_trim(struct mlib_library *lib,
+			      struct mlib_bucket *bucket, uint32_t keep)
+{
+	uint32_t cut, tail_bytes;
+	void *tail, *end;
+	struct mlib_playlist *plist;
+
+	if (__mlib_bucket_free_space(bucket) <= keep)
+		return 0;
+	cut = __mlib_bucket_free_space(bucket) - keep;
+
+	/* Slide the indexes and aux area down over the unused space. */
+	tail = ((void *)bucket) + MLIB_BUCKET_INDEX_OFFS(bucket);
+	end = ((void *)bucket) + MLIB_BUCKET_LENGTH(bucket);
+	tail_bytes = end - tail;
+	memmove(tail - cut, tail, tail_bytes);
+
+	MLIB_BUCKET_SET_INDEX_OFFS(bucket, MLIB_BUCKET_INDEX_OFFS(bucket) - cut);
+	MLIB_BUCKET_SET_AUX_OFFS(bucket, MLIB_BUCKET_AUX_OFFS(bucket) - cut);
+	MLIB_BUCKET_SET_LENGTH(bucket, MLIB_BUCKET_LENGTH(bucket) - cut);
+
+	plist = container_of(bucket, struct mlib_playlist, data);
+	MLIB_PLIST_SET_LEN(plist, MLIB_PLIST_LEN(plist) - cut);
+	__mlib_library_dirty(lib, plist, sizeof(*plist));
+	__mlib_bucket_dirty_all(lib, bucket);
+
+	return __mlib_library_cut_record(lib, mlib_lib_offset(lib, plist),
+					 (end - cut) - (void *)plist, cut);
+}
+
+/*
+ * Give excess free space in the bucket back to the library. A bucket keeps
+ * MLIB_BUCKET_GROWTH_RATE bytes of slack so the next add doesn't have to grow
+ * it right away. In a v1 library this cuts the space out of the library file,
+ * so everything after the bucket is moved. Returns 0 on success, < 0 on
+ * failure.
+ */
+int mlib_bucket_trim(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	return __mlib_bucket_trim(lib, bucket, MLIB_BUCKET_GROWTH_RATE);
+}
+
+/*
+ * Pack the bucket as tightly as it goes: squeeze out the dead strings and give
+ * all of the free space, slack included, back to the library. The next add
+ * grows the bucket again. Returns 0 on success, < 0 on failure.
+ */
+int mlib_bucket_pack(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_COMPRESSED)) {
+		bucket = __mlib_bucket_compact(lib, bucket);
+		if (!bucket)
+			return -1;
+	}
+	return __mlib_bucket_trim(lib, bucket, 0);
+}
+
+/*
+ * Compress the strings in @bucket with a symbol table trained on those
+ * strings. If the bucket is already compressed the symbol table is retrained
+ * and everything is re-encoded. The strings are rewritten in sorted order and
+ * the space saved is given back to the library. Single strings can still be
+ * looked up and decoded without touching the rest of the bucket. Buckets that
+ * refer to .global have no strings of their own; compressing them does
+ * nothing. Returns 0 on success, < 0 on failure.
+ */
+int mlib_bucket_compress(struct mlib_library *lib, struct mlib_bucket *bucket)
+{
+	int i, nr, ret = -1;
+	uint32_t plain_bytes = 0, enc_bytes = 0, *enc_offs = NULL;
+	char *plain = NULL, *enc = NULL, buf[MLIB_BUCKET_MAX_STR];
+	const char **strs = NULL, *str;
+	struct mlib_symtab symtab;
+
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_REFS)
+		return 0;
+
+	/*
+	 * Decode everything up front; the old strings get overwritten once the
+	 * new ones are written out.
+	 */
+	nr = mlib_bucket_nr_indexes(bucket);
+	for (i = 0; i < nr; i++) {
+		str = __mlib_bucket_str(bucket, mlib_bucket_index(bucket, i),
+					buf);
+		plain_bytes += strlen(str) + 1;
+	}
+
+	plain = malloc(plain_bytes + 1);
+	enc = malloc(plain_bytes * 2 + 1);
+	strs = malloc((nr + 1) * sizeof(char *));
+	enc_offs = malloc((nr + 1) * sizeof(uint32_t));
+	if (!plain || !enc || !strs || !enc_offs)
+		goto done;
+
+	plain_bytes = 0;
+	for (i = 0; i < nr; i++) {
+		str = __mlib_bucket_str(bucket, mlib_bucket_index(bucket, i),
+					buf);
+		strs[i] = plain + plain_bytes;
+		strcpy(plain + plain_bytes, str);
+		plain_bytes += strlen(str) + 1;
+	}
+
+	if (mlib_symtab_train(&symtab, strs, nr))
+		goto done;
+
+	for (i = 0; i < nr; i++) {
+		enc_offs[i] = enc_bytes;
+		enc_bytes += mlib_symtab_encode(&symtab, strs[i],
+						enc + enc_bytes,
+						plain_bytes * 2 + 1 -
+						enc_bytes) + 1;
+	}
+
+	/* Make room for the symbol table if this is the first compression. */
+	if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_COMPRESSED)) {
+		bucket = __mlib_bucket_aux_grow(lib, bucket, 0,
+						sizeof(struct mlib_symtab));
+		if (!bucket)
+			goto done;
+	}
+	if (enc_bytes > MLIB_BUCKET_STR_BYTES(bucket)) {
+		bucket = __mlib_bucket_make_room(lib, bucket, enc_bytes -
+						 MLIB_BUCKET_STR_BYTES(bucket));
+		if (!bucket)
+			goto done;
+	}
+	/* The encoded offsets may not fit in the current index width. */
+	if (nr && !(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS)) {
+		bucket = __mlib_bucket_index_fit(lib, bucket, enc_offs[nr - 1]);
+		if (!bucket)
+			goto done;
+	}
+
+	memcpy(bucket->strings, enc, enc_bytes);
+	for (i = 0; i < nr; i++) {
+		if (!(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS)) {
+			__mlib_bucket_set_index(bucket, i, enc_offs[i]);
+			continue;
+		}
+		__mlib_bucket_set_id(bucket, mlib_bucket_index(bucket, i),
+				     enc_offs[i]);
+	}
+	MLIB_BUCKET_SET_STR_BYTES(bucket, enc_bytes);
+	MLIB_BUCKET_SET_DEAD_BYTES(bucket, 0);
+	memcpy((void *)__mlib_bucket_symtab(bucket), &symtab, sizeof(symtab));
+	MLIB_BUCKET_SET_FLAGS(bucket, MLIB_BUCKET_FLAGS(bucket) |
+			      MLIB_BUCKET_F_COMPRESSED);
+
+	/*
+	 * The string offsets all changed so the hash table needs a rebuild,
+	 * unless it holds IDs.
+	 */
+	if ((MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_HASH) &&
+	    !(MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_IDS)) {
+		bucket = __mlib_bucket_hash_resize(lib, bucket,
+						   MLIB_BUCKET_HASH_SLOTS(bucket));
+		if (!bucket)
+			goto done;
+	}
+
+	/* Removed strings are gone now; drop them from the filter too. */
+	if (MLIB_BUCKET_FLAGS(bucket) & MLIB_BUCKET_F_BLOOM)
+		__mlib_bucket_bloom_rebuild(lib, bucket);
+	__mlib_bucket_tree_refresh(lib, bucket);
+	__mlib_bucket_dirty_all(lib, bucket);
+
+	ret = mlib_bucket_trim(lib, bucket);
+
+done:
+	free(plain);
+	free(strs);
+	free(enc_offs);
+	free(enc);
+	return ret;
+}
+
+/**
+ * Add the storage statistics of @bucket to @stats. Everything but
+ * @path_bytes comes straight from the bucket header. The paths of plain
+ * buckets are their strings less the terminators; only the paths of
+ * compressed buckets and of buckets holding .global IDs have to be read.
+ *
+ * @lib		The library the bucket is in.
+ * @bucket	The bucket.
+ * @stats	Statistics to add to.
+ */
+void mlib_bucket_stats(const struct mlib_library *lib,
+		       const struct mlib_bucket *bucket,
+		       struct mlib_bucket_stats *stats)
+{
+	const struct mlib_bucket *strs;
+	uint32_t flags = MLIB_BUCKET_FLAGS(bucket);
+	uint32_t nr = mlib_bucket_nr_indexes(bucket);
+	uint32_t dead = MLIB_BUCKET_DEAD_BYTES(bucket);
+	uint32_t i;
+
+	stats->entries += nr;
+	stats->total_bytes += MLIB_BUCKET_LENGTH(bucket);
+	stats->header_bytes += sizeof(struct mlib_bucket);
+	stats->str_bytes += MLIB_BUCKET_STR_BYTES(bucket) - dead;
+	stats->dead_bytes += dead;
+	stats->index_bytes += MLIB_BUCKET_AUX_OFFS(bucket) -
+		MLIB_BUCKET_INDEX_OFFS(bucket);
+	stats->aux_bytes += MLIB_BUCKET_LENGTH(bucket) -
+		MLIB_BUCKET_AUX_OFFS(bucket);
+	stats->free_bytes += __mlib_bucket_free_space(bucket);
+
+	if (!(flags & (MLIB_BUCKET_F_COMPRESSED | MLIB_BUCKET_F_REFS))) {
+		stats->path_bytes += MLIB_BUCKET_STR_BYTES(bucket) - dead - nr;
+		return;
+	}
+	strs = __mlib_bucket_strings(lib, bucket);
+	if (!strs)
+		return;
+	for (i = 0; i < nr; i++)
+		stats->path_bytes += strlen(__mlib_bucket_string_at(strs,
+					mlib_bucket_index(bucket, i)));
 }
 
 /*
@@ -267,7 +2365,8 @@ restart:
  * purposes.
  */
 #ifdef __DEBUG_BUCKETS
-void __mlib_print_bucket_info(struct mlib_bucket *bucket)
+void __mlib_print_bucket_info(struct mlib_library *lib,
+			      struct mlib_bucket *bucket)
 {
 	int nr_indexes, index, i;
 	const char *str;
@@ -276,16 +2375,22 @@ void __mlib_print_bucket_info(struct mlib_bucket *bucket)
 	mlib_printf("  Length:     %u\n", MLIB_BUCKET_LENGTH(bucket));
 	mlib_printf("  Index offs: %u\n", MLIB_BUCKET_INDEX_OFFS(bucket));
 	mlib_printf("  Str bytes:  %u\n", MLIB_BUCKET_STR_BYTES(bucket));
-	mlib_printf("  Free space: %u\n",
-		    (uint32_t)MLIB_BUCKET_INDEX_OFFS(bucket) -
-		    (uint32_t)MLIB_BUCKET_STR_BYTES(bucket) -
-		    (uint32_t)sizeof(struct mlib_bucket));
+	mlib_printf("  Aux offs:   %u\n", MLIB_BUCKET_AUX_OFFS(bucket));
+	mlib_printf("  Flags:      0x%x\n", MLIB_BUCKET_FLAGS(bucket));
+	mlib_printf("  Idx width:  %u\n", __mlib_bucket_index_width(bucket));
+	mlib_printf("  Hash slots: %u\n", MLIB_BUCKET_HASH_SLOTS(bucket));
+	mlib_printf("  Dead bytes: %u\n", MLIB_BUCKET_DEAD_BYTES(bucket));
+	mlib_printf("  ID slots:   %u\n", MLIB_BUCKET_ID_SLOTS(bucket));
+	mlib_printf("  Next ID:    %u\n", MLIB_BUCKET_NEXT_ID(bucket));
+	mlib_printf("  Bloom blks: %u\n", MLIB_BUCKET_BLOOM_BLOCKS(bucket));
+	mlib_printf("  Tree slots: %u\n", MLIB_BUCKET_TREE_SLOTS(bucket));
+	mlib_printf("  Free space: %u\n", __mlib_bucket_free_space(bucket));
 
 	/* Print the indexes and their strings. */
 	nr_indexes = mlib_bucket_nr_indexes(bucket);
 	for (i = 0; i < nr_indexes; i++) {
 		index = mlib_bucket_index(bucket, i);
-		str = mlib_bucket_string(bucket, i);
+		str = mlib_bucket_string(lib, bucket, i);
 		mlib_printf("indexes[%d] = %-4u | '%s'\n", i, index, str);
 	}
 }
@@ -314,7 +2419,7 @@ int __mlib_bucket_dump(int argc, char *argv[])
 	}
 
 	bucket = &plist->data;
-	__mlib_print_bucket_info(bucket);
+	__mlib_print_bucket_info(lib, bucket);
 
 	return 0;
 }
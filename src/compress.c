@@ -0,0 +1,381 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Symbol table string compression for buckets. This is loosely based on FSST:
+ * a table of up to 254 symbols, each 1 to 8 bytes long, is trained on the
+ * strings of a bucket. Each string is then encoded on its own as a sequence of
+ * one byte codes:
+ *
+ *   0x00          End of string.
+ *   0x01 - 0xfe   The symbol with that code.
+ *   0xff          Escape; the next byte is a literal.
+ *
+ * Since every string is encoded separately and stays null terminated, single
+ * strings can be decoded (or compared against) without touching any of the
+ * other strings in the bucket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mlib/mlib.h>
+#include <mlib/plist_bucket.h>
+
+/* Number of training passes; FSST finds 5 is plenty. */
+#define MLIB_SYMTAB_ROUNDS	5
+
+/* Cap on the number of strings to train on. */
+#define MLIB_SYMTAB_SAMPLE	16384
+
+/*
+ * Training uses ids 0 - 253 for symbols in the table being built and
+ * 256 + byte for single byte literals.
+ */
+#define MLIB_SYMTAB_NR_IDS	512
+
+struct __mlib_symbol {
+	char		str[MLIB_SYMTAB_SYM_LEN];
+	int		len;
+	long		gain;
+};
+
+/*
+ * First byte lookup chains for a symbol table, longest symbols first. Building
+ * this is cheap so it's done for each call that needs it rather than stored.
+ */
+struct __mlib_symtab_chains {
+	uint8_t		first[256];
+	uint8_t		next[256];
+};
+
+static void __mlib_symtab_chains(const struct mlib_symtab *symtab,
+				 struct __mlib_symtab_chains *chains)
+{
+	int code, len;
+	uint8_t *link;
+	unsigned char c;
+
+	memset(chains, 0, sizeof(*chains));
+
+	for (code = 1; code < MLIB_SYMTAB_ESCAPE; code++) {
+		len = symtab->lens[code];
+		if (!len)
+			continue;
+
+		c = symtab->syms[code][0];
+		link = &chains->first[c];
+		while (*link && symtab->lens[*link] >= len)
+			link = &chains->next[*link];
+		chains->next[code] = *link;
+		*link = code;
+	}
+}
+
+/*
+ * Return the code of the longest symbol that matches the start of @str or 0 if
+ * none does.
+ */
+static int __mlib_symtab_match(const struct mlib_symtab *symtab,
+			       const struct __mlib_symtab_chains *chains,
+			       const char *str)
+{
+	int code, len, i;
+
+	for (code = chains->first[(unsigned char)*str]; code;
+	     code = chains->next[code]) {
+		len = symtab->lens[code];
+		for (i = 1; i < len; i++)
+			if (symtab->syms[code][i] != str[i])
+				break;
+		if (i == len)
+			return code;
+	}
+
+	return 0;
+}
+
+/**
+ * Encode @str with @symtab into @out. At most @out_len bytes, including the
+ * null terminator, are written. Returns the length of the encoded string (not
+ * including the terminator) or -1 if @out is too small.
+ *
+ * @symtab	The symbol table.
+ * @str		String to encode.
+ * @out		Where to write the encoded string.
+ * @out_len	Size of @out.
+ */
+int mlib_symtab_encode(const struct mlib_symtab *symtab, const char *str,
+		       char *out, int out_len)
+{
+	int code, len = 0;
+	struct __mlib_symtab_chains chains;
+
+	__mlib_symtab_chains(symtab, &chains);
+
+	while (*str) {
+		if (len + 3 > out_len)
+			return -1;
+
+		code = __mlib_symtab_match(symtab, &chains, str);
+		if (code) {
+			out[len++] = code;
+			str += symtab->lens[code];
+		} else {
+			out[len++] = (char)MLIB_SYMTAB_ESCAPE;
+			out[len++] = *str++;
+		}
+	}
+
+	out[len] = 0;
+	return len;
+}
+
+/**
+ * Decode @enc into @out. Returns the length of the decoded string or -1 if it
+ * does not fit in @out_len bytes.
+ *
+ * @symtab	The symbol table.
+ * @enc		The encoded string.
+ * @out		Where to write the decoded string.
+ * @out_len	Size of @out.
+ */
+int mlib_symtab_decode(const struct mlib_symtab *symtab, const char *enc,
+		       char *out, int out_len)
+{
+	int len = 0, sym_len;
+	unsigned char code;
+
+	while ((code = *enc++) != 0) {
+		if (code == MLIB_SYMTAB_ESCAPE) {
+			if (len + 1 >= out_len)
+				return -1;
+			out[len++] = *enc++;
+			continue;
+		}
+
+		sym_len = symtab->lens[code];
+		if (len + sym_len >= out_len)
+			return -1;
+		memcpy(out + len, symtab->syms[code], sym_len);
+		len += sym_len;
+	}
+
+	out[len] = 0;
+	return len;
+}
+
+/**
+ * Compare an encoded string against a plain one. This works like strcmp() on
+ * the decoded string but stops decoding as soon as the strings differ.
+ *
+ * @symtab	The symbol table.
+ * @enc		The encoded string.
+ * @str		A regular string.
+ */
+int mlib_symtab_cmp(const struct mlib_symtab *symtab, const char *enc,
+		    const char *str)
+{
+	int i, sym_len;
+	unsigned char code;
+	const unsigned char *s = (const unsigned char *)str;
+	const unsigned char *sym;
+
+	while ((code = *enc++) != 0) {
+		if (code == MLIB_SYMTAB_ESCAPE) {
+			sym = (const unsigned char *)enc++;
+			sym_len = 1;
+		} else {
+			sym = (const unsigned char *)symtab->syms[code];
+			sym_len = symtab->lens[code];
+		}
+
+		for (i = 0; i < sym_len; i++, s++) {
+			if (sym[i] != *s)
+				return sym[i] - *s;
+		}
+	}
+
+	return 0 - *s;
+}
+
+/*
+ * Sort candidate symbols by decreasing gain.
+ */
+static int __mlib_symbol_cmp(const void *a, const void *b)
+{
+	const struct __mlib_symbol *sa = a, *sb = b;
+
+	if (sa->gain != sb->gain)
+		return sa->gain < sb->gain ? 1 : -1;
+	return sb->len - sa->len;
+}
+
+/*
+ * Return the training id of the longest symbol matching the start of @str;
+ * single bytes that have no symbol are returned as 256 + the byte.
+ */
+static int __mlib_symtab_train_match(const struct mlib_symtab *symtab,
+				     const struct __mlib_symtab_chains *chains,
+				     const char *str)
+{
+	int code = __mlib_symtab_match(symtab, chains, str);
+
+	if (code)
+		return code - 1;
+	return 256 + (unsigned char)*str;
+}
+
+/*
+ * Fill in @sym with the symbol for training id @id.
+ */
+static void __mlib_symtab_id(const struct mlib_symtab *symtab, int id,
+			     struct __mlib_symbol *sym)
+{
+	if (id >= 256) {
+		sym->str[0] = id - 256;
+		sym->len = 1;
+	} else {
+		memcpy(sym->str, symtab->syms[id + 1], MLIB_SYMTAB_SYM_LEN);
+		sym->len = symtab->lens[id + 1];
+	}
+}
+
+/*
+ * Pick the best symbols out of @cands and make them the new table.
+ */
+static void __mlib_symtab_pick(struct mlib_symtab *symtab,
+			       struct __mlib_symbol *cands, int nr_cands)
+{
+	int i, j, nr = 0;
+	struct mlib_symtab new_tab;
+
+	qsort(cands, nr_cands, sizeof(*cands), __mlib_symbol_cmp);
+
+	memset(&new_tab, 0, sizeof(new_tab));
+	for (i = 0; i < nr_cands && nr < MLIB_SYMTAB_MAX_SYMS; i++) {
+		for (j = 1; j <= nr; j++) {
+			if (new_tab.lens[j] == cands[i].len &&
+			    memcmp(new_tab.syms[j], cands[i].str,
+				   cands[i].len) == 0)
+				break;
+		}
+		if (j <= nr)
+			continue;
+
+		nr++;
+		memcpy(new_tab.syms[nr], cands[i].str, cands[i].len);
+		new_tab.lens[nr] = cands[i].len;
+	}
+
+	*symtab = new_tab;
+}
+
+/**
+ * Train a symbol table on the passed strings. Each round encodes a sample of
+ * the strings with the current table and counts how often each symbol and
+ * each pair of adjacent symbols occurs. The symbols and concatenated pairs
+ * that would save the most bytes make up the next table. Returns 0 on
+ * success, < 0 if memory could not be allocated.
+ *
+ * @symtab	Symbol table to fill in.
+ * @strs	Strings to train on.
+ * @nr		Number of strings.
+ */
+int mlib_symtab_train(struct mlib_symtab *symtab, const char **strs, int nr)
+{
+	int round, i, a, b, id, prev, nr_cands, step;
+	const char *str;
+	long *counts1, *counts2;
+	struct __mlib_symbol *cands, sym_a, sym_b;
+	struct __mlib_symtab_chains chains;
+
+	counts1 = calloc(MLIB_SYMTAB_NR_IDS, sizeof(long));
+	counts2 = calloc(MLIB_SYMTAB_NR_IDS * MLIB_SYMTAB_NR_IDS,
+			 sizeof(long));
+	cands = malloc(MLIB_SYMTAB_NR_IDS * (MLIB_SYMTAB_NR_IDS + 1) *
+		       sizeof(struct __mlib_symbol));
+	if (!counts1 || !counts2 || !cands) {
+		free(counts1);
+		free(counts2);
+		free(cands);
+		return -1;
+	}
+
+	step = nr > MLIB_SYMTAB_SAMPLE ? nr / MLIB_SYMTAB_SAMPLE : 1;
+	memset(symtab, 0, sizeof(*symtab));
+
+	for (round = 0; round < MLIB_SYMTAB_ROUNDS; round++) {
+		memset(counts1, 0, MLIB_SYMTAB_NR_IDS * sizeof(long));
+		memset(counts2, 0, MLIB_SYMTAB_NR_IDS * MLIB_SYMTAB_NR_IDS *
+		       sizeof(long));
+		__mlib_symtab_chains(symtab, &chains);
+
+		for (i = 0; i < nr; i += step) {
+			str = strs[i];
+			prev = -1;
+			while (*str) {
+				id = __mlib_symtab_train_match(symtab, &chains,
+							       str);
+				__mlib_symtab_id(symtab, id, &sym_a);
+				counts1[id]++;
+				if (prev >= 0)
+					counts2[prev * MLIB_SYMTAB_NR_IDS +
+						id]++;
+				prev = id;
+				str += sym_a.len;
+			}
+		}
+
+		/*
+		 * Candidates are the symbols that were used plus every pair of
+		 * adjacent symbols that still fits in one symbol.
+		 */
+		nr_cands = 0;
+		for (a = 0; a < MLIB_SYMTAB_NR_IDS; a++) {
+			if (!counts1[a])
+				continue;
+			__mlib_symtab_id(symtab, a, &sym_a);
+			cands[nr_cands] = sym_a;
+			cands[nr_cands++].gain = counts1[a] * sym_a.len;
+
+			for (b = 0; b < MLIB_SYMTAB_NR_IDS; b++) {
+				long count = counts2[a * MLIB_SYMTAB_NR_IDS +
+						     b];
+
+				if (!count)
+					continue;
+				__mlib_symtab_id(symtab, b, &sym_b);
+				if (sym_a.len + sym_b.len > MLIB_SYMTAB_SYM_LEN)
+					continue;
+
+				cands[nr_cands] = sym_a;
+				memcpy(cands[nr_cands].str + sym_a.len,
+				       sym_b.str, sym_b.len);
+				cands[nr_cands].len = sym_a.len + sym_b.len;
+				cands[nr_cands++].gain =
+					count * (sym_a.len + sym_b.len);
+			}
+		}
+
+		__mlib_symtab_pick(symtab, cands, nr_cands);
+	}
+
+	free(counts1);
+	free(counts2);
+	free(cands);
+	return 0;
+}
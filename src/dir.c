@@ -0,0 +1,317 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The playlist directory. Finding a playlist by name used to mean walking
+ * every playlist in the library. v2 libraries keep an open addressing hash
+ * table of playlist names instead, in a record of its own that the library
+ * header points to. It works like the bucket hash tables: linear probing,
+ * tombstones for removed playlists and a stored hash so probes rarely have to
+ * look at the playlist itself.
+ *
+ * The table is kept at most half full. When an insert would take it past that
+ * a new table twice the size is allocated, the live entries are copied over
+ * and the old table is freed. Playlists that move to a new extent have their
+ * slot updated by the library code.
+ *
+ * v1 libraries have no directory; their playlists move on every insert so
+ * lookups there still walk the library.
+ */
+
+#include <string.h>
+
+#include <mlib/mlib.h>
+
+#define __mlib_dir(lib)							\
+	((struct mlib_dir *)(((void *)(lib)->header) +			\
+			     __mlib_read_offs(lib, &(lib)->header->dir_offs)))
+
+/*
+ * Hash a playlist name. Same 32 bit FNV-1a as the bucket hash tables.
+ */
+static uint32_t __mlib_dir_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/*
+ * Put the playlist at @offs into @dir. The table must have a free slot.
+ */
+static void __mlib_dir_insert(struct mlib_library *lib,
+			      struct mlib_dir *dir, uint64_t offs)
+{
+	const struct mlib_playlist *plist = ((void *)lib->header) + offs;
+	uint32_t hash = __mlib_dir_hash(MLIB_PLIST_NAME(plist));
+	uint32_t mask = MLIB_DIR_SLOTS(dir) - 1;
+	uint32_t slot = hash & mask, old;
+
+	while ((old = __mlib_readl(&dir->table[slot].offset)) != 0 &&
+	       old != MLIB_BUCKET_HSLOT_DEAD)
+		slot = (slot + 1) & mask;
+
+	if (old == MLIB_BUCKET_HSLOT_DEAD)
+		MLIB_DIR_SET_DEAD(dir, MLIB_DIR_DEAD(dir) - 1);
+	__mlib_write_offs(lib, &dir->table[slot].offset, offs);
+	__mlib_writel(&dir->table[slot].hash, hash);
+	MLIB_DIR_SET_NR(dir, MLIB_DIR_NR(dir) + 1);
+	__mlib_library_dirty(lib, dir, sizeof(*dir));
+	__mlib_library_dirty(lib, &dir->table[slot], sizeof(dir->table[0]));
+}
+
+/*
+ * Find the slot holding the playlist at @offs, whose name is @name. Returns
+ * NULL if it is not in the table.
+ */
+static struct mlib_bucket_hslot *__mlib_dir_slot(struct mlib_library *lib,
+						 struct mlib_dir *dir,
+						 const char *name,
+						 uint64_t offs)
+{
+	uint32_t mask = MLIB_DIR_SLOTS(dir) - 1;
+	uint32_t slot = __mlib_dir_hash(name) & mask;
+	uint32_t probes = 0;
+
+	while (__mlib_readl(&dir->table[slot].offset) != 0 &&
+	       probes++ <= mask) {
+		if (__mlib_read_offs(lib, &dir->table[slot].offset) == offs)
+			return &dir->table[slot];
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/*
+ * Allocate a directory with room for @nr playlists, fill it with every
+ * playlist in the library and make it the library's directory. The old
+ * directory, if any, is freed. Returns 0 on success, < 0 on failure.
+ */
+static int __mlib_dir_resize(struct mlib_library *lib, uint32_t nr)
+{
+	uint32_t slots = MLIB_DIR_MIN_SLOTS, len, slot_offs, magic, i;
+	uint64_t dir_offs, offs, old;
+	struct mlib_dir *dir, *old_dir;
+
+	while (slots < 2 * nr)
+		slots <<= 1;
+	len = sizeof(struct mlib_dir) +
+		slots * sizeof(struct mlib_bucket_hslot);
+
+	dir_offs = __mlib_library_alloc_record(lib, len);
+	if (!dir_offs)
+		return -1;
+	dir = ((void *)lib->header) + dir_offs;
+	__mlib_writel(&dir->magic, MLIB_DIR_MAGIC);
+	__mlib_writel(&dir->length, len);
+	MLIB_DIR_SET_SLOTS(dir, slots);
+
+	old = __mlib_read_offs(lib, &lib->header->dir_offs);
+	if (old) {
+		old_dir = ((void *)lib->header) + old;
+		for (i = 0; i < MLIB_DIR_SLOTS(old_dir); i++) {
+			slot_offs = __mlib_readl(&old_dir->table[i].offset);
+			if (slot_offs && slot_offs != MLIB_BUCKET_HSLOT_DEAD)
+				__mlib_dir_insert(lib, dir, __mlib_read_offs(
+					lib, &old_dir->table[i].offset));
+		}
+		__mlib_library_free_record(lib, old);
+	} else {
+		for (offs = __mlib_extent_next(lib, 0); offs;
+		     offs = __mlib_extent_next(lib, offs)) {
+			magic = __mlib_readl((uint32_t *)
+					     (((void *)lib->header) + offs));
+			if (magic == MLIB_PLIST_HDR_MAGIC ||
+			    magic == MLIB_PLIST_PAGED_MAGIC)
+				__mlib_dir_insert(lib, dir, offs);
+		}
+	}
+
+	__mlib_write_offs(lib, &lib->header->dir_offs, dir_offs);
+	MLIB_LIB_DIRTY_HEADER(lib);
+	return 0;
+}
+
+/**
+ * Build the directory of a v2 library that doesn't have one yet, e.g one
+ * written before there were directories. Does nothing for v1 libraries.
+ * Returns 0 on success, < 0 on failure.
+ *
+ * @lib		The library.
+ */
+int mlib_dir_build(struct mlib_library *lib)
+{
+	struct mlib_playlist *plist;
+	uint32_t nr = 0;
+
+	if (!MLIB_LIB_EXTENTS(lib) || __mlib_readl(&lib->header->dir_offs))
+		return 0;
+
+	mlib_for_each_pls(lib, plist)
+		nr++;
+	return __mlib_dir_resize(lib, nr);
+}
+
+/**
+ * Look up the playlist called @name in the directory. Returns NULL if there is
+ * no such playlist or the library has no directory.
+ *
+ * @lib		The library.
+ * @name	Name of the playlist.
+ */
+struct mlib_playlist *mlib_dir_find(const struct mlib_library *lib,
+				    const char *name)
+{
+	struct mlib_dir *dir;
+	struct mlib_playlist *plist;
+	uint32_t hash, mask, slot, offs, probes = 0;
+
+	if (!MLIB_LIB_EXTENTS(lib) || !__mlib_readl(&lib->header->dir_offs))
+		return NULL;
+
+	dir = __mlib_dir(lib);
+	hash = __mlib_dir_hash(name);
+	mask = MLIB_DIR_SLOTS(dir) - 1;
+	slot = hash & mask;
+
+	/* Tombstones can fill every empty slot, so stop after a full lap. */
+	while ((offs = __mlib_readl(&dir->table[slot].offset)) != 0 &&
+	       probes++ <= mask) {
+		if (offs != MLIB_BUCKET_HSLOT_DEAD &&
+		    __mlib_readl(&dir->table[slot].hash) == hash) {
+			plist = ((void *)lib->header) +
+				((uint64_t)offs << lib->offs_shift);
+			if (strncmp(MLIB_PLIST_NAME(plist), name,
+				    MLIB_PLIST_NAME_LEN) == 0)
+				return plist;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/**
+ * Add a newly made playlist to the directory, growing the directory if need
+ * be. Returns 0 on success, < 0 on failure.
+ *
+ * @lib		The library.
+ * @plist	The playlist; its name must already be set.
+ */
+int mlib_dir_add(struct mlib_library *lib, struct mlib_playlist *plist)
+{
+	uint64_t offs = mlib_lib_offset(lib, plist);
+	struct mlib_dir *dir;
+
+	if (!MLIB_LIB_EXTENTS(lib))
+		return 0;
+	if (!__mlib_readl(&lib->header->dir_offs))
+		return mlib_dir_build(lib);
+
+	dir = __mlib_dir(lib);
+	if (2 * (MLIB_DIR_NR(dir) + MLIB_DIR_DEAD(dir) + 1) >
+	    MLIB_DIR_SLOTS(dir)) {
+		if (__mlib_dir_resize(lib, MLIB_DIR_NR(dir) + 1))
+			return -1;
+		dir = __mlib_dir(lib);
+	}
+
+	__mlib_dir_insert(lib, dir, offs);
+	return 0;
+}
+
+/**
+ * Take a playlist that is about to be deleted out of the directory.
+ *
+ * @lib		The library.
+ * @plist	The playlist.
+ */
+void mlib_dir_remove(struct mlib_library *lib, struct mlib_playlist *plist)
+{
+	struct mlib_bucket_hslot *slot;
+	struct mlib_dir *dir;
+
+	if (!MLIB_LIB_EXTENTS(lib) || !__mlib_readl(&lib->header->dir_offs))
+		return;
+
+	dir = __mlib_dir(lib);
+	slot = __mlib_dir_slot(lib, dir, MLIB_PLIST_NAME(plist),
+			       mlib_lib_offset(lib, plist));
+	if (!slot)
+		return;
+
+	__mlib_writel(&slot->offset, MLIB_BUCKET_HSLOT_DEAD);
+	MLIB_DIR_SET_NR(dir, MLIB_DIR_NR(dir) - 1);
+	MLIB_DIR_SET_DEAD(dir, MLIB_DIR_DEAD(dir) + 1);
+	__mlib_library_dirty(lib, dir, sizeof(*dir));
+	__mlib_library_dirty(lib, slot, sizeof(*slot));
+}
+
+/**
+ * The playlist that was at offset @from is now at @to; update its slot.
+ *
+ * @lib		The library.
+ * @from	Old offset of the playlist.
+ * @to		New offset of the playlist.
+ */
+void mlib_dir_moved(struct mlib_library *lib, uint64_t from, uint64_t to)
+{
+	struct mlib_playlist *plist = ((void *)lib->header) + to;
+	struct mlib_bucket_hslot *slot;
+
+	if (!MLIB_LIB_EXTENTS(lib) || !__mlib_readl(&lib->header->dir_offs))
+		return;
+
+	slot = __mlib_dir_slot(lib, __mlib_dir(lib), MLIB_PLIST_NAME(plist),
+			       from);
+	if (slot) {
+		__mlib_write_offs(lib, &slot->offset, to);
+		__mlib_library_dirty(lib, slot, sizeof(*slot));
+	}
+}
+
+/**
+ * Add the storage statistics of the directory to @stats; see
+ * mlib_bucket_stats(). Used slots count as index bytes, the rest as free
+ * space.
+ *
+ * @lib		The library.
+ * @stats	Statistics to add to.
+ */
+void mlib_dir_stats(const struct mlib_library *lib,
+		    struct mlib_bucket_stats *stats)
+{
+	uint64_t offs = __mlib_read_offs(lib, &lib->header->dir_offs);
+	struct mlib_dir *dir;
+	uint32_t used;
+
+	if (!MLIB_LIB_EXTENTS(lib) || !offs)
+		return;
+
+	dir = __mlib_dir(lib);
+	used = (MLIB_DIR_NR(dir) + MLIB_DIR_DEAD(dir)) *
+		sizeof(struct mlib_bucket_hslot);
+	stats->total_bytes += __mlib_readl(&dir->length);
+	stats->header_bytes += sizeof(struct mlib_dir);
+	stats->index_bytes += used;
+	stats->free_bytes += __mlib_readl(&dir->length) -
+		sizeof(struct mlib_dir) - used;
+	__mlib_library_record_stats(lib, offs, stats);
+}
@@ -0,0 +1,450 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Extent allocator for v2 libraries. In a v1 library the records (playlists
+ * and pages) sit back to back, so growing or deleting one moves everything
+ * after it. In a v2 library every record lives in an extent of its own:
+ *
+ *   [1KB header][extent][extent][extent]...
+ *
+ * Each extent starts with a struct mlib_extent giving its length, so the
+ * extents can still be walked in order, and an extent may be longer than the
+ * record in it. Extents that are not in use are kept on a free list sorted by
+ * offset; that list is the free space map. Freed extents are merged with free
+ * neighbours and free space at the end of the file is given back.
+ *
+ * A record that outgrows its extent takes over the free extent after it, or
+ * the space at the end of the library if it is the last extent. Failing that
+ * it is copied to a new extent. Either way no other record moves, so growing
+ * or deleting a playlist costs the same no matter where in the library it
+ * is. The record itself may move though; see __mlib_library_moved().
+ */
+
+#include <string.h>
+
+#include <mlib/mlib.h>
+
+/* Don't leave free extents smaller than this behind when splitting. */
+#define MLIB_EXTENT_MIN		64
+
+#define __mlib_extent(lib, offs)					\
+	((struct mlib_extent *)(((void *)(lib)->header) + (offs)))
+
+#define MLIB_EXTENT_MAGIC(ext)		__mlib_readl(&(ext)->magic)
+#define MLIB_EXTENT_LEN(lib, ext)	__mlib_read_offs(lib, &(ext)->length)
+#define MLIB_EXTENT_NEXT(lib, ext)	__mlib_read_offs(lib, &(ext)->next)
+
+static uint64_t __mlib_extent_size(uint64_t len)
+{
+	len += sizeof(struct mlib_extent) + MLIB_EXTENT_ALIGN - 1;
+	return len - len % MLIB_EXTENT_ALIGN;
+}
+
+static void __mlib_extent_init(struct mlib_library *lib, uint64_t offs,
+			       uint32_t magic, uint64_t len, uint64_t next)
+{
+	struct mlib_extent *ext = __mlib_extent(lib, offs);
+
+	__mlib_writel(&ext->magic, magic);
+	__mlib_write_offs(lib, &ext->length, len);
+	__mlib_write_offs(lib, &ext->next, next);
+	__mlib_writel(&ext->pad, 0);
+	__mlib_library_dirty(lib, ext, sizeof(*ext));
+}
+
+static void __mlib_extent_set_len(struct mlib_library *lib, uint64_t offs,
+				  uint64_t len)
+{
+	struct mlib_extent *ext = __mlib_extent(lib, offs);
+
+	__mlib_write_offs(lib, &ext->length, len);
+	__mlib_library_dirty(lib, ext, sizeof(*ext));
+}
+
+static void __mlib_extent_add_free(struct mlib_library *lib, int64_t delta)
+{
+	MLIB_LIB_SET_FREE_BYTES(lib, MLIB_LIB_FREE_BYTES(lib) + delta);
+	MLIB_LIB_DIRTY_HEADER(lib);
+}
+
+/*
+ * Point the link to the free extent after @prev (or the head of the list if
+ * @prev is 0) at @offs.
+ */
+static void __mlib_extent_link(struct mlib_library *lib, uint64_t prev,
+			       uint64_t offs)
+{
+	if (prev) {
+		__mlib_write_offs(lib, &__mlib_extent(lib, prev)->next, offs);
+		__mlib_library_dirty(lib, __mlib_extent(lib, prev),
+				     sizeof(struct mlib_extent));
+	} else {
+		__mlib_write_offs(lib, &lib->header->free_offs, offs);
+		MLIB_LIB_DIRTY_HEADER(lib);
+	}
+}
+
+/*
+ * Take @size bytes from the front of the free extent at @offs, which comes
+ * after @prev on the free list. What is left over stays on the list if it is
+ * big enough; otherwise it is handed out as well. Returns the length of the
+ * extent taken.
+ */
+static uint64_t __mlib_extent_take(struct mlib_library *lib, uint64_t prev,
+				   uint64_t offs, uint64_t size)
+{
+	struct mlib_extent *ext = __mlib_extent(lib, offs);
+	uint64_t len = MLIB_EXTENT_LEN(lib, ext);
+	uint64_t next = MLIB_EXTENT_NEXT(lib, ext);
+
+	if (len - size >= MLIB_EXTENT_MIN) {
+		__mlib_extent_init(lib, offs + size, MLIB_EXTENT_FREE,
+				   len - size, next);
+		__mlib_extent_link(lib, prev, offs + size);
+		len = size;
+	} else {
+		__mlib_extent_link(lib, prev, next);
+	}
+
+	__mlib_extent_add_free(lib, -(int64_t)len);
+	return len;
+}
+
+/**
+ * Allocate an extent for a record of @len bytes, reusing free space if
+ * possible. The record is zeroed. Returns the offset of the record or 0 on
+ * failure.
+ *
+ * @lib		The library.
+ * @len		Length of the record.
+ */
+uint64_t __mlib_extent_alloc(struct mlib_library *lib, uint32_t len)
+{
+	uint64_t size = __mlib_extent_size(len), offs, prev = 0;
+
+	for (offs = __mlib_read_offs(lib, &lib->header->free_offs); offs;
+	     prev = offs,
+	     offs = MLIB_EXTENT_NEXT(lib, __mlib_extent(lib, offs))) {
+		if (MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs)) >= size)
+			break;
+	}
+
+	if (offs) {
+		size = __mlib_extent_take(lib, prev, offs, size);
+		memset(__mlib_extent(lib, offs)->data, 0,
+		       size - sizeof(struct mlib_extent));
+		__mlib_library_dirty(lib, __mlib_extent(lib, offs), size);
+	} else {
+		offs = MLIB_LIB_LEN(lib);
+		if (__mlib_library_expand(lib, offs + size))
+			return 0;
+	}
+
+	__mlib_extent_init(lib, offs, MLIB_EXTENT_USED, size, 0);
+	offs += sizeof(struct mlib_extent);
+
+	/* Whatever used to be here is gone; see __mlib_library_moved(). */
+	if (lib->moved_from == offs)
+		lib->moved_from = 0;
+	return offs;
+}
+
+/**
+ * Free the extent of the record at @rec. It is merged with any free extents
+ * next to it, and if it ends up at the end of the library the library is
+ * truncated instead.
+ *
+ * @lib		The library.
+ * @rec		Offset of the record.
+ */
+void __mlib_extent_free(struct mlib_library *lib, uint64_t rec)
+{
+	uint64_t offs = rec - sizeof(struct mlib_extent);
+	uint64_t len = MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs));
+	uint64_t prev = 0, next, prev_len = 0;
+
+	for (next = __mlib_read_offs(lib, &lib->header->free_offs);
+	     next && next < offs;
+	     next = MLIB_EXTENT_NEXT(lib, __mlib_extent(lib, next)))
+		prev = next;
+
+	__mlib_extent_add_free(lib, len);
+
+	/* Merge with the following free extent. */
+	if (next && offs + len == next) {
+		len += MLIB_EXTENT_LEN(lib, __mlib_extent(lib, next));
+		next = MLIB_EXTENT_NEXT(lib, __mlib_extent(lib, next));
+	}
+
+	/* And the preceding one. */
+	if (prev)
+		prev_len = MLIB_EXTENT_LEN(lib, __mlib_extent(lib, prev));
+	if (prev && prev + prev_len == offs) {
+		offs = prev;
+		len += prev_len;
+		__mlib_extent_init(lib, offs, MLIB_EXTENT_FREE, len, next);
+	} else {
+		__mlib_extent_init(lib, offs, MLIB_EXTENT_FREE, len, next);
+		__mlib_extent_link(lib, prev, offs);
+	}
+
+	/* Free space at the end of the file isn't worth keeping. */
+	if (offs + len == MLIB_LIB_LEN(lib)) {
+		if (prev == offs) {
+			/* @prev was merged; find what comes before it. */
+			for (prev = 0, next = __mlib_read_offs(
+				     lib, &lib->header->free_offs);
+			     next != offs;
+			     next = MLIB_EXTENT_NEXT(lib,
+						     __mlib_extent(lib, next)))
+				prev = next;
+		}
+		__mlib_extent_link(lib, prev, 0);
+		__mlib_extent_add_free(lib, -(int64_t)len);
+		__mlib_library_trunc(lib, offs);
+	}
+}
+
+/*
+ * The record at @from now lives at @to: fix up the header if it is .global and
+ * remember the move for __mlib_library_moved().
+ */
+static void __mlib_extent_moved(struct mlib_library *lib, uint64_t from,
+				uint64_t to)
+{
+	if (__mlib_read_offs(lib, &lib->header->global_offs) == from) {
+		__mlib_write_offs(lib, &lib->header->global_offs, to);
+		MLIB_LIB_DIRTY_HEADER(lib);
+	}
+	if (lib->moved_from && lib->moved_to == from) {
+		/* Moved again; remember where it started out. */
+		lib->moved_to = to;
+	} else {
+		lib->moved_from = from;
+		lib->moved_to = to;
+	}
+}
+
+/**
+ * Make sure the extent of the record at *@rec can hold @len bytes. The extent
+ * grows into the free extent after it or the end of the library if it can;
+ * otherwise the record is copied to a new extent and *@rec is updated. New
+ * space is zeroed. Returns 0 on success, < 0 on failure.
+ *
+ * @lib		The library.
+ * @rec		Offset of the record.
+ * @len		Length the record needs to be able to grow to.
+ */
+int __mlib_extent_reserve(struct mlib_library *lib, uint64_t *rec,
+			  uint32_t len)
+{
+	uint64_t size = __mlib_extent_size(len);
+	uint64_t offs = *rec - sizeof(struct mlib_extent), cur, next, prev = 0;
+	uint64_t new_rec;
+
+	cur = MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs));
+	if (cur >= size)
+		return 0;
+
+	/* The last extent just grows the library. */
+	if (offs + cur == MLIB_LIB_LEN(lib)) {
+		if (__mlib_library_expand(lib, offs + size))
+			return -1;
+		__mlib_extent_set_len(lib, offs, size);
+		return 0;
+	}
+
+	/* Take over the free extent right after this one. */
+	for (next = __mlib_read_offs(lib, &lib->header->free_offs);
+	     next && next < offs + cur;
+	     next = MLIB_EXTENT_NEXT(lib, __mlib_extent(lib, next)))
+		prev = next;
+	if (next == offs + cur &&
+	    cur + MLIB_EXTENT_LEN(lib, __mlib_extent(lib, next)) >= size) {
+		next = __mlib_extent_take(lib, prev, next, size - cur);
+		memset(((void *)__mlib_extent(lib, offs)) + cur, 0, next);
+		__mlib_library_dirty(lib, ((void *)__mlib_extent(lib, offs)) +
+				     cur, next);
+		__mlib_extent_set_len(lib, offs, cur + next);
+		return 0;
+	}
+
+	/* Move the record. */
+	new_rec = __mlib_extent_alloc(lib, len);
+	if (!new_rec)
+		return -1;
+	memcpy(((void *)lib->header) + new_rec, ((void *)lib->header) + *rec,
+	       MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs)) -
+	       sizeof(struct mlib_extent));
+	__mlib_extent_free(lib, *rec);
+
+	__mlib_extent_moved(lib, *rec, new_rec);
+	*rec = new_rec;
+	return 0;
+}
+
+/*
+ * Slide the record at @rec, @len bytes long in an extent of @cur bytes, down
+ * over the free extent at @free right before it, which comes after @prev on
+ * the free list. Whatever is left over past the record is freed. Returns the
+ * new offset of the record.
+ */
+static uint64_t __mlib_extent_slide(struct mlib_library *lib, uint64_t prev,
+				    uint64_t free, uint64_t rec, uint64_t len,
+				    uint64_t cur)
+{
+	struct mlib_extent *ext = __mlib_extent(lib, free);
+	uint64_t total = MLIB_EXTENT_LEN(lib, ext) + cur;
+	uint64_t size = __mlib_extent_size(len);
+
+	__mlib_extent_link(lib, prev, MLIB_EXTENT_NEXT(lib, ext));
+	__mlib_extent_add_free(lib, -(int64_t)MLIB_EXTENT_LEN(lib, ext));
+	memmove(ext->data, ((void *)lib->header) + rec, len);
+
+	if (total - size < MLIB_EXTENT_MIN)
+		size = total;
+	__mlib_extent_init(lib, free, MLIB_EXTENT_USED, size, 0);
+	memset(ext->data + len, 0, size - sizeof(struct mlib_extent) - len);
+	__mlib_library_dirty(lib, ext, size);
+
+	if (size < total) {
+		__mlib_extent_init(lib, free + size, MLIB_EXTENT_USED,
+				   total - size, 0);
+		__mlib_extent_free(lib, free + size +
+				   sizeof(struct mlib_extent));
+	}
+	return free + sizeof(struct mlib_extent);
+}
+
+/**
+ * Move the record at *@rec further down the library, leaving behind any slack
+ * its old extent had: into the first free extent before it that can hold it
+ * or, failing that, over the free extent right before it. Doing this to every
+ * record in turn collects the free space at the end of the library, where it
+ * is given back. Returns 1 and updates *@rec if the record moved, 0 if there
+ * was no free space before it.
+ *
+ * @lib		The library.
+ * @rec		Offset of the record.
+ */
+int __mlib_extent_pack(struct mlib_library *lib, uint64_t *rec)
+{
+	uint64_t offs = *rec - sizeof(struct mlib_extent), prev = 0, free;
+	uint64_t cur = MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs));
+	uint64_t len = MLIB_PLIST_LEN(((struct mlib_playlist *)
+				       (((void *)lib->header) + *rec)));
+	uint64_t size = __mlib_extent_size(len), free_len = 0, new_rec;
+
+	for (free = __mlib_read_offs(lib, &lib->header->free_offs);
+	     free && free < offs;
+	     prev = free,
+	     free = MLIB_EXTENT_NEXT(lib, __mlib_extent(lib, free))) {
+		free_len = MLIB_EXTENT_LEN(lib, __mlib_extent(lib, free));
+		if (free_len >= size || free + free_len == offs)
+			break;
+	}
+	if (!free || free > offs)
+		return 0;
+
+	if (free_len < size) {
+		new_rec = __mlib_extent_slide(lib, prev, free, *rec, len, cur);
+	} else {
+		size = __mlib_extent_take(lib, prev, free, size);
+		__mlib_extent_init(lib, free, MLIB_EXTENT_USED, size, 0);
+		new_rec = free + sizeof(struct mlib_extent);
+		memcpy(((void *)lib->header) + new_rec,
+		       ((void *)lib->header) + *rec, len);
+		memset(((void *)lib->header) + new_rec + len, 0,
+		       size - sizeof(struct mlib_extent) - len);
+		__mlib_library_dirty(lib, __mlib_extent(lib, free), size);
+		__mlib_extent_free(lib, *rec);
+	}
+
+	__mlib_extent_moved(lib, *rec, new_rec);
+	*rec = new_rec;
+	return 1;
+}
+
+/**
+ * Give the part of the extent of the record at @rec past its first @len bytes
+ * back to the free space map, if there is enough of it to bother.
+ *
+ * @lib		The library.
+ * @rec		Offset of the record.
+ * @len		Length of the record.
+ */
+void __mlib_extent_trim(struct mlib_library *lib, uint64_t rec, uint32_t len)
+{
+	uint64_t offs = rec - sizeof(struct mlib_extent);
+	uint64_t size = __mlib_extent_size(len);
+	uint64_t cur = MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs));
+
+	if (cur - size < MLIB_EXTENT_MIN)
+		return;
+
+	__mlib_extent_set_len(lib, offs, size);
+	__mlib_extent_init(lib, offs + size, MLIB_EXTENT_USED, cur - size, 0);
+	__mlib_extent_free(lib, offs + size + sizeof(struct mlib_extent));
+}
+
+/**
+ * Return the number of bytes the record at @rec can grow to without its extent
+ * having to change.
+ *
+ * @lib		The library.
+ * @rec		Offset of the record.
+ */
+uint32_t __mlib_extent_capacity(const struct mlib_library *lib, uint64_t rec)
+{
+	return MLIB_EXTENT_LEN(lib, __mlib_extent(lib, rec -
+					     sizeof(struct mlib_extent))) -
+		sizeof(struct mlib_extent);
+}
+
+/**
+ * Walk the records of a v2 library in file order. Returns the offset of the
+ * first record after the one at @rec (or the first record if @rec is 0), or 0
+ * if there are no more records or the library is corrupt.
+ *
+ * @lib		The library.
+ * @rec		Offset of the current record.
+ */
+uint64_t __mlib_extent_next(const struct mlib_library *lib, uint64_t rec)
+{
+	const struct mlib_extent *ext;
+	uint64_t offs = MLIB_HEADER_SIZE;
+
+	if (rec) {
+		offs = rec - sizeof(struct mlib_extent);
+		offs += MLIB_EXTENT_LEN(lib, __mlib_extent(lib, offs));
+	}
+
+	while (offs + sizeof(struct mlib_extent) <= MLIB_LIB_LEN(lib)) {
+		ext = __mlib_extent(lib, offs);
+		if (MLIB_EXTENT_MAGIC(ext) == MLIB_EXTENT_USED)
+			return offs + sizeof(struct mlib_extent);
+		if (MLIB_EXTENT_MAGIC(ext) != MLIB_EXTENT_FREE ||
+		    MLIB_EXTENT_LEN(lib, ext) < sizeof(struct mlib_extent)) {
+			mlib_error("Library corruption detected.\n");
+			mlib_error("Invalid extent at offset %llu.\n",
+				   (unsigned long long)offs);
+			return 0;
+		}
+		offs += MLIB_EXTENT_LEN(lib, ext);
+	}
+
+	return 0;
+}
@@ -18,39 +18,46 @@
  * memory mapped from disk into our virtual address space.
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <mlib/mlib.h>
 
-#include <curl/curl.h>
-
-static LIST_HEAD(library_list);
-
 /*
- * Returns non-zero if a library with the same name as the passed library is
- * already open.
+ * Every open library is in library_list and in the registry, a hash table by
+ * name that grows as libraries are opened. Mapped libraries are also in
+ * mapped[], sorted by address, for mlib_library_of(). Mapped libraries
+ * nobody holds a reference to are on idle_list, least recently used first;
+ * they are unmapped when more than max_mapped libraries are mapped. That way
+ * a process can have thousands of libraries open while only a bounded number
+ * of them use a file descriptor and address space.
  */
-int __mlib_library_already_open(struct mlib_library_header *lib)
-{
-	struct list_head *elem;
-	struct mlib_library *cur_lib;
+static LIST_HEAD(library_list);
+static struct hlist_head *registry;
+static uint32_t registry_size;
+static uint32_t nr_libraries;
 
-	list_for_each(elem, &library_list) {
-		cur_lib = list_entry(elem, struct mlib_library, list);
-		if (strncmp(lib->lib_name, MLIB_LIB_NAME(cur_lib),
-			    MLIB_LIBRARY_LIB_NAME_LEN) == 0)
-			return 1;
-	}
-	return 0;
-}
+static struct mlib_library **mapped;
+static uint32_t nr_mapped;
+static uint32_t mapped_size;
+
+static LIST_HEAD(idle_list);
+static uint32_t max_mapped = MLIB_LIB_MAX_MAPPED;
+static struct mlib_registry_stats registry_stats;
+
+static int __mlib_mapped_add(struct mlib_library *lib);
+static void __mlib_mapped_del(struct mlib_library *lib);
+static int __mlib_library_refresh(struct mlib_library *lib);
 
 /*
  * Expand the passed FD to the requested length. If the library is longer this
@@ -64,61 +71,208 @@ int __mlib_library_expand_fd(int fd, size_t len)
 	return write(fd, "", 1);
 }
 
+static size_t __mlib_round_up(size_t len, size_t align)
+{
+	return (len + align - 1) / align * align;
+}
+
 /*
- * Grow the size of a library to the requested length. If the library is
- * already bigger than the passed size an error is returned. This is a pretty
- * expensive operation. Try to avoid it if at all possible. If this fails the
- * pointer @lib is no longer valid.
+ * Reserve at least @reserve bytes of address space (MLIB_LIB_RESERVE at
+ * least) and map the first @file_len bytes of the library file at the start of
+ * it. The rest of the reservation is inaccessible until the file grows into
+ * it. @flags are added to the mmap() flags of the file mapping, e.g
+ * MAP_POPULATE.
  */
-int __mlib_library_expand(struct mlib_library *lib, size_t len)
+static int __mlib_library_map(struct mlib_library *lib, size_t file_len,
+			      size_t reserve, int flags)
+{
+	void *base;
+
+	if (reserve < MLIB_LIB_RESERVE)
+		reserve = MLIB_LIB_RESERVE;
+	reserve = __mlib_round_up(reserve, MLIB_LIB_CHUNK);
+
+	base = mmap(NULL, reserve, PROT_NONE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	if (mmap(base, file_len, lib->map_prot,
+		 lib->map_flags|MAP_FIXED|flags, lib->fd, 0) == MAP_FAILED) {
+		munmap(base, reserve);
+		return -1;
+	}
+
+	lib->header = base;
+	lib->file_len = file_len;
+	lib->map_len = reserve;
+	return 0;
+}
+
+/*
+ * Make the mapping of @lib cover the first @file_len bytes of the file, which
+ * already has that length. Growing maps just the new pages, right after the
+ * old ones, so the library stays where it is unless it outgrows its
+ * reservation; shrinking puts the cut off pages back to being just reserved.
+ */
+static int __mlib_library_map_to(struct mlib_library *lib, size_t file_len)
+{
+	size_t page = getpagesize(), start, end;
+	int indexed;
+
+	if (file_len > lib->map_len) {
+		indexed = lib->indexed;
+		__mlib_mapped_del(lib);
+		munmap(lib->header, lib->map_len);
+		if (__mlib_library_map(lib, file_len, 2 * file_len, 0)) {
+			mlib_error("Could not remap library.\n");
+			return -1;
+		}
+		return indexed ? __mlib_mapped_add(lib) : 0;
+	}
+
+	if (file_len > lib->file_len) {
+		/* The old end may be in the middle of a page; map it again. */
+		start = lib->file_len / page * page;
+		if (mmap(((void *)lib->header) + start, file_len - start,
+			 lib->map_prot, lib->map_flags|MAP_FIXED, lib->fd,
+			 start) == MAP_FAILED) {
+			mlib_perror("mmap: %s", MLIB_LIB_NAME(lib));
+			return -1;
+		}
+	} else {
+		start = __mlib_round_up(file_len, page);
+		end = __mlib_round_up(lib->file_len, page);
+		if (start < end &&
+		    mmap(((void *)lib->header) + start, end - start, PROT_NONE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED,
+			 -1, 0) == MAP_FAILED) {
+			mlib_perror("mmap: %s", MLIB_LIB_NAME(lib));
+			return -1;
+		}
+	}
+	lib->file_len = file_len;
+	return 0;
+}
+
+/*
+ * Grow the library file to @file_len bytes and map the new part of it.
+ */
+static int __mlib_library_grow_file(struct mlib_library *lib, size_t file_len)
 {
 	int ret;
-	struct mlib_library_header *new_header;
 
-	if (MLIB_LIB_LEN(lib) >= len)
+	ret = posix_fallocate(lib->fd, lib->file_len,
+			      file_len - lib->file_len);
+	if (ret == EINVAL || ret == EOPNOTSUPP)
+		ret = ftruncate(lib->fd, file_len) ? errno : 0;
+	if (ret) {
+		errno = ret;
+		mlib_perror("fallocate: %s", MLIB_LIB_NAME(lib));
 		return -1;
+	}
 
-	munmap(lib->header, MLIB_LIB_LEN(lib));
+	return __mlib_library_map_to(lib, file_len);
+}
 
-	ret = __mlib_library_expand_fd(lib->fd, len);
-	if (ret < 0)
-		return ret;
+/*
+ * Map the library file again in place with @flags (MAP_SHARED or
+ * MAP_PRIVATE). With MAP_PRIVATE changes stay in memory until they are
+ * written out some other way; see wal.c. The mapping must match the file when
+ * this is called.
+ */
+int __mlib_library_remap(struct mlib_library *lib, int flags)
+{
+	if (mmap(lib->header, lib->file_len, lib->map_prot,
+		 flags|MAP_FIXED, lib->fd, 0) == MAP_FAILED) {
+		mlib_perror("mmap: %s", MLIB_LIB_NAME(lib));
+		return -1;
+	}
+	lib->map_flags = flags;
+	return 0;
+}
 
-	/* Now remap the file in memory. */
-	new_header = mmap(lib->header, len, PROT_READ|PROT_WRITE,
-			  MAP_SHARED, lib->fd, 0);
-	if (new_header == MAP_FAILED) {
-		mlib_error("Could not remap library.\n");
+/*
+ * How far the library file grows past what is needed: an eighth of its size,
+ * but at least MLIB_LIB_CHUNK.
+ */
+static size_t __mlib_library_slack(size_t file_len)
+{
+	return file_len / 8 > MLIB_LIB_CHUNK ? file_len / 8 : MLIB_LIB_CHUNK;
+}
+
+/*
+ * Grow the size of a library to the requested length. If the library is
+ * already bigger than the passed size an error is returned. The new space is
+ * zeroed.
+ *
+ * The file is grown in big preallocated steps, so most calls just bump the
+ * length in the header, and the file is mapped into address space reserved
+ * when it was opened, so the mapping doesn't move (and stays faulted in) when
+ * the file does grow. Either way this costs the same no matter how big the
+ * library is. @lib->header may still change, so pointers into the library
+ * have to be recomputed afterwards.
+ */
+int __mlib_library_expand(struct mlib_library *lib, size_t len)
+{
+	size_t old_len = MLIB_LIB_LEN(lib), file_len;
+
+	if (old_len >= len)
 		return -1;
+	if (len > MLIB_LIB_MAX_LEN(lib)) {
+		mlib_error("%s: library would be bigger than %llu bytes.\n",
+			   MLIB_LIB_NAME(lib),
+			   (unsigned long long)MLIB_LIB_MAX_LEN(lib));
+		return -1;
+	}
+
+	if (len > lib->file_len) {
+		file_len = lib->file_len + __mlib_library_slack(lib->file_len);
+		if (file_len < len)
+			file_len = len;
+		file_len = __mlib_round_up(file_len, MLIB_LIB_CHUNK);
+		if (file_len > lib->map_len && len <= lib->map_len)
+			file_len = lib->map_len;
+		if (__mlib_library_grow_file(lib, file_len))
+			return -1;
 	}
-	lib->header = new_header;
 
+	memset(((void *)lib->header) + old_len, 0, len - old_len);
 	MLIB_LIB_SET_LEN(lib, len);
+	MLIB_LIB_DIRTY_HEADER(lib);
+	__mlib_library_dirty(lib, ((void *)lib->header) + old_len,
+			     len - old_len);
 	return 0;
 }
 
-extern void __mlib_print_bucket_info(struct mlib_bucket *bucket);
+extern void __mlib_print_bucket_info(struct mlib_library *lib,
+				     struct mlib_bucket *bucket);
 /*
  * Insert some blank space into the passed library at @offset. The amount of
  * space to insert is @length bytes.
  */
-int __mlib_library_insert_space(struct mlib_library *lib, uint32_t offset,
+int __mlib_library_insert_space(struct mlib_library *lib, uint64_t offset,
 				uint32_t length)
 {
 	void *lib_start;
-	uint32_t move_len;
-
-	move_len = MLIB_LIB_LEN(lib) - offset;
+	uint64_t old_len;
+	size_t move_len;
 
-	if (__mlib_library_expand(lib, MLIB_LIB_LEN(lib) + length)) {
+	old_len = MLIB_LIB_LEN(lib);
+	move_len = old_len - offset;
+	if (__mlib_library_expand(lib, old_len + length)) {
 		mlib_error("Failed to expand library by %u bytes\n.", length);
 		return -1;
 	}
 
-	/* Now we have space, so push pre-existing data to the end. */
+	/*
+	 * Now we have space, so push pre-existing data to the end. Page
+	 * offsets are only fixed up once nothing can fail any more.
+	 */
+	__mlib_ptree_shift(lib, old_len, offset, length);
 	lib_start = lib->header;
 	memmove(lib_start + offset + length, lib_start + offset, move_len);
 	memset(lib_start + offset, 0, length);
+	__mlib_library_dirty(lib, lib_start + offset, move_len + length);
 
 	return 0;
 }
@@ -128,24 +282,50 @@ int __mlib_library_insert_space(struct mlib_library *lib, uint32_t offset,
  * Will truncate an mlib_library down to the passed size. If the passed size is
  * greater than the current length or less than 1024 (size of mlib header) then
  * less than 0 will be returned. Otherwise, 0 is returned on success, < 0 on
- * error.
+ * error. The file itself is only shrunk once it is well past the end of the
+ * library so that shrinking and growing a little at a time doesn't resize it
+ * over and over.
  */
 int __mlib_library_trunc(struct mlib_library *lib, size_t len)
 {
 	int ret;
+	size_t file_len;
 
 	if (len < 1024 || len > MLIB_LIB_LEN(lib))
 		return -1;
 
-	ret = ftruncate(lib->fd, len);
+	MLIB_LIB_SET_LEN(lib, len);
+	MLIB_LIB_DIRTY_HEADER(lib);
+	if (lib->file_len - len <= 2 * __mlib_library_slack(len))
+		return 0;
+
+	/*
+	 * The file of a journaled library is its last checkpoint, which may
+	 * well be longer than this; the file shrinks when it is closed.
+	 */
+	if (lib->wal)
+		return 0;
+
+	file_len = __mlib_round_up(len, MLIB_LIB_CHUNK);
+	ret = ftruncate(lib->fd, file_len);
 	if (ret < 0)
 		return ret;
-	MLIB_LIB_SET_LEN(lib, len);
-	return 0;
+
+	return __mlib_library_map_to(lib, file_len);
+}
+
+/*
+ * How far offsets stored in a library of format @version are shifted.
+ */
+static int __mlib_library_offs_shift(uint32_t version)
+{
+	return version >= MLIB_LIB_VERSION_WIDE ? MLIB_EXTENT_SHIFT : 0;
 }
 
 /**
- * Create a library from scratch with @name located in @path.
+ * Create a library from scratch with @name located in @path. The library is a
+ * v2 library; see mlib_create_library_version() for ones that may grow past
+ * 4GB.
  *
  * @path:		The path for the library.
  * @name:		The name to give the library.
@@ -153,11 +333,34 @@ int __mlib_library_trunc(struct mlib_library *lib, size_t len)
  */
 int mlib_create_library(const char *path, const char *name,
 			const char *media_prefix)
+{
+	return mlib_create_library_version(path, name, media_prefix,
+					   MLIB_LIB_VERSION_EXTENTS);
+}
+
+/**
+ * Create a library like mlib_create_library() but in format @version, one of
+ * MLIB_LIB_VERSION_*. MLIB_LIB_VERSION_WIDE libraries can grow to 64GB. v1 is
+ * the layout libraries had before v2; there is little reason to create new
+ * ones outside of tests.
+ *
+ * @path:		The path for the library.
+ * @name:		The name to give the library.
+ * @media_prefix:	The prefix to append to media paths if not absolute.
+ * @version:		The library format.
+ */
+int mlib_create_library_version(const char *path, const char *name,
+				const char *media_prefix, uint32_t version)
 {
 	int fd;
 	struct mlib_library_header *header;
 	struct mlib_library lib;
 
+	if (version < MLIB_LIB_VERSION_1 ||
+	    version > MLIB_LIB_VERSION_CURRENT) {
+		mlib_error("Unknown library version %u.\n", version);
+		return -1;
+	}
 	if ((strlen(name) + 1) > MLIB_LIBRARY_LIB_NAME_LEN) {
 		mlib_error("Library name too long.\n");
 		return -1;
@@ -176,28 +379,34 @@ int mlib_create_library(const char *path, const char *name,
 
 	__mlib_library_expand_fd(fd, 1024);
 
-	header = mmap(NULL, 1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (!header) {
+	memset(&lib, 0, sizeof(lib));
+	lib.fd = fd;
+	lib.map_prot = PROT_READ|PROT_WRITE;
+	lib.map_flags = MAP_SHARED;
+	if (__mlib_library_map(&lib, 1024, 0, 0)) {
 		mlib_perror("mmap: %s", path);
 		goto fail;
 	}
+	header = lib.header;
 
-	memset(header, MLIB_HEADER_SIZE, 0);
+	memset(header, 0, MLIB_HEADER_SIZE);
 	__mlib_writel(&header->mlib_magic, MLIB_MAGIC);
 	__mlib_writel(&header->media_count, 0);
 	__mlib_writel(&header->lib_len, 1024);
 	memcpy(header->lib_name, name, strlen(name) + 1);
 	memcpy(header->media_prefix, media_prefix, strlen(media_prefix) + 1);
+	__mlib_writel(&header->version, version);
+	lib.offs_shift = __mlib_library_offs_shift(version);
 
 	/* Make the global playlist .global - Doesn't need to be in the list
 	 * for mlib_start_playlist() to work. */
-	lib.header = header;
-	lib.fd = fd;
 	mlib_start_playlist(&lib, ".global");
 
 	/* Sync and close. */
-	msync(header, MLIB_HEADER_SIZE, MS_SYNC);
-	munmap(header, MLIB_LIB_LEN(&lib));
+	msync(lib.header, MLIB_LIB_LEN(&lib), MS_SYNC);
+	if (ftruncate(fd, MLIB_LIB_LEN(&lib)))
+		mlib_perror("ftruncate: %s", path);
+	munmap(lib.header, lib.map_len);
 	close(fd);
 	return 0;
 
@@ -207,139 +416,944 @@ fail:
 }
 
 /*
- * Open a local library.
+ * Hash a library name. Same 32 bit FNV-1a as the playlist directory.
  */
-struct mlib_library *__mlib_open_local_lib(const char *lib_name)
+static uint32_t __mlib_registry_hash(const char *name)
 {
-	struct stat sb;
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static struct mlib_library *__mlib_registry_find(const char *name)
+{
+	struct hlist_node *node;
 	struct mlib_library *lib;
-	struct mlib_library_header *header;
+	uint32_t slot;
 
-	lib = malloc(sizeof(struct mlib_library));
-	if (!lib) {
-		mlib_perror("malloc: %s", lib_name);
+	if (!registry_size)
 		return NULL;
+	slot = __mlib_registry_hash(name) & (registry_size - 1);
+	hlist_for_each_entry(lib, node, &registry[slot], hash)
+		if (strcmp(lib->name, name) == 0)
+			return lib;
+	return NULL;
+}
+
+/*
+ * Add @lib to the registry under @lib->name, doubling the table once there
+ * are more libraries than slots.
+ */
+static int __mlib_registry_add(struct mlib_library *lib)
+{
+	struct hlist_head *table;
+	struct hlist_node *node, *tmp;
+	struct mlib_library *cur;
+	uint32_t size, slot, i;
+
+	if (nr_libraries >= registry_size) {
+		size = registry_size ? registry_size * 2 : 64;
+		table = calloc(size, sizeof(*table));
+		if (!table) {
+			mlib_perror("malloc: %s", lib->path);
+			return -1;
+		}
+		for (i = 0; i < registry_size; i++)
+			hlist_for_each_entry_safe(cur, node, tmp, &registry[i],
+						  hash) {
+				slot = __mlib_registry_hash(cur->name) &
+					(size - 1);
+				hlist_del(&cur->hash);
+				hlist_add_head(&cur->hash, &table[slot]);
+			}
+		free(registry);
+		registry = table;
+		registry_size = size;
+	}
+
+	slot = __mlib_registry_hash(lib->name) & (registry_size - 1);
+	hlist_add_head(&lib->hash, &registry[slot]);
+	list_add_tail(&lib->list, &library_list);
+	nr_libraries++;
+	return 0;
+}
+
+static void __mlib_registry_del(struct mlib_library *lib)
+{
+	hlist_del(&lib->hash);
+	list_del(&lib->list);
+	nr_libraries--;
+}
+
+/*
+ * Index of the first mapped library that starts at or after @addr.
+ */
+static uint32_t __mlib_mapped_pos(const void *addr)
+{
+	uint32_t lo = 0, hi = nr_mapped, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((const void *)mapped[mid]->header < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Put @lib, which has just been mapped, into the address index that
+ * mlib_library_of() searches.
+ */
+static int __mlib_mapped_add(struct mlib_library *lib)
+{
+	struct mlib_library **tmp;
+	uint32_t pos;
+
+	if (nr_mapped == mapped_size) {
+		tmp = realloc(mapped, (mapped_size ? mapped_size * 2 : 64) *
+			      sizeof(*mapped));
+		if (!tmp) {
+			mlib_perror("malloc: %s", lib->path);
+			return -1;
+		}
+		mapped = tmp;
+		mapped_size = mapped_size ? mapped_size * 2 : 64;
 	}
 
-	lib->fd = open(lib_name, O_RDWR);
+	pos = __mlib_mapped_pos(lib->header);
+	memmove(&mapped[pos + 1], &mapped[pos],
+		(nr_mapped - pos) * sizeof(*mapped));
+	mapped[pos] = lib;
+	nr_mapped++;
+	lib->indexed = 1;
+	return 0;
+}
+
+static void __mlib_mapped_del(struct mlib_library *lib)
+{
+	uint32_t pos;
+
+	if (!lib->indexed)
+		return;
+	pos = __mlib_mapped_pos(lib->header);
+	memmove(&mapped[pos], &mapped[pos + 1],
+		(nr_mapped - pos - 1) * sizeof(*mapped));
+	nr_mapped--;
+	lib->indexed = 0;
+}
+
+/*
+ * Check the header of the library just mapped at @lib->header, pick up what
+ * is needed from it and make the library findable by address. The first time
+ * a library is mapped its name is checked against the registry and recorded;
+ * after that it has to stay the same. Returns 0 on success, < 0 on failure.
+ */
+static int __mlib_library_attach_header(struct mlib_library *lib)
+{
+	struct mlib_library_header *header = lib->header;
+
+	/*
+	 * The fields at the end of the header used to be the end of
+	 * media_prefix. A library whose prefix runs into them is from before
+	 * they were taken and can't be read.
+	 */
+	if (!memchr(header->media_prefix, 0, MLIB_LIBRARY_MEDIA_PREFIX_LEN)) {
+		mlib_error("%s: media prefix is too long.\n", lib->path);
+		return -1;
+	}
+	if (MLIB_LIB_VERSION(lib) > MLIB_LIB_VERSION_CURRENT) {
+		mlib_error("%s: unsupported library version %u.\n", lib->path,
+			   MLIB_LIB_VERSION(lib));
+		return -1;
+	}
+	if (lib->read_only && !__mlib_readl(&header->version)) {
+		mlib_error("%s: library is in the old format; open it "
+			   "read-write once to upgrade it.\n", lib->path);
+		return -1;
+	}
+	lib->generation = __mlib_readl(&header->generation);
+	lib->offs_shift = __mlib_library_offs_shift(MLIB_LIB_VERSION(lib));
+
+	if (!lib->name[0]) {
+		/* Make sure the library is not already open. */
+		memcpy(lib->name, header->lib_name, sizeof(lib->name) - 1);
+		if (__mlib_registry_find(lib->name)) {
+			mlib_error("Library %s is already open.\n", lib->name);
+			lib->name[0] = 0;
+			return -1;
+		}
+	} else if (strncmp(lib->name, header->lib_name, sizeof(lib->name))) {
+		mlib_error("%s: library was renamed under us.\n", lib->path);
+		return -1;
+	}
+
+	return __mlib_mapped_add(lib);
+}
+
+/*
+ * Map a local library in. @lib->path, @lib->read_only and @lib->ro_flags say
+ * what to open and how; see mlib_open_library_ro() for the flags.
+ */
+static int __mlib_attach_local(struct mlib_library *lib)
+{
+	struct stat sb;
+	struct mlib_library_header *header;
+	int read_only = lib->read_only, ro_flags = lib->ro_flags;
+
+	lib->fd = open(lib->path, read_only ? O_RDONLY : O_RDWR);
 	if (lib->fd < 0) {
-		mlib_perror("open: %s", lib_name);
-		goto fail;
+		mlib_perror("open: %s", lib->path);
+		return -1;
 	}
 
+	/* Finish a checkpoint a crash cut short before reading anything. */
+	if (!read_only && __mlib_wal_recover(lib->path, lib->fd))
+		goto fail;
+
 	if (fstat(lib->fd, &sb) == -1) {
-		mlib_perror("fstat: %s", lib_name);
-		goto fail_2;
+		mlib_perror("fstat: %s", lib->path);
+		goto fail;
 	}
 	if (sb.st_size < 1024) {
-		mlib_error("%s: not an mlib library.\n", lib_name);
-		goto fail_2;
+		mlib_error("%s: not an mlib library.\n", lib->path);
+		goto fail;
 	}
 
-	header = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
-		      lib->fd, 0); 
-	if (header == MAP_FAILED) {
-		mlib_perror("mmap: %s", lib_name);
-		goto fail_2;
+	lib->map_prot = read_only ? PROT_READ : PROT_READ|PROT_WRITE;
+	lib->map_flags = MAP_SHARED;
+	if (__mlib_library_map(lib, sb.st_size, 2 * sb.st_size,
+			       ro_flags & MLIB_RO_POPULATE ? MAP_POPULATE : 0)) {
+		mlib_perror("mmap: %s", lib->path);
+		goto fail;
 	}
+	header = lib->header;
 	if (__mlib_readl(&header->mlib_magic) != MLIB_MAGIC) {
-		mlib_error("%s: not an mlib library.\n", lib_name);
+		mlib_error("%s: not an mlib library.\n", lib->path);
 		goto fail_2;
 	}
-
-	/* Make sure the library is not already open. */
-	if (__mlib_library_already_open(header)) {
-		mlib_error("Library %s is already open.\n", header->lib_name);
+	if (__mlib_library_attach_header(lib))
 		goto fail_2;
+	if (MLIB_LIB_LEN(lib) > (uint64_t)sb.st_size) {
+		mlib_error("%s: library is truncated.\n", lib->path);
+		goto fail_3;
 	}
 
-	lib->header = header;
-	list_add_tail(&lib->list, &library_list);
-	return lib;
+	/*
+	 * Nothing below writes to a read-only library. A journaled one is read
+	 * as of its last checkpoint; the log is left to the writer.
+	 */
+	if (read_only) {
+		if ((ro_flags & MLIB_RO_WILLNEED) &&
+		    madvise(lib->header, lib->file_len, MADV_WILLNEED))
+			mlib_perror("madvise: %s - warning", lib->path);
+		return 0;
+	}
+
+	/*
+	 * Journaled libraries are only written through checkpoints; until then
+	 * changes stay in memory and in the log.
+	 */
+	if ((MLIB_LIB_FLAGS(lib) & MLIB_LIB_F_JOURNAL) &&
+	    __mlib_library_remap(lib, MAP_PRIVATE))
+		goto fail_3;
+
+	/* Libraries from before there were versions get new bucket headers. */
+	if (mlib_upgrade_playlists(lib)) {
+		mlib_error("%s: failed to upgrade library.\n", lib->path);
+		goto fail_3;
+	}
+
+	/* v2 libraries from before there were directories get one now. */
+	if (mlib_dir_build(lib)) {
+		mlib_error("%s: failed to build playlist directory.\n",
+			   lib->path);
+		goto fail_3;
+	}
 
+	/* Replay whatever didn't make it into the library file. */
+	if ((MLIB_LIB_FLAGS(lib) & MLIB_LIB_F_JOURNAL) &&
+	    __mlib_wal_open(lib, 1))
+		goto fail_3;
+	return 0;
+
+fail_3:
+	__mlib_mapped_del(lib);
 fail_2:
+	munmap(lib->header, lib->map_len);
+	lib->header = NULL;
+fail:
 	close(lib->fd);
+	lib->fd = -1;
+	return -1;
+}
+
+/*
+ * Map the library served at @lib->path in. Only its header is fetched here;
+ * the rest is fetched as it is read, see remote.c.
+ */
+static int __mlib_attach_remote(struct mlib_library *lib)
+{
+	lib->fd = -1;
+	lib->map_prot = PROT_READ;
+	lib->map_flags = MAP_PRIVATE;
+	if (__mlib_remote_open(lib, lib->path))
+		return -1;
+	if (__mlib_library_attach_header(lib)) {
+		__mlib_remote_close(lib);
+		lib->header = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write @lib out and unmap it, giving up its file descriptor. The library
+ * stays in the registry and is mapped again when next used. Returns 0 on
+ * success and < 0 if it could not be synced; it is unmapped either way.
+ */
+static int __mlib_library_detach(struct mlib_library *lib)
+{
+	int ret;
+
+	/* Write everything to the library file and drop the log. */
+	if (lib->wal && __mlib_wal_close(lib))
+		mlib_error("Failed to checkpoint %s - warning\n", lib->name);
+
+	ret = mlib_sync_library(lib);
+	if (ret)
+		mlib_perror("msync - warning");
+
+	/*
+	 * Drop the preallocated space past the end of the library. Other
+	 * processes may still be using it, so only do that under the write
+	 * lock; they remap when they see the new generation. Closing must not
+	 * wait on readers though, so if the lock is busy the space stays and
+	 * the next writer to close the library trims it.
+	 */
+	if (!lib->read_only && lib->file_len > MLIB_LIB_LEN(lib)) {
+		if (lib->lock != MLIB_LOCK_WRITE) {
+			mlib_library_unlock(lib);
+			if (flock(lib->fd, LOCK_EX|LOCK_NB) == 0) {
+				lib->lock = MLIB_LOCK_WRITE;
+				if (__mlib_readl(&lib->header->generation) !=
+				    lib->generation &&
+				    __mlib_library_refresh(lib))
+					mlib_library_unlock(lib);
+			}
+		}
+		if (lib->lock == MLIB_LOCK_WRITE &&
+		    lib->file_len > MLIB_LIB_LEN(lib) &&
+		    ftruncate(lib->fd, MLIB_LIB_LEN(lib)))
+			mlib_perror("ftruncate - warning");
+	}
+	mlib_library_unlock(lib);
+
+	__mlib_mapped_del(lib);
+	list_del_init(&lib->lru);
+	if (lib->remote) {
+		__mlib_remote_close(lib);
+	} else {
+		munmap(lib->header, lib->map_len);
+		close(lib->fd);
+	}
+	lib->header = NULL;
+	lib->fd = -1;
+	lib->nr_dirty = 0;
+	return ret;
+}
+
+/*
+ * Unmap idle libraries, least recently used first, until no more than
+ * max_mapped libraries are mapped. Locked libraries are left alone.
+ */
+static void __mlib_library_evict(void)
+{
+	struct mlib_library *lib, *tmp;
+
+	list_for_each_entry_safe(lib, tmp, &idle_list, lru) {
+		if (nr_mapped <= max_mapped)
+			break;
+		if (lib->lock)
+			continue;
+		if (__mlib_library_detach(lib))
+			mlib_error("Failed to sync %s - warning\n", lib->name);
+		registry_stats.unmaps++;
+	}
+}
+
+/*
+ * Map @lib in if it isn't. Mapping a library in may unmap idle ones.
+ */
+static int __mlib_library_attach(struct mlib_library *lib)
+{
+	int ret;
+
+	if (lib->header)
+		return 0;
+
+	ret = lib->is_remote ? __mlib_attach_remote(lib) :
+		__mlib_attach_local(lib);
+	if (ret)
+		return -1;
+	registry_stats.maps++;
+	__mlib_library_evict();
+	return 0;
+}
+
+/*
+ * Set up an unmapped library for @path.
+ */
+static struct mlib_library *__mlib_library_alloc(const char *path,
+						 int read_only, int ro_flags,
+						 int remote)
+{
+	struct mlib_library *lib;
+
+	lib = calloc(1, sizeof(struct mlib_library));
+	if (!lib) {
+		mlib_perror("malloc: %s", path);
+		return NULL;
+	}
+	lib->path = strdup(path);
+	if (!lib->path) {
+		mlib_perror("malloc: %s", path);
+		free(lib);
+		return NULL;
+	}
+	lib->fd = -1;
+	lib->read_only = read_only || remote;
+	lib->ro_flags = ro_flags;
+	lib->is_remote = remote;
+	INIT_LIST_HEAD(&lib->lru);
+	return lib;
+}
+
+/*
+ * Open a library, map it and add it to the registry. The caller gets the
+ * one reference. With @read_only set the library is mapped read-only and
+ * @ro_flags (MLIB_RO_*) say how to warm the mapping up; see
+ * mlib_open_library_ro(). Remote libraries are always read-only.
+ */
+static struct mlib_library *__mlib_open(const char *path, int read_only,
+					int ro_flags, int remote)
+{
+	struct mlib_library *lib;
+
+	lib = __mlib_library_alloc(path, read_only, ro_flags, remote);
+	if (!lib)
+		return NULL;
+
+	if (__mlib_library_attach(lib))
+		goto fail;
+	if (__mlib_registry_add(lib)) {
+		__mlib_library_detach(lib);
+		goto fail;
+	}
+	lib->refs = 1;
+	return lib;
+
 fail:
+	free(lib->path);
 	free(lib);
 	return NULL;
 }
 
+/*
+ * Open a local library for reading and writing.
+ */
+struct mlib_library *__mlib_open_local_lib(const char *lib_name)
+{
+	return __mlib_open(lib_name, 0, 0, 0);
+}
+
+/**
+ * Open the local library at @path read-only, for processes that only query
+ * it. The file is mapped PROT_READ and MAP_SHARED so every reader shares the
+ * one copy in the page cache, and nothing is ever written back. Anything that
+ * would change the library fails. Returns the library or NULL on failure.
+ *
+ * By default pages are faulted in as they are first read. @flags can ask for
+ * more up front:
+ *
+ *   MLIB_RO_POPULATE	Fault the whole library in before returning.
+ *   MLIB_RO_WILLNEED	Start reading it in the background and return.
+ *
+ * @path	Path to the library file.
+ * @flags	MLIB_RO_* flags or 0.
+ */
+struct mlib_library *mlib_open_library_ro(const char *path, int flags)
+{
+	return __mlib_open(path, 1, flags, 0);
+}
+
 /**
  * Open an MLib library pointed to by @location. If @remote is set then the
- * location is assumed to be a URL of some kind. Otherwise the library is
- * assumed to be a local file. Returns a pointer to the library on success or
+ * location is a URL, e.g http://host/music.lib, and the library is fetched
+ * from there piece by piece as it is read; the server has to support Range
+ * requests. Otherwise the library is assumed to be a local file. Remote
+ * libraries are read-only. Returns a pointer to the library on success or
  * NULL on failure.
  *
- * @url		A URL to access.
- * @remote	Set to 1 if the library is remote.
+ * The library comes with one reference, so it stays mapped until it is
+ * closed; see mlib_library_put() for letting it go idle instead.
+ *
+ * @location	A path or URL to access.
+ * @remote	MLIB_REMOTE if the library is remote, MLIB_LOCAL if not.
  */
 struct mlib_library *mlib_open_library(const char *location, int remote)
 {
-	CURL *curl __attribute__((unused));
+	return __mlib_open(location, 0, 0, remote);
+}
 
-	if (remote) {
-		/* TODO: support remote URLs. */
-		mlib_error("Remotes not yet supported.\n");
+/**
+ * Register the local library at @path without mapping it. Only its header is
+ * read, to learn its name; the file is opened and mapped the first time the
+ * library is used, i.e by mlib_library_hold(), mlib_library_get() or
+ * mlib_find_library(). Meant for processes with many more libraries than
+ * they use at once. Returns the library, with no references, or NULL on
+ * failure.
+ *
+ * @path	Path to the library file.
+ */
+struct mlib_library *mlib_open_library_lazy(const char *path)
+{
+	struct mlib_library_header header;
+	struct mlib_library *lib, tmp = { .header = &header };
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		mlib_perror("open: %s", path);
 		return NULL;
-	} else {
-		return __mlib_open_local_lib(location);
 	}
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    __mlib_readl(&header.mlib_magic) != MLIB_MAGIC) {
+		mlib_error("%s: not an mlib library.\n", path);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	if (MLIB_LIB_VERSION(&tmp) > MLIB_LIB_VERSION_CURRENT) {
+		mlib_error("%s: unsupported library version %u.\n", path,
+			   MLIB_LIB_VERSION(&tmp));
+		return NULL;
+	}
+
+	lib = __mlib_library_alloc(path, 0, 0, 0);
+	if (!lib)
+		return NULL;
+	memcpy(lib->name, header.lib_name, sizeof(lib->name) - 1);
+	if (__mlib_registry_find(lib->name)) {
+		mlib_error("Library %s is already open.\n", lib->name);
+		goto fail;
+	}
+	if (__mlib_registry_add(lib))
+		goto fail;
+	return lib;
+
+fail:
+	free(lib->path);
+	free(lib);
+	return NULL;
 }
 
 /**
- * Close a library. Returns 0 on succes, -1 otherwise.
+ * Take a reference to @lib, mapping it in first if it isn't mapped. A
+ * library with references is never unmapped behind your back; give the
+ * reference back with mlib_library_put() once done with the library and any
+ * pointers into it. Returns 0 on success, < 0 if the library could not be
+ * mapped.
  *
- * @lib:	The library to close.
+ * @lib		The library.
  */
-int mlib_close_library(struct mlib_library *lib)
+int mlib_library_hold(struct mlib_library *lib)
 {
-	int ret;
+	if (__mlib_library_attach(lib))
+		return -1;
+	if (!lib->refs++)
+		list_del_init(&lib->lru);
+	return 0;
+}
 
-	list_del(&lib->list);
+/**
+ * Find the library called @name and take a reference to it; see
+ * mlib_library_hold(). Returns the library or NULL if there is no such
+ * library or it could not be mapped.
+ *
+ * @name	The name of the library.
+ */
+struct mlib_library *mlib_library_get(const char *name)
+{
+	struct mlib_library *lib = __mlib_registry_find(name);
 
-	ret = mlib_sync_library(lib);
-	if (ret)
-		mlib_perror("msync - warning");
-	munmap(lib->header, MLIB_LIB_LEN(lib));
+	if (!lib || mlib_library_hold(lib))
+		return NULL;
+	return lib;
+}
 
-	close(lib->fd);
+/**
+ * Give back a reference taken with mlib_library_hold() or mlib_library_get(),
+ * or the one mlib_open_library() returns with. Once nobody holds a library
+ * it is idle: it stays mapped, but once more than the limit set with
+ * mlib_library_set_max_mapped() are mapped the idle ones that were used
+ * longest ago are unmapped.
+ *
+ * @lib		The library.
+ */
+void mlib_library_put(struct mlib_library *lib)
+{
+	if (!lib->refs) {
+		mlib_error("%s: put without a reference.\n", lib->name);
+		return;
+	}
+	if (--lib->refs)
+		return;
+	if (lib->header)
+		list_add_tail(&lib->lru, &idle_list);
+	__mlib_library_evict();
+}
+
+/**
+ * Keep at most @nr libraries mapped, as far as references allow; see
+ * mlib_library_put(). Idle libraries over the new limit are unmapped right
+ * away. The default is MLIB_LIB_MAX_MAPPED.
+ *
+ * @nr		The most libraries to keep mapped; at least 1.
+ */
+void mlib_library_set_max_mapped(uint32_t nr)
+{
+	max_mapped = nr ? nr : 1;
+	__mlib_library_evict();
+}
+
+/**
+ * Copy the registry counters into @stats: how many libraries are open, how
+ * many of those are mapped and how often libraries were mapped in and
+ * unmapped for being idle.
+ *
+ * @stats	Where to put the counters.
+ */
+void mlib_registry_stats(struct mlib_registry_stats *stats)
+{
+	*stats = registry_stats;
+	stats->libraries = nr_libraries;
+	stats->mapped = nr_mapped;
+}
+
+/**
+ * Close a library. Returns 0 on succes, -1 otherwise. The library is closed
+ * whatever references are still held to it.
+ *
+ * @lib:	The library to close.
+ */
+int mlib_close_library(struct mlib_library *lib)
+{
+	int ret = 0;
+
+	if (lib->header)
+		ret = __mlib_library_detach(lib);
+	__mlib_registry_del(lib);
+	free(lib->path);
 	free(lib);
 	return ret;
 }
 
+/*
+ * Check that @lib may be changed. Returns 0 if so and < 0, with an error
+ * printed, if it was opened read-only.
+ */
+int __mlib_library_writable(const struct mlib_library *lib)
+{
+	if (lib->read_only) {
+		mlib_user_error("%s is open read-only.\n", MLIB_LIB_NAME(lib));
+		return -1;
+	}
+	return 0;
+}
+
 /**
  * Find the pointer to the library with the passed @name. Returns a pointer to
- * the named libray if it exists or NULL if not.
+ * the named libray if it exists or NULL if not. A library that isn't mapped
+ * is mapped in, but no reference is taken: the library may be unmapped again
+ * once other libraries are mapped in, so use mlib_library_get() to keep it
+ * for longer.
  *
  * @name	The name of the library.
  */
 struct mlib_library *mlib_find_library(const char *name)
 {
-	int name_len;
-	struct list_head *elem;
+	struct mlib_library *lib = __mlib_registry_find(name);
+
+	if (!lib || __mlib_library_attach(lib))
+		return NULL;
+
+	/* Used just now; the last idle library to go. */
+	if (!lib->refs)
+		list_move_tail(&lib->lru, &idle_list);
+	return lib;
+}
+
+/**
+ * Find the open library whose mapping contains @addr; e.g the library a
+ * playlist lives in. Returns NULL if @addr is not in any mapped library.
+ *
+ * @addr	An address inside a library.
+ */
+struct mlib_library *mlib_library_of(const void *addr)
+{
 	struct mlib_library *lib;
+	uint32_t pos;
 
-	list_for_each(elem, &library_list) {
-		lib = list_entry(elem, struct mlib_library, list);
+	/* The last library that starts at or before @addr. */
+	pos = __mlib_mapped_pos(addr);
+	if (pos < nr_mapped && (const void *)mapped[pos]->header == addr)
+		pos++;
+	if (!pos)
+		return NULL;
+	lib = mapped[pos - 1];
+	if (addr < ((void *)lib->header) + MLIB_LIB_LEN(lib))
+		return lib;
+	return NULL;
+}
 
-		/* Print some useful info. */
-		name_len = strlen(MLIB_LIB_NAME(lib));
-		if (strncmp(name, MLIB_LIB_NAME(lib), name_len) == 0)
-			return lib;
+/*
+ * Note that the @len bytes at @addr in @lib have been written to, so that
+ * mlib_sync_library() flushes them. Everything that writes to a library calls
+ * this; the ranges are kept in pages, sorted, with neighbouring and
+ * overlapping ones merged. Journaled libraries never write the file through
+ * the mapping so nothing is tracked for them. @lib may be NULL, for buckets
+ * that aren't in an open library.
+ */
+void __mlib_library_dirty(struct mlib_library *lib, const void *addr,
+			  size_t len)
+{
+	struct mlib_dirty_range *r;
+	size_t page = getpagesize(), offs;
+	uint32_t start, end;
+	int i, j, best;
+
+	if (!lib || lib->wal || !len)
+		return;
+
+	offs = addr - (void *)lib->header;
+	start = offs / page;
+	end = (offs + len + page - 1) / page;
+
+	/* Find the first range that doesn't end before @start. */
+	r = lib->dirty;
+	for (i = 0; i < lib->nr_dirty && r[i].end < start; i++)
+		;
+
+	if (i < lib->nr_dirty && r[i].start <= end) {
+		if (start < r[i].start)
+			r[i].start = start;
+		if (end <= r[i].end)
+			return;
+
+		/* Swallow the ranges the new end reaches. */
+		r[i].end = end;
+		for (j = i + 1; j < lib->nr_dirty && r[j].start <= end; j++)
+			if (r[j].end > end)
+				r[i].end = r[j].end;
+		memmove(&r[i + 1], &r[j], (lib->nr_dirty - j) * sizeof(*r));
+		lib->nr_dirty -= j - i - 1;
+		return;
 	}
 
-	return NULL;
+	memmove(&r[i + 1], &r[i], (lib->nr_dirty - i) * sizeof(*r));
+	r[i].start = start;
+	r[i].end = end;
+	if (++lib->nr_dirty <= MLIB_LIB_DIRTY_RANGES)
+		return;
+
+	/* One too many: merge the two ranges with the smallest gap. */
+	best = 0;
+	for (i = 1; i < lib->nr_dirty - 1; i++)
+		if (r[i + 1].start - r[i].end <
+		    r[best + 1].start - r[best].end)
+			best = i;
+	r[best].end = r[best + 1].end;
+	memmove(&r[best + 1], &r[best + 2],
+		(lib->nr_dirty - best - 2) * sizeof(*r));
+	lib->nr_dirty--;
+}
+
+/*
+ * Start writeback of one dirty range. With sync_file_range() the range is
+ * queued and the caller makes it durable with a single fdatasync(); every
+ * msync(MS_SYNC) would be its own journal commit.
+ */
+static int __mlib_library_flush_range(struct mlib_library *lib, size_t start,
+				      size_t len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	return sync_file_range(lib->fd, start, len, SYNC_FILE_RANGE_WRITE);
+#else
+	return msync(((void *)lib->header) + start, len, MS_SYNC);
+#endif
 }
 
 /**
- * Sync a library to disk. Returns the error code from the mysnc() call: that
- * is 0 on success, < 0 on failure.
+ * Sync a library to disk. Only the pages written since the last sync are
+ * flushed: writeback is started for each dirty range and then waited for
+ * with one fdatasync(). Returns 0 on success, < 0 on failure; anything not
+ * flushed stays dirty. For a journaled library this just commits the log.
  *
  * @lib		The library to sync.
  */
-int mlib_sync_library(const struct mlib_library *lib)
+int mlib_sync_library(struct mlib_library *lib)
+{
+	size_t page = getpagesize(), start, end, limit;
+	uint64_t bytes = 0;
+	int i;
+
+	if (lib->wal)
+		return mlib_journal_commit(lib);
+
+	/* Ranges past the end of a truncated file are gone anyway. */
+	limit = __mlib_round_up(lib->file_len, page);
+	for (i = 0; i < lib->nr_dirty; i++) {
+		start = (size_t)lib->dirty[i].start * page;
+		end = (size_t)lib->dirty[i].end * page;
+		if (end > limit)
+			end = limit;
+		if (start >= end)
+			continue;
+		if (__mlib_library_flush_range(lib, start, end - start)) {
+			memmove(lib->dirty, &lib->dirty[i],
+				(lib->nr_dirty - i) * sizeof(*lib->dirty));
+			lib->nr_dirty -= i;
+			return -1;
+		}
+		bytes += end - start;
+	}
+	if (bytes && fdatasync(lib->fd))
+		return -1;
+
+	lib->nr_dirty = 0;
+	lib->sync_stats.syncs++;
+	lib->sync_stats.bytes += bytes;
+	lib->sync_stats.last_bytes = bytes;
+	return 0;
+}
+
+/**
+ * Copy the sync counters of @lib into @stats: how many times it was synced
+ * and how many bytes those syncs flushed.
+ *
+ * @lib		The library.
+ * @stats	Where to put the counters.
+ */
+void mlib_library_sync_stats(const struct mlib_library *lib,
+			     struct mlib_sync_stats *stats)
+{
+	*stats = lib->sync_stats;
+}
+
+/*
+ * Catch up with changes another process made to the library file: if it grew
+ * or shrank, map the new length. The library may move.
+ */
+static int __mlib_library_refresh(struct mlib_library *lib)
+{
+	struct stat sb;
+
+	if (fstat(lib->fd, &sb)) {
+		mlib_perror("fstat: %s", lib->path);
+		return -1;
+	}
+	if ((size_t)sb.st_size != lib->file_len &&
+	    __mlib_library_map_to(lib, sb.st_size))
+		return -1;
+	lib->generation = __mlib_readl(&lib->header->generation);
+	return 0;
+}
+
+/**
+ * Lock @lib against other processes that have the same library file open.
+ * Any number of processes can hold MLIB_LOCK_READ at once; MLIB_LOCK_WRITE
+ * shuts everyone else out. Hold a read lock while reading the library and a
+ * write lock while changing it, and don't keep pointers into the library
+ * across an unlock: once the lock is taken again the library may have been
+ * resized by someone else and moved here. Locks are flock()s of the file so
+ * they go away with a process that dies holding them. Returns 0 on success,
+ * < 0 on failure.
+ *
+ * Taking the lock checks the generation in the header; if another process
+ * has given up the write lock since, the file is looked at again and mapped
+ * at its new length. A journaled library keeps its changes in a private
+ * mapping until it is checkpointed, so other processes only ever see it as
+ * of its last checkpoint.
+ *
+ * @lib		The library.
+ * @mode	MLIB_LOCK_READ or MLIB_LOCK_WRITE.
+ */
+int mlib_library_lock(struct mlib_library *lib, int mode)
+{
+	int ret;
+
+	if (lib->lock) {
+		mlib_error("%s is already locked.\n", MLIB_LIB_NAME(lib));
+		return -1;
+	}
+	if (mode == MLIB_LOCK_WRITE && __mlib_library_writable(lib))
+		return -1;
+
+	/* Nobody changes a remote library under us; there's no file. */
+	if (lib->remote) {
+		lib->lock = mode;
+		return 0;
+	}
+
+	do {
+		ret = flock(lib->fd, mode == MLIB_LOCK_WRITE ?
+			    LOCK_EX : LOCK_SH);
+	} while (ret && errno == EINTR);
+	if (ret) {
+		mlib_perror("flock: %s", lib->path);
+		return -1;
+	}
+	lib->lock = mode;
+
+	if (!lib->wal &&
+	    __mlib_readl(&lib->header->generation) != lib->generation &&
+	    __mlib_library_refresh(lib)) {
+		mlib_library_unlock(lib);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Give up the lock taken with mlib_library_lock(). Giving up a write lock
+ * bumps the generation so other processes notice the change. Returns 0 on
+ * success, < 0 on failure.
+ *
+ * @lib		The library.
+ */
+int mlib_library_unlock(struct mlib_library *lib)
 {
-	return msync(lib->header, MLIB_LIB_LEN(lib), MS_SYNC);
+	if (!lib->lock)
+		return 0;
+
+	if (lib->lock == MLIB_LOCK_WRITE) {
+		lib->generation = __mlib_readl(&lib->header->generation) + 1;
+		__mlib_writel(&lib->header->generation, lib->generation);
+		MLIB_LIB_DIRTY_HEADER(lib);
+	}
+
+	lib->lock = 0;
+	if (!lib->remote && flock(lib->fd, LOCK_UN)) {
+		mlib_perror("flock: %s", lib->path);
+		return -1;
+	}
+	return 0;
 }
 
 /*
@@ -353,7 +1367,7 @@ int mlib_sync_library(const struct mlib_library *lib)
  */
 int __mlib_library_excise(struct mlib_library *lib, void *start, void *end)
 {
-	uint32_t bytes;
+	size_t bytes;
 	size_t libend;
 	void *lib_start, *lib_end;
 
@@ -362,28 +1376,201 @@ int __mlib_library_excise(struct mlib_library *lib, void *start, void *end)
 
 	bytes = lib_end - end;
 	memmove(start, end, bytes);
+	__mlib_library_dirty(lib, start, bytes);
 
 	libend = MLIB_LIB_LEN(lib) - (end - start);
+	__mlib_ptree_shift(lib, libend, end - lib_start,
+			   -(int32_t)(end - start));
 	return __mlib_library_trunc(lib, libend);
 }
 
 /*
- * Command to open a library. Right now only accepts the following usage:
+ * Records are the playlists and pages that make up a library. In a v1 library
+ * they sit back to back after the header; in a v2 library each one has an
+ * extent of its own. The functions below hide the difference. Records are
+ * referred to by their offset in the library and always start with a magic
+ * and a length, like struct mlib_playlist does.
+ */
+#define __mlib_record(lib, rec)						\
+	((struct mlib_playlist *)(((void *)(lib)->header) + (rec)))
+
+/*
+ * Allocate a zeroed record of @len bytes. Returns the offset of the record or
+ * 0 on failure. The caller fills in the magic and length.
+ */
+uint64_t __mlib_library_alloc_record(struct mlib_library *lib, uint32_t len)
+{
+	uint64_t rec;
+
+	if (MLIB_LIB_EXTENTS(lib))
+		return __mlib_extent_alloc(lib, len);
+
+	rec = MLIB_LIB_LEN(lib);
+	if (__mlib_library_expand(lib, rec + len))
+		return 0;
+	return rec;
+}
+
+/*
+ * Free the record at @rec. In a v1 library everything after it moves down.
+ */
+int __mlib_library_free_record(struct mlib_library *lib, uint64_t rec)
+{
+	void *start = __mlib_record(lib, rec);
+
+	if (MLIB_LIB_EXTENTS(lib)) {
+		__mlib_extent_free(lib, rec);
+		return 0;
+	}
+
+	return __mlib_library_excise(lib, start,
+				     start + MLIB_PLIST_LEN(__mlib_record(lib,
+									 rec)));
+}
+
+/*
+ * Insert @length zeroed bytes into the record at *@rec, @offset bytes from its
+ * start. The caller updates the length of the record afterwards. In a v2
+ * library the record may have to move, in which case *@rec is updated; in a
+ * v1 library the rest of the library moves instead.
+ */
+int __mlib_library_grow_record(struct mlib_library *lib, uint64_t *rec,
+			       uint32_t offset, uint32_t length)
+{
+	uint64_t old = *rec;
+	uint32_t len;
+	void *start;
+
+	if (!MLIB_LIB_EXTENTS(lib))
+		return __mlib_library_insert_space(lib, *rec + offset, length);
+
+	len = MLIB_PLIST_LEN(__mlib_record(lib, *rec));
+	if (__mlib_extent_reserve(lib, rec, len + length)) {
+		mlib_error("Failed to expand library by %u bytes\n.", length);
+		return -1;
+	}
+	if (*rec != old)
+		mlib_dir_moved(lib, old, *rec);
+
+	start = __mlib_record(lib, *rec);
+	memmove(start + offset + length, start + offset, len - offset);
+	memset(start + offset, 0, length);
+	__mlib_library_dirty(lib, start + offset, len - offset + length);
+	return 0;
+}
+
+/*
+ * Remove the @length bytes @offset bytes into the record at @rec. Unlike
+ * __mlib_library_grow_record() the caller must have already shortened the
+ * record by @length bytes.
+ */
+int __mlib_library_cut_record(struct mlib_library *lib, uint64_t rec,
+			      uint32_t offset, uint32_t length)
+{
+	uint32_t len = MLIB_PLIST_LEN(__mlib_record(lib, rec));
+	void *start = __mlib_record(lib, rec);
+
+	if (!MLIB_LIB_EXTENTS(lib))
+		return __mlib_library_excise(lib, start + offset,
+					     start + offset + length);
+
+	memmove(start + offset, start + offset + length, len - offset);
+	__mlib_library_dirty(lib, start + offset, len - offset);
+	__mlib_extent_trim(lib, rec, len);
+	return 0;
+}
+
+/*
+ * Where the record that was at @rec is now. Growing a record in a v2 library
+ * can move it to a new extent; callers that only had the old address can find
+ * the record again with this. Only the most recent record to move is
+ * remembered, which is enough for a caller that grew one record; the caller
+ * clears lib->moved_from before growing it.
+ */
+uint64_t __mlib_library_moved(const struct mlib_library *lib, uint64_t rec)
+{
+	if (lib->moved_from && lib->moved_from == rec)
+		return lib->moved_to;
+	return rec;
+}
+
+/*
+ * Move the record at *@rec further down the library if there is room for it
+ * there; see __mlib_extent_pack(). Returns 1 and updates *@rec if it moved,
+ * 0 if not. v1 libraries have no gaps to move records into, and pages are
+ * pointed to by other pages so they stay put.
+ */
+int __mlib_library_pack_record(struct mlib_library *lib, uint64_t *rec)
+{
+	uint64_t old = *rec;
+	uint32_t magic;
+
+	if (!MLIB_LIB_EXTENTS(lib))
+		return 0;
+	magic = MLIB_PLIST_MAGIC(__mlib_record(lib, old));
+	if (magic == MLIB_PAGE_MAGIC || !__mlib_extent_pack(lib, rec))
+		return 0;
+
+	if (magic == MLIB_DIR_MAGIC) {
+		__mlib_write_offs(lib, &lib->header->dir_offs, *rec);
+		MLIB_LIB_DIRTY_HEADER(lib);
+	} else {
+		mlib_dir_moved(lib, old, *rec);
+	}
+	return 1;
+}
+
+/*
+ * Account for the extent around the record at @rec in @stats: the extent
+ * header counts as a header and any space past the end of the record as
+ * free. Nothing to do in a v1 library.
+ */
+void __mlib_library_record_stats(const struct mlib_library *lib, uint64_t rec,
+				 struct mlib_bucket_stats *stats)
+{
+	uint32_t slack;
+
+	if (!MLIB_LIB_EXTENTS(lib))
+		return;
+
+	slack = __mlib_extent_capacity(lib, rec) -
+		MLIB_PLIST_LEN(__mlib_record(lib, rec));
+	stats->header_bytes += sizeof(struct mlib_extent);
+	stats->free_bytes += slack;
+	stats->total_bytes += sizeof(struct mlib_extent) + slack;
+}
+
+/**
+ * Return the number of bytes in @lib that are free for reuse. Only v2
+ * libraries have free space; see extent.c.
  *
- *   open <lib-path>
+ * @lib		The library.
+ */
+uint64_t mlib_library_free_bytes(const struct mlib_library *lib)
+{
+	if (!MLIB_LIB_EXTENTS(lib))
+		return 0;
+	return MLIB_LIB_FREE_BYTES(lib);
+}
+
+/*
+ * Command to open a library. Usage:
+ *
+ *   open <lib-path|url>
  *
- * TODO: expand this to enable opening of remote libraries.
+ * Anything that looks like a URL is opened as a remote library.
  */
 int __mlib_open_library(int argc, char *argv[])
 {
 	struct mlib_library *lib;
 
 	if (argc != 2) {
-		mlib_printf("Usage: open <lib-path>\n");
+		mlib_printf("Usage: open <lib-path|url>\n");
 		return 1;
 	}
 
-	lib = mlib_open_library(argv[1], MLIB_LOCAL);
+	lib = mlib_open_library(argv[1], strstr(argv[1], "://") ?
+				MLIB_REMOTE : MLIB_LOCAL);
 	if (!lib)
 		return 1;
 
@@ -450,8 +1637,9 @@ int __mlib_list_libraries(int argc, char *argv[])
 		lib = list_entry(elem, struct mlib_library, list);
 
 		/* Print some useful info. */
-		mlib_printf("  %-12s    ", MLIB_LIB_NAME(lib));
-		mlib_printf("%s\n", MLIB_LIB_PREFIX(lib));
+		mlib_printf("  %-12s    ", lib->name);
+		mlib_printf("%s\n", lib->header ? MLIB_LIB_PREFIX(lib) :
+			    "(not mapped)");
 	}
 	return 0;
 }
@@ -465,18 +1653,24 @@ static struct mlib_command mlib_command_lslib = {
 /*
  * Command to create a library. Usage:
  *
- *   create <path> <name> <media_prefix>
+ *   create <path> <name> <media_prefix> [version]
+ *
+ * Version 3 libraries can grow past 4GB.
  */
 int __mlib_create_library(int argc, char *argv[])
 {
+	uint32_t version = MLIB_LIB_VERSION_EXTENTS;
 	int ret;
 
-	if (argc != 4) {
-		mlib_printf("Usage: create <path> <name> <media_prefix>\n");
+	if (argc != 4 && argc != 5) {
+		mlib_printf("Usage: create <path> <name> <media_prefix> "
+			    "[version]\n");
 		return -1;
 	}
+	if (argc == 5)
+		version = strtoul(argv[4], NULL, 0);
 
-	ret = mlib_create_library(argv[1], argv[2], argv[3]);
+	ret = mlib_create_library_version(argv[1], argv[2], argv[3], version);
 	if (ret)
 		return -1;
 
@@ -498,5 +1692,7 @@ int mlib_library_init()
 	mlib_command_register(&mlib_command_close);
 	mlib_command_register(&mlib_command_create);
 	mlib_command_register(&mlib_command_lslib);
-	return 0;
+	if (mlib_vacuum_init())
+		return -1;
+	return mlib_wal_init();
 }
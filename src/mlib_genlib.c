@@ -40,6 +40,7 @@ static void	die(char *msg);
 static void	die_help(void);
 static int	do_search(void);
 static int	parse_args(int argc, char *argv[]);
+static void	print_bloom_stats(void);
 
 static char **custom_list;
 static char *output;
@@ -48,6 +49,10 @@ static char *name;
 static char *dir;
 static int   verbose;
 static int   overwrite;
+static int   hash;
+static int   bloom;
+static int   tree;
+static int   compress;
 
 static struct mlib_library *lib;
 
@@ -56,11 +61,15 @@ static const struct option opts[] = {
 	{ "prefix",	1, NULL, 'p' },
 	{ "overwrite",	0, NULL, 'o' },
 	{ "name",	1, NULL, 'n' },
+	{ "hash",	0, NULL, 'H' },
+	{ "bloom",	0, NULL, 'B' },
+	{ "tree",	0, NULL, 't' },
+	{ "compress",	0, NULL, 'z' },
 	{ "verbose",	0, NULL, 'v' },
 	{ "help",	0, NULL, 'h' },
 	{ NULL,		0, NULL,  0  }
 };
-static const char *short_opts = "f:p:oO:n:vh";
+static const char *short_opts = "f:p:oO:n:HBtzvh";
 
 int main(int argc, char *argv[])
 {
@@ -101,8 +110,21 @@ int main(int argc, char *argv[])
 	if (!lib)
 		die("Failed.");
 
+	if (hash && mlib_hash_playlist(lib, ".global"))
+		die("Failed.");
+	if (bloom && mlib_bloom_playlist(lib, ".global"))
+		die("Failed.");
+
 	do_search();
 
+	if (bloom)
+		print_bloom_stats();
+
+	if (compress && mlib_compress_playlist(lib, ".global"))
+		die("Failed.");
+	if (tree && mlib_tree_playlist(lib, ".global"))
+		die("Failed.");
+
 	return 0;
 }
 
@@ -140,6 +162,54 @@ static char *drop_prefix(char *path)
 	return str;
 }
 
+/*
+ * Returns non-zero if @elem looks like a media file we want in the library.
+ */
+static int want_file(const char *elem)
+{
+	if (custom_list)
+		return mlib_filter(elem, custom_list);
+
+	return mlib_filter(elem, mlib_audio_ext) ||
+		mlib_filter(elem, mlib_video_ext);
+}
+
+/*
+ * Reserve room in .global for the media files in @dir so that adding them
+ * grows the library once instead of once per file. Files already in .global
+ * are left out so rescanning a library doesn't reserve room for them again.
+ * Directories that happen to match the filter get counted too; the extra space
+ * just stays free for later.
+ */
+static void reserve_dir(DIR *dir, const char *cwd)
+{
+	char *new_name, *elem;
+	uint32_t nr = 0, bytes = 0;
+	struct dirent *ent;
+	struct mlib_playlist *plist;
+
+	plist = mlib_find_playlist(lib, ".global");
+	if (!plist)
+		return;
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (!want_file(ent->d_name))
+			continue;
+
+		new_name = path_combine(cwd, ent->d_name);
+		elem = drop_prefix(new_name);
+		if (!mlib_find_path(lib, plist, elem)) {
+			nr++;
+			bytes += strlen(elem) + 1;
+		}
+		free(new_name);
+	}
+	rewinddir(dir);
+
+	if (nr)
+		mlib_playlist_reserve(lib, ".global", nr, bytes);
+}
+
 /*
  * Recursive search.
  */
@@ -158,6 +228,8 @@ static int __do_search(const char *cwd)
 		return -1;
 	}
 
+	reserve_dir(dir, cwd);
+
 	/*
 	 * Do this in two passes. First add any media files in the current dir
 	 * and then recurse into sub-dirs.
@@ -177,20 +249,12 @@ static int __do_search(const char *cwd)
 
 		elem = drop_prefix(new_name);
 
-		if (mlib_find_path(plist, elem))
+		if (mlib_find_path(lib, plist, elem))
 			continue;
 
-		if (custom_list) {
-			if (!mlib_filter(elem, custom_list)) {
-				genlib_print("- Rejecting %s\n", elem);
-				continue;
-			}
-		} else {
-			if (!mlib_filter(elem, mlib_audio_ext) &&
-			    !mlib_filter(elem, mlib_video_ext)) {
-				genlib_print("- Rejecting %s\n", elem);
-				continue;
-			}
+		if (!want_file(elem)) {
+			genlib_print("- Rejecting %s\n", elem);
+			continue;
 		}
 
 		genlib_print("+ %s\n", elem);
@@ -236,6 +300,23 @@ static int do_search()
 	return 0;
 }
 
+/*
+ * Report how well the Bloom filter did at answering lookups for new files.
+ */
+static void print_bloom_stats(void)
+{
+	struct mlib_bloom_stats stats;
+	uint64_t misses;
+
+	mlib_bucket_bloom_stats(&stats);
+	misses = stats.negatives + stats.false_positives;
+	mlib_printf("Bloom filter:   %llu of %llu misses skipped the search, "
+		    "%.2f%% false positives\n",
+		    (unsigned long long)stats.negatives,
+		    (unsigned long long)misses,
+		    misses ? 100.0 * stats.false_positives / misses : 0.0);
+}
+
 static int parse_args(int argc, char *argv[])
 {
 	int opt;
@@ -256,6 +337,18 @@ static int parse_args(int argc, char *argv[])
 		case 'n':
 			name = optarg;
 			break;
+		case 'H':
+			hash = 1;
+			break;
+		case 'B':
+			bloom = 1;
+			break;
+		case 't':
+			tree = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -312,6 +405,18 @@ Where OPTIONS are:\n\
 			library. If the target library does not exist yet\n\
 			one will be created.\n\
   -n|--name <name>	Specify a name for the library if it gets created.\n\
+  -H|--hash		Keep a hash table for the library's paths. This makes\n\
+			checking whether a path is already in the library\n\
+			much cheaper for big libraries.\n\
+  -B|--bloom		Keep a Bloom filter for the library's paths. Checking\n\
+			for files that aren't in the library yet then mostly\n\
+			skips searching it.\n\
+  -t|--tree		Build a search tree for the library's paths once the\n\
+			search is done. Lookups in big libraries that are\n\
+			mostly read after that get faster.\n\
+  -z|--compress		Compress the library's paths once the search is\n\
+			done. Shared directory prefixes make this quite\n\
+			effective.\n\
   -v|--verbose		Be verbose.\n\
   -h|--help		Print this help message.\n\
 \n\
@@ -55,35 +55,42 @@ struct mlib_playlist *mlib_next_playlist(const struct mlib_library *lib,
 					 struct mlib_playlist *plist)
 {
 	struct mlib_playlist *tmp_plist;
+	uint64_t offs = 0;
 
-	if (plist == NULL)
+	/* In a v2 library the playlists are found by walking the extents. */
+	if (MLIB_LIB_EXTENTS(lib)) {
+		if (plist)
+			offs = ((void *)plist) - ((void *)lib->header);
+		while ((offs = __mlib_extent_next(lib, offs)) != 0) {
+			tmp_plist = ((void *)lib->header) + offs;
+			if (MLIB_PLIST_MAGIC(tmp_plist) != MLIB_PAGE_MAGIC &&
+			    MLIB_PLIST_MAGIC(tmp_plist) != MLIB_DIR_MAGIC)
+				break;
+		}
+		if (!offs)
+			return NULL;
+	} else if (plist == NULL)
 		tmp_plist = ((void *)lib->header) + MLIB_HEADER_SIZE;
 	else
 		tmp_plist = plist;
 
 	/*
-	 * Handle the start case: use the first play list in the library.
+	 * Start with the first record in the library or, if there is a current
+	 * playlist, add its length to its address: that's where the next
+	 * playlist should be. The pages of paged playlists are records too;
+	 * step over them.
 	 */
-	if (!plist) {
-		if (__mlib_plist_check_len(lib, tmp_plist))
-			return NULL;
-		if (MLIB_PLIST_MAGIC(tmp_plist) != MLIB_PLIST_HDR_MAGIC) {
-			mlib_error("Library corruption detected.\n");
-			mlib_error("Invalid playist header magic found.\n");
-			return NULL;
-		}
-		return tmp_plist;
-	}
+	if (!MLIB_LIB_EXTENTS(lib) && plist)
+		tmp_plist = ((void *)tmp_plist) + MLIB_PLIST_LEN(plist);
+	while (!MLIB_LIB_EXTENTS(lib) &&
+	       !__mlib_plist_check_len(lib, tmp_plist) &&
+	       MLIB_PLIST_MAGIC(tmp_plist) == MLIB_PAGE_MAGIC)
+		tmp_plist = ((void *)tmp_plist) + MLIB_PLIST_LEN(tmp_plist);
 
-	/*
-	 * Otherwise go to the next playlist. Add the length of the current
-	 * playlist to the playlist address: that's where the next playlist
-	 * should be.
-	 */
-	tmp_plist = ((void *)tmp_plist) + MLIB_PLIST_LEN(plist);
 	if (__mlib_plist_check_len(lib, tmp_plist))
 		return NULL;
-	if (MLIB_PLIST_MAGIC(tmp_plist) != MLIB_PLIST_HDR_MAGIC) {
+	if (MLIB_PLIST_MAGIC(tmp_plist) != MLIB_PLIST_HDR_MAGIC &&
+	    !MLIB_PLIST_PAGED(tmp_plist)) {
 		mlib_error("Library corruption detected.\n");
 		mlib_error("Invalid playist header magic found.\n");
 		return NULL;
@@ -97,15 +104,19 @@ struct mlib_playlist *mlib_next_playlist(const struct mlib_library *lib,
  * the first path. Returns the path after @path or NULL if there are no more
  * paths in the playlist.
  *
+ * @lib		The library @plist is in.
  * @plist	The playlist to iterate through.
  * @path	The index path.
  */
-const char *mlib_get_path_at(const struct mlib_playlist *plist, int index)
+const char *mlib_get_path_at(const struct mlib_library *lib,
+			     const struct mlib_playlist *plist, int index)
 {
+	if (MLIB_PLIST_PAGED(plist))
+		return mlib_ptree_path_at(lib, plist, index);
 	if (index >= mlib_bucket_nr_indexes(&plist->data))
 		return NULL;
 
-	return mlib_bucket_string(&plist->data, index);
+	return mlib_bucket_string(lib, &plist->data, index);
 }
 
 /**
@@ -121,6 +132,10 @@ struct mlib_playlist *mlib_find_playlist(const struct mlib_library *lib,
 {
 	struct mlib_playlist *plist;
 
+	/* v2 libraries have a directory; see dir.c. */
+	if (MLIB_LIB_EXTENTS(lib) && __mlib_readl(&lib->header->dir_offs))
+		return mlib_dir_find(lib, name);
+
 	mlib_for_each_pls(lib, plist) {
 		if (strncmp(MLIB_PLIST_NAME(plist), name,
 			    MLIB_PLIST_NAME_LEN) == 0)
@@ -130,41 +145,212 @@ struct mlib_playlist *mlib_find_playlist(const struct mlib_library *lib,
 }
 
 /**
- * Create an empty playlist in the passed library.
+ * Return the .global playlist of @lib. In a v1 library it is always the first
+ * playlist in the library; a v2 library keeps track of where it is in the
+ * header.
  *
- * @lib		The library to add the playlist to.
- * @name	A name for the playlist.
+ * @lib		The library.
  */
-int mlib_start_playlist(struct mlib_library *lib, const char *name)
+struct mlib_playlist *mlib_global_playlist(const struct mlib_library *lib)
+{
+	if (MLIB_LIB_EXTENTS(lib))
+		return ((void *)lib->header) +
+			__mlib_read_offs(lib, &lib->header->global_offs);
+	return ((void *)lib->header) + MLIB_HEADER_SIZE;
+}
+
+/*
+ * Add @delta to the media count of @plist.
+ */
+static void __mlib_plist_count(struct mlib_library *lib,
+			       struct mlib_playlist *plist, int delta)
+{
+	MLIB_PLIST_SET_MCOUNT(plist, MLIB_PLIST_MCOUNT(plist) + delta);
+	__mlib_library_dirty(lib, plist, sizeof(*plist));
+}
+
+/*
+ * Add whatever paths of the plain playlist at @plist_offs are missing from
+ * .global to it. mlib_add_path() always added paths to .global as well, but
+ * nothing else made sure of that. .global is the first playlist of the v1
+ * libraries this is for, so adding to it moves @plist along by however much
+ * .global grew. Returns the playlist's new offset or 0 on failure.
+ */
+static uint64_t __mlib_plist_fill_global(struct mlib_library *lib,
+					 uint64_t plist_offs)
+{
+	struct mlib_playlist *plist = ((void *)lib->header) + plist_offs;
+	struct mlib_playlist *global = mlib_global_playlist(lib);
+	char path[MLIB_BUCKET_MAX_STR];
+	uint32_t id, global_len;
+	int i;
+
+	for (i = 0; i < mlib_bucket_nr_indexes(&plist->data); i++) {
+		snprintf(path, sizeof(path), "%s",
+			 mlib_bucket_string(lib, &plist->data, i));
+		if (!mlib_bucket_find_id(lib, &global->data, path, &id))
+			continue;
+
+		global_len = MLIB_PLIST_LEN(global);
+		if (mlib_bucket_add(lib, &global->data, path))
+			return 0;
+		global = mlib_global_playlist(lib);
+		__mlib_plist_count(lib, global, 1);
+		plist_offs += MLIB_PLIST_LEN(global) - global_len;
+		plist = ((void *)lib->header) + plist_offs;
+	}
+	return plist_offs;
+}
+
+/**
+ * Bring the playlists of a library written before its header had a version
+ * up to date. Their buckets get the current header, see mlib_bucket_upgrade(),
+ * and the paths are interned: .global hands out IDs and the other playlists
+ * refer to those. The library is then marked MLIB_LIB_VERSION_1 so this is
+ * only done once. Does nothing for other libraries. Returns 0 on success, < 0
+ * on failure.
+ *
+ * @lib		The library; it must be writable.
+ */
+int mlib_upgrade_playlists(struct mlib_library *lib)
+{
+	struct mlib_playlist *plist;
+	struct mlib_bucket *bucket;
+	uint64_t plist_offs;
+
+	if (__mlib_readl(&lib->header->version))
+		return 0;
+
+	mlib_for_each_pls(lib, plist) {
+		/* The library may move; the playlist itself doesn't. */
+		bucket = mlib_bucket_upgrade(lib, &plist->data);
+		if (!bucket)
+			return -1;
+		plist = container_of(bucket, struct mlib_playlist, data);
+	}
+
+	if (mlib_bucket_assign_ids(lib, &mlib_global_playlist(lib)->data))
+		return -1;
+	mlib_for_each_pls(lib, plist) {
+		if (plist == mlib_global_playlist(lib))
+			continue;
+		plist_offs = mlib_lib_offset(lib, plist);
+		plist_offs = __mlib_plist_fill_global(lib, plist_offs);
+		if (!plist_offs)
+			return -1;
+		plist = ((void *)lib->header) + plist_offs;
+		if (mlib_bucket_make_refs(lib, &plist->data) ||
+		    mlib_bucket_trim(lib, &plist->data))
+			return -1;
+		plist = ((void *)lib->header) + plist_offs;
+	}
+
+	__mlib_writel(&lib->header->version, MLIB_LIB_VERSION_1);
+	MLIB_LIB_DIRTY_HEADER(lib);
+	return 0;
+}
+
+/*
+ * Allocate an empty playlist record with room for @data_len bytes of data.
+ * Returns the new playlist or NULL on failure.
+ */
+static struct mlib_playlist *__mlib_new_playlist(struct mlib_library *lib,
+						 const char *name,
+						 uint32_t magic,
+						 uint32_t data_len)
 {
-	uint32_t newlen;
+	uint64_t plist_offs;
 	struct mlib_playlist *plist;
 
+	if (__mlib_library_writable(lib))
+		return NULL;
 	if (mlib_find_playlist(lib, name)) {
 		mlib_user_error("playlist '%s' already exists.\n", name);
-		return -1;
+		return NULL;
 	}
 
 	if (strlen(name) >= (MLIB_PLIST_NAME_LEN - 1))
 		mlib_printf("warning: truncating playlist name.\n");
 
-	plist = __mlib_new_playlist_addr(lib);
-
-	/* Allocate room for the playlist. */
-	newlen = MLIB_LIB_LEN(lib) + sizeof(struct mlib_playlist) +
-		MLIB_BUCKET_GROWTH_RATE;
-	if (__mlib_library_expand(lib, newlen) < 0)
-		return -1;
+	/* Allocate room for the playlist; this may move the library. */
+	plist_offs = __mlib_library_alloc_record(lib,
+						 sizeof(struct mlib_playlist) +
+						 data_len);
+	if (!plist_offs)
+		return NULL;
+	plist = ((void *)lib->header) + plist_offs;
 
 	memset(plist->name, 0, MLIB_PLIST_NAME_LEN);
 	strncpy(plist->name, name, MLIB_PLIST_NAME_LEN - 1);
-	MLIB_PLIST_SET_MAGIC(plist, MLIB_PLIST_HDR_MAGIC);
-	MLIB_PLIST_SET_LEN(plist, sizeof(struct mlib_playlist) +
-			   MLIB_BUCKET_GROWTH_RATE);
+	MLIB_PLIST_SET_MAGIC(plist, magic);
+	MLIB_PLIST_SET_LEN(plist, sizeof(struct mlib_playlist) + data_len);
 	MLIB_PLIST_SET_MCOUNT(plist, 0);
 
-	mlib_init_bucket(&plist->data, MLIB_BUCKET_GROWTH_RATE);
+	if (mlib_dir_add(lib, plist)) {
+		__mlib_library_free_record(lib, plist_offs);
+		return NULL;
+	}
+	return ((void *)lib->header) + plist_offs;
+}
+
+/**
+ * Create an empty playlist in the passed library. '.global' interns the paths
+ * of the library and hands out their IDs; every other playlist just holds IDs
+ * of paths in '.global'.
+ *
+ * @lib		The library to add the playlist to.
+ * @name	A name for the playlist.
+ */
+int mlib_start_playlist(struct mlib_library *lib, const char *name)
+{
+	struct mlib_playlist *plist;
+
+	plist = __mlib_new_playlist(lib, name, MLIB_PLIST_HDR_MAGIC,
+				    MLIB_BUCKET_GROWTH_RATE);
+	if (!plist)
+		return -1;
+
+	mlib_init_bucket(&plist->data, MLIB_BUCKET_GROWTH_RATE,
+			 strcmp(name, ".global") ? MLIB_BUCKET_F_REFS :
+			 MLIB_BUCKET_F_IDS);
+	if (!strcmp(name, ".global")) {
+		__mlib_write_offs(lib, &lib->header->global_offs,
+				  mlib_lib_offset(lib, plist));
+		MLIB_LIB_DIRTY_HEADER(lib);
+	}
+
+	if (mlib_wal_log(lib, MLIB_WAL_START, name, NULL, 0, 0))
+		return -1;
+	return mlib_sync_library(lib);
+}
+
+/**
+ * Create an empty paged playlist; see ptree.c. Paths are added to and removed
+ * from a paged playlist without moving the rest of the library, which makes
+ * it the better choice for very large playlists. Paged playlists can't be
+ * hashed, compressed, etc. '.global' can't be paged.
+ *
+ * @lib		The library to add the playlist to.
+ * @name	A name for the playlist.
+ */
+int mlib_start_paged_playlist(struct mlib_library *lib, const char *name)
+{
+	struct mlib_playlist *plist;
+
+	if (!strcmp(name, ".global")) {
+		mlib_user_error("'.global' can't be paged.\n");
+		return -1;
+	}
+
+	plist = __mlib_new_playlist(lib, name, MLIB_PLIST_PAGED_MAGIC,
+				    sizeof(struct mlib_ptree));
+	if (!plist)
+		return -1;
+
+	mlib_ptree_init(MLIB_PLIST_PTREE(plist));
 
+	if (mlib_wal_log(lib, MLIB_WAL_START_PAGED, name, NULL, 0, 0))
+		return -1;
 	return mlib_sync_library(lib);
 }
 
@@ -176,25 +362,35 @@ int mlib_start_playlist(struct mlib_library *lib, const char *name)
  */
 int mlib_delete_playlist(struct mlib_library *lib, const char *name)
 {
-	void *start, *end;
-	uint32_t plist_len;
 	struct mlib_playlist *plist;
 
+	if (__mlib_library_writable(lib))
+		return -1;
 	plist = mlib_find_playlist(lib, name);
 	if (!plist) {
 		mlib_user_error("Playlist '%s' does not exist.\n", name);
 		return -1;
 	}
+	if (plist == mlib_global_playlist(lib)) {
+		mlib_user_error("'.global' can't be deleted.\n");
+		return -1;
+	}
 
-	plist_len = MLIB_PLIST_LEN(plist);
-	start = plist;
-	end = start + plist_len;
+	/*
+	 * Free the pages first; in a v1 library they all come after the
+	 * playlist.
+	 */
+	if (MLIB_PLIST_PAGED(plist) && mlib_ptree_destroy(lib, plist)) {
+		mlib_error("Failed to truncate '%s'\n", MLIB_LIB_NAME(lib));
+		return -1;
+	}
 
-	if (__mlib_library_excise(lib, start, end)) {
+	mlib_dir_remove(lib, plist);
+	if (__mlib_library_free_record(lib, mlib_lib_offset(lib, plist))) {
 		mlib_error("Failed to truncate '%s'\n", MLIB_LIB_NAME(lib));
 		return -1;
 	}
-	return 0;
+	return mlib_wal_log(lib, MLIB_WAL_DELETE, name, NULL, 0, 0);
 }
 
 /**
@@ -208,15 +404,33 @@ int mlib_delete_playlist(struct mlib_library *lib, const char *name)
 int mlib_add_path_to_plist(struct mlib_library *lib,
 			   struct mlib_playlist *plist, const char *path)
 {
-	if (MLIB_PLIST_MAGIC(plist) != MLIB_PLIST_HDR_MAGIC) {
+	uint64_t plist_offs;
+
+	if (__mlib_library_writable(lib))
+		return -1;
+	if (MLIB_PLIST_MAGIC(plist) != MLIB_PLIST_HDR_MAGIC &&
+	    !MLIB_PLIST_PAGED(plist)) {
 		mlib_error("Invalid playlist (%p).\n", plist);
 		return -1;
 	}
-	if (mlib_bucket_add(lib, &plist->data, path))
+
+	/*
+	 * Adding to the bucket may remap the library or move the playlist so
+	 * @plist has to be recomputed from its offset afterwards.
+	 */
+	plist_offs = mlib_lib_offset(lib, plist);
+	lib->moved_from = 0;
+	if (MLIB_PLIST_PAGED(plist)) {
+		if (mlib_ptree_add(lib, plist, path))
+			return -1;
+	} else if (mlib_bucket_add(lib, &plist->data, path)) {
 		return -1;
+	}
+	plist = ((void *)lib->header) + __mlib_library_moved(lib, plist_offs);
 
-	MLIB_PLIST_SET_MCOUNT(plist, MLIB_PLIST_MCOUNT(plist) + 1);
-	return 0;
+	__mlib_plist_count(lib, plist, 1);
+	return mlib_wal_log(lib, MLIB_WAL_ADD, MLIB_PLIST_NAME(plist), path,
+			    0, 0);
 }
 
 /**
@@ -235,6 +449,8 @@ int mlib_add_path(struct mlib_library *lib, const char *plist,
 	struct mlib_playlist *real_plist;
 	struct mlib_playlist *global_plist;
 
+	if (__mlib_library_writable(lib))
+		return -1;
 	if (strcmp(plist, ".global")) {
 		global_plist = mlib_find_playlist(lib, ".global");
 		if (!global_plist) {
@@ -253,148 +469,896 @@ int mlib_add_path(struct mlib_library *lib, const char *plist,
 	return mlib_add_path_to_plist(lib, real_plist, path);
 }
 
-/*
- * Internel version of mlib_find_path() that doesn't return a const.
+/**
+ * Add a path to a playlist for a bulk load; see mlib_bucket_append(). The
+ * playlist is unsorted until mlib_rebuild_playlist() is called on it and
+ * unlike mlib_add_path() the path is not added to '.global' as well. Returns
+ * 0 on success, < 0 on failure.
+ *
+ * @lib		Library to find the playlist in.
+ * @plist	Name of the playlist.
+ * @path	The path to add; it must not be in the playlist yet.
  */
-char *__mlib_find_path(const struct mlib_playlist *plist, const char *path)
+int mlib_append_path(struct mlib_library *lib, const char *plist,
+		     const char *path)
 {
-	return (char *)mlib_bucket_contains(&plist->data, path);
+	struct mlib_playlist *real_plist;
+	uint64_t plist_offs;
+
+	if (__mlib_library_writable(lib))
+		return -1;
+	real_plist = mlib_find_playlist(lib, plist);
+	if (!real_plist) {
+		mlib_user_error("Playlist '%s' not found.\n", plist);
+		return -1;
+	}
+
+	/* Paged playlists are always sorted; this is just an add for them. */
+	if (MLIB_PLIST_PAGED(real_plist))
+		return mlib_add_path_to_plist(lib, real_plist, path);
+
+	plist_offs = mlib_lib_offset(lib, real_plist);
+	lib->moved_from = 0;
+	if (mlib_bucket_append(lib, &real_plist->data, path))
+		return -1;
+	real_plist = ((void *)lib->header) +
+		__mlib_library_moved(lib, plist_offs);
+
+	__mlib_plist_count(lib, real_plist, 1);
+	return mlib_wal_log(lib, MLIB_WAL_APPEND, plist, path, 0, 0);
 }
 
 /**
- * Search for the element in @path in the passed library and playlist. Returns
- * a pointer to the location of that string in the library or NULL if not
- * found.
+ * Remove the passed path from a playlist. Returns 0 on success, < 0 if the
+ * path is not in the playlist.
  *
- * @lib		The library.
- * @plist	The playlist in @lib.
- * @path	The path to look for.
+ * @lib		The library @plist is in.
+ * @plist	A pointer to the playlist itself.
+ * @path	The path to remove.
  */
-const char *mlib_find_path(const struct mlib_playlist *plist, const char *path)
+int mlib_remove_path_from_plist(struct mlib_library *lib,
+				struct mlib_playlist *plist, const char *path)
 {
-	if (MLIB_PLIST_MAGIC(plist) != MLIB_PLIST_HDR_MAGIC) {
+	if (__mlib_library_writable(lib))
+		return -1;
+	if (MLIB_PLIST_PAGED(plist)) {
+		if (mlib_ptree_remove(lib, plist, path))
+			return -1;
+	} else if (MLIB_PLIST_MAGIC(plist) != MLIB_PLIST_HDR_MAGIC) {
 		mlib_error("Invalid playlist (%p).\n", plist);
-		return NULL;
+		return -1;
+	} else if (mlib_bucket_remove(lib, &plist->data, path)) {
+		return -1;
 	}
-	return __mlib_find_path(plist, path);
+
+	__mlib_plist_count(lib, plist, -1);
+	return mlib_wal_log(lib, MLIB_WAL_REMOVE, MLIB_PLIST_NAME(plist), path,
+			    0, 0);
 }
 
-/*
- * Create an empty playlist. Very simple low level command here. Usage:
+/**
+ * Remove the passed path from a playlist. Removing a path from '.global'
+ * removes it from every playlist in the library first since the other
+ * playlists refer to the paths in '.global'. Returns 0 on success, < 0 if the
+ * playlist does not exist or the path is not in it.
  *
- *   mkpls <lib> <name>
+ * @lib		Library to find the playlist in.
+ * @plist	Name of the playlist.
+ * @path	The path to remove.
  */
-int __mlib_make_playlist(int argc, char *argv[])
+int mlib_remove_path(struct mlib_library *lib, const char *plist,
+		     const char *path)
 {
-	int ret;
-	struct mlib_library *lib;
+	struct mlib_playlist *real_plist;
+	struct mlib_playlist *tmp;
 
-	if (argc != 3) {
-		mlib_printf("Usage: mkpls <lib> <name>\n");
-		return 1;
+	if (__mlib_library_writable(lib))
+		return -1;
+	real_plist = mlib_find_playlist(lib, plist);
+	if (!real_plist) {
+		mlib_user_error("Playlist '%s' not found.\n", plist);
+		return -1;
 	}
 
-	lib = mlib_find_library(argv[1]);
-	if (!lib) {
-		mlib_printf("Library '%s' not loaded.\n", argv[1]);
-		return 1;
+	if (real_plist == mlib_global_playlist(lib)) {
+		if (!mlib_find_path(lib, real_plist, path))
+			return -1;
+		mlib_for_each_pls(lib, tmp) {
+			if (tmp != real_plist)
+				mlib_remove_path_from_plist(lib, tmp, path);
+		}
 	}
 
-	ret = mlib_start_playlist(lib, argv[2]);
-	if (ret) {
-		mlib_printf("Failed to make empty playlist.\n");
-		return 1;
-	}
+	return mlib_remove_path_from_plist(lib, real_plist, path);
+}
 
-	return 0;
+/**
+ * Look up the media ID of @path. IDs are handed out when a path is first added
+ * to the library and stay the same until the path is removed from '.global'.
+ * Returns 0 and sets @id if the path is in the library, < 0 otherwise.
+ *
+ * @lib		The library.
+ * @path	The path to look up.
+ * @id		Set to the path's ID.
+ */
+int mlib_media_id(const struct mlib_library *lib, const char *path,
+		  uint32_t *id)
+{
+	return mlib_bucket_find_id(lib, &mlib_global_playlist(lib)->data, path,
+				   id);
 }
 
-static struct mlib_command mlib_command_mkpls = {
-	.name = "mkpls",
-	.desc = "Create an empty playlist.",
-	.main = __mlib_make_playlist,
-};
+/**
+ * Return the path with media ID @id or NULL if there is no such path. Like
+ * other paths read from the library the result may point into a per thread
+ * buffer if '.global' is compressed.
+ *
+ * @lib		The library.
+ * @id		The media ID.
+ */
+const char *mlib_media_path(const struct mlib_library *lib, uint32_t id)
+{
+	return mlib_bucket_id_string(&mlib_global_playlist(lib)->data, id);
+}
 
 /*
- * List play lists in a library or paths in a playlist. Usage:
- *
- *   lspls <lib> [playlist]
+ * Find the named playlist for a change to its bucket. Paged playlists don't
+ * have one.
  */
-int __mlib_ls_playlist(int argc, char *argv[])
+static struct mlib_playlist *__mlib_find_bucket_plist(struct mlib_library *lib,
+						      const char *name)
 {
-	int ind;
-	const char *path;
-	struct mlib_library *lib;
 	struct mlib_playlist *plist;
 
-	if (argc < 2 || argc > 4) {
-		mlib_printf("Usage: lspls <lib> [playlist]\n");
-		return 1;
-	}
-
-	lib = mlib_find_library(argv[1]);
-	if (!lib) {
-		mlib_printf("Library '%s' not loaded.\n", argv[1]);
-		return 1;
+	if (__mlib_library_writable(lib))
+		return NULL;
+	plist = mlib_find_playlist(lib, name);
+	if (!plist) {
+		mlib_user_error("Playlist '%s' not found.\n", name);
+		return NULL;
 	}
-
-	if (argc == 2) {
-		mlib_for_each_pls(lib, plist)
-			mlib_printf("%5d  - %s\n", MLIB_PLIST_MCOUNT(plist),
-				    MLIB_PLIST_NAME(plist));
-	} else {
-		plist = mlib_find_playlist(lib, argv[2]);
-		if (!plist) {
-			mlib_printf("Playlist '%s' does not exist.\n",
-				    argv[2]);
-			return 1;
-		}
-		mlib_for_each_path(plist, ind, path)
-			mlib_printf("%s\n", path);
+	if (MLIB_PLIST_PAGED(plist)) {
+		mlib_user_error("'%s' is a paged playlist.\n", name);
+		return NULL;
 	}
 
-	return 0;
+	return plist;
 }
 
-static struct mlib_command mlib_command_lspls = {
-	.name = "lspls",
-	.desc = "List playlists in a library.",
-	.main = __mlib_ls_playlist,
-};
-
-/*
- * Add a path to the specified playlist. Usage:
+/**
+ * Reserve space in the named playlist for @nr more paths that take up
+ * @str_bytes bytes (including their terminators). Adding that many paths
+ * afterwards won't have to grow the playlist. Returns 0 on success, < 0 on
+ * failure.
  *
- *   plsadd <lib> <playlist> <path>
+ * @lib		Library to find the playlist in.
+ * @name	Name of the playlist.
+ * @nr		Number of paths to make room for.
+ * @str_bytes	Total length of those paths.
  */
-int __mlib_playlist_add(int argc, char *argv[])
+int mlib_playlist_reserve(struct mlib_library *lib, const char *name,
+			  uint32_t nr, uint32_t str_bytes)
 {
-	int ret;
-	struct mlib_library *lib;
-
-	if (argc != 4) {
-		mlib_printf("Usage: plsadd <lib> <plist> <path>\n");
-		return 1;
-	}
+	struct mlib_playlist *plist;
 
-	lib = mlib_find_library(argv[1]);
-	if (!lib) {
-		mlib_printf("Library '%s' not loaded.\n", argv[1]);
-		return 1;
-	}
+	plist = __mlib_find_bucket_plist(lib, name);
+	if (!plist)
+		return -1;
 
-	ret = mlib_add_path(lib, argv[2], argv[3]);
-	if (ret)
-		return 1;
-	return 0;
+	if (mlib_bucket_reserve(lib, &plist->data, nr, str_bytes))
+		return -1;
+	return mlib_wal_log(lib, MLIB_WAL_RESERVE, name, NULL, nr, str_bytes);
 }
 
-static struct mlib_command mlib_command_plsadd = {
+/**
+ * Give the named playlist a hash table so that path lookups are answered in
+ * constant time instead of with a binary search. The table is stored in the
+ * library and kept up to date as paths are added. Returns 0 on success, < 0
+ * on failure.
+ *
+ * @lib		Library to find the playlist in.
+ * @name	Name of the playlist.
+ */
+int mlib_hash_playlist(struct mlib_library *lib, const char *name)
+{
+	struct mlib_playlist *plist;
+
+	plist = __mlib_find_bucket_plist(lib, name);
+	if (!plist)
+		return -1;
+
+	if (mlib_bucket_enable_hash(lib, &plist->data))
+		return -1;
+	return mlib_wal_log(lib, MLIB_WAL_HASH, name, NULL, 0, 0);
+}
+
+/**
+ * Add a Bloom filter to the named playlist. Looking up paths that are not in
+ * the playlist then mostly skips searching it. The filter is kept up to date
+ * as paths are added. Returns 0 on success, < 0 on failure.
+ *
+ * @lib		Library to find the playlist in.
+ * @name	Name of the playlist.
+ */
+int mlib_bloom_playlist(struct mlib_library *lib, const char *name)
+{
+	struct mlib_playlist *plist;
+
+	plist = __mlib_find_bucket_plist(lib, name);
+	if (!plist)
+		return -1;
+
+	if (mlib_bucket_enable_bloom(lib, &plist->data))
+		return -1;
+	return mlib_wal_log(lib, MLIB_WAL_BLOOM, name, NULL, 0, 0);
+}
+
+/**
+ * Build a search tree for the named playlist; see mlib_bucket_build_tree().
+ * Adding or removing paths makes the tree go stale and it has to be built
+ * again to be used. Returns 0 on success, < 0 on failure.
+ *
+ * @lib		Library to find the playlist in.
+ * @name	Name of the playlist.
+ */
+int mlib_tree_playlist(struct mlib_library *lib, const char *name)
+{
+	struct mlib_playlist *plist;
+
+	plist = __mlib_find_bucket_plist(lib, name);
+	if (!plist)
+		return -1;
+
+	if (mlib_bucket_build_tree(lib, &plist->data))
+		return -1;
+	return mlib_wal_log(lib, MLIB_WAL_TREE, name, NULL, 0, 0);
+}
+
+/**
+ * Sort the named playlist from scratch with up to @nr_threads threads (0 for
+ * one per CPU); see mlib_bucket_rebuild(). Returns 0 on success, < 0 on
+ * failure.
+ *
+ * @lib		Library to find the playlist in.
+ * @name	Name of the playlist.
+ * @nr_threads	Most threads to sort with.
+ */
+int mlib_rebuild_playlist(struct mlib_library *lib, const char *name,
+			  int nr_threads)
+{
+	struct mlib_playlist *plist;
+
+	plist = __mlib_find_bucket_plist(lib, name);
+	if (!plist)
+		return -1;
+
+	if (mlib_bucket_rebuild(lib, &plist->data, nr_threads))
+		return -1;
+	return mlib_wal_log(lib, MLIB_WAL_REBUILD, name, NULL, nr_threads, 0);
+}
+
+/**
+ * Compress the paths in the named playlist with a symbol table trained on the
+ * playlist itself. Paths added later are compressed with the same table. Paths
+ * returned from a compressed playlist are decoded into a per thread buffer
+ * that is only valid until the next path is read from the same thread.
+ * Returns 0 on success, < 0 on failure.
+ *
+ * @lib		Library to find the playlist in.
+ * @name	Name of the playlist.
+ */
+int mlib_compress_playlist(struct mlib_library *lib, const char *name)
+{
+	struct mlib_playlist *plist;
+
+	plist = __mlib_find_bucket_plist(lib, name);
+	if (!plist)
+		return -1;
+
+	if (mlib_bucket_compress(lib, &plist->data))
+		return -1;
+	return mlib_wal_log(lib, MLIB_WAL_COMPRESS, name, NULL, 0, 0);
+}
+
+/**
+ * Add the storage statistics of @plist, its header included, to @stats; see
+ * mlib_bucket_stats(). Summing this over every playlist covers the whole
+ * library but for its header.
+ *
+ * @lib		The library @plist is in.
+ * @plist	The playlist.
+ * @stats	Statistics to add to.
+ */
+void mlib_playlist_stats(const struct mlib_library *lib,
+			 const struct mlib_playlist *plist,
+			 struct mlib_bucket_stats *stats)
+{
+	uint32_t hdr = MLIB_PLIST_LEN(plist);
+
+	/* Everything in the record that isn't the bucket. */
+	if (!MLIB_PLIST_PAGED(plist))
+		hdr -= MLIB_BUCKET_LENGTH(&plist->data);
+	stats->total_bytes += hdr;
+	stats->header_bytes += hdr;
+	__mlib_library_record_stats(lib, ((void *)plist) -
+				    ((void *)lib->header), stats);
+
+	if (MLIB_PLIST_PAGED(plist))
+		mlib_ptree_stats(lib, plist, stats);
+	else
+		mlib_bucket_stats(lib, &plist->data, stats);
+}
+
+/*
+ * Internel version of mlib_find_path() that doesn't return a const.
+ */
+char *__mlib_find_path(const struct mlib_library *lib,
+		       const struct mlib_playlist *plist, const char *path)
+{
+	if (MLIB_PLIST_PAGED(plist))
+		return (char *)mlib_ptree_find(lib, plist, path);
+	return (char *)mlib_bucket_contains(lib, &plist->data, path);
+}
+
+/**
+ * Search for the element in @path in the passed library and playlist. Returns
+ * a pointer to the location of that string in the library or NULL if not
+ * found.
+ *
+ * @lib		The library.
+ * @plist	The playlist in @lib.
+ * @path	The path to look for.
+ */
+const char *mlib_find_path(const struct mlib_library *lib,
+			   const struct mlib_playlist *plist, const char *path)
+{
+	if (MLIB_PLIST_MAGIC(plist) != MLIB_PLIST_HDR_MAGIC &&
+	    !MLIB_PLIST_PAGED(plist)) {
+		mlib_error("Invalid playlist (%p).\n", plist);
+		return NULL;
+	}
+	return __mlib_find_path(lib, plist, path);
+}
+
+/**
+ * Find the paths in @plist that start with @prefix, e.g everything under a
+ * directory. The matches are the paths at indexes @first to @last (inclusive)
+ * for mlib_get_path_at(). Returns the number of matches or < 0 on error.
+ *
+ * @lib		The library @plist is in.
+ * @plist	The playlist to search.
+ * @prefix	The prefix to look for.
+ * @first	Set to the index of the first match.
+ * @last	Set to the index of the last match.
+ */
+int mlib_find_prefix(const struct mlib_library *lib,
+		     const struct mlib_playlist *plist, const char *prefix,
+		     int *first, int *last)
+{
+	if (MLIB_PLIST_PAGED(plist))
+		return mlib_ptree_prefix(lib, plist, prefix, first, last);
+	if (MLIB_PLIST_MAGIC(plist) != MLIB_PLIST_HDR_MAGIC) {
+		mlib_error("Invalid playlist (%p).\n", plist);
+		return -1;
+	}
+	return mlib_bucket_prefix_range(lib, &plist->data, prefix, first,
+					last);
+}
+
+/*
+ * Create an empty playlist. Very simple low level command here. Usage:
+ *
+ *   mkpls <lib> <name> [paged]
+ */
+int __mlib_make_playlist(int argc, char *argv[])
+{
+	int ret;
+	struct mlib_library *lib;
+
+	if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "paged"))) {
+		mlib_printf("Usage: mkpls <lib> <name> [paged]\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (argc == 4)
+		ret = mlib_start_paged_playlist(lib, argv[2]);
+	else
+		ret = mlib_start_playlist(lib, argv[2]);
+	if (ret) {
+		mlib_printf("Failed to make empty playlist.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static struct mlib_command mlib_command_mkpls = {
+	.name = "mkpls",
+	.desc = "Create an empty playlist.",
+	.main = __mlib_make_playlist,
+};
+
+/*
+ * List play lists in a library or paths in a playlist. Usage:
+ *
+ *   lspls <lib> [playlist]
+ */
+int __mlib_ls_playlist(int argc, char *argv[])
+{
+	int ind;
+	const char *path;
+	struct mlib_library *lib;
+	struct mlib_playlist *plist;
+
+	if (argc < 2 || argc > 4) {
+		mlib_printf("Usage: lspls <lib> [playlist]\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (argc == 2) {
+		mlib_for_each_pls(lib, plist)
+			mlib_printf("%5d  - %s\n", MLIB_PLIST_MCOUNT(plist),
+				    MLIB_PLIST_NAME(plist));
+	} else {
+		plist = mlib_find_playlist(lib, argv[2]);
+		if (!plist) {
+			mlib_printf("Playlist '%s' does not exist.\n",
+				    argv[2]);
+			return 1;
+		}
+		mlib_for_each_path(lib, plist, ind, path)
+			mlib_printf("%s\n", path);
+	}
+
+	return 0;
+}
+
+static struct mlib_command mlib_command_lspls = {
+	.name = "lspls",
+	.desc = "List playlists in a library.",
+	.main = __mlib_ls_playlist,
+};
+
+/*
+ * Add a path to the specified playlist. Usage:
+ *
+ *   plsadd <lib> <playlist> <path>
+ */
+int __mlib_playlist_add(int argc, char *argv[])
+{
+	int ret;
+	struct mlib_library *lib;
+
+	if (argc != 4) {
+		mlib_printf("Usage: plsadd <lib> <plist> <path>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	ret = mlib_add_path(lib, argv[2], argv[3]);
+	if (ret)
+		return 1;
+	return 0;
+}
+
+static struct mlib_command mlib_command_plsadd = {
 	.name = "plsadd",
 	.desc = "Add a path to a playlist.",
 	.main = __mlib_playlist_add,
 };
 
+/*
+ * Remove a path from the specified playlist. Usage:
+ *
+ *   plsrm <lib> <playlist> <path>
+ */
+int __mlib_playlist_rm(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+
+	if (argc != 4) {
+		mlib_printf("Usage: plsrm <lib> <plist> <path>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (mlib_remove_path(lib, argv[2], argv[3])) {
+		mlib_printf("Path '%s' is not in '%s'.\n", argv[3], argv[2]);
+		return 1;
+	}
+	return 0;
+}
+
+static struct mlib_command mlib_command_plsrm = {
+	.name = "plsrm",
+	.desc = "Remove a path from a playlist.",
+	.main = __mlib_playlist_rm,
+};
+
+/*
+ * List the paths in a playlist that start with a prefix. Usage:
+ *
+ *   plsprefix <lib> <playlist> <prefix>
+ */
+int __mlib_playlist_prefix(int argc, char *argv[])
+{
+	int ind, first, last;
+	struct mlib_library *lib;
+	struct mlib_playlist *plist;
+
+	if (argc != 4) {
+		mlib_printf("Usage: plsprefix <lib> <plist> <prefix>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	plist = mlib_find_playlist(lib, argv[2]);
+	if (!plist) {
+		mlib_printf("Playlist '%s' does not exist.\n", argv[2]);
+		return 1;
+	}
+
+	if (mlib_find_prefix(lib, plist, argv[3], &first, &last) < 0)
+		return 1;
+	for (ind = first; ind <= last; ind++)
+		mlib_printf("%s\n", mlib_get_path_at(lib, plist, ind));
+
+	return 0;
+}
+
+static struct mlib_command mlib_command_plsprefix = {
+	.name = "plsprefix",
+	.desc = "List the paths in a playlist that start with a prefix.",
+	.main = __mlib_playlist_prefix,
+};
+
+/*
+ * Add a hash table to a playlist. Usage:
+ *
+ *   plshash <lib> <playlist>
+ */
+int __mlib_playlist_hash(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+
+	if (argc != 3) {
+		mlib_printf("Usage: plshash <lib> <plist>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (mlib_hash_playlist(lib, argv[2]))
+		return 1;
+	return 0;
+}
+
+static struct mlib_command mlib_command_plshash = {
+	.name = "plshash",
+	.desc = "Add a hash table to a playlist for faster lookups.",
+	.main = __mlib_playlist_hash,
+};
+
+/*
+ * Add a Bloom filter to a playlist. Usage:
+ *
+ *   plsbloom <lib> <playlist>
+ */
+int __mlib_playlist_bloom(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+
+	if (argc != 3) {
+		mlib_printf("Usage: plsbloom <lib> <plist>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (mlib_bloom_playlist(lib, argv[2]))
+		return 1;
+	return 0;
+}
+
+static struct mlib_command mlib_command_plsbloom = {
+	.name = "plsbloom",
+	.desc = "Add a Bloom filter to a playlist for faster misses.",
+	.main = __mlib_playlist_bloom,
+};
+
+/*
+ * Print the Bloom filter counters. Usage:
+ *
+ *   bloomstat [reset]
+ */
+int __mlib_bloom_stat(int argc, char *argv[])
+{
+	struct mlib_bloom_stats stats;
+	uint64_t misses;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+		mlib_printf("Usage: bloomstat [reset]\n");
+		return 1;
+	}
+
+	mlib_bucket_bloom_stats(&stats);
+	misses = stats.negatives + stats.false_positives;
+	mlib_printf("Checks:          %llu\n",
+		    (unsigned long long)stats.checks);
+	mlib_printf("Negatives:       %llu\n",
+		    (unsigned long long)stats.negatives);
+	mlib_printf("False positives: %llu (%.2f%%)\n",
+		    (unsigned long long)stats.false_positives,
+		    misses ? 100.0 * stats.false_positives / misses : 0.0);
+
+	if (argc == 2)
+		mlib_bucket_bloom_stats_reset();
+	return 0;
+}
+
+static struct mlib_command mlib_command_bloomstat = {
+	.name = "bloomstat",
+	.desc = "Print Bloom filter hit and false positive counts.",
+	.main = __mlib_bloom_stat,
+};
+
+/*
+ * (Re)build the search tree of a playlist. Usage:
+ *
+ *   plstree <lib> <playlist>
+ */
+int __mlib_playlist_tree(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+
+	if (argc != 3) {
+		mlib_printf("Usage: plstree <lib> <plist>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (mlib_tree_playlist(lib, argv[2]))
+		return 1;
+	return 0;
+}
+
+static struct mlib_command mlib_command_plstree = {
+	.name = "plstree",
+	.desc = "Build a cache friendly search tree for a playlist.",
+	.main = __mlib_playlist_tree,
+};
+
+/*
+ * Re-sort a playlist using every CPU. Usage:
+ *
+ *   plsrebuild <lib> <playlist>
+ */
+int __mlib_playlist_rebuild(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+
+	if (argc != 3) {
+		mlib_printf("Usage: plsrebuild <lib> <plist>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (mlib_rebuild_playlist(lib, argv[2], 0))
+		return 1;
+	return 0;
+}
+
+static struct mlib_command mlib_command_plsrebuild = {
+	.name = "plsrebuild",
+	.desc = "Sort a playlist from scratch with a parallel radix sort.",
+	.main = __mlib_playlist_rebuild,
+};
+
+/*
+ * Compress a playlist. Usage:
+ *
+ *   plscompress <lib> <playlist>
+ */
+int __mlib_playlist_compress(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+
+	if (argc != 3) {
+		mlib_printf("Usage: plscompress <lib> <plist>\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (mlib_compress_playlist(lib, argv[2]))
+		return 1;
+	return 0;
+}
+
+static struct mlib_command mlib_command_plscompress = {
+	.name = "plscompress",
+	.desc = "Compress the paths in a playlist.",
+	.main = __mlib_playlist_compress,
+};
+
+static double __mlib_pct(uint64_t part, uint64_t whole)
+{
+	return whole ? 100.0 * part / whole : 0.0;
+}
+
+static double __mlib_avg(uint64_t sum, uint64_t nr)
+{
+	return nr ? (double)sum / nr : 0.0;
+}
+
+/*
+ * Print one line of the plsstat table.
+ */
+static void __mlib_print_stats_line(const char *name,
+				    const struct mlib_bucket_stats *s)
+{
+	mlib_printf("%-16s %9llu %11llu %11llu %9llu %9llu %9llu %5.1f%% "
+		    "%6.1f\n", name,
+		    (unsigned long long)s->entries,
+		    (unsigned long long)s->total_bytes,
+		    (unsigned long long)s->str_bytes,
+		    (unsigned long long)s->index_bytes,
+		    (unsigned long long)s->aux_bytes,
+		    (unsigned long long)(s->free_bytes + s->dead_bytes),
+		    __mlib_pct(s->free_bytes + s->dead_bytes, s->total_bytes),
+		    __mlib_avg(s->path_bytes, s->entries));
+}
+
+/*
+ * Print the full statistics of a playlist.
+ */
+static void __mlib_print_stats(const struct mlib_bucket_stats *s)
+{
+	mlib_printf("Entries:        %llu\n",
+		    (unsigned long long)s->entries);
+	mlib_printf("Total bytes:    %llu\n",
+		    (unsigned long long)s->total_bytes);
+	mlib_printf("Headers:        %llu\n",
+		    (unsigned long long)s->header_bytes);
+	mlib_printf("Strings:        %llu\n",
+		    (unsigned long long)s->str_bytes);
+	mlib_printf("Indexes:        %llu (%.1f per entry)\n",
+		    (unsigned long long)s->index_bytes,
+		    __mlib_avg(s->index_bytes, s->entries));
+	mlib_printf("Aux tables:     %llu\n",
+		    (unsigned long long)s->aux_bytes);
+	mlib_printf("Free slack:     %llu (%.1f%%)\n",
+		    (unsigned long long)s->free_bytes,
+		    __mlib_pct(s->free_bytes, s->total_bytes));
+	mlib_printf("Dead strings:   %llu\n",
+		    (unsigned long long)s->dead_bytes);
+	mlib_printf("Fragmentation:  %.1f%% of string bytes\n",
+		    __mlib_pct(s->dead_bytes, s->str_bytes + s->dead_bytes));
+	mlib_printf("Avg path len:   %.1f\n",
+		    __mlib_avg(s->path_bytes, s->entries));
+}
+
+/*
+ * Print storage statistics for every playlist in a library, or all of the
+ * statistics of one playlist. Waste is free slack plus dead strings. Usage:
+ *
+ *   plsstat <lib> [playlist]
+ */
+int __mlib_playlist_stat(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+	struct mlib_playlist *plist;
+	struct mlib_bucket_stats stats, total;
+
+	if (argc < 2 || argc > 3) {
+		mlib_printf("Usage: plsstat <lib> [plist]\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library '%s' not loaded.\n", argv[1]);
+		return 1;
+	}
+
+	if (argc == 3) {
+		plist = mlib_find_playlist(lib, argv[2]);
+		if (!plist) {
+			mlib_printf("Playlist '%s' does not exist.\n",
+				    argv[2]);
+			return 1;
+		}
+		memset(&stats, 0, sizeof(stats));
+		mlib_playlist_stats(lib, plist, &stats);
+		__mlib_print_stats(&stats);
+		return 0;
+	}
+
+	mlib_printf("%-16s %9s %11s %11s %9s %9s %9s %6s %6s\n", "Playlist",
+		    "Entries", "Bytes", "Strings", "Indexes", "Aux", "Waste",
+		    "", "Path");
+	memset(&total, 0, sizeof(total));
+	total.total_bytes = total.header_bytes = MLIB_HEADER_SIZE;
+	mlib_for_each_pls(lib, plist) {
+		memset(&stats, 0, sizeof(stats));
+		mlib_playlist_stats(lib, plist, &stats);
+		__mlib_print_stats_line(MLIB_PLIST_NAME(plist), &stats);
+
+		total.entries += stats.entries;
+		total.total_bytes += stats.total_bytes;
+		total.header_bytes += stats.header_bytes;
+		total.str_bytes += stats.str_bytes;
+		total.dead_bytes += stats.dead_bytes;
+		total.index_bytes += stats.index_bytes;
+		total.aux_bytes += stats.aux_bytes;
+		total.free_bytes += stats.free_bytes;
+		total.path_bytes += stats.path_bytes;
+	}
+
+	/* The directory and free extents that no playlist owns. */
+	mlib_dir_stats(lib, &total);
+	total.total_bytes += mlib_library_free_bytes(lib);
+	total.free_bytes += mlib_library_free_bytes(lib);
+	__mlib_print_stats_line("(library)", &total);
+
+	return 0;
+}
+
+static struct mlib_command mlib_command_plsstat = {
+	.name = "plsstat",
+	.desc = "Print storage statistics for playlists.",
+	.main = __mlib_playlist_stat,
+};
+
 /*
  * Remove a playlist. Usage:
  *
@@ -432,5 +1396,14 @@ int mlib_playlist_init()
 	mlib_command_register(&mlib_command_rmpls);
 	mlib_command_register(&mlib_command_lspls);
 	mlib_command_register(&mlib_command_plsadd);
+	mlib_command_register(&mlib_command_plsrm);
+	mlib_command_register(&mlib_command_plsprefix);
+	mlib_command_register(&mlib_command_plshash);
+	mlib_command_register(&mlib_command_plsbloom);
+	mlib_command_register(&mlib_command_bloomstat);
+	mlib_command_register(&mlib_command_plstree);
+	mlib_command_register(&mlib_command_plsrebuild);
+	mlib_command_register(&mlib_command_plscompress);
+	mlib_command_register(&mlib_command_plsstat);
 	return 0;
 }
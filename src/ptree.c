@@ -0,0 +1,842 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Paged playlists. A regular playlist is one bucket, so growing it shifts
+ * everything after it in the library. A paged playlist is instead a B+tree of
+ * MLIB_PAGE_SIZE pages:
+ *
+ *   - Leaves hold a bucket that never grows (MLIB_BUCKET_F_FIXED). Like any
+ *     other named playlist it only stores the .global IDs of its paths, in
+ *     sorted order. A full leaf is split in two.
+ *
+ *   - Interior pages hold up to MLIB_PAGE_FANOUT children. Each child records
+ *     the ID of the first path under it, which is what lookups compare
+ *     against, and the number of paths under it so paths can be found by
+ *     position.
+ *
+ * New pages are allocated as library records (appended to the end of a v1
+ * library) and freed pages go on a per playlist free list, so adding or
+ * removing a path touches O(log n) pages and never moves the rest of the
+ * library. Pages that become empty are freed but partly empty pages are not
+ * merged.
+ *
+ * Pages are referred to by library offset. In a v1 library growing or
+ * shrinking a regular playlist still moves everything after it, pages
+ * included, so the library code calls __mlib_ptree_shift() to fix the offsets
+ * up when that happens. Pages in a v2 library never move.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mlib/mlib.h>
+#include <mlib/ptree.h>
+
+#define MLIB_PTREE_MAX_DEPTH	16
+
+#define __mlib_page(lib, offs)						\
+	((struct mlib_page *)(((void *)(lib)->header) + (offs)))
+#define __mlib_page_leaf(page)		((struct mlib_bucket *)(page)->data)
+#define __mlib_page_children(page)	((struct mlib_page_child *)(page)->data)
+
+/*
+ * State for an add or remove. The playlist is kept as an offset since adding
+ * pages may remap the library.
+ */
+struct __mlib_ptree_op {
+	struct mlib_library	*lib;
+	uint64_t		 plist;
+	const char		*path;
+};
+
+static struct mlib_ptree *__mlib_ptree_of(struct __mlib_ptree_op *op)
+{
+	struct mlib_playlist *plist;
+
+	plist = ((void *)op->lib->header) + op->plist;
+	return MLIB_PLIST_PTREE(plist);
+}
+
+/**
+ * Set up an empty tree.
+ *
+ * @ptree	The tree header of a new paged playlist.
+ */
+int mlib_ptree_init(struct mlib_ptree *ptree)
+{
+	__mlib_writel(&ptree->root, 0);
+	__mlib_writel(&ptree->free, 0);
+	__mlib_writel(&ptree->nr_pages, 0);
+	return 0;
+}
+
+/*
+ * Number of paths under @page.
+ */
+static uint32_t __mlib_page_count(const struct mlib_page *page)
+{
+	const struct mlib_page_child *children = __mlib_page_children(page);
+	uint32_t i, count = 0;
+
+	if (MLIB_PAGE_LEVEL(page) == 0)
+		return mlib_bucket_nr_indexes(__mlib_page_leaf(page));
+
+	for (i = 0; i < MLIB_PAGE_NR(page); i++)
+		count += __mlib_readl(&children[i].count);
+	return count;
+}
+
+/*
+ * ID of the first path under @page, which must not be empty.
+ */
+static uint32_t __mlib_page_first(const struct mlib_page *page)
+{
+	if (MLIB_PAGE_LEVEL(page) == 0)
+		return mlib_bucket_index(__mlib_page_leaf(page), 0);
+	return __mlib_readl(&__mlib_page_children(page)[0].key);
+}
+
+/*
+ * Point child @slot of @page at the page at @offs and refresh its key and
+ * count.
+ */
+static void __mlib_page_set_child(struct mlib_library *lib,
+				  struct mlib_page *page, uint32_t slot,
+				  uint64_t offs)
+{
+	struct mlib_page_child *child = &__mlib_page_children(page)[slot];
+	struct mlib_page *sub = __mlib_page(lib, offs);
+
+	__mlib_write_offs(lib, &child->offs, offs);
+	__mlib_writel(&child->count, __mlib_page_count(sub));
+	if (__mlib_page_count(sub))
+		__mlib_writel(&child->key, __mlib_page_first(sub));
+	__mlib_library_dirty(lib, child, sizeof(*child));
+}
+
+/*
+ * Note that the header of @page changed.
+ */
+static void __mlib_page_dirty(struct mlib_library *lib, struct mlib_page *page)
+{
+	__mlib_library_dirty(lib, page, sizeof(*page));
+}
+
+/*
+ * Point the root of the tree at the page at @root.
+ */
+static void __mlib_ptree_set_root(struct __mlib_ptree_op *op, uint64_t root)
+{
+	struct mlib_ptree *ptree = __mlib_ptree_of(op);
+
+	__mlib_write_offs(op->lib, &ptree->root, root);
+	__mlib_library_dirty(op->lib, ptree, sizeof(*ptree));
+}
+
+/*
+ * Compare the path with ID @id against @str.
+ */
+static int __mlib_ptree_cmp(const struct mlib_library *lib, uint32_t id,
+			    const char *str)
+{
+	const char *path = mlib_media_path(lib, id);
+
+	return path ? strcmp(path, str) : -1;
+}
+
+/*
+ * Pick the child of @page that @str belongs under: the last one whose first
+ * path is not greater than @str, or the first child if there is none.
+ */
+static uint32_t __mlib_page_route(const struct mlib_library *lib,
+				  const struct mlib_page *page,
+				  const char *str)
+{
+	const struct mlib_page_child *children = __mlib_page_children(page);
+	uint32_t lo = 0, hi = MLIB_PAGE_NR(page) - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (__mlib_ptree_cmp(lib, __mlib_readl(&children[mid].key),
+				     str) <= 0)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/*
+ * Get a page for the tree, off the free list if there is one and from the
+ * library otherwise. Returns the page's offset or 0 on failure.
+ */
+static uint64_t __mlib_page_alloc(struct __mlib_ptree_op *op, uint32_t level)
+{
+	struct mlib_ptree *ptree = __mlib_ptree_of(op);
+	struct mlib_page *page;
+	uint64_t offs = __mlib_read_offs(op->lib, &ptree->free);
+
+	if (offs) {
+		page = __mlib_page(op->lib, offs);
+		__mlib_write_offs(op->lib, &ptree->free,
+				  MLIB_PAGE_NEXT(op->lib, page));
+	} else {
+		offs = __mlib_library_alloc_record(op->lib, MLIB_PAGE_SIZE);
+		if (!offs)
+			return 0;
+		ptree = __mlib_ptree_of(op);
+		__mlib_writel(&ptree->nr_pages,
+			      __mlib_readl(&ptree->nr_pages) + 1);
+		page = __mlib_page(op->lib, offs);
+		__mlib_writel(&page->magic, MLIB_PAGE_MAGIC);
+		__mlib_writel(&page->length, MLIB_PAGE_SIZE);
+	}
+
+	MLIB_PAGE_SET_LEVEL(page, level);
+	MLIB_PAGE_SET_NR(page, 0);
+	MLIB_PAGE_SET_NEXT(op->lib, page, 0);
+	if (level == 0)
+		mlib_init_bucket(__mlib_page_leaf(page), MLIB_PAGE_DATA_LEN,
+				 MLIB_BUCKET_F_REFS | MLIB_BUCKET_F_FIXED);
+	__mlib_library_dirty(op->lib, page, sizeof(*page) +
+			     sizeof(struct mlib_bucket));
+	__mlib_library_dirty(op->lib, ptree, sizeof(*ptree));
+	return offs;
+}
+
+static void __mlib_page_free(struct __mlib_ptree_op *op, uint64_t offs)
+{
+	struct mlib_ptree *ptree = __mlib_ptree_of(op);
+	struct mlib_page *page = __mlib_page(op->lib, offs);
+
+	MLIB_PAGE_SET_LEVEL(page, MLIB_PAGE_FREE);
+	MLIB_PAGE_SET_NR(page, 0);
+	MLIB_PAGE_SET_NEXT(op->lib, page,
+			   __mlib_read_offs(op->lib, &ptree->free));
+	__mlib_write_offs(op->lib, &ptree->free, offs);
+	__mlib_page_dirty(op->lib, page);
+	__mlib_library_dirty(op->lib, ptree, sizeof(*ptree));
+}
+
+/*
+ * Add the path to the leaf at @offs, splitting it if it is full. The new right
+ * half, if any, is returned in @split.
+ */
+static int __mlib_ptree_insert_leaf(struct __mlib_ptree_op *op, uint64_t offs,
+				    uint64_t *split)
+{
+	struct mlib_bucket *left, *right, *target;
+	uint64_t right_offs;
+
+	left = __mlib_page_leaf(__mlib_page(op->lib, offs));
+	if (mlib_bucket_contains(op->lib, left, op->path))
+		return -1;
+	if (mlib_bucket_add(op->lib, left, op->path) == 0)
+		return 0;
+
+	right_offs = __mlib_page_alloc(op, 0);
+	if (!right_offs)
+		return -1;
+	left = __mlib_page_leaf(__mlib_page(op->lib, offs));
+	right = __mlib_page_leaf(__mlib_page(op->lib, right_offs));
+	if (mlib_bucket_split(op->lib, left, right))
+		return -1;
+
+	*split = right_offs;
+	target = strcmp(op->path, mlib_bucket_string(op->lib, right, 0)) < 0 ?
+		left : right;
+	return mlib_bucket_add(op->lib, target, op->path);
+}
+
+/*
+ * Insert the page at @child as child @slot of the interior page at @offs,
+ * splitting the page if it is full. The new right half, if any, is returned
+ * in @split.
+ */
+static int __mlib_ptree_insert_child(struct __mlib_ptree_op *op, uint64_t offs,
+				     uint32_t slot, uint64_t child,
+				     uint64_t *split)
+{
+	struct mlib_page *page = __mlib_page(op->lib, offs), *right;
+	struct mlib_page_child *children;
+	uint32_t nr = MLIB_PAGE_NR(page), keep;
+	uint64_t right_offs;
+
+	if (nr == MLIB_PAGE_FANOUT) {
+		right_offs = __mlib_page_alloc(op, MLIB_PAGE_LEVEL(page));
+		if (!right_offs)
+			return -1;
+		page = __mlib_page(op->lib, offs);
+		right = __mlib_page(op->lib, right_offs);
+
+		keep = nr / 2;
+		memcpy(__mlib_page_children(right),
+		       __mlib_page_children(page) + keep,
+		       (nr - keep) * sizeof(struct mlib_page_child));
+		MLIB_PAGE_SET_NR(right, nr - keep);
+		MLIB_PAGE_SET_NR(page, keep);
+		__mlib_library_dirty(op->lib, right, sizeof(*right) +
+				     (nr - keep) *
+				     sizeof(struct mlib_page_child));
+		__mlib_page_dirty(op->lib, page);
+		*split = right_offs;
+
+		if (slot > keep) {
+			page = right;
+			slot -= keep;
+		}
+		nr = MLIB_PAGE_NR(page);
+	}
+
+	children = __mlib_page_children(page);
+	memmove(children + slot + 1, children + slot,
+		(nr - slot) * sizeof(*children));
+	MLIB_PAGE_SET_NR(page, nr + 1);
+	__mlib_page_dirty(op->lib, page);
+	__mlib_library_dirty(op->lib, children + slot,
+			     (nr + 1 - slot) * sizeof(*children));
+	__mlib_page_set_child(op->lib, page, slot, child);
+	return 0;
+}
+
+/*
+ * Add the path to the subtree at @offs. If the page at @offs had to be split
+ * the offset of its new right half is returned in @split.
+ */
+static int __mlib_ptree_insert(struct __mlib_ptree_op *op, uint64_t offs,
+			       uint64_t *split)
+{
+	struct mlib_page *page = __mlib_page(op->lib, offs);
+	uint64_t child, child_split = 0;
+	uint32_t slot;
+
+	*split = 0;
+	if (MLIB_PAGE_LEVEL(page) == 0)
+		return __mlib_ptree_insert_leaf(op, offs, split);
+
+	slot = __mlib_page_route(op->lib, page, op->path);
+	child = __mlib_read_offs(op->lib,
+				 &__mlib_page_children(page)[slot].offs);
+	if (__mlib_ptree_insert(op, child, &child_split))
+		return -1;
+
+	page = __mlib_page(op->lib, offs);
+	__mlib_page_set_child(op->lib, page, slot, child);
+	if (!child_split)
+		return 0;
+	return __mlib_ptree_insert_child(op, offs, slot + 1, child_split,
+					 split);
+}
+
+/**
+ * Add @path to a paged playlist. The path must already be in .global. Returns
+ * 0 on success, < 0 on failure or if the path is already in the playlist.
+ *
+ * @lib		The library.
+ * @plist	The paged playlist.
+ * @path	Path to add.
+ */
+int mlib_ptree_add(struct mlib_library *lib, struct mlib_playlist *plist,
+		   const char *path)
+{
+	struct __mlib_ptree_op op;
+	struct mlib_page *page;
+	uint64_t root, new_root, split;
+	uint32_t id;
+
+	if (mlib_media_id(lib, path, &id)) {
+		mlib_error("'%s' is not in .global.\n", path);
+		return -1;
+	}
+
+	op.lib = lib;
+	op.plist = mlib_lib_offset(lib, plist);
+	op.path = path;
+
+	root = __mlib_read_offs(lib, &__mlib_ptree_of(&op)->root);
+	if (!root) {
+		root = __mlib_page_alloc(&op, 0);
+		if (!root)
+			return -1;
+		__mlib_ptree_set_root(&op, root);
+	}
+
+	if (__mlib_ptree_insert(&op, root, &split))
+		return -1;
+	if (!split)
+		return 0;
+
+	/* The root was split; the tree gets one level taller. */
+	new_root = __mlib_page_alloc(&op, MLIB_PAGE_LEVEL(__mlib_page(lib,
+								     root)) + 1);
+	if (!new_root)
+		return -1;
+	page = __mlib_page(lib, new_root);
+	MLIB_PAGE_SET_NR(page, 2);
+	__mlib_page_dirty(lib, page);
+	__mlib_page_set_child(lib, page, 0, root);
+	__mlib_page_set_child(lib, page, 1, split);
+	__mlib_ptree_set_root(&op, new_root);
+	return 0;
+}
+
+/*
+ * Remove the path from the subtree at @offs. Children left empty are freed.
+ */
+static int __mlib_ptree_delete(struct __mlib_ptree_op *op, uint64_t offs)
+{
+	struct mlib_page *page = __mlib_page(op->lib, offs);
+	struct mlib_page_child *children;
+	uint32_t slot, nr;
+	uint64_t child;
+
+	if (MLIB_PAGE_LEVEL(page) == 0)
+		return mlib_bucket_remove(op->lib, __mlib_page_leaf(page),
+					  op->path);
+
+	slot = __mlib_page_route(op->lib, page, op->path);
+	children = __mlib_page_children(page);
+	child = __mlib_read_offs(op->lib, &children[slot].offs);
+	if (__mlib_ptree_delete(op, child))
+		return -1;
+
+	if (__mlib_page_count(__mlib_page(op->lib, child))) {
+		__mlib_page_set_child(op->lib, page, slot, child);
+		return 0;
+	}
+
+	__mlib_page_free(op, child);
+	nr = MLIB_PAGE_NR(page);
+	memmove(children + slot, children + slot + 1,
+		(nr - slot - 1) * sizeof(*children));
+	MLIB_PAGE_SET_NR(page, nr - 1);
+	__mlib_page_dirty(op->lib, page);
+	__mlib_library_dirty(op->lib, children + slot,
+			     (nr - slot - 1) * sizeof(*children));
+	return 0;
+}
+
+/**
+ * Remove @path from a paged playlist. Returns 0 on success, < 0 if the path is
+ * not in the playlist.
+ *
+ * @lib		The library.
+ * @plist	The paged playlist.
+ * @path	Path to remove.
+ */
+int mlib_ptree_remove(struct mlib_library *lib, struct mlib_playlist *plist,
+		      const char *path)
+{
+	struct __mlib_ptree_op op;
+	struct mlib_page *page;
+	uint64_t root;
+
+	op.lib = lib;
+	op.plist = mlib_lib_offset(lib, plist);
+	op.path = path;
+
+	root = __mlib_read_offs(lib, &MLIB_PLIST_PTREE(plist)->root);
+	if (!root || __mlib_ptree_delete(&op, root))
+		return -1;
+
+	/* Drop roots with a single child and empty trees. */
+	for (;;) {
+		page = __mlib_page(lib, root);
+		if (MLIB_PAGE_LEVEL(page) && MLIB_PAGE_NR(page) == 1) {
+			__mlib_page_free(&op, root);
+			root = __mlib_read_offs(lib,
+					&__mlib_page_children(page)[0].offs);
+			continue;
+		}
+		if (!__mlib_page_count(page)) {
+			__mlib_page_free(&op, root);
+			root = 0;
+		}
+		break;
+	}
+	__mlib_ptree_set_root(&op, root);
+
+	return 0;
+}
+
+/*
+ * Find the leaf @str belongs in, or NULL if the tree is empty.
+ */
+static const struct mlib_bucket *
+__mlib_ptree_leaf(const struct mlib_library *lib,
+		  const struct mlib_playlist *plist, const char *str)
+{
+	const struct mlib_page *page;
+	const struct mlib_page_child *children;
+	uint64_t root = __mlib_read_offs(lib, &MLIB_PLIST_PTREE(plist)->root);
+	uint32_t slot;
+
+	if (!root)
+		return NULL;
+
+	page = __mlib_page(lib, root);
+	while (MLIB_PAGE_LEVEL(page)) {
+		slot = __mlib_page_route(lib, page, str);
+		children = __mlib_page_children(page);
+		page = __mlib_page(lib, __mlib_read_offs(lib,
+						&children[slot].offs));
+	}
+
+	return __mlib_page_leaf(page);
+}
+
+/**
+ * Look up @path in a paged playlist. Returns the path or NULL if it is not in
+ * the playlist.
+ *
+ * @lib		The library @plist is in.
+ * @plist	The paged playlist.
+ * @path	Path to look for.
+ */
+const char *mlib_ptree_find(const struct mlib_library *lib,
+			    const struct mlib_playlist *plist,
+			    const char *path)
+{
+	const struct mlib_bucket *leaf;
+
+	leaf = __mlib_ptree_leaf(lib, plist, path);
+	return leaf ? mlib_bucket_contains(lib, leaf, path) : NULL;
+}
+
+/**
+ * Return the path at position @index of a paged playlist, or NULL if there is
+ * no such position. This walks down the tree by the child counts so it costs
+ * O(log n).
+ *
+ * @lib		The library @plist is in.
+ * @plist	The paged playlist.
+ * @index	Position of the path.
+ */
+const char *mlib_ptree_path_at(const struct mlib_library *lib,
+			       const struct mlib_playlist *plist, int index)
+{
+	const struct mlib_page *page;
+	const struct mlib_page_child *children;
+	uint64_t root;
+	uint32_t i, count, pos = index;
+
+	if (index < 0)
+		return NULL;
+	root = __mlib_read_offs(lib, &MLIB_PLIST_PTREE(plist)->root);
+	if (!root)
+		return NULL;
+
+	page = __mlib_page(lib, root);
+	while (MLIB_PAGE_LEVEL(page)) {
+		children = __mlib_page_children(page);
+		for (i = 0; i < MLIB_PAGE_NR(page); i++) {
+			count = __mlib_readl(&children[i].count);
+			if (pos < count)
+				break;
+			pos -= count;
+		}
+		if (i == MLIB_PAGE_NR(page))
+			return NULL;
+		page = __mlib_page(lib, __mlib_read_offs(lib,
+						&children[i].offs));
+	}
+
+	if (pos >= (uint32_t)mlib_bucket_nr_indexes(__mlib_page_leaf(page)))
+		return NULL;
+	return mlib_bucket_string(lib, __mlib_page_leaf(page), pos);
+}
+
+/*
+ * True for paths before @prefix, or for __mlib_ptree_upto() before or starting
+ * with it. Either way the paths it is true for come first in the playlist.
+ */
+static int __mlib_ptree_below(const char *str, const char *prefix, size_t len)
+{
+	return strcmp(str, prefix) < 0;
+}
+
+static int __mlib_ptree_upto(const char *str, const char *prefix, size_t len)
+{
+	return mlib_prefix_cmp(str, prefix, len) <= 0;
+}
+
+/*
+ * Count the paths @pred is true for.
+ */
+static uint32_t __mlib_ptree_rank(const struct mlib_library *lib,
+				  uint64_t root, const char *prefix,
+				  int (*pred)(const char *, const char *,
+					      size_t))
+{
+	const struct mlib_page *page = __mlib_page(lib, root);
+	const struct mlib_page_child *children;
+	const struct mlib_bucket *leaf;
+	size_t len = strlen(prefix);
+	uint32_t rank = 0, lo, hi, mid, i;
+
+	while (MLIB_PAGE_LEVEL(page)) {
+		children = __mlib_page_children(page);
+		lo = 0;
+		hi = MLIB_PAGE_NR(page);
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (pred(mlib_media_path(lib,
+					__mlib_readl(&children[mid].key)),
+				 prefix, len))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (!lo)
+			return rank;
+		for (i = 0; i < lo - 1; i++)
+			rank += __mlib_readl(&children[i].count);
+		page = __mlib_page(lib, __mlib_read_offs(lib,
+						&children[lo - 1].offs));
+	}
+
+	leaf = __mlib_page_leaf(page);
+	lo = 0;
+	hi = mlib_bucket_nr_indexes(leaf);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pred(mlib_bucket_string(lib, leaf, mid), prefix, len))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return rank + lo;
+}
+
+/**
+ * Find the paths in a paged playlist that start with @prefix; this works just
+ * like mlib_bucket_prefix_range().
+ *
+ * @lib		The library @plist is in.
+ * @plist	The paged playlist.
+ * @prefix	The prefix to look for.
+ * @first	Set to the position of the first match.
+ * @last	Set to the position of the last match.
+ */
+int mlib_ptree_prefix(const struct mlib_library *lib,
+		      const struct mlib_playlist *plist, const char *prefix,
+		      int *first, int *last)
+{
+	uint64_t root;
+	uint32_t lo = 0, hi = 0;
+
+	root = __mlib_read_offs(lib, &MLIB_PLIST_PTREE(plist)->root);
+	if (root) {
+		lo = __mlib_ptree_rank(lib, root, prefix, __mlib_ptree_below);
+		hi = __mlib_ptree_rank(lib, root, prefix, __mlib_ptree_upto);
+	}
+
+	*first = lo;
+	*last = hi - 1;
+	return hi - lo;
+}
+
+/*
+ * Add the offsets of the pages under @offs to @pages.
+ */
+static void __mlib_ptree_collect(const struct mlib_library *lib,
+				 uint64_t offs, uint64_t *pages, uint32_t *nr)
+{
+	const struct mlib_page *page = __mlib_page(lib, offs);
+	uint32_t i;
+
+	pages[(*nr)++] = offs;
+	if (!MLIB_PAGE_LEVEL(page))
+		return;
+	for (i = 0; i < MLIB_PAGE_NR(page); i++)
+		__mlib_ptree_collect(lib,
+			__mlib_read_offs(lib,
+					 &__mlib_page_children(page)[i].offs),
+			pages, nr);
+}
+
+static int __mlib_ptree_offs_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * Cut all of the pages of a paged playlist out of the library, leaving an
+ * empty tree. The pages are freed from the end of the library backwards so
+ * in a v1 library the ones still to go don't move. Returns 0 on success, < 0
+ * on failure.
+ *
+ * @lib		The library.
+ * @plist	The paged playlist.
+ */
+int mlib_ptree_destroy(struct mlib_library *lib, struct mlib_playlist *plist)
+{
+	struct mlib_ptree *ptree = MLIB_PLIST_PTREE(plist);
+	uint64_t *pages, offs;
+	uint32_t nr = 0, i;
+
+	pages = malloc((__mlib_readl(&ptree->nr_pages) + 1) * sizeof(*pages));
+	if (!pages)
+		return -1;
+
+	if (__mlib_read_offs(lib, &ptree->root))
+		__mlib_ptree_collect(lib, __mlib_read_offs(lib, &ptree->root),
+				     pages, &nr);
+	for (offs = __mlib_read_offs(lib, &ptree->free); offs;
+	     offs = MLIB_PAGE_NEXT(lib, __mlib_page(lib, offs)))
+		pages[nr++] = offs;
+	mlib_ptree_init(ptree);
+	__mlib_library_dirty(lib, ptree, sizeof(*ptree));
+
+	qsort(pages, nr, sizeof(*pages), __mlib_ptree_offs_cmp);
+	for (i = 0; i < nr; i++) {
+		if (__mlib_library_free_record(lib, pages[i])) {
+			free(pages);
+			return -1;
+		}
+	}
+
+	free(pages);
+	return 0;
+}
+
+/*
+ * Add the statistics of the subtree at @offs to @stats.
+ */
+static void __mlib_ptree_stats(const struct mlib_library *lib, uint64_t offs,
+			       struct mlib_bucket_stats *stats)
+{
+	const struct mlib_page *page = __mlib_page(lib, offs);
+	uint32_t i, nr = MLIB_PAGE_NR(page);
+
+	stats->total_bytes += sizeof(struct mlib_page);
+	stats->header_bytes += sizeof(struct mlib_page);
+	__mlib_library_record_stats(lib, offs, stats);
+	if (!MLIB_PAGE_LEVEL(page)) {
+		mlib_bucket_stats(lib, __mlib_page_leaf(page), stats);
+		return;
+	}
+
+	stats->total_bytes += MLIB_PAGE_DATA_LEN;
+	stats->index_bytes += nr * sizeof(struct mlib_page_child);
+	stats->free_bytes += MLIB_PAGE_DATA_LEN -
+		nr * sizeof(struct mlib_page_child);
+	for (i = 0; i < nr; i++)
+		__mlib_ptree_stats(lib,
+			__mlib_read_offs(lib,
+					 &__mlib_page_children(page)[i].offs),
+			stats);
+}
+
+/**
+ * Add the storage statistics of the pages of a paged playlist to @stats; see
+ * mlib_bucket_stats(). Interior pages count as index bytes and free pages as
+ * free space.
+ *
+ * @lib		The library @plist is in.
+ * @plist	The paged playlist.
+ * @stats	Statistics to add to.
+ */
+void mlib_ptree_stats(const struct mlib_library *lib,
+		      const struct mlib_playlist *plist,
+		      struct mlib_bucket_stats *stats)
+{
+	const struct mlib_ptree *ptree = MLIB_PLIST_PTREE(plist);
+	uint64_t offs;
+
+	if (__mlib_read_offs(lib, &ptree->root))
+		__mlib_ptree_stats(lib, __mlib_read_offs(lib, &ptree->root),
+				   stats);
+	for (offs = __mlib_read_offs(lib, &ptree->free); offs;
+	     offs = MLIB_PAGE_NEXT(lib, __mlib_page(lib, offs))) {
+		stats->total_bytes += MLIB_PAGE_SIZE;
+		stats->free_bytes += MLIB_PAGE_SIZE;
+		__mlib_library_record_stats(lib, offs, stats);
+	}
+}
+
+/*
+ * Add @delta to a page offset that is at or past @offset.
+ */
+static uint64_t __mlib_ptree_moved(uint64_t val, uint64_t offset,
+				   int32_t delta)
+{
+	return val && val >= offset ? val + delta : val;
+}
+
+/*
+ * Everything in the first @len bytes of the library at or past @offset is
+ * about to move (or just moved) by @delta bytes. Fix up every page offset
+ * that points there. The records in those @len bytes must be laid out
+ * consistently when this is called. Only v1 libraries move records around.
+ */
+void __mlib_ptree_shift(struct mlib_library *lib, uint64_t len,
+			uint64_t offset, int32_t delta)
+{
+	struct mlib_playlist *plist;
+	struct mlib_ptree *ptree;
+	struct mlib_page *page;
+	struct mlib_page_child *children;
+	uint64_t pos = MLIB_HEADER_SIZE;
+	uint32_t magic, i;
+
+	if (MLIB_LIB_EXTENTS(lib))
+		return;
+
+	while (pos + sizeof(struct mlib_page) <= len) {
+		page = __mlib_page(lib, pos);
+		magic = __mlib_readl(&page->magic);
+
+		if (magic == MLIB_PAGE_MAGIC) {
+			if (MLIB_PAGE_LEVEL(page))
+				__mlib_library_dirty(lib, page,
+						     MLIB_PAGE_SIZE);
+			if (MLIB_PAGE_LEVEL(page) == MLIB_PAGE_FREE) {
+				MLIB_PAGE_SET_NEXT(lib, page,
+					__mlib_ptree_moved(
+					MLIB_PAGE_NEXT(lib, page),
+					offset, delta));
+			} else if (MLIB_PAGE_LEVEL(page)) {
+				children = __mlib_page_children(page);
+				for (i = 0; i < MLIB_PAGE_NR(page); i++)
+					__mlib_write_offs(lib,
+						&children[i].offs,
+						__mlib_ptree_moved(
+						__mlib_read_offs(lib,
+							&children[i].offs),
+						offset, delta));
+			}
+		} else if (magic == MLIB_PLIST_PAGED_MAGIC) {
+			plist = (struct mlib_playlist *)page;
+			ptree = MLIB_PLIST_PTREE(plist);
+			__mlib_write_offs(lib, &ptree->root,
+				__mlib_ptree_moved(__mlib_read_offs(lib,
+					&ptree->root), offset, delta));
+			__mlib_write_offs(lib, &ptree->free,
+				__mlib_ptree_moved(__mlib_read_offs(lib,
+					&ptree->free), offset, delta));
+			__mlib_library_dirty(lib, ptree, sizeof(*ptree));
+		}
+
+		if (!__mlib_readl(&page->length))
+			break;
+		pos += __mlib_readl(&page->length);
+	}
+}
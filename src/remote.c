@@ -0,0 +1,523 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Remote libraries. A library served over HTTP is opened without downloading
+ * it. Only its header is fetched up front, to check it and to learn how long
+ * the library is; then address space for the whole library is reserved, just
+ * like the reservation a local library is mapped into, and the rest of mlib
+ * reads the library through it as usual.
+ *
+ * The reservation is registered with a userfaultfd, so the first read of
+ * each MLIB_REMOTE_CHUNK sized chunk blocks the reading thread and queues a
+ * message on it. A fetch thread per library picks the message up, fetches
+ * the chunk with an HTTP Range request and copies it in with UFFDIO_COPY,
+ * which maps the whole chunk at once, so other threads never see a half
+ * filled chunk, and wakes the reader. Chunks stay cached until the library
+ * is closed. A lookup therefore downloads just the directory slots, playlist
+ * headers and bucket pages it actually touches. Nothing runs in a signal
+ * handler: the fetching is ordinary code on its own thread.
+ *
+ * Remote libraries are read-only; anything that would change one fails like
+ * it does for mlib_open_library_ro(). The server has to answer Range requests
+ * with 206. Requests time out, and ones that fail for a reason that may go
+ * away (a timeout, a dropped connection, a 5xx answer) are tried again a few
+ * times with a growing wait in between. A read can't return an error, so if
+ * a chunk still can't be fetched the fetch thread prints why, makes the
+ * chunk inaccessible and wakes the reader, which then takes a SIGSEGV, much
+ * like a local library whose file can't be read back raises SIGBUS. The
+ * chunk is made readable again after MLIB_REMOTE_POISON milliseconds, so the
+ * next read of it fetches it again instead of faulting for good.
+ *
+ * Where unprivileged processes may only catch faults taken in user mode, the
+ * kernel can't wait for a chunk either, so a missing chunk handed straight
+ * to a system call fails with EFAULT there. mlib only ever hands the kernel
+ * copies of what it reads from a library. The reservation isn't inherited
+ * across fork(); the fetch thread isn't either.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <mlib/mlib.h>
+
+#include <curl/curl.h>
+
+/*
+ * Where a transfer puts what it receives.
+ */
+struct mlib_remote_xfer {
+	char	*buf;
+	size_t	 len;
+	size_t	 got;
+};
+
+static size_t __mlib_remote_write(char *data, size_t size, size_t nmemb,
+				  void *priv)
+{
+	struct mlib_remote_xfer *xfer = priv;
+	size_t bytes = size * nmemb;
+
+	/* More than was asked for; the range was ignored. */
+	if (bytes > xfer->len - xfer->got)
+		return 0;
+	memcpy(xfer->buf + xfer->got, data, bytes);
+	xfer->got += bytes;
+	return bytes;
+}
+
+static uint64_t __mlib_remote_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Whether a transfer that failed with @ret may work if it is tried again.
+ */
+static int __mlib_remote_transient(CURLcode ret)
+{
+	switch (ret) {
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Make one attempt at fetching the @len bytes at @offs of the remote library
+ * into @buf. A failure worth trying again is only reported if @last is set.
+ * Returns 0 on success, 1 if the request may work if tried again, < 0 if it
+ * won't.
+ */
+static int __mlib_remote_try(struct mlib_remote *remote, uint64_t offs,
+			     size_t len, void *buf, int last)
+{
+	struct mlib_remote_xfer xfer = { .buf = buf, .len = len };
+	char range[48];
+	long code = 0;
+	CURLcode ret;
+	int err = 0;
+
+	snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long)offs,
+		 (unsigned long long)(offs + len - 1));
+	curl_easy_setopt(remote->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(remote->curl, CURLOPT_WRITEDATA, &xfer);
+
+	ret = curl_easy_perform(remote->curl);
+
+	/* Anything but file:// has to have answered with just the range. */
+	curl_easy_getinfo(remote->curl, CURLINFO_RESPONSE_CODE, &code);
+	if (code && code != 206) {
+		err = code == 408 || code == 429 || code >= 500 ? 1 : -1;
+		if (err < 0 || last)
+			mlib_error("%s: server answered %ld to a range "
+				   "request.\n", remote->url, code);
+	} else if (ret != CURLE_OK) {
+		err = __mlib_remote_transient(ret) ? 1 : -1;
+		if (err < 0 || last)
+			mlib_error("%s: %s\n", remote->url,
+				   curl_easy_strerror(ret));
+	} else if (xfer.got != len) {
+		err = 1;
+		if (last)
+			mlib_error("%s: short read at %llu.\n", remote->url,
+				   (unsigned long long)offs);
+	}
+
+	pthread_mutex_lock(&remote->lock);
+	remote->stats.requests++;
+	remote->stats.bytes += xfer.got;
+	if (err)
+		remote->stats.failures++;
+	pthread_mutex_unlock(&remote->lock);
+	return err;
+}
+
+/*
+ * Fetch the @len bytes at @offs of the remote library into @buf, trying
+ * again with a growing wait in between if that may help. Returns 0 on
+ * success, < 0 on failure.
+ */
+static int __mlib_remote_get(struct mlib_remote *remote, uint64_t offs,
+			     size_t len, void *buf)
+{
+	unsigned int wait = MLIB_REMOTE_BACKOFF;
+	int i, ret;
+
+	for (i = 0; ; i++) {
+		ret = __mlib_remote_try(remote, offs, len, buf,
+					i == MLIB_REMOTE_RETRIES);
+		if (ret <= 0 || i == MLIB_REMOTE_RETRIES)
+			return ret ? -1 : 0;
+		usleep(wait * 1000);
+		wait *= 2;
+	}
+}
+
+/*
+ * Take all access to chunk @n away so that reads of it fault, until
+ * __mlib_remote_unpoison() gives it back MLIB_REMOTE_POISON milliseconds
+ * after the last chunk was poisoned.
+ */
+static void __mlib_remote_poison(struct mlib_remote *remote, size_t n)
+{
+	if (mprotect(remote->base + (uint64_t)n * remote->chunk, remote->chunk,
+		     PROT_NONE)) {
+		mlib_perror("mprotect: %s", remote->url);
+		return;
+	}
+	remote->poisoned[n / 8] |= 1 << (n % 8);
+	remote->nr_poisoned++;
+	remote->unpoison_at = __mlib_remote_msecs() + MLIB_REMOTE_POISON;
+
+	pthread_mutex_lock(&remote->lock);
+	remote->stats.poisoned++;
+	pthread_mutex_unlock(&remote->lock);
+}
+
+/*
+ * Make the poisoned chunks readable again. They are still missing, so the
+ * next read of one faults on the userfaultfd and fetches it again.
+ */
+static void __mlib_remote_unpoison(struct mlib_remote *remote)
+{
+	size_t n;
+
+	for (n = 0; n < remote->nr_chunks && remote->nr_poisoned; n++) {
+		if (!(remote->poisoned[n / 8] & (1 << (n % 8))))
+			continue;
+		if (mprotect(remote->base + (uint64_t)n * remote->chunk,
+			     remote->chunk, PROT_READ)) {
+			mlib_perror("mprotect: %s", remote->url);
+			continue;
+		}
+		remote->poisoned[n / 8] &= ~(1 << (n % 8));
+		remote->nr_poisoned--;
+	}
+
+	/* Whatever couldn't be given back gets another go later. */
+	if (remote->nr_poisoned)
+		remote->unpoison_at = __mlib_remote_msecs() + MLIB_REMOTE_POISON;
+}
+
+/*
+ * Fetch chunk @n of @remote and copy it into place, which wakes everyone
+ * waiting for it. If it can't be fetched, poison it before waking them so
+ * that they fault for real. Only the fetch thread calls this.
+ */
+static void __mlib_remote_fill(struct mlib_remote *remote, size_t n)
+{
+	uint64_t offs = (uint64_t)n * remote->chunk;
+	size_t len = remote->chunk;
+	struct uffdio_copy copy;
+	struct uffdio_range range;
+
+	range.start = (unsigned long)remote->base + offs;
+	range.len = remote->chunk;
+
+	/*
+	 * Someone else asked for it too, before it got here. If that failed
+	 * don't try again right away; everyone waiting gets the fault.
+	 */
+	if ((remote->cached[n / 8] | remote->poisoned[n / 8]) & (1 << (n % 8)))
+		goto wake;
+	if (offs + len > remote->len)
+		len = remote->len - offs;
+
+	if (__mlib_remote_get(remote, offs, len, remote->buf))
+		goto fail;
+	memset(remote->buf + len, 0, remote->chunk - len);
+
+	/* Count it first; the copy wakes readers that may look. */
+	pthread_mutex_lock(&remote->lock);
+	remote->stats.chunks++;
+	pthread_mutex_unlock(&remote->lock);
+
+	copy.dst = range.start;
+	copy.src = (unsigned long)remote->buf;
+	copy.len = range.len;
+	copy.mode = 0;
+	if (ioctl(remote->uffd, UFFDIO_COPY, &copy) && errno != EEXIST) {
+		mlib_perror("UFFDIO_COPY: %s", remote->url);
+		pthread_mutex_lock(&remote->lock);
+		remote->stats.chunks--;
+		pthread_mutex_unlock(&remote->lock);
+		goto fail;
+	}
+	remote->cached[n / 8] |= 1 << (n % 8);
+	return;
+
+fail:
+	__mlib_remote_poison(remote, n);
+wake:
+	if (ioctl(remote->uffd, UFFDIO_WAKE, &range))
+		mlib_perror("UFFDIO_WAKE: %s", remote->url);
+}
+
+/*
+ * The fetch thread: fill in chunks as they are faulted on, and give poisoned
+ * chunks back when it's time, until the stop pipe is closed.
+ */
+static void *__mlib_remote_thread(void *arg)
+{
+	struct mlib_remote *remote = arg;
+	struct pollfd fds[2] = {
+		{ .fd = remote->uffd,		.events = POLLIN },
+		{ .fd = remote->stop[0],	.events = POLLIN },
+	};
+	struct uffd_msg msg;
+	uint64_t addr, now;
+	int timeout, ret;
+
+	for (;;) {
+		timeout = -1;
+		if (remote->nr_poisoned) {
+			now = __mlib_remote_msecs();
+			if (now >= remote->unpoison_at) {
+				__mlib_remote_unpoison(remote);
+				continue;
+			}
+			timeout = remote->unpoison_at - now;
+		}
+
+		ret = poll(fds, 2, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			mlib_perror("poll: %s", remote->url);
+			break;
+		}
+		if (!ret)
+			continue;
+		if (fds[1].revents)
+			break;
+		if (read(remote->uffd, &msg, sizeof(msg)) != sizeof(msg) ||
+		    msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		addr = msg.arg.pagefault.address - (unsigned long)remote->base;
+		__mlib_remote_fill(remote, addr / remote->chunk);
+	}
+	return NULL;
+}
+
+/*
+ * Get a userfaultfd for the calling process. Where unprivileged processes
+ * aren't allowed to catch kernel faults, settle for user faults.
+ */
+static int __mlib_remote_uffd(void)
+{
+	struct uffdio_api api = { .api = UFFD_API };
+	int fd;
+
+	fd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+	if (fd < 0 && errno == EPERM)
+		fd = syscall(SYS_userfaultfd,
+			     O_CLOEXEC|O_NONBLOCK|UFFD_USER_MODE_ONLY);
+#endif
+	if (fd < 0) {
+		mlib_perror("userfaultfd");
+		return -1;
+	}
+	if (ioctl(fd, UFFDIO_API, &api)) {
+		mlib_perror("UFFDIO_API");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Set up @lib to read the library at @url: fetch and check its header and
+ * reserve the address space it will be paged into. On success the mapping,
+ * its length and @lib->remote are filled in. Returns 0 on success, < 0 on
+ * failure.
+ */
+int __mlib_remote_open(struct mlib_library *lib, const char *url)
+{
+	struct mlib_library_header header;
+	struct mlib_library tmp = { .header = &header };
+	struct mlib_remote *remote;
+	struct uffdio_register reg;
+	size_t page = getpagesize();
+	int err;
+
+	remote = calloc(1, sizeof(*remote));
+	if (!remote) {
+		mlib_perror("malloc: %s", url);
+		return -1;
+	}
+	pthread_mutex_init(&remote->lock, NULL);
+	remote->url = strdup(url);
+	remote->curl = curl_easy_init();
+	if (!remote->url || !remote->curl) {
+		mlib_error("%s: could not set up a transfer.\n", url);
+		goto fail;
+	}
+	curl_easy_setopt(remote->curl, CURLOPT_URL, remote->url);
+	curl_easy_setopt(remote->curl, CURLOPT_WRITEFUNCTION,
+			 __mlib_remote_write);
+	curl_easy_setopt(remote->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(remote->curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(remote->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(remote->curl, CURLOPT_TIMEOUT,
+			 (long)MLIB_REMOTE_TIMEOUT);
+	curl_easy_setopt(remote->curl, CURLOPT_CONNECTTIMEOUT,
+			 (long)MLIB_REMOTE_CONNECT_TIMEOUT);
+
+	if (__mlib_remote_get(remote, 0, MLIB_HEADER_SIZE, &header))
+		goto fail;
+	if (__mlib_readl(&header.mlib_magic) != MLIB_MAGIC ||
+	    MLIB_LIB_LEN(&tmp) < MLIB_HEADER_SIZE) {
+		mlib_error("%s: not an mlib library.\n", url);
+		goto fail;
+	}
+
+	remote->len = MLIB_LIB_LEN(&tmp);
+	remote->chunk = MLIB_REMOTE_CHUNK > page ? MLIB_REMOTE_CHUNK : page;
+	remote->nr_chunks = (remote->len + remote->chunk - 1) / remote->chunk;
+	remote->map_len = remote->nr_chunks * remote->chunk;
+	remote->cached = calloc((remote->nr_chunks + 7) / 8, 1);
+	remote->poisoned = calloc((remote->nr_chunks + 7) / 8, 1);
+	remote->buf = malloc(remote->chunk);
+	if (!remote->cached || !remote->poisoned || !remote->buf) {
+		mlib_perror("malloc: %s", url);
+		goto fail;
+	}
+
+	remote->base = mmap(NULL, remote->map_len, PROT_READ,
+			    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (remote->base == MAP_FAILED) {
+		mlib_perror("mmap: %s", url);
+		goto fail;
+	}
+	if (madvise(remote->base, remote->map_len, MADV_DONTFORK)) {
+		mlib_perror("madvise: %s", url);
+		goto fail_2;
+	}
+
+	remote->uffd = __mlib_remote_uffd();
+	if (remote->uffd < 0)
+		goto fail_2;
+	reg.range.start = (unsigned long)remote->base;
+	reg.range.len = remote->map_len;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if (ioctl(remote->uffd, UFFDIO_REGISTER, &reg)) {
+		mlib_perror("UFFDIO_REGISTER: %s", url);
+		goto fail_3;
+	}
+	if (pipe2(remote->stop, O_CLOEXEC)) {
+		mlib_perror("pipe: %s", url);
+		goto fail_3;
+	}
+	err = pthread_create(&remote->thread, NULL, __mlib_remote_thread,
+			     remote);
+	if (err) {
+		mlib_error("%s: can't start a fetch thread: %s\n", url,
+			   strerror(err));
+		goto fail_4;
+	}
+
+	lib->remote = remote;
+	lib->header = remote->base;
+	lib->file_len = remote->len;
+	lib->map_len = remote->map_len;
+	return 0;
+
+fail_4:
+	close(remote->stop[0]);
+	close(remote->stop[1]);
+fail_3:
+	close(remote->uffd);
+fail_2:
+	munmap(remote->base, remote->map_len);
+fail:
+	if (remote->curl)
+		curl_easy_cleanup(remote->curl);
+	pthread_mutex_destroy(&remote->lock);
+	free(remote->buf);
+	free(remote->poisoned);
+	free(remote->cached);
+	free(remote->url);
+	free(remote);
+	return -1;
+}
+
+/*
+ * Stop the fetch thread of remote library @lib, then drop the cached chunks
+ * and everything else __mlib_remote_open() set up. Nothing may be reading
+ * the library any more.
+ */
+void __mlib_remote_close(struct mlib_library *lib)
+{
+	struct mlib_remote *remote = lib->remote;
+
+	close(remote->stop[1]);
+	pthread_join(remote->thread, NULL);
+	close(remote->stop[0]);
+
+	munmap(remote->base, remote->map_len);
+	close(remote->uffd);
+	curl_easy_cleanup(remote->curl);
+	pthread_mutex_destroy(&remote->lock);
+	free(remote->buf);
+	free(remote->poisoned);
+	free(remote->cached);
+	free(remote->url);
+	free(remote);
+	lib->remote = NULL;
+}
+
+/**
+ * Copy the remote counters of @lib into @stats: how many range requests were
+ * made, how many bytes they fetched, how many chunks are cached, how many
+ * requests failed and how many times a chunk was given up on. All zero for a
+ * local library.
+ *
+ * @lib		The library.
+ * @stats	Where to put the counters.
+ */
+void mlib_library_remote_stats(const struct mlib_library *lib,
+			       struct mlib_remote_stats *stats)
+{
+	if (lib->remote) {
+		pthread_mutex_lock(&lib->remote->lock);
+		*stats = lib->remote->stats;
+		pthread_mutex_unlock(&lib->remote->lock);
+	} else
+		memset(stats, 0, sizeof(*stats));
+}
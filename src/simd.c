@@ -0,0 +1,180 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vectorized string compare kernels used by the bucket searches. On x86 the
+ * kernel compares 32 (AVX2) or 16 (SSE2) bytes at a time; the AVX2 version is
+ * picked at run time if the CPU has it. Everywhere else a plain byte loop is
+ * used.
+ *
+ * The vector loads may read past the end of a string. That is harmless as
+ * long as the load does not cross into the next page, which might not be
+ * mapped, so loads that would are done a byte at a time instead. The
+ * sanitizers can't tell these reads are fine so they are not instrumented.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <mlib/mlib.h>
+#include <mlib/plist_bucket.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MLIB_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define MLIB_PAGE_SIZE		4096
+
+#define __mlib_overreads	__attribute__((no_sanitize_address))
+
+/*
+ * True if reading @width bytes at @ptr could touch the next page.
+ */
+#define __mlib_crosses_page(ptr, width)					\
+	((((uintptr_t)(ptr)) & (MLIB_PAGE_SIZE - 1)) > MLIB_PAGE_SIZE - (width))
+
+/*
+ * Compare the first @len bytes of @str and @prefix a byte at a time.
+ */
+static int __mlib_prefix_cmp_scalar(const char *str, const char *prefix,
+				    size_t len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	const unsigned char *p = (const unsigned char *)prefix;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] != p[i])
+			return s[i] - p[i];
+	}
+	return 0;
+}
+
+#ifdef MLIB_SIMD_X86
+
+/*
+ * Given a mask with a bit set for each byte that differs, return the result of
+ * the compare of the block starting at @i.
+ */
+static inline int __mlib_prefix_mismatch(const char *str, const char *prefix,
+					 size_t i, size_t len, uint32_t diff)
+{
+	size_t at = i + __builtin_ctz(diff);
+
+	if (at >= len)
+		return 0;
+	return (unsigned char)str[at] - (unsigned char)prefix[at];
+}
+
+__mlib_overreads
+static int __mlib_prefix_cmp_sse2(const char *str, const char *prefix,
+				  size_t len)
+{
+	size_t i;
+	uint32_t diff;
+	__m128i a, b;
+
+	for (i = 0; i < len; i += 16) {
+		if (__mlib_crosses_page(str + i, 16) ||
+		    __mlib_crosses_page(prefix + i, 16))
+			return __mlib_prefix_cmp_scalar(str + i, prefix + i,
+							len - i);
+
+		a = _mm_loadu_si128((const __m128i *)(str + i));
+		b = _mm_loadu_si128((const __m128i *)(prefix + i));
+		diff = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+		if (diff)
+			return __mlib_prefix_mismatch(str, prefix, i, len,
+						      diff);
+	}
+	return 0;
+}
+
+__attribute__((target("avx2"))) __mlib_overreads
+static int __mlib_prefix_cmp_avx2(const char *str, const char *prefix,
+				  size_t len)
+{
+	size_t i;
+	uint32_t diff;
+	__m256i a, b;
+
+	for (i = 0; i < len; i += 32) {
+		if (__mlib_crosses_page(str + i, 32) ||
+		    __mlib_crosses_page(prefix + i, 32))
+			return __mlib_prefix_cmp_scalar(str + i, prefix + i,
+							len - i);
+
+		a = _mm256_loadu_si256((const __m256i *)(str + i));
+		b = _mm256_loadu_si256((const __m256i *)(prefix + i));
+		diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+		if (diff)
+			return __mlib_prefix_mismatch(str, prefix, i, len,
+						      diff);
+	}
+	return 0;
+}
+
+#endif
+
+typedef int (*mlib_prefix_cmp_fn)(const char *, const char *, size_t);
+
+static mlib_prefix_cmp_fn __mlib_prefix_cmp_impl;
+
+static mlib_prefix_cmp_fn __mlib_prefix_cmp_pick(void)
+{
+#ifdef MLIB_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return __mlib_prefix_cmp_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return __mlib_prefix_cmp_sse2;
+#endif
+	return __mlib_prefix_cmp_scalar;
+}
+
+/**
+ * Compare @str against the first @len bytes of @prefix. Returns < 0, 0 or > 0
+ * like strncmp(str, prefix, len); that is 0 means @str starts with @prefix.
+ * @prefix must not contain a null byte in its first @len bytes. Any number of
+ * threads may call this at once.
+ *
+ * @str		The string to check.
+ * @prefix	The prefix.
+ * @len		Length of @prefix.
+ */
+int mlib_prefix_cmp(const char *str, const char *prefix, size_t len)
+{
+	mlib_prefix_cmp_fn fn = __mlib_prefix_cmp_impl;
+
+	/* Racing threads all pick the same function so this is fine. */
+	if (!fn) {
+		fn = __mlib_prefix_cmp_pick();
+		__mlib_prefix_cmp_impl = fn;
+	}
+	return fn(str, prefix, len);
+}
+
+/**
+ * Force the byte at a time compare kernel (@scalar != 0) or go back to picking
+ * the fastest one the CPU supports. Meant for tests and benchmarks.
+ *
+ * @scalar	Non-zero to use the scalar kernel.
+ */
+void mlib_prefix_cmp_force_scalar(int scalar)
+{
+	__mlib_prefix_cmp_impl = scalar ? __mlib_prefix_cmp_scalar :
+		__mlib_prefix_cmp_pick();
+}
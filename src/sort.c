@@ -0,0 +1,300 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Parallel string sort for rebuilding big bucket indexes in one go. The
+ * entries are cut into one slice per thread and each slice is sorted with an
+ * MSD radix sort: one counting pass per byte position, so a string's bytes are
+ * looked at about once instead of once per comparison. The sorted slices are
+ * then merged pairwise. Each merge is itself split between all of the threads
+ * by cutting both runs at matching ranks (the "merge path"), so every round
+ * keeps all of the cores busy, not just the first one.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <mlib/mlib.h>
+#include <mlib/plist_bucket.h>
+
+/* Below this many entries a radix pass costs more than insertion sort. */
+#define MLIB_SORT_INSERTION	32
+
+/* Don't start a thread for fewer entries than this. */
+#define MLIB_SORT_MIN_SLICE	16384
+
+#define MLIB_SORT_MAX_THREADS	64
+
+struct __mlib_sort_ctx {
+	struct mlib_sort_ent	*src;
+	struct mlib_sort_ent	*dst;
+	uint32_t		 nr;
+	uint32_t		 nr_slices;
+	uint32_t		 width;		/* Slices per sorted run. */
+};
+
+struct __mlib_sort_worker {
+	struct __mlib_sort_ctx	*ctx;
+	uint32_t		 id;
+	pthread_t		 thr;
+};
+
+static void __mlib_sort_insertion(struct mlib_sort_ent *ents, uint32_t nr,
+				  uint32_t depth)
+{
+	uint32_t i, j;
+	struct mlib_sort_ent tmp;
+
+	for (i = 1; i < nr; i++) {
+		tmp = ents[i];
+		for (j = i; j > 0 &&
+			     strcmp(ents[j - 1].str + depth, tmp.str + depth) > 0;
+		     j--)
+			ents[j] = ents[j - 1];
+		ents[j] = tmp;
+	}
+}
+
+/*
+ * MSD radix sort of @ents on the bytes from @depth on; every string is known
+ * to match the others in the bytes before that. @tmp is scratch space for @nr
+ * entries. Strings that end at @depth are equal so that bucket is left alone.
+ * Runs of entries that all have the same next byte, which paths with a common
+ * directory prefix produce a lot of, are skipped without moving anything.
+ * Only the smaller buckets are sorted recursively and the biggest one by
+ * going around again, so each level of recursion at least halves the entries
+ * and the stack stays shallow however long the strings get.
+ */
+static void __mlib_sort_msd(struct mlib_sort_ent *ents,
+			    struct mlib_sort_ent *tmp, uint32_t nr,
+			    uint32_t depth)
+{
+	uint32_t counts[256], offs[256], i, c, start, big, big_start;
+
+again:
+	if (nr < MLIB_SORT_INSERTION) {
+		__mlib_sort_insertion(ents, nr, depth);
+		return;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < nr; i++)
+		counts[(unsigned char)ents[i].str[depth]]++;
+
+	c = (unsigned char)ents[0].str[depth];
+	if (counts[c] == nr) {
+		if (!c)
+			return;
+		depth++;
+		goto again;
+	}
+
+	offs[0] = 0;
+	for (c = 1; c < 256; c++)
+		offs[c] = offs[c - 1] + counts[c - 1];
+	for (i = 0; i < nr; i++)
+		tmp[offs[(unsigned char)ents[i].str[depth]]++] = ents[i];
+	memcpy(ents, tmp, nr * sizeof(*ents));
+
+	big = 0;
+	big_start = 0;
+	for (c = 1, start = counts[0]; c < 256; start += counts[c++]) {
+		if (counts[c] > counts[big]) {
+			big = c;
+			big_start = start;
+		}
+	}
+	for (c = 1, start = counts[0]; c < 256; start += counts[c++]) {
+		if (c != big && counts[c] > 1)
+			__mlib_sort_msd(ents + start, tmp + start, counts[c],
+					depth + 1);
+	}
+	if (!big || counts[big] < 2)
+		return;
+	ents += big_start;
+	tmp += big_start;
+	nr = counts[big];
+	depth++;
+	goto again;
+}
+
+/*
+ * First entry of slice @i.
+ */
+static uint32_t __mlib_sort_bound(const struct __mlib_sort_ctx *ctx,
+				  uint32_t i)
+{
+	if (i > ctx->nr_slices)
+		i = ctx->nr_slices;
+	return (uint64_t)ctx->nr * i / ctx->nr_slices;
+}
+
+/*
+ * Return how many entries of @a are among the first @k entries of the stable
+ * merge of @a and @b.
+ */
+static uint32_t __mlib_sort_corank(uint32_t k,
+				   const struct mlib_sort_ent *a, uint32_t na,
+				   const struct mlib_sort_ent *b, uint32_t nb)
+{
+	uint32_t lo = k > nb ? k - nb : 0;
+	uint32_t hi = k < na ? k : na;
+	uint32_t i;
+
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (strcmp(a[i].str, b[k - i - 1].str) <= 0)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	return lo;
+}
+
+static void __mlib_sort_merge(const struct mlib_sort_ent *a, uint32_t na,
+			      const struct mlib_sort_ent *b, uint32_t nb,
+			      struct mlib_sort_ent *out)
+{
+	while (na && nb) {
+		if (strcmp(a->str, b->str) <= 0) {
+			*out++ = *a++;
+			na--;
+		} else {
+			*out++ = *b++;
+			nb--;
+		}
+	}
+	memcpy(out, a, na * sizeof(*a));
+	memcpy(out + na, b, nb * sizeof(*b));
+}
+
+/*
+ * Sort one slice in place, using the matching part of dst as scratch.
+ */
+static void *__mlib_sort_slice(void *arg)
+{
+	struct __mlib_sort_worker *w = arg;
+	struct __mlib_sort_ctx *ctx = w->ctx;
+	uint32_t lo = __mlib_sort_bound(ctx, w->id);
+	uint32_t hi = __mlib_sort_bound(ctx, w->id + 1);
+
+	__mlib_sort_msd(ctx->src + lo, ctx->dst + lo, hi - lo, 0);
+	return NULL;
+}
+
+/*
+ * Write the part of the merged output that lines up with this worker's slice.
+ * Runs start on slice boundaries so that part always falls inside a single
+ * pair of runs.
+ */
+static void *__mlib_sort_merge_slice(void *arg)
+{
+	struct __mlib_sort_worker *w = arg;
+	struct __mlib_sort_ctx *ctx = w->ctx;
+	uint32_t first = w->id - w->id % (2 * ctx->width);
+	uint32_t base = __mlib_sort_bound(ctx, first);
+	uint32_t mid = __mlib_sort_bound(ctx, first + ctx->width);
+	uint32_t end = __mlib_sort_bound(ctx, first + 2 * ctx->width);
+	uint32_t k0 = __mlib_sort_bound(ctx, w->id) - base;
+	uint32_t k1 = __mlib_sort_bound(ctx, w->id + 1) - base;
+	const struct mlib_sort_ent *a = ctx->src + base, *b = ctx->src + mid;
+	uint32_t na = mid - base, nb = end - mid, i0, i1;
+
+	i0 = __mlib_sort_corank(k0, a, na, b, nb);
+	i1 = __mlib_sort_corank(k1, a, na, b, nb);
+	__mlib_sort_merge(a + i0, i1 - i0, b + (k0 - i0), (k1 - i1) - (k0 - i0),
+			  ctx->dst + base + k0);
+	return NULL;
+}
+
+/*
+ * Run @fn once per slice, each in its own thread. The calling thread does
+ * slice 0 once the others are started, and any slice whose thread can't be
+ * started.
+ */
+static void __mlib_sort_run(struct __mlib_sort_ctx *ctx,
+			    struct __mlib_sort_worker *workers,
+			    void *(*fn)(void *))
+{
+	uint32_t i;
+
+	for (i = 1; i < ctx->nr_slices; i++) {
+		workers[i].ctx = ctx;
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thr, NULL, fn, &workers[i])) {
+			fn(&workers[i]);
+			workers[i].ctx = NULL;
+		}
+	}
+	workers[0].ctx = ctx;
+	workers[0].id = 0;
+	fn(&workers[0]);
+
+	for (i = 1; i < ctx->nr_slices; i++) {
+		if (workers[i].ctx)
+			pthread_join(workers[i].thr, NULL);
+	}
+}
+
+/**
+ * Sort @nr entries by string using up to @nr_threads threads; 0 means one per
+ * online CPU. Equal strings keep no particular order. Returns 0 on success, < 0
+ * if the scratch space could not be allocated.
+ *
+ * @ents	The entries to sort.
+ * @nr		Number of entries.
+ * @nr_threads	Most threads to use.
+ */
+int mlib_sort_strings(struct mlib_sort_ent *ents, uint32_t nr, int nr_threads)
+{
+	struct __mlib_sort_worker workers[MLIB_SORT_MAX_THREADS];
+	struct __mlib_sort_ctx ctx;
+	struct mlib_sort_ent *tmp, *swap;
+
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > MLIB_SORT_MAX_THREADS)
+		nr_threads = MLIB_SORT_MAX_THREADS;
+	if (nr_threads > nr / MLIB_SORT_MIN_SLICE)
+		nr_threads = nr / MLIB_SORT_MIN_SLICE;
+	if (nr_threads < 1)
+		nr_threads = 1;
+
+	tmp = malloc((nr ? nr : 1) * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+
+	ctx.src = ents;
+	ctx.dst = tmp;
+	ctx.nr = nr;
+	ctx.nr_slices = nr_threads;
+	__mlib_sort_run(&ctx, workers, __mlib_sort_slice);
+
+	for (ctx.width = 1; ctx.width < ctx.nr_slices; ctx.width *= 2) {
+		__mlib_sort_run(&ctx, workers, __mlib_sort_merge_slice);
+		swap = ctx.src;
+		ctx.src = ctx.dst;
+		ctx.dst = swap;
+	}
+
+	if (ctx.src != ents)
+		memcpy(ents, ctx.src, nr * sizeof(*ents));
+	free(tmp);
+	return 0;
+}
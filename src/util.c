@@ -108,11 +108,11 @@ void mlib_free_parsed_list(char **list)
  *
  * @lib		The library to use.
  * @ptr		A pointer into the library.
- * @return	Returns the unsigned 32 bit difference.
+ * @return	Returns the unsigned 64 bit difference.
  */
-uint32_t mlib_lib_offset(struct mlib_library *lib, void *ptr)
+uint64_t mlib_lib_offset(struct mlib_library *lib, void *ptr)
 {
-	return (uint32_t)(ptr - (void *)lib->header);
+	return (uint64_t)(ptr - (void *)lib->header);
 }
 
 /**
@@ -131,7 +131,8 @@ int mlib_filter(const char *file, char *mtypes[])
 	filt = *mtypes;
 	while (filt) {
 		filt_len = strlen(filt);
-		if (!strcmp(filt, file + file_len - filt_len))
+		if (filt_len <= file_len &&
+		    !strcmp(filt, file + file_len - filt_len))
 			return 1;
 
 		filt = *mtypes++;
@@ -0,0 +1,221 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vacuuming a library. Over time a library collects space it doesn't need:
+ * every bucket keeps MLIB_BUCKET_GROWTH_RATE bytes of slack, removed paths
+ * leave dead strings behind and in a v2 library deleted and moved records
+ * leave free extents all over the file. A vacuum rewrites every bucket tightly
+ * packed and, in a v2 library, moves each record into the first free extent
+ * before it that fits or slides it down over the gap right before it. That
+ * collects the free space at the end of the library, where it is given back.
+ *
+ * The work is done a record at a time, in file order, in steps of a bounded
+ * number of bytes; struct mlib_vacuum remembers where the last step stopped.
+ * The library is consistent between steps, so a vacuum can be spread out
+ * over time while the library is in use. Pages of paged playlists are
+ * pointed to by other pages and stay where they are.
+ */
+
+#include <time.h>
+
+#include <mlib/mlib.h>
+
+static uint64_t __mlib_vacuum_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define __mlib_vacuum_record(lib, rec)					\
+	((struct mlib_playlist *)(((void *)(lib)->header) + (rec)))
+
+/*
+ * Return the offset of the record after the one at @rec, or the first record
+ * if @rec is 0. Returns 0 at the end of the library.
+ */
+static uint64_t __mlib_vacuum_next(const struct mlib_library *lib,
+				   uint64_t rec)
+{
+	uint32_t len;
+
+	if (MLIB_LIB_EXTENTS(lib))
+		return __mlib_extent_next(lib, rec);
+
+	if (!rec)
+		rec = MLIB_HEADER_SIZE;
+	else if ((len = MLIB_PLIST_LEN(__mlib_vacuum_record(lib, rec))) != 0)
+		rec += len;
+	else
+		return 0;
+	return rec < MLIB_LIB_LEN(lib) ? rec : 0;
+}
+
+/*
+ * Return the offset of the first record at or after @offs, or 0 if there is
+ * none.
+ */
+static uint64_t __mlib_vacuum_find(const struct mlib_library *lib,
+				   uint64_t offs)
+{
+	uint64_t rec;
+
+	for (rec = __mlib_vacuum_next(lib, 0); rec && rec < offs;
+	     rec = __mlib_vacuum_next(lib, rec))
+		;
+	return rec;
+}
+
+/**
+ * Do one step of vacuuming @lib: pack records, starting where the last step
+ * stopped, until @budget bytes worth of them have been done. The last record
+ * may take a step over @budget; at least one record is done per step.
+ * @vac->done is set once the whole library has been vacuumed. Returns 0 on
+ * success, < 0 on failure.
+ *
+ * @lib		The library.
+ * @vac		The state of the vacuum; zeroed for the first step.
+ * @budget	Bytes of records to get through.
+ */
+int mlib_vacuum_step(struct mlib_library *lib, struct mlib_vacuum *vac,
+		     uint32_t budget)
+{
+	uint64_t start = __mlib_vacuum_usecs();
+	uint64_t rec, next, lib_len = MLIB_LIB_LEN(lib);
+	uint32_t len, work = 0;
+	struct mlib_playlist *plist;
+	int ret = 0;
+
+	if (vac->done)
+		return 0;
+	if (__mlib_library_writable(lib))
+		return -1;
+
+	rec = __mlib_vacuum_find(lib, vac->next);
+	while (rec && (!work || work < budget)) {
+		plist = __mlib_vacuum_record(lib, rec);
+		len = MLIB_PLIST_LEN(plist);
+		if (MLIB_PLIST_MAGIC(plist) == MLIB_PLIST_HDR_MAGIC) {
+			if (mlib_bucket_pack(lib, &plist->data)) {
+				ret = -1;
+				break;
+			}
+			plist = __mlib_vacuum_record(lib, rec);
+			vac->packed += len - MLIB_PLIST_LEN(plist);
+		}
+
+		/* Moving the record doesn't change what comes after it. */
+		next = __mlib_vacuum_next(lib, rec);
+		vac->next = rec + 1;
+		vac->moved += __mlib_library_pack_record(lib, &rec);
+		vac->records++;
+		work += len;
+		rec = next;
+	}
+	if (!rec)
+		vac->done = 1;
+
+	if (MLIB_LIB_LEN(lib) < lib_len)
+		vac->reclaimed += lib_len - MLIB_LIB_LEN(lib);
+	vac->steps++;
+	if (mlib_sync_library(lib))
+		ret = -1;
+	vac->usecs += __mlib_vacuum_usecs() - start;
+	return ret;
+}
+
+/**
+ * Vacuum all of @lib, MLIB_VACUUM_STEP bytes at a time. Returns 0 on success,
+ * < 0 on failure; @vac says what was done either way.
+ *
+ * @lib		The library.
+ * @vac		Filled in with what the vacuum did.
+ */
+int mlib_vacuum_library(struct mlib_library *lib, struct mlib_vacuum *vac)
+{
+	memset(vac, 0, sizeof(*vac));
+	while (!vac->done)
+		if (mlib_vacuum_step(lib, vac, MLIB_VACUUM_STEP))
+			return -1;
+	return 0;
+}
+
+/*
+ * Command to vacuum a library. Usage:
+ *
+ *   vacuum <lib> [step-KB]
+ *
+ * Each step is done under the write lock, so other processes using the
+ * library get a turn in between.
+ */
+static int __mlib_vacuum(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+	struct mlib_vacuum vac;
+	uint32_t budget = MLIB_VACUUM_STEP;
+	uint64_t before;
+
+	if (argc < 2 || argc > 3) {
+		mlib_printf("Usage: vacuum <lib> [step-KB]\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library does not exist: %s\n", argv[1]);
+		return 1;
+	}
+	if (argc == 3)
+		budget = strtoul(argv[2], NULL, 0) << 10;
+
+	memset(&vac, 0, sizeof(vac));
+	before = MLIB_LIB_LEN(lib);
+	while (!vac.done) {
+		if (mlib_library_lock(lib, MLIB_LOCK_WRITE))
+			return 1;
+		if (mlib_vacuum_step(lib, &vac, budget)) {
+			mlib_library_unlock(lib);
+			mlib_printf("%s: vacuum failed\n", MLIB_LIB_NAME(lib));
+			return 1;
+		}
+		mlib_library_unlock(lib);
+	}
+
+	mlib_printf("%s: %llu -> %llu bytes\n", MLIB_LIB_NAME(lib),
+		    (unsigned long long)before,
+		    (unsigned long long)MLIB_LIB_LEN(lib));
+	mlib_printf("  Reclaimed: %llu bytes\n",
+		    (unsigned long long)vac.reclaimed);
+	mlib_printf("  Packed:    %llu bytes of slack and dead strings\n",
+		    (unsigned long long)vac.packed);
+	mlib_printf("  Records:   %u (%u moved)\n", vac.records, vac.moved);
+	mlib_printf("  Time:      %.3f ms in %u steps\n", vac.usecs / 1000.0,
+		    vac.steps);
+	return 0;
+}
+
+static struct mlib_command mlib_command_vacuum = {
+	.name = "vacuum",
+	.desc = "Pack a library and give back the space it doesn't need.",
+	.main = __mlib_vacuum,
+};
+
+int mlib_vacuum_init()
+{
+	mlib_command_register(&mlib_command_vacuum);
+	return 0;
+}
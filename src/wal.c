@@ -0,0 +1,720 @@
+/* (C) Copyright 2013
+ * Alex Waterman <imNotListening@gmail.com>
+ *
+ * mlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Journaled libraries. A library is normally a shared mapping of its file, so
+ * the kernel may write any page back at any time: a crash in the middle of
+ * moving a playlist leaves a torn library behind, and the only way to know a
+ * change is on disk is to msync() every page it touched.
+ *
+ * A journaled library (MLIB_LIB_F_JOURNAL) is mapped privately instead, so
+ * the library file is only ever written by a checkpoint. Every change is
+ * logged as a logical record (add this path to that playlist, etc.) to a
+ * write-ahead log next to the library, <library>-wal. Records are buffered
+ * and written and fsync()ed in groups of MLIB_WAL_GROUP, or when the library
+ * is synced, so many changes share one fsync(). A crash loses at most the
+ * records that were not committed yet; the library stays consistent.
+ *
+ * A checkpoint writes the library back into its own file, then empties the
+ * log. Locks are flock()s of the library file and other processes keep it
+ * mapped, so the file itself has to stay; the new contents are written over
+ * the old ones. To survive a crash half way through that, the whole library
+ * is first written to <library>.ckpt.tmp, synced and renamed to
+ * <library>.ckpt; only then is it copied over the library, which is synced
+ * before the copy is removed. Opening a library read-write finishes any copy
+ * that was left behind. The library header records the sequence number of
+ * the last record it includes so a crash before the log is emptied doesn't
+ * replay records twice. Checkpoints happen when the log passes
+ * MLIB_WAL_CKPT_BYTES and when the library is closed.
+ *
+ * When a journaled library is opened its log is replayed by calling the
+ * logged functions again. Replay stops at the first torn or corrupt record.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mlib/mlib.h>
+
+#define MLIB_WAL_MODE	(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
+
+static uint32_t __mlib_crc_table[256];
+
+/*
+ * CRC-32 (IEEE 802.3) of @len bytes at @buf.
+ */
+static uint32_t __mlib_crc32(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t crc = 0xffffffff;
+
+	while (len--)
+		crc = __mlib_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+static uint32_t __mlib_wal_crc(struct mlib_wal_rec *rec, uint32_t len)
+{
+	uint32_t crc = rec->crc, ret;
+
+	rec->crc = 0;
+	ret = __mlib_crc32(rec, len);
+	rec->crc = crc;
+	return ret;
+}
+
+/*
+ * write() all of @len bytes or fail.
+ */
+static int __mlib_write_all(int fd, const void *buf, size_t len, off_t offs)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offs);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		offs += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * fsync() the directory @path is in so that a rename in it is durable.
+ */
+static int __mlib_sync_dir(const char *path)
+{
+	char *copy = strdup(path);
+	int fd, ret = -1;
+
+	if (!copy)
+		return -1;
+	fd = open(dirname(copy), O_RDONLY);
+	if (fd >= 0) {
+		ret = fsync(fd);
+		close(fd);
+	}
+	free(copy);
+	return ret;
+}
+
+/*
+ * Apply a logged record to @lib again. Errors are reported but replay goes
+ * on; the record was logged because it worked the first time.
+ */
+static void __mlib_wal_apply(struct mlib_library *lib,
+			     const struct mlib_wal_rec *rec)
+{
+	const char *name = rec->data, *path;
+	struct mlib_playlist *plist;
+	uint32_t op = __mlib_readl(&rec->op);
+	uint32_t arg0 = __mlib_readl(&rec->args[0]);
+	uint32_t arg1 = __mlib_readl(&rec->args[1]);
+	int ret = -1;
+
+	path = name + strlen(name) + 1;
+	plist = mlib_find_playlist(lib, name);
+
+	switch (op) {
+	case MLIB_WAL_START:
+		ret = mlib_start_playlist(lib, name);
+		break;
+	case MLIB_WAL_START_PAGED:
+		ret = mlib_start_paged_playlist(lib, name);
+		break;
+	case MLIB_WAL_DELETE:
+		ret = mlib_delete_playlist(lib, name);
+		break;
+	case MLIB_WAL_ADD:
+		if (plist)
+			ret = mlib_add_path_to_plist(lib, plist, path);
+		break;
+	case MLIB_WAL_APPEND:
+		ret = mlib_append_path(lib, name, path);
+		break;
+	case MLIB_WAL_REMOVE:
+		if (plist)
+			ret = mlib_remove_path_from_plist(lib, plist, path);
+		break;
+	case MLIB_WAL_RESERVE:
+		ret = mlib_playlist_reserve(lib, name, arg0, arg1);
+		break;
+	case MLIB_WAL_HASH:
+		ret = mlib_hash_playlist(lib, name);
+		break;
+	case MLIB_WAL_BLOOM:
+		ret = mlib_bloom_playlist(lib, name);
+		break;
+	case MLIB_WAL_TREE:
+		ret = mlib_tree_playlist(lib, name);
+		break;
+	case MLIB_WAL_REBUILD:
+		ret = mlib_rebuild_playlist(lib, name, arg0);
+		break;
+	case MLIB_WAL_COMPRESS:
+		ret = mlib_compress_playlist(lib, name);
+		break;
+	}
+
+	if (ret)
+		mlib_error("%s: failed to replay log record %u (op %u).\n",
+			   MLIB_LIB_NAME(lib), __mlib_readl(&rec->seq), op);
+}
+
+/*
+ * Check the record at @rec, which has @left bytes of log after it. Returns its
+ * length or 0 if it is torn or corrupt.
+ */
+static uint32_t __mlib_wal_check(struct mlib_wal_rec *rec, size_t left)
+{
+	uint32_t len;
+
+	if (left < sizeof(*rec) || __mlib_readl(&rec->magic) != MLIB_WAL_MAGIC)
+		return 0;
+	len = __mlib_readl(&rec->length);
+	if (len < sizeof(*rec) + 2 || len > left || len % 4 ||
+	    __mlib_wal_crc(rec, len) != __mlib_readl(&rec->crc))
+		return 0;
+
+	/* The name and path have to end inside the record. */
+	if (!memchr(rec->data, 0, len - sizeof(*rec)) ||
+	    !memchr(rec->data + strlen(rec->data) + 1, 0,
+		    len - sizeof(*rec) - strlen(rec->data) - 1))
+		return 0;
+	return len;
+}
+
+/*
+ * Replay the log of @lib. Records the library file already has are skipped.
+ * The log is cut off after the last good record.
+ */
+static int __mlib_wal_replay(struct mlib_library *lib)
+{
+	struct mlib_wal *wal = lib->wal;
+	struct mlib_wal_rec *rec;
+	uint32_t base = __mlib_readl(&lib->header->wal_seq), seq, len;
+	size_t offs = 0;
+	struct stat sb;
+	char *log;
+
+	if (fstat(wal->fd, &sb))
+		return -1;
+	if (!sb.st_size)
+		return 0;
+	log = malloc(sb.st_size);
+	if (!log)
+		return -1;
+	if (pread(wal->fd, log, sb.st_size, 0) != sb.st_size) {
+		free(log);
+		return -1;
+	}
+
+	wal->replaying = 1;
+	while ((len = __mlib_wal_check((void *)log + offs,
+				       sb.st_size - offs)) != 0) {
+		rec = (void *)log + offs;
+		seq = __mlib_readl(&rec->seq);
+		if ((int32_t)(seq - base) > 0) {
+			__mlib_wal_apply(lib, rec);
+			wal->seq = seq;
+		}
+		offs += len;
+	}
+	wal->replaying = 0;
+	free(log);
+
+	if (offs != (size_t)sb.st_size) {
+		mlib_error("%s: dropping %zu bytes of torn log.\n",
+			   MLIB_LIB_NAME(lib), (size_t)sb.st_size - offs);
+		if (ftruncate(wal->fd, offs))
+			return -1;
+	}
+	wal->size = offs;
+	return 0;
+}
+
+/*
+ * Set up the log of a journaled library: open it and, if @replay is set, replay
+ * it. Otherwise any old log is thrown away. Returns 0 on success, < 0 on
+ * failure.
+ */
+int __mlib_wal_open(struct mlib_library *lib, int replay)
+{
+	struct mlib_wal *wal;
+
+	wal = calloc(1, sizeof(*wal));
+	if (!wal)
+		return -1;
+	wal->lib_path = strdup(lib->path);
+	wal->path = malloc(strlen(lib->path) + sizeof(MLIB_WAL_SUFFIX));
+	if (!wal->lib_path || !wal->path)
+		goto fail;
+	sprintf(wal->path, "%s%s", lib->path, MLIB_WAL_SUFFIX);
+
+	wal->fd = open(wal->path, O_RDWR|O_CREAT|(replay ? 0 : O_TRUNC),
+		       MLIB_WAL_MODE);
+	if (wal->fd < 0) {
+		mlib_perror("open: %s", wal->path);
+		goto fail;
+	}
+	wal->seq = __mlib_readl(&lib->header->wal_seq);
+	wal->group = MLIB_WAL_GROUP;
+	wal->ckpt_bytes = MLIB_WAL_CKPT_BYTES;
+
+	lib->wal = wal;
+	if (replay && __mlib_wal_replay(lib)) {
+		mlib_error("%s: failed to replay the log.\n", wal->path);
+		lib->wal = NULL;
+		close(wal->fd);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	free(wal->lib_path);
+	free(wal->path);
+	free(wal);
+	return -1;
+}
+
+/*
+ * Checkpoint @lib and get rid of its log. The library stays mapped privately;
+ * the caller decides what to do with it.
+ */
+int __mlib_wal_close(struct mlib_library *lib)
+{
+	struct mlib_wal *wal = lib->wal;
+	int ret;
+
+	ret = mlib_journal_checkpoint(lib);
+	lib->wal = NULL;
+	close(wal->fd);
+	if (!ret)
+		unlink(wal->path);
+	free(wal->buf);
+	free(wal->lib_path);
+	free(wal->path);
+	free(wal);
+	return ret;
+}
+
+/**
+ * Log a change to a journaled library. @op says which function made the
+ * change and the rest are its arguments. The record is committed with the
+ * rest of its group. Does nothing if @lib isn't journaled. Returns 0 on
+ * success, < 0 on failure.
+ *
+ * @lib		The library.
+ * @op		An MLIB_WAL_* operation.
+ * @plist	Name of the playlist changed.
+ * @path	The path added or removed, if any.
+ * @arg0	Numeric arguments, if any.
+ * @arg1
+ */
+int mlib_wal_log(struct mlib_library *lib, uint32_t op, const char *plist,
+		 const char *path, uint32_t arg0, uint32_t arg1)
+{
+	struct mlib_wal *wal = lib ? lib->wal : NULL;
+	struct mlib_wal_rec *rec;
+	size_t name_len, path_len, len;
+	char *buf;
+
+	if (!wal || wal->replaying)
+		return 0;
+
+	name_len = strlen(plist) + 1;
+	path_len = path ? strlen(path) + 1 : 1;
+	len = (sizeof(*rec) + name_len + path_len + 3) & ~3;
+
+	if (wal->buf_len + len > wal->buf_size) {
+		buf = realloc(wal->buf, 2 * (wal->buf_size + len));
+		if (!buf)
+			return -1;
+		wal->buf = buf;
+		wal->buf_size = 2 * (wal->buf_size + len);
+	}
+
+	rec = (void *)wal->buf + wal->buf_len;
+	memset(rec, 0, len);
+	__mlib_writel(&rec->magic, MLIB_WAL_MAGIC);
+	__mlib_writel(&rec->length, len);
+	__mlib_writel(&rec->seq, ++wal->seq);
+	__mlib_writel(&rec->op, op);
+	__mlib_writel(&rec->args[0], arg0);
+	__mlib_writel(&rec->args[1], arg1);
+	memcpy(rec->data, plist, name_len);
+	if (path)
+		memcpy(rec->data + name_len, path, path_len);
+	__mlib_writel(&rec->crc, __mlib_wal_crc(rec, len));
+
+	wal->buf_len += len;
+	wal->records++;
+	if (++wal->pending < wal->group)
+		return 0;
+
+	if (mlib_journal_commit(lib))
+		return -1;
+	if (wal->size >= wal->ckpt_bytes)
+		return mlib_journal_checkpoint(lib);
+	return 0;
+}
+
+/**
+ * Write the records logged so far to the log and fsync() it. Returns 0 on
+ * success, < 0 on failure.
+ *
+ * @lib		A journaled library.
+ */
+int mlib_journal_commit(const struct mlib_library *lib)
+{
+	struct mlib_wal *wal = lib->wal;
+
+	if (!wal || !wal->buf_len)
+		return 0;
+
+	if (__mlib_write_all(wal->fd, wal->buf, wal->buf_len, wal->size) ||
+	    fdatasync(wal->fd)) {
+		mlib_perror("write: %s", wal->path);
+		return -1;
+	}
+
+	wal->size += wal->buf_len;
+	wal->buf_len = 0;
+	wal->pending = 0;
+	wal->commits++;
+	return 0;
+}
+
+/*
+ * Names of the copy of a library being checkpointed, while it is written and
+ * once it is complete. The caller frees them.
+ */
+static int __mlib_ckpt_names(const char *lib_path, char **tmp, char **ckpt)
+{
+	*tmp = malloc(strlen(lib_path) + sizeof(".ckpt.tmp"));
+	*ckpt = malloc(strlen(lib_path) + sizeof(".ckpt"));
+	if (!*tmp || !*ckpt) {
+		free(*tmp);
+		free(*ckpt);
+		return -1;
+	}
+	sprintf(*tmp, "%s.ckpt.tmp", lib_path);
+	sprintf(*ckpt, "%s.ckpt", lib_path);
+	return 0;
+}
+
+/*
+ * Copy the complete checkpoint @ckpt over the library open as @fd and sync
+ * it, then drop the checkpoint. Returns 0 on success, < 0 on failure.
+ */
+static int __mlib_ckpt_apply(const char *ckpt, int fd, const void *buf,
+			     size_t len, size_t file_len)
+{
+	if (__mlib_write_all(fd, buf, len, 0) || ftruncate(fd, file_len) ||
+	    fdatasync(fd)) {
+		mlib_perror("checkpoint: %s", ckpt);
+		return -1;
+	}
+	if (unlink(ckpt) || __mlib_sync_dir(ckpt)) {
+		mlib_perror("unlink: %s", ckpt);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Finish a checkpoint of the library at @path, open read-write as @fd, that a
+ * crash cut short: a complete <library>.ckpt is copied over the library. An
+ * incomplete <library>.ckpt.tmp is left for the next checkpoint to overwrite.
+ * Checkpoints hold the write lock from the rename on, so one that is still
+ * going on is waited for. Returns 0 on success or if there was nothing to
+ * do, < 0 on failure.
+ */
+int __mlib_wal_recover(const char *path, int fd)
+{
+	char *tmp, *ckpt;
+	struct stat sb;
+	void *buf;
+	int ckpt_fd, ret = -1;
+
+	if (__mlib_ckpt_names(path, &tmp, &ckpt))
+		return -1;
+	if (stat(ckpt, &sb) && errno == ENOENT) {
+		ret = 0;
+		goto out_free;
+	}
+	if (flock(fd, LOCK_EX)) {
+		mlib_perror("flock: %s", path);
+		goto out_free;
+	}
+
+	ckpt_fd = open(ckpt, O_RDONLY);
+	if (ckpt_fd < 0) {
+		ret = errno == ENOENT ? 0 : -1;
+		if (ret)
+			mlib_perror("open: %s", ckpt);
+		goto out;
+	}
+	if (fstat(ckpt_fd, &sb) || sb.st_size < MLIB_HEADER_SIZE) {
+		mlib_error("%s: bad checkpoint.\n", ckpt);
+		goto out_close;
+	}
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, ckpt_fd, 0);
+	if (buf == MAP_FAILED) {
+		mlib_perror("mmap: %s", ckpt);
+		goto out_close;
+	}
+	ret = __mlib_ckpt_apply(ckpt, fd, buf, sb.st_size, sb.st_size);
+	munmap(buf, sb.st_size);
+
+out_close:
+	close(ckpt_fd);
+out:
+	flock(fd, LOCK_UN);
+out_free:
+	free(tmp);
+	free(ckpt);
+	return ret;
+}
+
+/**
+ * Write @lib to its file and empty the log. A complete copy of the library is
+ * made first, so after a crash the library file is either the old version or,
+ * once it is next opened, the new one. The file is written under the write
+ * lock, which is taken for the checkpoint if the caller doesn't hold it, and
+ * the generation is bumped so readers map it again. Returns 0 on success, < 0
+ * on failure.
+ *
+ * @lib		A journaled library.
+ */
+int mlib_journal_checkpoint(struct mlib_library *lib)
+{
+	struct mlib_wal *wal = lib->wal;
+	char *tmp, *ckpt;
+	int fd, ret = -1;
+
+	if (!wal)
+		return 0;
+	if (__mlib_ckpt_names(wal->lib_path, &tmp, &ckpt))
+		return -1;
+
+	/* Everything logged so far is in memory; records after it aren't. */
+	__mlib_writel(&lib->header->wal_seq, wal->seq);
+	lib->generation = __mlib_readl(&lib->header->generation) + 1;
+	__mlib_writel(&lib->header->generation, lib->generation);
+
+	fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, MLIB_WAL_MODE);
+	if (fd < 0) {
+		mlib_perror("open: %s", tmp);
+		goto out;
+	}
+	if (__mlib_write_all(fd, lib->header, MLIB_LIB_LEN(lib), 0) ||
+	    ftruncate(fd, lib->file_len) || fsync(fd)) {
+		mlib_perror("checkpoint: %s", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	/*
+	 * The private mapping reads the file for pages that haven't been
+	 * written to; they are the same before and after.
+	 */
+	if (lib->lock != MLIB_LOCK_WRITE && flock(lib->fd, LOCK_EX)) {
+		mlib_perror("flock: %s", wal->lib_path);
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, ckpt) || __mlib_sync_dir(ckpt)) {
+		mlib_perror("rename: %s", tmp);
+		unlink(tmp);
+	} else {
+		ret = __mlib_ckpt_apply(ckpt, lib->fd, lib->header,
+					MLIB_LIB_LEN(lib), lib->file_len);
+	}
+	if (lib->lock != MLIB_LOCK_WRITE &&
+	    flock(lib->fd, lib->lock == MLIB_LOCK_READ ? LOCK_SH : LOCK_UN))
+		mlib_perror("flock: %s - warning", wal->lib_path);
+	if (ret)
+		goto out;
+
+	ret = -1;
+	if (ftruncate(wal->fd, 0) || fdatasync(wal->fd)) {
+		mlib_perror("ftruncate: %s", wal->path);
+		goto out;
+	}
+	wal->size = 0;
+	wal->buf_len = 0;
+	wal->pending = 0;
+	wal->checkpoints++;
+	ret = 0;
+
+out:
+	free(tmp);
+	free(ckpt);
+	return ret;
+}
+
+/**
+ * Turn journaling on or off for @lib. The setting is stored in the library.
+ * Returns 0 on success, < 0 on failure.
+ *
+ * @lib		The library.
+ * @on		Non-zero to turn journaling on.
+ */
+int mlib_journal_enable(struct mlib_library *lib, int on)
+{
+	struct mlib_wal *wal;
+
+	if (!on == !lib->wal)
+		return 0;
+	if (__mlib_library_writable(lib))
+		return -1;
+
+	if (on) {
+		if (mlib_sync_library(lib) ||
+		    __mlib_library_remap(lib, MAP_PRIVATE))
+			return -1;
+		MLIB_LIB_SET_FLAGS(lib, MLIB_LIB_FLAGS(lib) |
+				   MLIB_LIB_F_JOURNAL);
+		if (__mlib_wal_open(lib, 0))
+			goto fail;
+		if (mlib_journal_checkpoint(lib)) {
+			wal = lib->wal;
+			lib->wal = NULL;
+			close(wal->fd);
+			unlink(wal->path);
+			free(wal->lib_path);
+			free(wal->path);
+			free(wal);
+			goto fail;
+		}
+		return 0;
+	}
+
+	/* The checkpoint writes the library out without the flag. */
+	MLIB_LIB_SET_FLAGS(lib, MLIB_LIB_FLAGS(lib) & ~MLIB_LIB_F_JOURNAL);
+	if (__mlib_wal_close(lib)) {
+		MLIB_LIB_SET_FLAGS(lib, MLIB_LIB_FLAGS(lib) |
+				   MLIB_LIB_F_JOURNAL);
+		return -1;
+	}
+	return __mlib_library_remap(lib, MAP_SHARED);
+
+fail:
+	MLIB_LIB_SET_FLAGS(lib, MLIB_LIB_FLAGS(lib) & ~MLIB_LIB_F_JOURNAL);
+	__mlib_library_remap(lib, MAP_SHARED);
+	return -1;
+}
+
+/**
+ * Commit the log of @lib after every @group records.
+ *
+ * @lib		A journaled library.
+ * @group	Records per commit; at least 1.
+ */
+void mlib_journal_set_group(struct mlib_library *lib, uint32_t group)
+{
+	if (lib->wal)
+		lib->wal->group = group ? group : 1;
+}
+
+/*
+ * Command to control journaling. Usage:
+ *
+ *   journal <lib> [on|off|commit|checkpoint]
+ *
+ * With no argument prints the log statistics.
+ */
+static int __mlib_journal(int argc, char *argv[])
+{
+	struct mlib_library *lib;
+	struct mlib_wal *wal;
+	int ret = 0;
+
+	if (argc < 2 || argc > 3) {
+		mlib_printf("Usage: journal <lib> [on|off|commit|checkpoint]\n");
+		return 1;
+	}
+
+	lib = mlib_find_library(argv[1]);
+	if (!lib) {
+		mlib_printf("Library does not exist: %s\n", argv[1]);
+		return 1;
+	}
+
+	if (argc == 3) {
+		if (!strcmp(argv[2], "on"))
+			ret = mlib_journal_enable(lib, 1);
+		else if (!strcmp(argv[2], "off"))
+			ret = mlib_journal_enable(lib, 0);
+		else if (!strcmp(argv[2], "commit"))
+			ret = mlib_journal_commit(lib);
+		else if (!strcmp(argv[2], "checkpoint"))
+			ret = mlib_journal_checkpoint(lib);
+		else {
+			mlib_printf("Unknown journal command: %s\n", argv[2]);
+			return 1;
+		}
+		return ret ? 1 : 0;
+	}
+
+	wal = lib->wal;
+	if (!wal) {
+		mlib_printf("%s: not journaled\n", MLIB_LIB_NAME(lib));
+		return 0;
+	}
+	mlib_printf("%s: journaled, log %s\n", MLIB_LIB_NAME(lib), wal->path);
+	mlib_printf("  Records:     %llu (%u pending)\n",
+		    (unsigned long long)wal->records, wal->pending);
+	mlib_printf("  Commits:     %llu (every %u records)\n",
+		    (unsigned long long)wal->commits, wal->group);
+	mlib_printf("  Checkpoints: %llu\n",
+		    (unsigned long long)wal->checkpoints);
+	mlib_printf("  Log size:    %zu bytes\n", wal->size);
+	return 0;
+}
+
+static struct mlib_command mlib_command_journal = {
+	.name = "journal",
+	.desc = "Control journaling of a library.",
+	.main = __mlib_journal,
+};
+
+int mlib_wal_init()
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+		__mlib_crc_table[i] = crc;
+	}
+
+	mlib_command_register(&mlib_command_journal);
+	return 0;
+}